@@ -36,12 +36,17 @@
 #define _BSD_SOURCE
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <signal.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
 #include "balloc.h"
 #include "dlink.h"
 #include "cron.h"
 #include "memory.h"
 #include "timestr.h"
+#include "topology.h"
 #ifndef MAP_ANONYMOUS
 #ifdef MAP_ANON
 #define MAP_ANONYMOUS MAP_ANON
@@ -51,6 +56,9 @@
 static int  blockheap_block_new(BlockHeap * bh);
 int  blockheap_garbagecollect(BlockHeap *);
 static dlink_list heap_lists;
+static int heap_node = -1;		// NUMA node new blocks should come from
+static unsigned long heap_grown = 0;	// blocks allocated by any heap, ever
+static int heap_release = BH_RELEASE_DONTNEED;	// how blockheap_trim() hands pages back
 
 #define blockheap_fail(x) _blockheap_fail(x, __FILE__, __LINE__)
 
@@ -71,6 +79,37 @@ static void blockheap_block_free(void *ptr, size_t size) {
    munmap(ptr, size);
 }
 
+#define	blockheap_parked(b, i)	((b)->parkmap[(i) >> 3] & (1 << ((i) & 7)))
+
+// Partial blocks blockheap_alloc() compares when picking one
+#define	BH_FIT_CANDIDATES	4
+
+/*
+ * Blocks with free (or parked) elements are kept on bh->partial, so
+ * allocating never walks full blocks. A block which fills up leaves the
+ * list; one which gets an element back goes to the front, as it's the
+ * fullest there is.
+ */
+static void blockheap_partial_add(BlockHeap *bh, Block *b) {
+   if (b->ppprev != NULL)
+      return;
+
+   if ((b->pnext = bh->partial) != NULL)
+      b->pnext->ppprev = &b->pnext;
+   bh->partial = b;
+   b->ppprev = &bh->partial;
+}
+
+static void blockheap_partial_del(Block *b) {
+   if (b->ppprev == NULL)
+      return;
+
+   if ((*b->ppprev = b->pnext) != NULL)
+      b->pnext->ppprev = b->ppprev;
+   b->pnext = NULL;
+   b->ppprev = NULL;
+}
+
 /*
  * void blockheap_init(void)
  * 
@@ -91,18 +130,56 @@ void blockheap_init(void) {
 }
 
 /*
- * static void *blockheap_block_get(size_t size)
+ * static void *blockheap_block_get(size_t size, int *huge)
  * 
- * Input: Size of block to allocate
- * Output: Pointer to new block
+ * Input: Size of block to allocate, block source wanted (BH_HUGE_*)
+ * Output: Pointer to new block, *huge set to the source actually used
  * Side Effects: None
  */
-static void *blockheap_block_get(size_t size) {
-   void       *ptr;
-   ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+static void *blockheap_block_get(size_t size, int *huge) {
+   void       *ptr = MAP_FAILED, *aligned;
+   size_t      slop;
+   int         node;
+
+#if	defined(MAP_HUGETLB)
+   if (*huge == BH_HUGE_TLB) {
+      ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+      // No hugetlbfs pages reserved, settle for transparent ones
+      if (ptr == MAP_FAILED)
+         *huge = BH_HUGE_THP;
+   }
+#endif
+
+   if (ptr == MAP_FAILED && *huge != BH_HUGE_NONE) {
+      // Over-allocate so the block starts on a hugepage boundary
+      ptr = mmap(NULL, size + BH_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+      if (ptr != MAP_FAILED) {
+         aligned = (void *)(((uintptr_t)ptr + BH_HUGE_PAGE - 1) & ~(BH_HUGE_PAGE - 1));
+         slop = (char *)aligned - (char *)ptr;
+
+         if (slop > 0)
+            munmap(ptr, slop);
+         munmap((char *)aligned + size, BH_HUGE_PAGE - slop);
+         ptr = aligned;
+         *huge = BH_HUGE_THP;
+#if	defined(MADV_HUGEPAGE)
+         madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+      }
+   }
+
+   if (ptr == MAP_FAILED) {
+      *huge = BH_HUGE_NONE;
+      ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   }
 
    if (ptr == MAP_FAILED)
       ptr = NULL;
+   // Nothing is faulted in yet, so this decides where all of it lands
+   else if ((node = __atomic_load_n(&heap_node, __ATOMIC_RELAXED)) >= 0)
+      topo_mem_prefer(ptr, size, node);
 
    return (ptr);
 }
@@ -121,9 +198,12 @@ static void *blockheap_block_get(size_t size) {
 static int blockheap_block_new(BlockHeap * bh) {
    MemBlock   *newblk;
    Block      *b;
-   unsigned long i;
+   unsigned long i, nelems;
    void       *offset;
 
+   // May be changed from another thread by blockheap_set_elems()
+   nelems = __atomic_load_n(&bh->elemsPerBlock, __ATOMIC_RELAXED);
+
    // Setup the initial data structure. 
    b = (Block *) mem_calloc(1, sizeof(Block));
 
@@ -134,17 +214,27 @@ static int blockheap_block_new(BlockHeap * bh) {
    b->used_list.head = b->used_list.tail = NULL;
    b->next = bh->base;
 
-   b->alloc_size = (bh->elemsPerBlock + 1) * (bh->elemSize + sizeof(MemBlock));
+   b->huge = bh->huge;
+   b->alloc_size = (nelems + 1) * (bh->elemSize + sizeof(MemBlock));
+
+   // Hugepage backed: round up to whole hugepages and fill them
+   if (b->huge != BH_HUGE_NONE) {
+      b->alloc_size = (b->alloc_size + BH_HUGE_PAGE - 1) & ~(BH_HUGE_PAGE - 1);
+      nelems = b->alloc_size / (bh->elemSize + sizeof(MemBlock)) - 1;
+   }
 
-   b->elems = blockheap_block_get(b->alloc_size);
+   b->nelems = nelems;
+   b->elems = blockheap_block_get(b->alloc_size, &b->huge);
 
-   if (b->elems == NULL)
+   if (b->elems == NULL) {
+      mem_free(b);
       return (1);
+   }
 
    offset = b->elems;
 
    // Setup our blocks now 
-   for (i = 0; i < bh->elemsPerBlock; i++) {
+   for (i = 0; i < nelems; i++) {
       void       *data;
       newblk = (void *)offset;
       newblk->block = b;
@@ -157,9 +247,14 @@ static int blockheap_block_new(BlockHeap * bh) {
       offset = (unsigned char *)((unsigned char *)offset + bh->elemSize + sizeof(MemBlock));
    }
 
-   ++bh->blocksAllocated;
-   bh->freeElems += bh->elemsPerBlock;
+   if (++bh->blocksAllocated > bh->peakBlocks)
+      bh->peakBlocks = bh->blocksAllocated;
+   __atomic_add_fetch(&heap_grown, 1, __ATOMIC_RELAXED);
+   bh->freeElems += nelems;
+   bh->totalElems += nelems;
+   bh->reservedBytes += b->alloc_size;
    bh->base = b;
+   blockheap_partial_add(bh, b);
 
    return (0);
 }
@@ -221,11 +316,54 @@ BlockHeap  *blockheap_create(size_t elemsize, int elemsperblock, const char *nam
    }
 
    if (name != NULL)
-      memcpy(bh->name, name, sizeof(bh->name) - 1);
+      strncpy(bh->name, name, sizeof(bh->name) - 1);
    dlink_add(bh, &bh->hlist, &heap_lists);
    return (bh);
 }
 
+#ifdef CONFIG_DEBUG_BALLOC
+// Charge an element to its allocation site
+static void blockheap_site_add(BlockHeap *bh, MemBlock *mb, const char *file, int line) {
+   unsigned int i;
+
+   for (i = 0; i < BH_MAX_SITES - 1; i++) {
+      if (bh->sites[i].file == NULL) {
+         bh->sites[i].file = file;
+         bh->sites[i].line = line;
+      }
+
+      if (bh->sites[i].line == line && strcmp(bh->sites[i].file, file) == 0)
+         break;
+   }
+
+   bh->sites[i].live++;
+   mb->site = i;
+}
+#endif
+
+// Put elements whose pages were released back on the free list
+static void blockheap_unpark(BlockHeap *bh, Block *b) {
+   size_t      unit = bh->elemSize + sizeof(MemBlock);
+   unsigned long i;
+   MemBlock   *mb;
+
+   for (i = 0; i < b->nelems && b->parked > 0; i++) {
+      if (!blockheap_parked(b, i))
+         continue;
+
+      // The header went with the page, write it again
+      mb = (MemBlock *)((unsigned char *)b->elems + i * unit);
+      mb->block = b;
+#ifdef CONFIG_DEBUG_BALLOC
+      mb->magic = BALLOC_MAGIC;
+#endif
+      dlink_add((unsigned char *)mb + sizeof(MemBlock), &mb->self, &b->free_list);
+      b->parkmap[i >> 3] &= ~(1 << (i & 7));
+      b->parked--;
+      bh->parkedElems--;
+   }
+}
+
 /*
  * FUNCTION DOCUMENTATION:
  *    BlockHeapAlloc
@@ -234,12 +372,14 @@ BlockHeap  *blockheap_create(size_t elemsize, int elemsperblock, const char *nam
  *    the taking.
  * Parameters:
  *    bh (IN):  Pointer to the Blockheap.
+ *    file, line (IN):  Call site, see the blockheap_alloc() macro
  * Returns:
  *    Pointer to a structure (void *), or NULL if unsuccessful.
  */
-void       *blockheap_alloc(BlockHeap * bh) {
-   Block      *walker;
+void       *_blockheap_alloc(BlockHeap * bh, const char *file, int line) {
+   Block      *walker, *best;
    dlink_node *new_node;
+   int         i;
 
    if (bh == NULL) {
       blockheap_fail("Cannot allocate if bh == NULL");
@@ -259,16 +399,36 @@ void       *blockheap_alloc(BlockHeap * bh) {
       }
    }
 
-   for (walker = bh->base; walker != NULL; walker = walker->next) {
-      if (DLINK_LENGTH(&walker->free_list) > 0) {
-         bh->freeElems--;
-         new_node = walker->free_list.head;
-         dlink_move(new_node, &walker->free_list, &walker->used_list);
-         if (new_node->data == NULL)
-            blockheap_fail("new_node->data is NULL and that shouldn't happen!!!");
-         memset(new_node->data, 0, bh->elemSize);
-         return (new_node->data);
-      }
+   // Compaction hint: fill up the fullest of the first few partial blocks,
+   // so sparse ones drain and can be given back to the OS by the garbage
+   // collector. Bounded, so allocating stays O(1) however big the heap is
+   for (best = NULL, walker = bh->partial, i = 0; walker != NULL && i < BH_FIT_CANDIDATES;
+        walker = walker->pnext, i++) {
+      if (DLINK_LENGTH(&walker->free_list) > 0 &&
+          (best == NULL || DLINK_LENGTH(&walker->free_list) + walker->parked <
+                           DLINK_LENGTH(&best->free_list) + best->parked))
+         best = walker;
+   }
+
+   // Only released pages left there: take some back
+   if (best == NULL && (best = bh->partial) != NULL)
+      blockheap_unpark(bh, best);
+   if (best != NULL) {
+      bh->freeElems--;
+      bh->allocs++;
+      if (bh->totalElems - bh->freeElems > bh->peakUsed)
+         bh->peakUsed = bh->totalElems - bh->freeElems;
+      new_node = best->free_list.head;
+      dlink_move(new_node, &best->free_list, &best->used_list);
+      if (DLINK_LENGTH(&best->free_list) == 0 && best->parked == 0)
+         blockheap_partial_del(best);
+      if (new_node->data == NULL)
+         blockheap_fail("new_node->data is NULL and that shouldn't happen!!!");
+#ifdef CONFIG_DEBUG_BALLOC
+      blockheap_site_add(bh, (MemBlock *)((size_t)new_node->data - sizeof(MemBlock)), file, line);
+#endif
+      memset(new_node->data, 0, bh->elemSize);
+      return (new_node->data);
    }
    blockheap_fail("BlockHeapAlloc failed, giving up");
    return NULL;
@@ -315,53 +475,76 @@ int blockheap_free(BlockHeap * bh, void *ptr) {
    memset(ptr, 0, bh->elemSize);
    block = memblock->block;
    bh->freeElems++;
+   bh->frees++;
+   block->dirty = 1;
+#ifdef CONFIG_DEBUG_BALLOC
+   bh->sites[memblock->site].live--;
+#endif
    dlink_move(&memblock->self, &block->used_list, &block->free_list);
+   blockheap_partial_add(bh, block);
 
    return (0);
 }
 
 /*
  * FUNCTION DOCUMENTATION:
- *    BlockHeapGarbageCollect
+ *    BlockHeapCollect
  * Description:
- *    Performs garbage collection on the block heap.  Any blocks that are
- *    completely unallocated are removed from the heap.  Garbage collection
- *    will never remove the root node of the heap.
+ *    Incremental garbage collection: returns up to max_blocks completely
+ *    unallocated blocks (0: all of them) to the OS. The last block of a
+ *    heap is never removed.
  * Parameters:
  *    bh (IN):  Pointer to the BlockHeap to be cleaned up
+ *    max_blocks (IN):  Most blocks to free in this call, 0 for no limit
+ *    released (OUT):  Bytes unmapped are added to this (may be NULL)
  * Returns:
- *   0 if successful, 1 if bh == NULL
+ *   1 if it stopped at max_blocks and there may be more, 0 otherwise
  */
-int blockheap_garbagecollect(BlockHeap * bh) {
+int blockheap_collect(BlockHeap * bh, int max_blocks, size_t *released) {
    Block      *walker, *last;
-   if (bh == NULL) {
-      return (1);
-   }
+   int         freed = 0;
 
-   if (bh->freeElems < bh->elemsPerBlock || bh->blocksAllocated == 1) {
-      // There couldn't possibly be an entire free block.  Return. 
+   if (bh == NULL)
       return (0);
-   }
 
    last = NULL;
    walker = bh->base;
 
    while (walker != NULL) {
-      if ((DLINK_LENGTH(&walker->free_list) == bh->elemsPerBlock) != 0) {
+      // There couldn't possibly be an entire free block left
+      if (bh->freeElems == 0 || bh->blocksAllocated == 1)
+         return (0);
+
+      if (DLINK_LENGTH(&walker->free_list) + walker->parked == walker->nelems) {
+         unsigned long walker_nelems = walker->nelems, walker_parked = walker->parked;
+         size_t      walker_alloc_size = walker->alloc_size;
+
+         if (max_blocks > 0 && freed >= max_blocks)
+            return (1);
+
+         blockheap_partial_del(walker);
          blockheap_block_free(walker->elems, walker->alloc_size);
+         if (walker->parkmap)
+            mem_free(walker->parkmap);
+
+         if (released != NULL)
+            *released += walker->alloc_size;
+
          if (last != NULL) {
             last->next = walker->next;
-            if (walker != NULL)
-               mem_free(walker);
+            mem_free(walker);
             walker = last->next;
          } else {
             bh->base = walker->next;
-            if (walker != NULL)
-               mem_free(walker);
+            mem_free(walker);
             walker = bh->base;
          }
          bh->blocksAllocated--;
-         bh->freeElems -= bh->elemsPerBlock;
+         bh->reservedBytes -= walker_alloc_size;
+         bh->parkedElems -= walker_parked;
+         bh->freeElems -= walker_nelems;
+         bh->totalElems -= walker_nelems;
+         freed++;
       } else {
          last = walker;
          walker = walker->next;
@@ -370,6 +553,165 @@ int blockheap_garbagecollect(BlockHeap * bh) {
    return (0);
 }
 
+/*
+ * FUNCTION DOCUMENTATION:
+ *    BlockHeapGarbageCollect
+ * Description:
+ *    Performs garbage collection on the block heap.  Any blocks that are
+ *    completely unallocated are removed from the heap.  Garbage collection
+ *    will never remove the root node of the heap.
+ * Parameters:
+ *    bh (IN):  Pointer to the BlockHeap to be cleaned up
+ * Returns:
+ *   0 if successful, 1 if bh == NULL
+ */
+int blockheap_garbagecollect(BlockHeap * bh) {
+   if (bh == NULL) {
+      return (1);
+   }
+
+   blockheap_collect(bh, 0, NULL);
+   return (0);
+}
+
+/*
+ * Release the whole pages of b covered only by free elements. Those
+ * elements are taken off the free list ("parked") so nothing touches
+ * them until blockheap_unpark(); they still count as free.
+ */
+static void blockheap_trim_block(BlockHeap *bh, Block *b, int mode, size_t *released) {
+   size_t      unit = bh->elemSize + sizeof(MemBlock), page = sysconf(_SC_PAGESIZE), bytes = 0;
+   uintptr_t   base = (uintptr_t)b->elems, start, end, p;
+   unsigned long i, j, k, last;
+   unsigned char *isfree;
+   dlink_node *ptr;
+   MemBlock   *mb;
+   int         advice, fresh;
+
+   // Can't possibly cover a whole page
+   if (DLINK_LENGTH(&b->free_list) * unit < page)
+      return;
+
+   if (b->parkmap == NULL && (b->parkmap = mem_calloc(1, (b->nelems + 7) / 8)) == NULL)
+      return;
+
+   if ((isfree = mem_calloc(1, b->nelems)) == NULL)
+      return;
+
+   // 1: free, 2: free and already released
+   DLINK_FOREACH(ptr, b->free_list.head)
+      isfree[((uintptr_t)ptr->data - sizeof(MemBlock) - base) / unit] = 1;
+
+   for (i = 0; i < b->nelems && b->parked > 0; i++)
+      if (blockheap_parked(b, i))
+         isfree[i] = 2;
+
+#if	defined(MADV_FREE)
+   advice = (mode == BH_RELEASE_FREE ? MADV_FREE : MADV_DONTNEED);
+#else
+   advice = MADV_DONTNEED;
+#endif
+
+   for (i = 0; i < b->nelems; i = j) {
+      if (!isfree[i]) {
+         j = i + 1;
+         continue;
+      }
+
+      // A run of free elements [i, j), and the whole pages inside it
+      for (j = i; j < b->nelems && isfree[j]; j++)
+         ;
+
+      start = (base + i * unit + page - 1) & ~(page - 1);
+      end = (base + j * unit) & ~(page - 1);
+
+      if (end <= start)
+         continue;
+
+      // Off the free list first: the list pointers live in those pages
+      for (k = (start - base) / unit, last = (end - 1 - base) / unit; k <= last; k++)
+         if (isfree[k] == 1)
+            dlink_delete(&((MemBlock *)(base + k * unit))->self, &b->free_list);
+
+      if (madvise((void *)start, end - start, advice) != 0 &&
+          (advice == MADV_DONTNEED || madvise((void *)start, end - start, MADV_DONTNEED) != 0)) {
+         for (k = (start - base) / unit; k <= last; k++) {
+            if (isfree[k] != 1)
+               continue;
+
+            mb = (MemBlock *)(base + k * unit);
+            dlink_add((unsigned char *)mb + sizeof(MemBlock), &mb->self, &b->free_list);
+         }
+         continue;
+      }
+
+      // Only count pages which weren't already given back
+      for (p = start; p < end; p += page) {
+         for (k = (p - base) / unit, last = (p + page - 1 - base) / unit, fresh = 0; k <= last; k++)
+            if (isfree[k] == 1)
+               fresh = 1;
+
+         if (fresh)
+            bytes += page;
+      }
+
+      for (k = (start - base) / unit, last = (end - 1 - base) / unit; k <= last; k++) {
+         if (isfree[k] != 1)
+            continue;
+
+         b->parkmap[k >> 3] |= 1 << (k & 7);
+         b->parked++;
+         bh->parkedElems++;
+         isfree[k] = 2;
+      }
+   }
+
+   mem_free(isfree);
+   bh->trimmed += bytes;
+
+   if (released != NULL)
+      *released += bytes;
+}
+
+/*
+ * FUNCTION DOCUMENTATION:
+ *    BlockHeapTrim
+ * Description:
+ *    Hands whole pages of free elements inside blocks which are still
+ *    in use back to the OS. Only blocks with elements freed since they
+ *    were last trimmed are looked at; hugepage blocks are left alone.
+ * Parameters:
+ *    bh (IN):  Pointer to the BlockHeap
+ *    max_blocks (IN):  Most blocks to look at in this call, 0 for no limit
+ *    released (OUT):  Bytes released are added to this (may be NULL)
+ * Returns:
+ *   1 if it stopped at max_blocks and there may be more, 0 otherwise
+ */
+int blockheap_trim(BlockHeap *bh, int max_blocks, size_t *released) {
+   int         mode = __atomic_load_n(&heap_release, __ATOMIC_RELAXED), done = 0;
+   Block      *walker;
+
+   if (bh == NULL || mode == BH_RELEASE_OFF)
+      return (0);
+
+   for (walker = bh->base; walker != NULL; walker = walker->next) {
+      if (!walker->dirty || walker->huge != BH_HUGE_NONE)
+         continue;
+
+      if (max_blocks > 0 && done >= max_blocks)
+         return (1);
+
+      blockheap_trim_block(bh, walker, mode, released);
+      walker->dirty = 0;
+      done++;
+   }
+   return (0);
+}
+
+void blockheap_set_release(int mode) {
+   __atomic_store_n(&heap_release, mode, __ATOMIC_RELAXED);
+}
+
 /*
  * FUNCTION DOCUMENTATION:
  *    BlockHeapDestroy
@@ -390,6 +732,8 @@ int blockheap_destroy(BlockHeap * bh) {
    for (walker = bh->base; walker != NULL; walker = next) {
       next = walker->next;
       blockheap_block_free(walker->elems, walker->alloc_size);
+      if (walker->parkmap)
+         mem_free(walker->parkmap);
       if (walker != NULL)
          mem_free(walker);
    }
@@ -398,6 +742,120 @@ int blockheap_destroy(BlockHeap * bh) {
    return (0);
 }
 
+/*
+ * FUNCTION DOCUMENTATION:
+ *    blockheap_set_elems
+ * Description:
+ *    Changes how many elements blocks allocated from now on will hold.
+ *    Existing blocks keep their size until garbage collected.
+ * Parameters:
+ *    bh (IN):  Pointer to the BlockHeap
+ *    elemsperblock (IN):  New number of elements per block
+ */
+void blockheap_set_elems(BlockHeap *bh, unsigned long elemsperblock) {
+   if (bh == NULL || elemsperblock == 0)
+      return;
+
+   __atomic_store_n(&bh->elemsPerBlock, elemsperblock, __ATOMIC_RELAXED);
+}
+
+unsigned long blockheap_grown(void) {
+   return __atomic_load_n(&heap_grown, __ATOMIC_RELAXED);
+}
+
+void blockheap_set_node(int node) {
+   __atomic_store_n(&heap_node, (node < topo_nodes() ? node : -1), __ATOMIC_RELAXED);
+}
+
+void blockheap_set_huge(BlockHeap *bh, int mode) {
+   if (bh != NULL)
+      bh->huge = mode;
+}
+
+int blockheap_huge_parse(const char *str) {
+   if (str == NULL)
+      return BH_HUGE_NONE;
+   else if (strcasecmp(str, "thp") == 0)
+      return BH_HUGE_THP;
+   else if (strcasecmp(str, "hugetlb") == 0)
+      return BH_HUGE_TLB;
+
+   return BH_HUGE_NONE;
+}
+
+/*
+ * FUNCTION DOCUMENTATION:
+ *    blockheap_stats
+ * Description:
+ *    Fills in st with the counters, high-water marks and fragmentation
+ *    (live vs. reserved bytes) of a heap.
+ */
+void blockheap_stats(BlockHeap *bh, struct blockheap_stats *st) {
+   size_t      unit;
+
+   memset(st, 0, sizeof(*st));
+
+   if (bh == NULL)
+      return;
+
+   unit = bh->elemSize + sizeof(MemBlock);
+   st->name = bh->name;
+   st->elem_size = bh->elemSize;
+   st->blocks = bh->blocksAllocated;
+   st->peak_blocks = bh->peakBlocks;
+   st->elems = bh->totalElems;
+   st->used = bh->totalElems - bh->freeElems;
+   st->peak_used = bh->peakUsed;
+   st->allocs = bh->allocs;
+   st->frees = bh->frees;
+   st->rate = bh->rate;
+   st->live = st->used * bh->elemSize;
+   st->trimmed = bh->trimmed;
+   st->reserved = bh->reservedBytes;
+   st->released = bh->parkedElems * unit;
+}
+
+void blockheap_foreach(void (*fn)(BlockHeap *bh, void *arg), void *arg) {
+   dlink_node *ptr, *tptr;
+
+   DLINK_FOREACH_SAFE(ptr, tptr, heap_lists.head) {
+      fn(ptr->data, arg);
+   }
+}
+
+void blockheap_stats_tick(double secs) {
+   dlink_node *ptr;
+   BlockHeap  *bh;
+   unsigned long allocs;
+
+   if (secs <= 0)
+      return;
+
+   DLINK_FOREACH(ptr, heap_lists.head) {
+      bh = ptr->data;
+      allocs = bh->allocs;
+      bh->rate = bh->rate * 0.75 + (allocs - bh->lastAllocs) / secs * 0.25;
+      bh->lastAllocs = allocs;
+   }
+}
+
+int blockheap_sites(BlockHeap *bh, void (*fn)(const char *file, int line, unsigned long live, void *arg), void *arg) {
+#ifdef CONFIG_DEBUG_BALLOC
+   int         i, n = 0;
+
+   for (i = 0; bh != NULL && i < BH_MAX_SITES; i++) {
+      if (bh->sites[i].live == 0)
+         continue;
+
+      fn((i < BH_MAX_SITES - 1 ? bh->sites[i].file : NULL), bh->sites[i].line, bh->sites[i].live, arg);
+      n++;
+   }
+   return n;
+#else
+   return -1;
+#endif
+}
+
 void blockheap_usage(BlockHeap * bh, size_t * bused, size_t * bfree, size_t * bmemusage) {
    size_t      used;
    size_t      freem;
@@ -407,7 +865,7 @@ void blockheap_usage(BlockHeap * bh, size_t * bused, size_t * bfree, size_t * bm
    }
 
    freem = bh->freeElems;
-   used = (bh->blocksAllocated * bh->elemsPerBlock) - bh->freeElems;
+   used = bh->totalElems - bh->freeElems;
    memusage = used * (bh->elemSize + sizeof(MemBlock));
 
    if (bused != NULL)
@@ -23,16 +23,23 @@
 #include <lsd/dlink.h>
 struct Block {
    size_t      alloc_size;
+   unsigned long nelems;               /* Elements in this block */
    struct Block *next;                 /* Next in our chain of blocks */
    void       *elems;                  /* Points to allocated memory */
    dlink_list  free_list;
    dlink_list  used_list;
+   unsigned long parked;               /* Free elements whose pages went back to the OS */
+   unsigned char *parkmap;             /* ... one bit per element, NULL until needed */
+   int         dirty;                  /* Elements freed since the last trim */
+   int         huge;                   /* Hugepage backed (BH_HUGE_*), never trimmed */
+   struct Block *pnext, **ppprev;      /* BlockHeap.partial, ppprev NULL when full */
 };
 typedef struct Block Block;
 
 struct MemBlock {
-#ifdef DEBUG_BALLOC
+#ifdef CONFIG_DEBUG_BALLOC
    unsigned long magic;
+   unsigned int site;                  /* Index into BlockHeap.sites while allocated */
 #endif
    dlink_node  self;
    Block      *block;                  /* Which block we belong to */
@@ -40,32 +47,114 @@ struct MemBlock {
 
 typedef struct MemBlock MemBlock;
 
+#ifdef CONFIG_DEBUG_BALLOC
+#define	BALLOC_MAGIC	0x3d3a3c3eUL
+
+/* where outstanding elements were allocated (the last slot takes overflow) */
+#define	BH_MAX_SITES	32
+struct bh_site {
+   const char *file;
+   int         line;
+   unsigned long live;
+};
+#endif
+
 /* information for the root node of the heap */
 struct BlockHeap {
    dlink_node  hlist;
    char        name[64];               /* heap name */
    size_t      elemSize;               /* Size of each element to be stored */
-   unsigned long elemsPerBlock;        /* Number of elements per block */
+   unsigned long elemsPerBlock;        /* Number of elements per new block */
+   unsigned long totalElems;           /* Elements in all blocks */
    unsigned long blocksAllocated;      /* Number of blocks allocated */
    unsigned long freeElems;            /* Number of free elements */
    Block      *base;                   /* Pointer to first block */
+   Block      *partial;                /* Blocks with free elements, last refilled first */
+   int         huge;                   /* Block source for new blocks (BH_HUGE_*) */
+   size_t      trimmed;                /* Bytes handed back by blockheap_trim(), ever */
+   size_t      reservedBytes;          /* Bytes mapped for all blocks */
+   unsigned long parkedElems;          /* Free elements whose pages were released */
+   unsigned long allocs, frees;        /* Elements handed out/returned, ever */
+   unsigned long peakUsed;             /* High-water mark of elements in use */
+   unsigned long peakBlocks;           /* ... and of blocks */
+   unsigned long lastAllocs;           /* allocs at the last blockheap_stats_tick() */
+   double      rate;                   /* Allocations per second (moving average) */
+#ifdef CONFIG_DEBUG_BALLOC
+   struct bh_site sites[BH_MAX_SITES];
+#endif
 };
 typedef struct BlockHeap BlockHeap;
 
-// Allocate/free a block (ptr) from the BlocKHeap (bh)
-extern void *blockheap_alloc(BlockHeap *bh);
+// Block sources: normal pages, transparent hugepages, hugetlbfs (falls back to THP)
+#define	BH_HUGE_NONE	0
+#define	BH_HUGE_THP	1
+#define	BH_HUGE_TLB	2
+#define	BH_HUGE_PAGE	(2UL * 1024 * 1024)
+
+// How blockheap_trim() gives pages back
+#define	BH_RELEASE_OFF	0
+#define	BH_RELEASE_DONTNEED	1	// RSS drops right away
+#define	BH_RELEASE_FREE	2		// cheaper, reclaimed only under memory pressure
+
+// Point-in-time statistics of one heap, see blockheap_stats()
+struct blockheap_stats {
+   const char *name;
+   size_t      elem_size;
+   unsigned long blocks, peak_blocks;
+   unsigned long elems, used, peak_used;
+   unsigned long allocs, frees;
+   double      rate;                   /* allocations/sec */
+   size_t      live;                   /* bytes in elements in use */
+   size_t      reserved;               /* bytes mapped for blocks */
+   size_t      released;               /* ... of which handed back by trimming */
+   size_t      trimmed;
+};
+
+// Allocate/free a block (ptr) from the BlocKHeap (bh). The call site is
+// remembered for leak reports when built with CONFIG_DEBUG_BALLOC
+#define	blockheap_alloc(bh)	_blockheap_alloc((bh), __FILE__, __LINE__)
+extern void *_blockheap_alloc(BlockHeap *bh, const char *file, int line);
 extern int  blockheap_free(BlockHeap *bh, void *ptr);
 
 // Create/destroy BlockHeap objects
 extern BlockHeap *blockheap_create(size_t elemsize, int elemsperblock, const char *name);
 extern int  blockheap_destroy(BlockHeap *bh);
 
+// Change the number of elements in blocks allocated from now on
+extern void blockheap_set_elems(BlockHeap *bh, unsigned long elemsperblock);
+
+// Place blocks allocated from now on on a NUMA node (-1: wherever they're first touched)
+extern void blockheap_set_node(int node);
+
 // Garbage collection
 extern int blockheap_garbagecollect(BlockHeap *bh);
+// ... a few blocks at a time: returns 1 if there may be more, adds bytes unmapped to *released
+extern int blockheap_collect(BlockHeap *bh, int max_blocks, size_t *released);
+// Blocks allocated by all heaps so far (allocation pressure)
+extern unsigned long blockheap_grown(void);
+// Give whole free pages inside partly used blocks back to the OS, up to
+// max_blocks blocks per call. Returns 1 if there may be more
+extern int blockheap_trim(BlockHeap *bh, int max_blocks, size_t *released);
+extern void blockheap_set_release(int mode);
+
+// Back blocks allocated from now on with hugepages (BH_HUGE_*), for big hot heaps
+extern void blockheap_set_huge(BlockHeap *bh, int mode);
+extern int blockheap_huge_parse(const char *str);
 extern void blockheap_gc(int fd, short event, void *arg);
 
 // Accessory functions
 extern void blockheap_init(void);
 extern void blockheap_usage(BlockHeap *bh, size_t *bused, size_t *bfree, size_t *bmemusage);
 
+// Statistics. Heaps are owned by the main loop; other threads get an
+// unlocked snapshot of the counters (no block lists are walked), good
+// enough for tuning but not exact
+extern void blockheap_stats(BlockHeap *bh, struct blockheap_stats *st);
+extern void blockheap_foreach(void (*fn)(BlockHeap *bh, void *arg), void *arg);
+// Fold the allocations of the last secs seconds into each heap's rate
+extern void blockheap_stats_tick(double secs);
+// Outstanding elements per allocation site (file NULL: sites beyond
+// BH_MAX_SITES). Returns the number of sites, -1 without CONFIG_DEBUG_BALLOC
+extern int blockheap_sites(BlockHeap *bh, void (*fn)(const char *file, int line, unsigned long live, void *arg), void *arg);
+
 #endif	// !defined(__BALLOC_H)
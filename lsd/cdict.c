@@ -0,0 +1,388 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * lsd/cdict.c:
+ *	Concurrent map with lock-free readers and striped writer locks
+ *
+ *	Buckets are singly linked chains. Writers only ever publish fully
+ * built entries with a release store into a bucket head or a next
+ * pointer, so a reader walking a chain sees either the old or the new
+ * chain, never half of an entry. An unlinked entry keeps its next
+ * pointer, so a reader standing on it can finish its walk.
+ *
+ *	Resizing copies every entry into a new, twice as big table (the old
+ * chains can't be relinked while readers may be on them) and swaps
+ * d->table. Readers already inside the old table finish there.
+ *
+ *	Stripe locks are picked by hash & (CDICT_STRIPES - 1); tables are
+ * never smaller than CDICT_STRIPES, so a bucket always belongs to
+ * exactly one stripe.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "memory.h"
+#include "dict.h"
+#include "cdict.h"
+#include "ebr.h"
+
+// Grow once there are more keys than buckets
+#define	CDICT_LOAD	1
+
+struct cdict_ent {
+   struct cdict_ent *next;
+   unsigned long hash;
+   size_t      keylen;
+   char       *val;
+   void       *blob;
+   time_t      ts;
+   char        key[];
+};
+
+struct cdict_table {
+   unsigned long size;		// buckets (power of 2)
+   struct cdict_ent *bucket[];
+};
+
+// Readers may still be looking at it, hand it to the reclaimer
+#define	cdict_retire(ptr)	ebr_retire((ptr), NULL)
+
+static struct cdict_table *cdict_table_new(unsigned long nelems) {
+   struct cdict_table *t;
+   unsigned long size = CDICT_STRIPES;
+
+   while (size * CDICT_LOAD < nelems)
+      size <<= 1;
+
+   if (!(t = calloc(1, sizeof(struct cdict_table) + size * sizeof(struct cdict_ent *))))
+      return NULL;
+
+   t->size = size;
+   return t;
+}
+
+cdict *cdict_new(unsigned long nelems) {
+   cdict *d;
+   int i;
+
+   if (posix_memalign((void **)&d, 64, sizeof(cdict)) != 0)
+      return NULL;
+
+   memset(d, 0, sizeof(cdict));
+
+   if (!(d->table = cdict_table_new(nelems))) {
+      free(d);
+      return NULL;
+   }
+
+   for (i = 0; i < CDICT_STRIPES; i++)
+      pthread_mutex_init(&d->stripe[i].lock, NULL);
+
+   return d;
+}
+
+void cdict_free(cdict *d) {
+   struct cdict_ent *e, *next;
+   unsigned long i;
+
+   if (d == NULL)
+      return;
+
+   for (i = 0; i < d->table->size; i++) {
+      for (e = d->table->bucket[i]; e != NULL; e = next) {
+         next = e->next;
+
+         if (e->val)
+            free(e->val);
+         free(e);
+      }
+   }
+
+   for (i = 0; i < CDICT_STRIPES; i++)
+      pthread_mutex_destroy(&d->stripe[i].lock);
+
+   free(d->table);
+   free(d);
+}
+
+#define	cdict_stripe(d, hash)	(&(d)->stripe[(hash) & (CDICT_STRIPES - 1)].lock)
+
+static struct cdict_ent *cdict_find(struct cdict_table *t, const char *key, size_t keylen, unsigned long hash) {
+   struct cdict_ent *e;
+
+   e = __atomic_load_n(&t->bucket[hash & (t->size - 1)], __ATOMIC_ACQUIRE);
+
+   for (; e != NULL; e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE))
+      if (e->hash == hash && e->keylen == keylen && memcmp(e->key, key, keylen) == 0)
+         return e;
+
+   return NULL;
+}
+
+// Free a table replaced by cdict_grow(): the entries' values live on in the new one
+static void cdict_table_retired(void *ptr) {
+   struct cdict_table *t = (struct cdict_table *)ptr;
+   struct cdict_ent *e, *next;
+   unsigned long i;
+
+   for (i = 0; i < t->size; i++)
+      for (e = t->bucket[i]; e != NULL; e = next) {
+         next = e->next;
+         free(e);
+      }
+
+   free(t);
+}
+
+// Double the table. Takes every stripe, so no writer is inside a chain
+static void cdict_grow(cdict *d) {
+   struct cdict_table *t, *nt;
+   struct cdict_ent *e, *ne, *next;
+   unsigned long i;
+   int s;
+
+   for (s = 0; s < CDICT_STRIPES; s++)
+      pthread_mutex_lock(&d->stripe[s].lock);
+
+   t = d->table;
+
+   // Someone else got here first?
+   if (__atomic_load_n(&d->used, __ATOMIC_RELAXED) <= t->size * CDICT_LOAD)
+      goto out;
+
+   if (!(nt = cdict_table_new(t->size * 2 * CDICT_LOAD)))
+      goto out;
+
+   for (i = 0; i < t->size; i++) {
+      for (e = t->bucket[i]; e != NULL; e = e->next) {
+         if (!(ne = malloc(sizeof(struct cdict_ent) + e->keylen + 1)))
+            break;
+
+         // Values and blobs move over, only the entry shell is copied
+         memcpy(ne, e, sizeof(struct cdict_ent) + e->keylen + 1);
+         ne->next = nt->bucket[ne->hash & (nt->size - 1)];
+         nt->bucket[ne->hash & (nt->size - 1)] = ne;
+      }
+
+      // Out of memory half way: keep the old table
+      if (e != NULL) {
+         for (i = 0; i < nt->size; i++)
+            for (ne = nt->bucket[i]; ne != NULL; ne = next) {
+               next = ne->next;
+               free(ne);
+            }
+         free(nt);
+         goto out;
+      }
+   }
+
+   __atomic_store_n(&d->table, nt, __ATOMIC_RELEASE);
+
+   for (s = CDICT_STRIPES - 1; s >= 0; s--)
+      pthread_mutex_unlock(&d->stripe[s].lock);
+
+   // Nobody writes to the old table any more, only readers may be in it
+   ebr_retire(t, cdict_table_retired);
+   return;
+
+out:
+   for (s = CDICT_STRIPES - 1; s >= 0; s--)
+      pthread_mutex_unlock(&d->stripe[s].lock);
+}
+
+static int cdict_add_p(cdict *d, const char *key, const char *val, const void *blob) {
+   struct cdict_table *t;
+   struct cdict_ent *e, **head;
+   pthread_mutex_t *lock;
+   unsigned long hash;
+   size_t keylen;
+   char *nval = NULL, *oval;
+   int grow = 0;
+
+   if (!d || !key)
+      return -1;
+
+   keylen = strlen(key);
+   hash = dict_hashn(key, keylen);
+
+   if (val && !(nval = strdup(val)))
+      return -1;
+
+   lock = cdict_stripe(d, hash);
+   pthread_mutex_lock(lock);
+   // Stable while we hold a stripe: resizing needs all of them
+   t = d->table;
+
+   if ((e = cdict_find(t, key, keylen, hash))) {
+      // Replace in place; readers see either the old or the new value
+      if (nval) {
+         oval = __atomic_exchange_n(&e->val, nval, __ATOMIC_ACQ_REL);
+         cdict_retire(oval);
+      }
+
+      if (blob)
+         __atomic_store_n(&e->blob, (void *)blob, __ATOMIC_RELEASE);
+
+      e->ts = time(NULL);
+      pthread_mutex_unlock(lock);
+      return 0;
+   }
+
+   if (!(e = malloc(sizeof(struct cdict_ent) + keylen + 1))) {
+      pthread_mutex_unlock(lock);
+
+      if (nval)
+         free(nval);
+      return -1;
+   }
+
+   memcpy(e->key, key, keylen + 1);
+   e->keylen = keylen;
+   e->hash = hash;
+   e->val = nval;
+   e->blob = (void *)blob;
+   e->ts = time(NULL);
+
+   head = &t->bucket[hash & (t->size - 1)];
+   e->next = *head;
+   __atomic_store_n(head, e, __ATOMIC_RELEASE);
+
+   if (__atomic_add_fetch(&d->used, 1, __ATOMIC_RELAXED) > t->size * CDICT_LOAD)
+      grow = 1;
+
+   pthread_mutex_unlock(lock);
+
+   if (grow)
+      cdict_grow(d);
+
+   return 0;
+}
+
+int cdict_add(cdict *d, const char *key, const char *val) {
+   return cdict_add_p(d, key, val, NULL);
+}
+
+int cdict_add_blob(cdict *d, const char *key, const void *blob) {
+   return cdict_add_p(d, key, NULL, blob);
+}
+
+const char *cdict_getn(cdict *d, const char *key, size_t keylen, const char *defval) {
+   struct cdict_ent *e;
+   const char *val;
+
+   if (!d || !key)
+      return defval;
+
+   e = cdict_find(__atomic_load_n(&d->table, __ATOMIC_ACQUIRE), key, keylen, dict_hashn(key, keylen));
+
+   if (e && (val = __atomic_load_n(&e->val, __ATOMIC_ACQUIRE)))
+      return val;
+
+   return defval;
+}
+
+const char *cdict_get(cdict *d, const char *key, const char *defval) {
+   if (!key)
+      return defval;
+
+   return cdict_getn(d, key, strlen(key), defval);
+}
+
+void *cdict_get_blobn(cdict *d, const char *key, size_t keylen, const void *defval) {
+   struct cdict_ent *e;
+   void *blob;
+
+   if (!d || !key)
+      return (void *)defval;
+
+   e = cdict_find(__atomic_load_n(&d->table, __ATOMIC_ACQUIRE), key, keylen, dict_hashn(key, keylen));
+
+   if (e && (blob = __atomic_load_n(&e->blob, __ATOMIC_ACQUIRE)))
+      return blob;
+
+   return (void *)defval;
+}
+
+void *cdict_get_blob(cdict *d, const char *key, const void *defval) {
+   if (!key)
+      return (void *)defval;
+
+   return cdict_get_blobn(d, key, strlen(key), defval);
+}
+
+int cdict_del(cdict *d, const char *key) {
+   struct cdict_table *t;
+   struct cdict_ent *e, **prev;
+   pthread_mutex_t *lock;
+   unsigned long hash;
+   size_t keylen;
+
+   if (!d || !key)
+      return -1;
+
+   keylen = strlen(key);
+   hash = dict_hashn(key, keylen);
+   lock = cdict_stripe(d, hash);
+
+   pthread_mutex_lock(lock);
+   t = d->table;
+
+   for (prev = &t->bucket[hash & (t->size - 1)]; (e = *prev) != NULL; prev = &e->next) {
+      if (e->hash == hash && e->keylen == keylen && memcmp(e->key, key, keylen) == 0) {
+         // e->next is left alone for readers still standing on e
+         __atomic_store_n(prev, e->next, __ATOMIC_RELEASE);
+         __atomic_sub_fetch(&d->used, 1, __ATOMIC_RELAXED);
+         pthread_mutex_unlock(lock);
+
+         cdict_retire(e->val);
+         cdict_retire(e);
+         return 0;
+      }
+   }
+
+   pthread_mutex_unlock(lock);
+   return -1;
+}
+
+void cdict_foreach(cdict *d, void (*fn)(const char *key, const char *val, void *blob, void *arg), void *arg) {
+   struct cdict_table *t;
+   struct cdict_ent *e;
+   unsigned long i;
+
+   if (!d || !fn)
+      return;
+
+   t = __atomic_load_n(&d->table, __ATOMIC_ACQUIRE);
+
+   for (i = 0; i < t->size; i++)
+      for (e = __atomic_load_n(&t->bucket[i], __ATOMIC_ACQUIRE); e != NULL;
+           e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE))
+         fn(e->key, __atomic_load_n(&e->val, __ATOMIC_ACQUIRE),
+            __atomic_load_n(&e->blob, __ATOMIC_ACQUIRE), arg);
+}
+
+static void cdict_dump_one(const char *key, const char *val, void *blob, void *arg) {
+   fprintf((FILE *)arg, "%s=%s\n", key, val ? val : "UNDEF");
+}
+
+int cdict_dump(cdict *d, FILE *out) {
+   if (!d || !out)
+      return 0;
+
+   cdict_foreach(d, cdict_dump_one, out);
+   return 0;
+}
+
+unsigned long cdict_count(cdict *d) {
+   return (d ? __atomic_load_n(&d->used, __ATOMIC_RELAXED) : 0);
+}
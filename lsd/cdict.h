@@ -0,0 +1,77 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * lsd/cdict.h:
+ *	Concurrent string/string (or string/blob) map, for tables that are
+ * read from many threads at once (hooks, the VFS path cache, ...).
+ *
+ *	Same idea as dict, different trade-offs:
+ *	- Lookups take no locks and never block, even while the table is
+ *	  being resized.
+ *	- Writers lock one of CDICT_STRIPES stripes, picked by the key's
+ *	  hash, so writers to different keys rarely contend. A resize takes
+ *	  every stripe.
+ *	- Anything a reader may still be looking at (replaced values,
+ *	  deleted entries, old tables) is handed to ebr_retire().
+ *
+ *	Readers must be registered with lsd/ebr (see thread_entry()).
+ * Pointers returned by cdict_get*() stay valid until the calling
+ * thread's next quiescent point; copy what you need to keep longer.
+ * Blobs are never freed by cdict, retire them with ebr_retire().
+ */
+#if	!defined(__LSD_CDICT_H)
+#define	__LSD_CDICT_H
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+// Writer lock stripes (power of 2)
+#define	CDICT_STRIPES	64
+
+struct cdict_ent;
+struct cdict_table;
+
+typedef struct cdict {
+   struct cdict_table *table;	// current table (swapped on resize)
+   unsigned long used;		// live keys
+   struct {
+      pthread_mutex_t lock;
+   } __attribute__((aligned(64))) stripe[CDICT_STRIPES];
+} cdict;
+
+// Create a map sized for nelems keys (0 for the default), free it
+// (no other thread may be using it by then)
+extern cdict *cdict_new(unsigned long nelems);
+extern void cdict_free(cdict *d);
+
+// Add or replace a key. The value is copied, the blob pointer is stored as is
+extern int cdict_add(cdict *d, const char *key, const char *val);
+extern int cdict_add_blob(cdict *d, const char *key, const void *blob);
+
+// Lock-free lookups, returning defval if key isn't there
+extern const char *cdict_get(cdict *d, const char *key, const char *defval);
+extern const char *cdict_getn(cdict *d, const char *key, size_t keylen, const char *defval);
+extern void *cdict_get_blob(cdict *d, const char *key, const void *defval);
+extern void *cdict_get_blobn(cdict *d, const char *key, size_t keylen, const void *defval);
+
+// Remove a key, 0 if it was there, -1 if not
+extern int cdict_del(cdict *d, const char *key);
+
+// Call fn for every key (lock-free; keys added or removed meanwhile may be missed)
+extern void cdict_foreach(cdict *d, void (*fn)(const char *key, const char *val, void *blob, void *arg), void *arg);
+extern int cdict_dump(cdict *d, FILE *out);
+
+// Number of keys (approximate while writers are busy)
+extern unsigned long cdict_count(cdict *d);
+
+#endif	// !defined(__LSD_CDICT_H)
@@ -19,8 +19,8 @@
  *	   Python implementation
  *		http://svn.python.org/projects/python/trunk/Objects/dictobject.c
  *
- *	A demo is included and compiled with -DMAIN. Use the Makefile to
- * create a benchmark program and run it.
+ *	A benchmark is included and compiled with -DMAIN. Use the Makefile
+ * (make bin/dict-bench) to create it and run it.
  */
 #include <errno.h>
 #include "dict.h"
@@ -33,104 +33,160 @@
 #define PERTURB_SHIFT   5
 /* Beyond this size, a dictionary will not be grown by the same factor */
 #define DICT_BIGSZ      64000
-
-/*
- * Specify which hash function to use
- * MurmurHash is fast but may not work on all architectures
- * Dobbs is a tad bit slower but not by much and works everywhere
- */
-#define dict_hash   dict_hash_dobbs
-/* #define dict_hash   dict_hash_murmur */
+/* dict_clear() keeps tables up to this size, bigger ones are shrunk */
+#define DICT_REUSE_SZ   64
+/* Slots moved from the old table per insert/delete while resizing */
+#define DICT_REHASH_STEP 64
+/* Largest table dict_reserve() will ask for */
+#define DICT_MAX_SIZE   (1U << 31)
 
 /* Forward definitions */
 static int dict_resize(dict *d);
 
 /*
- *	This hash function has been taken from an Article in Dr Dobbs Journal.
- * There are probably better ones out there but this one does the job.
+ * Hashing: wyhash (Wang Yi, public domain), final version 4.
+ *	Keys are consumed 8-16 bytes at a time with one 64x64->128 bit
+ * multiply per step, so typical config keys and paths hash in a handful
+ * of instructions once their length is known.
  */
-static unsigned dict_hash_dobbs(const char * key) {
-    int         len;
-    unsigned    hash;
-    int         i;
+#define	DICT_SEED	0x0badcafe
+static const unsigned long long dict_secret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
 
-    len = strlen(key);
+static inline void dict_mum(unsigned long long *a, unsigned long long *b) {
+    __uint128_t r = (__uint128_t)*a * *b;
 
-    for (hash = 0, i = 0; i < len; i++) {
-       hash += (unsigned)key[i];
-       hash += (hash << 10);
-       hash ^= (hash >> 6);
-    }
+    *a = (unsigned long long)r;
+    *b = (unsigned long long)(r >> 64);
+}
 
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
+static inline unsigned long long dict_mix(unsigned long long a, unsigned long long b) {
+    dict_mum(&a, &b);
+    return a ^ b;
+}
 
-    return hash;
+/* Unaligned little-endian loads; the compiler turns these into single moves */
+static inline unsigned long long dict_r8(const unsigned char *p) {
+    unsigned long long v;
+
+    memcpy(&v, p, 8);
+    return v;
 }
 
-/* Murmur hash */
-static unsigned dict_hash_murmur(const char *key) {
-    int         len;
-    unsigned    h, k, seed;
-    unsigned    m = 0x5bd1e995;
-    int         r = 24;
-    unsigned char *data;
+static inline unsigned long long dict_r4(const unsigned char *p) {
+    unsigned int v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline unsigned long long dict_r3(const unsigned char *p, size_t k) {
+    return (((unsigned long long)p[0]) << 16) | (((unsigned long long)p[k >> 1]) << 8) | p[k - 1];
+}
+
+unsigned long dict_hashn(const char *key, size_t len) {
+    const unsigned char *p = (const unsigned char *)key;
+    const unsigned long long *s = dict_secret;
+    unsigned long long seed = DICT_SEED, a, b;
+    size_t i;
+
+    seed ^= dict_mix(seed ^ s[0], s[1]);
+
+    if (len <= 16) {
+       if (len >= 4) {
+          a = (dict_r4(p) << 32) | dict_r4(p + ((len >> 3) << 2));
+          b = (dict_r4(p + len - 4) << 32) | dict_r4(p + len - 4 - ((len >> 3) << 2));
+       } else if (len > 0) {
+          a = dict_r3(p, len);
+          b = 0;
+       } else
+          a = b = 0;
+    } else {
+       i = len;
+
+       if (i > 48) {
+          unsigned long long see1 = seed, see2 = seed;
 
-    seed = 0x0badcafe;
-    len  = (int)strlen(key);
+          do {
+             seed = dict_mix(dict_r8(p) ^ s[1], dict_r8(p + 8) ^ seed);
+             see1 = dict_mix(dict_r8(p + 16) ^ s[2], dict_r8(p + 24) ^ see1);
+             see2 = dict_mix(dict_r8(p + 32) ^ s[3], dict_r8(p + 40) ^ see2);
+             p += 48;
+             i -= 48;
+          } while (i > 48);
 
-    h = seed ^ len;
-    data = (unsigned char *)key;
+          seed ^= see1 ^ see2;
+       }
+
+       while (i > 16) {
+          seed = dict_mix(dict_r8(p) ^ s[1], dict_r8(p + 8) ^ seed);
+          i -= 16;
+          p += 16;
+       }
 
-    while (len >= 4) {
-        k = *(unsigned int *)data;
+       a = dict_r8(p + i - 16);
+       b = dict_r8(p + i - 8);
+    }
+
+    a ^= s[1];
+    b ^= seed;
+    dict_mum(&a, &b);
+
+    return (unsigned long)dict_mix(a ^ s[0] ^ len, b ^ s[1]);
+}
 
-        k *= m;
-        k ^= k >> r;
-        k *= m;
+/*
+ * Key equality for keys already known to be len bytes long: compare a
+ * word at a time, finishing with an (overlapping) load of the last word.
+ */
+static inline int dict_keyeq(const char *a, const char *b, size_t len) {
+    const unsigned char *pa = (const unsigned char *)a,
+                        *pb = (const unsigned char *)b;
+    size_t i;
 
-        h *= m;
-        h ^= k;
+    if (len >= 8) {
+       for (i = 0; i + 8 <= len; i += 8)
+          if (dict_r8(pa + i) != dict_r8(pb + i))
+             return 0;
 
-        data += 4;
-        len -= 4;
+       return (i == len || dict_r8(pa + len - 8) == dict_r8(pb + len - 8));
     }
 
-    switch(len) {
-        case 3: h ^= data[2] << 16;
-        case 2: h ^= data[1] << 8;
-        case 1: h ^= data[0];
-                h *= m;
-    };
+    if (len >= 4)
+       return (dict_r4(pa) == dict_r4(pb) && dict_r4(pa + len - 4) == dict_r4(pb + len - 4));
 
-    h ^= h >> 13;
-    h *= m;
-    h ^= h >> 15;
+    for (i = 0; i < len; i++)
+       if (pa[i] != pb[i])
+          return 0;
 
-    return h;
+    return 1;
 }
 
+/* Cheapest checks first: hash, then length, then the bytes */
+#define	dict_match(ep, k, klen, h) \
+    ((ep)->hash == (h) && (ep)->keylen == (klen) && dict_keyeq((ep)->key, (k), (klen)))
+
 /***********************
  * BEGIN: implementation
  ***********************/
-/* Lookup an element in a dict
+/* Lookup an element in one table of a dict
  *   This implementation copied almost verbatim from the Python dictionary
- *  object, without the Pythonisms.
+ *  object, without the Pythonisms. Returns the key's slot, or the slot it
+ *  would be inserted into if missing.
  */
-static keypair *dict_lookup(dict *d, const char *key, unsigned hash) {
+static keypair *dict_lookup(keypair *table, unsigned size, const char *key,
+                            size_t keylen, unsigned long hash) {
     keypair *mem_freeslot;
     keypair *ep;
-    unsigned i;
-    unsigned perturb;
-
-    if (!d || !key)
-       return NULL;
+    unsigned long i;
+    unsigned long perturb;
 
-    i = hash & (d->size-1);
+    i = hash & (size-1);
 
     /* Look for empty slot */
-    ep = d->table + i;
+    ep = table + i;
 
     if (ep->key == NULL || ep->key == key) {
        return ep;
@@ -139,7 +195,7 @@ static keypair *dict_lookup(dict *d, const char *key, unsigned hash) {
     if (ep->key == DUMMY_PTR) {
        mem_freeslot = ep;
     } else {
-      if (ep->hash == hash && !strcmp(key, ep->key)) {
+      if (dict_match(ep, key, keylen, hash)) {
          return ep;
       }
       mem_freeslot = NULL;
@@ -147,15 +203,14 @@ static keypair *dict_lookup(dict *d, const char *key, unsigned hash) {
 
     for (perturb = hash ; ; perturb >>= PERTURB_SHIFT) {
         i = (i << 2) + i + perturb + 1;
-        i &= (d->size-1);
-        ep = d->table + i;
+        i &= (size-1);
+        ep = table + i;
 
         if (ep->key == NULL) {
            return mem_freeslot == NULL ? ep : mem_freeslot;
         }
         if ((ep->key == key) || 
-            (ep->hash == hash && ep->key != DUMMY_PTR &&
-             !strcmp(ep->key, key))) {
+            (ep->key != DUMMY_PTR && dict_match(ep, key, keylen, hash))) {
            return ep;
         }
         if (ep->key == DUMMY_PTR && mem_freeslot == NULL) {
@@ -165,11 +220,104 @@ static keypair *dict_lookup(dict *d, const char *key, unsigned hash) {
     return NULL;
 }
 
-/* Add an item to a dictionary without copying key/val
- *	Used by dict_resize() only.
+#define	dict_slot_used(ep)	((ep) && (ep)->key != NULL && (ep)->key != DUMMY_PTR)
+
+/* Find the live entry for key in either table, or NULL */
+static keypair *dict_find(dict *d, const char *key, size_t keylen, unsigned long hash) {
+    keypair *ep;
+
+    if (!d || !key)
+       return NULL;
+
+    ep = dict_lookup(d->table, d->size, key, keylen, hash);
+
+    if (dict_slot_used(ep))
+       return ep;
+
+    /* Not moved over yet? */
+    if (d->old) {
+       ep = dict_lookup(d->old, d->oldsize, key, keylen, hash);
+
+       if (dict_slot_used(ep))
+          return ep;
+    }
+
+    return NULL;
+}
+
+/*
+ * Incremental rehashing
+ *	Growing a dict doesn't re-insert everything at once: a new table is
+ * allocated and the old one is kept in d->old, then every insert or
+ * delete moves the next DICT_REHASH_STEP slots across. Lookups check the
+ * new table first and then the old one. Moved-out slots become DUMMY_PTR
+ * so probe chains in the old table stay intact.
+ *
+ *	Lookups never move entries, so a dict that isn't being written to
+ * is still safe to read from several threads.
+ *
+ *	With the table grown to at least twice the live keys, the copy is
+ * done long before the new table fills up (oldsize / DICT_REHASH_STEP
+ * writes), so a second resize never has to wait on the first.
  */
-static int dict_add_p(dict *d, const char *key, const char *val, const void *blob, time_t ts, int copy) {
-    unsigned  hash;
+static void dict_rehash_step(dict *d, unsigned n) {
+    keypair *ep, *slot;
+
+    if (!d->old)
+       return;
+
+    while (n-- > 0 && d->rehashidx < d->oldsize) {
+       ep = d->old + d->rehashidx++;
+
+       if (!dict_slot_used(ep))
+          continue;
+
+       slot = dict_lookup(d->table, d->size, ep->key, ep->keylen, ep->hash);
+
+       if (slot->key == NULL)
+          d->fill++;
+
+       *slot = *ep;
+       ep->key = DUMMY_PTR;
+       ep->val = NULL;
+       ep->blob = NULL;
+    }
+
+    if (d->rehashidx >= d->oldsize) {
+       mem_free(d->old);
+       d->old = NULL;
+       d->oldsize = 0;
+       d->rehashidx = 0;
+    }
+}
+
+/* Start moving everything into a fresh table of newsize slots */
+static int dict_grow(dict *d, unsigned newsize) {
+    keypair *table;
+
+    /* Only one migration at a time */
+    if (d->old)
+       dict_rehash_step(d, d->oldsize);
+
+    if (!(table = calloc(newsize, sizeof(keypair))))
+       return -1;
+
+#if DEBUG>2
+    printf("resizing %d to %d (used: %d)\n", d->size, newsize, d->used);
+#endif
+    d->old = d->table;
+    d->oldsize = d->size;
+    d->rehashidx = 0;
+    d->table = table;
+    d->size = newsize;
+    d->fill = 0;
+
+    return 0;
+}
+
+/* Add or replace an item in a dictionary (key/val are duplicated) */
+static int dict_add_p(dict *d, const char *key, size_t keylen, unsigned long hash,
+                      const char *val, const void *blob, time_t ts) {
     keypair  *slot;
 
     if (!d || !key)
@@ -178,44 +326,69 @@ static int dict_add_p(dict *d, const char *key, const char *val, const void *blo
 #if DEBUG>2
     printf("dict_add_p[%s][%s]\n", key, val ? val : "UNDEF");
 #endif
-    hash = dict_hash(key);
-    slot = dict_lookup(d, key, hash);
+    /*
+     * Key already present: replace the value and/or blob in place. This
+     * never moves entries, so it is safe in the middle of dict_enumerate().
+     */
+    if ((slot = dict_find(d, key, keylen, hash))) {
+       if (val) {
+          char *nval = strdup(val);
 
-    if (slot) {
-       if (copy) {
-          if (!(slot->key = strdup(key)))
+          if (!nval)
              return -1;
 
-          if (val) {
-             slot->val = val ? strdup(val) : (char *)val;
-
-             if (!slot->val) {
-               mem_free(slot->key);
-               return -1;
-             }
-          }
-       } else {
-          slot->key  = (char *)key;
-          slot->val  = (char *)val;
+          if (slot->val)
+             mem_free(slot->val);
+          slot->val = nval;
        }
 
        if (blob)
-          slot->blob = (void *)&blob;
+          slot->blob = (void *)blob;
 
-       slot->hash = hash;
+       slot->ts = (ts ? ts : time(NULL));
+       return 0;
+    }
 
-       if (ts)
-          slot->ts = ts;
-       else
-          slot->ts = time(NULL);
+    /* New key: move some of the old table across, then insert */
+    dict_rehash_step(d, DICT_REHASH_STEP);
+    slot = dict_lookup(d->table, d->size, key, keylen, hash);
 
-       d->used++;
+    if (!slot)
+       return -1;
+
+    /* Reusing a deleted slot doesn't add to fill */
+    if (slot->key == NULL)
        d->fill++;
 
-       if ((3 * d->fill) >= (d->size * 2)) {
-          if (dict_resize(d) != 0) {
-             return -1;
-          }
+    if (!(slot->key = malloc(keylen + 1))) {
+       slot->key = DUMMY_PTR;
+       return -1;
+    }
+
+    memcpy(slot->key, key, keylen);
+    slot->key[keylen] = '\0';
+    slot->val = NULL;
+
+    if (val && !(slot->val = strdup(val))) {
+       mem_free(slot->key);
+       slot->key = DUMMY_PTR;
+       return -1;
+    }
+
+    slot->blob = (void *)blob;
+    slot->hash = hash;
+    slot->keylen = keylen;
+
+    if (ts)
+       slot->ts = ts;
+    else
+       slot->ts = time(NULL);
+
+    d->used++;
+
+    if ((3 * d->fill) >= (d->size * 2)) {
+       if (dict_resize(d) != 0) {
+          return -1;
        }
     }
     return 0;
@@ -224,30 +397,45 @@ static int dict_add_p(dict *d, const char *key, const char *val, const void *blo
 
 /* dict_add: Add an item to a dict, with timestamp at current time */
 int dict_add(dict *d, const char *key, const char *val) {
-    return dict_add_p(d, key, val, NULL, time(NULL), 1);
+    return dict_add_ts(d, key, val, time(NULL));
 }
 
 /* dict_add_ts: Add an item to a dict with chosen timestamp */
 int dict_add_ts(dict *d, const char *key, const char *val, time_t ts) {
-    return dict_add_p(d, key, val, NULL, ts, 1);
+    size_t len;
+
+    if (!key)
+       return -1;
+
+    len = strlen(key);
+    return dict_add_p(d, key, len, dict_hashn(key, len), val, NULL, ts);
 }
 
 /* dict_add_blob: Add a blob to a dict by with current timestamp */
 int dict_add_blob(dict *d, const char *key, const void **ptr) {
-    return dict_add_p(d, key, NULL, &ptr, time(NULL), 1);
+    return dict_add_blob_ts(d, key, ptr, time(NULL));
 }
 
 /* dict_add_blob_ts: Add a blob to a dict with chosen timestamp */
 int dict_add_blob_ts(dict *d, const char *key, const void **ptr, time_t ts) {
-    return dict_add_p(d, key, NULL, &ptr, ts, 1);
+    size_t len;
+
+    if (!key)
+       return -1;
+
+    len = strlen(key);
+    return dict_add_p(d, key, len, dict_hashn(key, len), NULL, (const void *)ptr, ts);
 }
 
-/*Resize a dictionary */
+/*
+ * Resize a dictionary
+ *	Called once the table is 2/3 full (counting deleted slots), this only
+ * allocates the new table; entries move across in dict_rehash_step().
+ * If most of the fill is deleted keys, the table is rebuilt at the same
+ * size to clear them out.
+ */
 static int dict_resize(dict *d) {
     unsigned      newsize;
-    keypair      *oldtable;
-    unsigned      i;
-    unsigned      oldsize;
     unsigned      factor;
 
     newsize = d->size;
@@ -261,37 +449,48 @@ static int dict_resize(dict *d) {
        newsize*=2;
     }
  
-    /* Exit early if no re-sizing needed */
-    if (newsize==d->size)
+    return dict_grow(d, newsize);
+}
+
+/* Public: finish (n == 0) or advance an incremental resize */
+int dict_rehash(dict *d, unsigned n) {
+    if (!d || !d->old)
        return 0;
-#if DEBUG>2
-    printf("resizing %d to %d (used: %d)\n", d->size, newsize, d->used);
-#endif
 
-    /* Shuffle pointers, re-allocate new table, re-insert data */
-    oldtable = d->table;
-    d->table = calloc(newsize, sizeof(keypair));
+    dict_rehash_step(d, n ? n : d->oldsize);
+
+    return (d->old != NULL);
+}
+
+/* Public: make room for n keys up front, so filling d never resizes */
+int dict_reserve(dict *d, unsigned n) {
+    unsigned newsize;
+
+    if (!d)
+       return -1;
 
-    if (!(d->table)) {
-       /* Memory allocation failure */
+    /* 3 * n would wrap around and reserve a tiny table */
+    if (n > DICT_MAX_SIZE / 3 * 2)
        return -1;
-    }
 
-    oldsize  = d->size;
-    d->size  = newsize;
-    d->used  = 0;
-    d->fill  = 0;
+    newsize = d->size;
+
+    /* Same 2/3 fill limit as dict_add_p() */
+    while ((3 * n) >= (2 * (unsigned long long)newsize))
+       newsize *= 2;
 
-    for (i = 0; i < oldsize; i++)
-      if (oldtable[i].key && (oldtable[i].key != DUMMY_PTR))
-         dict_add_p(d, oldtable[i].key, oldtable[i].val, NULL, oldtable[i].ts, 0);
+    if (newsize == d->size)
+       return 0;
+
+    if (dict_grow(d, newsize) != 0)
+       return -1;
 
-    mem_free(oldtable);
+    /* The caller is about to fill it, so pay for the move now */
+    dict_rehash_step(d, d->oldsize);
 
     return 0;
 }
 
-
 /*
  * begin: implementation dict
  * scope: public
@@ -313,106 +512,162 @@ dict *dict_new(void) {
     return d;
 }
 
+/* Free the keys and values held in a table (but not the table) */
+static void dict_free_keys(keypair *table, unsigned size) {
+    unsigned i;
+
+    for (i=0; i < size; i++) {
+      if (table[i].key && table[i].key != DUMMY_PTR) {
+         mem_free(table[i].key);
+         if (table[i].val)
+            mem_free(table[i].val);
+      }
+    }
+}
+
+static void dict_free_table(keypair *table, unsigned size) {
+    dict_free_keys(table, size);
+    mem_free(table);
+}
+
 /* Public: deallocate a dict */
 void dict_free(dict * d) {
-    int i;
-    
     if (!d)
        return;
 
-    for (i=0; i < d->size; i++) {
-      if (d->table[i].key && d->table[i].key != DUMMY_PTR) {
-         mem_free(d->table[i].key);
-         if (d->table[i].val)
-            mem_free(d->table[i].val);
-      }
-    }
+    dict_free_table(d->table, d->size);
+
+    if (d->old)
+       dict_free_table(d->old, d->oldsize);
 
-    mem_free(d->table);
     mem_free(d);
 
     return;
 }
 
-/* Public: get an item from a dict */
-const char *dict_get(dict *d, const char *key, const char *defval) {
+/* Public: empty a dict, keeping it (and a small table) for reuse */
+void dict_clear(dict *d) {
+    if (!d)
+       return;
+
+    if (d->old) {
+       dict_free_table(d->old, d->oldsize);
+       d->old = NULL;
+       d->oldsize = 0;
+       d->rehashidx = 0;
+    }
+
+    if (d->size > DICT_REUSE_SZ) {
+       keypair *table = calloc(DICT_MIN_SZ, sizeof(keypair));
+
+       if (table) {
+          dict_free_table(d->table, d->size);
+          d->table = table;
+          d->size = DICT_MIN_SZ;
+          d->used = d->fill = 0;
+          return;
+       }
+    }
+
+    dict_free_keys(d->table, d->size);
+    memset(d->table, 0, d->size * sizeof(keypair));
+    d->used = d->fill = 0;
+}
+
+/* Public: get an item from a dict, by a key of known length */
+const char *dict_getn(dict *d, const char *key, size_t keylen, const char *defval) {
    keypair *kp;
-   unsigned  hash;
 
    if (!d || !key)
       return defval;
 
-   hash = dict_hash(key);
-   kp = dict_lookup(d, key, hash);
-
-   if (kp)
+   if ((kp = dict_find(d, key, keylen, dict_hashn(key, keylen))) && kp->val)
       return kp->val;
 
    return defval;
 }
 
-void *dict_get_blob(dict *d, const char *key, const void **defval) {
+/* Public: get an item from a dict */
+const char *dict_get(dict *d, const char *key, const char *defval) {
+   if (!key)
+      return defval;
+
+   return dict_getn(d, key, strlen(key), defval);
+}
+
+void *dict_get_blobn(dict *d, const char *key, size_t keylen, const void **defval) {
    keypair *kp;
-   unsigned  hash;
 
    if (!d || !key)
       return defval;
 
-   hash = dict_hash(key);
-   kp = dict_lookup(d, key, hash);
-
-   if (kp && kp->blob)
+   if ((kp = dict_find(d, key, keylen, dict_hashn(key, keylen))) && kp->blob)
       return kp->blob;
 
    return defval;
 }
 
+void *dict_get_blob(dict *d, const char *key, const void **defval) {
+   if (!key)
+      return defval;
+
+   return dict_get_blobn(d, key, strlen(key), defval);
+}
+
 /* Public: delete an item in a dict */
 int dict_del(dict *d, const char *key) {
-    unsigned    hash;
+    size_t      len;
     keypair    *kp;
 
     if (!d || !key)
        return -1;
 
-    hash = dict_hash(key);
-    kp = dict_lookup(d, key, hash);
+    len = strlen(key);
 
-    if (!kp)
+    if (!(kp = dict_find(d, key, len, dict_hashn(key, len))))
        return -1;
 
-    if (kp->key && kp->key != DUMMY_PTR)
-       mem_free(kp->key);
-
+    mem_free(kp->key);
     kp->key = DUMMY_PTR;
 
     if (kp->val)
        mem_free(kp->val);
 
     kp->val = NULL;
+    kp->blob = NULL;
     d->used --;
 
+    dict_rehash_step(d, DICT_REHASH_STEP);
+
     return 0;
 }
 
-/* Public: enumerate a dictionary */
+/*
+ * Public: enumerate a dictionary
+ *	Ranks past d->size walk the old table of a resize in progress.
+ */
 int dict_enumerate(dict *d, int rank, const char **key, const char **val, time_t *ts) {
+    keypair *ep = NULL;
+
     if (!d || !key || !val || (rank < 0))
        return -1;
 
-    while ((d->table[rank].key == NULL || d->table[rank].key == DUMMY_PTR) &&
-           (rank<d->size))
-       rank++;
+    for (; rank < d->size + d->oldsize; rank++) {
+       ep = (rank < d->size) ? &d->table[rank] : &d->old[rank - d->size];
 
-    if (rank >= d->size) {
+       if (dict_slot_used(ep))
+          break;
+    }
+
+    if (rank >= d->size + d->oldsize) {
        *key = NULL;
        *val = NULL;
        ts = 0;
        rank = -1;
     } else {
-       *key = d->table[rank].key;
-       *val = d->table[rank].val;
-       *ts = d->table[rank].ts;
+       *key = ep->key;
+       *val = ep->val;
+       *ts = ep->ts;
        rank++;
     }
 
@@ -459,91 +714,211 @@ dict *dict_merge(dict *a, dict *b, int merge_type) {
 }
 
 /*
- * Test harness
+ * Benchmark: build with -DMAIN (make bin/dict-bench)
+ *	Reports ns/op for hashing and lookups over key sets shaped like
+ * what jailfs actually stores: config keys, hook/api names, paths from
+ * package pools and the hex ids used by the old harness.
  */
-#ifdef TEST_HARNESS
-#define ALIGN   "%15s: %6.4f\n"
+#if	defined(MAIN) || defined(TEST_HARNESS)
+#include <time.h>
+#define ALIGN   "%-10s %-8s %9d keys %8.2f ns/op\n"
 #define NKEYS   1024*1024
 
-double epoch_double() {
-    struct timeval t;
-    gettimeofday(&t, NULL);
-    return t.tv_sec + (t.tv_usec * 1.0) / 1000000.0;
-}
-
-int main(int argc, char **argv) {
-    dict *d;
-    double t1, t2;
-    int i;
-    int nkeys;
-    char *buffer;
-    char *val;
+/* The previous one-at-a-time hash, for comparison */
+static unsigned dict_hash_dobbs(const char * key) {
+    int         len;
+    unsigned    hash;
+    int         i;
 
-    nkeys = (argc > 1) ? (int)atoi(argv[1]) : NKEYS;
-    printf("%15s: %d\n", "values", nkeys);
-    buffer = mem_alloc(9 * nkeys);
+    len = strlen(key);
 
-    d = dict_new();
-    t1 = epoch_double();
-    for (i = 0; i < nkeys; i++) {
-       sprintf(buffer + i * 9, "%08x", i);
+    for (hash = 0, i = 0; i < len; i++) {
+       hash += (unsigned)key[i];
+       hash += (hash << 10);
+       hash ^= (hash >> 6);
     }
-    t2 = epoch_double();
-    printf(ALIGN, "initialization", t2 - t1);
 
-    t1 = epoch_double();
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
 
-    for (i = 0; i < nkeys; i++) {
-       dict_add(d, buffer + i * 9, buffer + i * 9);
-    }
-    t2 = epoch_double();
-    printf(ALIGN, "adding", t2 - t1);
+    return hash;
+}
 
-    t1 = epoch_double();
+static double bench_now(void) {
+    struct timespec ts;
 
-    for (i = 0; i < nkeys; i++) {
-       val = dict_get(d, buffer + i * 9, "UNDEF");
-#if DEBUG > 1
-       printf("exp[%s] got[%s]\n", buffer + i * 9, val);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
 
-       if (val && strcmp(val, buffer+i*9)) {
-          printf("-> WRONG got[%s] exp[%s]\n", val, buffer + i * 9);
+static const char *bench_conf_keys[] = {
+    "log.level", "path.pkg", "path.cache", "path.mountpoint", "path.statedir",
+    "path.symtab", "path.log", "path.pid", "cache.type", "jail.name",
+    "jail.hostname", "init.cmd", "vfs.locking.host", "pkgdir.inotify",
+    "pkgdir.prescan", "shell.history-length", "debug.db", "debug.jail",
+    "debug.mem", "debug.net", "debug.pkg", "debug.threads", "debug.vfs",
+    "debug.vfs.mime", "tuning.heap.api-msg", "tuning.heap.files",
+    "tuning.heap.inode", "tuning.heap.node", "tuning.heap.pkg",
+    "tuning.heap.vfs_handle", "tuning.heap.vfs_watch",
+    "tuning.timer.blockheap_gc", "tuning.timer.pkg_gc",
+    "tuning.timer.global_gc", "tuning.timer.vfs_gc",
+    "tuning.threads.stacksz", "watchdog.interval", "experimental.watchdog",
+    NULL
+};
+
+static const char *bench_path_dirs[] = {
+    "usr/lib/x86_64-linux-gnu/", "usr/share/locale/en_US/LC_MESSAGES/",
+    "etc/", "usr/bin/", "lib/x86_64-linux-gnu/security/",
+    "usr/share/zoneinfo/America/", "usr/include/linux/"
+};
+
+/* Fill keys[] (each slot 96 bytes) with n keys of the given kind */
+static int bench_keys(char *keys, int n, int kind) {
+    int i, c;
+
+    for (i = 0; i < n; i++) {
+       char *k = keys + i * 96;
+
+       switch (kind) {
+          case 0:		/* config keys, suffixed once the list runs out */
+             for (c = 0; bench_conf_keys[c]; c++)
+                ;
+             if (i < c)
+                snprintf(k, 96, "%s", bench_conf_keys[i]);
+             else
+                snprintf(k, 96, "%s.%d", bench_conf_keys[i % c], i / c);
+             break;
+          case 1:		/* hook & api message names */
+             snprintf(k, 96, "%s:%d", (i & 1) ? "vfs.open" : "gc", i);
+             break;
+          case 2:		/* paths inside packages */
+             snprintf(k, 96, "%slib%x-%d.so.%d", bench_path_dirs[i % 7], i * 2654435761u, i % 13, i % 3);
+             break;
+          default:		/* hex ids, as the old harness */
+             snprintf(k, 96, "%08x", i);
        }
-#endif
     }
-    t2 = epoch_double();
-    printf(ALIGN, "lookup", t2 - t1);
 
-    if (nkeys < 100)
-       dict_dump(d, stdout);
+    return n;
+}
 
-    t1 = epoch_double();
+static void bench_run(const char *name, int kind, int nkeys) {
+    dict *d = dict_new();
+    char *keys = mem_alloc(96 * (size_t)nkeys),
+         *miss = mem_alloc(96 * (size_t)nkeys);
+    unsigned long sink = 0;
+    double t1, t2;
+    int i, r, rounds = (nkeys < 100000 ? 1000000 / nkeys + 1 : 1);
+
+    bench_keys(keys, nkeys, kind);
+
+    /* Same shape and length, last byte flipped */
+    memcpy(miss, keys, 96 * (size_t)nkeys);
+    for (i = 0; i < nkeys; i++)
+       miss[i * 96 + strlen(miss + i * 96) - 1] ^= 0x80;
+
+    for (i = 0; i < nkeys; i++)
+       dict_add(d, keys + i * 96, keys + i * 96);
+
+    t1 = bench_now();
+    for (r = 0; r < rounds; r++)
+       for (i = 0; i < nkeys; i++)
+          sink += dict_hash_dobbs(keys + i * 96);
+    t2 = bench_now();
+    printf(ALIGN, name, "dobbs", nkeys, (t2 - t1) / ((double)rounds * nkeys));
+
+    t1 = bench_now();
+    for (r = 0; r < rounds; r++)
+       for (i = 0; i < nkeys; i++)
+          sink += dict_hashn(keys + i * 96, strlen(keys + i * 96));
+    t2 = bench_now();
+    printf(ALIGN, name, "wyhash", nkeys, (t2 - t1) / ((double)rounds * nkeys));
+
+    t1 = bench_now();
+    for (r = 0; r < rounds; r++)
+       for (i = 0; i < nkeys; i++)
+          if (dict_get(d, keys + i * 96, NULL) == NULL)
+             printf("-> WRONG: lost key %s\n", keys + i * 96);
+    t2 = bench_now();
+    printf(ALIGN, name, "hit", nkeys, (t2 - t1) / ((double)rounds * nkeys));
+
+    t1 = bench_now();
+    for (r = 0; r < rounds; r++)
+       for (i = 0; i < nkeys; i++)
+          if (dict_get(d, miss + i * 96, NULL) != NULL)
+             printf("-> WRONG: found missing key %s\n", miss + i * 96);
+    t2 = bench_now();
+    printf(ALIGN, name, "miss", nkeys, (t2 - t1) / ((double)rounds * nkeys));
+
+    t1 = bench_now();
+    for (i = 0; i < nkeys; i++)
+       dict_del(d, keys + i * 96);
+    t2 = bench_now();
+    printf(ALIGN, name, "delete", nkeys, (t2 - t1) / nkeys);
+
+    if (d->used != 0)
+       printf("-> WRONG: %u keys left after delete\n", d->used);
 
-    for (i = 0; i < nkeys; i++) {
-       dict_del(d, buffer + i*9);
-    }
+    dict_free(d);
+    mem_free(keys);
+    mem_free(miss);
+
+    if (sink == 42)
+       printf("\n");
+}
+
+/*
+ * Worst single insert while filling a dict: with incremental rehashing
+ * this stays flat as the table grows, with dict_reserve() there is no
+ * resize at all.
+ */
+static void bench_fill(const char *name, int kind, int nkeys, int reserve) {
+    dict *d = dict_new();
+    char *keys = mem_alloc(96 * (size_t)nkeys);
+    double t0, t1, t2 = 0, worst = 0;
+    int i;
 
-    t2 = epoch_double();
-    printf(ALIGN, "delete", t2 - t1);
+    bench_keys(keys, nkeys, kind);
 
-    t1 = epoch_double();
+    t0 = bench_now();
+    if (reserve)
+       dict_reserve(d, nkeys);
 
     for (i = 0; i < nkeys; i++) {
-       dict_add(d, buffer + i * 9, buffer + i * 9);
+       t1 = bench_now();
+       dict_add(d, keys + i * 96, keys + i * 96);
+       t2 = bench_now();
+
+       if (t2 - t1 > worst)
+          worst = t2 - t1;
     }
-    t2 = epoch_double();
-    printf(ALIGN, "adding", t2 - t1);
+    printf(ALIGN, name, reserve ? "reserve" : "fill", nkeys, (t2 - t0) / nkeys);
+    printf("%-10s %-8s %9d keys %8.2f us worst insert\n", name, reserve ? "reserve" : "fill",
+           nkeys, worst / 1000);
+
+    for (i = 0; i < nkeys; i++)
+       if (dict_get(d, keys + i * 96, NULL) == NULL)
+          printf("-> WRONG: lost key %s\n", keys + i * 96);
 
-    t1 = epoch_double();
     dict_free(d);
-    t2 = epoch_double();
-    printf(ALIGN, "mem_free", t2 - t1);
+    mem_free(keys);
+}
 
-    mem_free(buffer);
+int main(int argc, char **argv) {
+    int nkeys = (argc > 1) ? (int)atoi(argv[1]) : NKEYS;
+
+    bench_run("config", 0, 38);
+    bench_run("hooks", 1, 64);
+    bench_run("paths", 2, 4096);
+    bench_run("paths", 2, nkeys);
+    bench_run("hexids", 3, nkeys);
+    bench_fill("paths", 2, nkeys, 0);
+    bench_fill("paths", 2, nkeys, 1);
 
     return 0;
 }
-#endif
+#endif	/* defined(MAIN) */
 
 bool dict_getBool(dict *cp, const char *key, bool def) {
    const char *str;
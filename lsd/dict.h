@@ -38,21 +38,26 @@ typedef enum { false = 0, true } bool;
 
 /* Keypair: holds a key/value pair. Key must be a hashable C string */
 typedef struct _keypair_ {
+    unsigned long hash;
+    size_t  keylen;		/* strlen(key), checked before comparing keys */
     char    *key;
     char    *val;
     /* Added by joseph to support a blob-type, storing only a pointer */
     void    *blob;
     time_t  ts;
     /* End AppWorx changes */
-    unsigned  hash;
 } keypair;
 
 /* Dict is the only type needed for clients of the dict object */
 typedef struct _dict_ {
-    unsigned  fill;
-    unsigned  used;
+    unsigned  fill;		/* live + deleted slots in table */
+    unsigned  used;		/* live keys, in both tables */
     unsigned  size;
     keypair *table;
+    /* While resizing: keys not yet moved into table (see dict_rehash) */
+    keypair *old;
+    unsigned  oldsize;
+    unsigned  rehashidx;	/* next slot of old to move */
 } dict;
 
 /*
@@ -71,6 +76,37 @@ extern dict *dict_new(void);
  */
 extern void   dict_free(dict *d);
 
+/*
+ *  @brief    Empty a dictionary
+ *  @param    d   dict to clear
+ *  @return   void
+ *	 Remove (and free) every key/value, leaving d ready to be filled
+ *  again. Cheaper than dict_free() + dict_new() for dicts that get
+ *  reused, like API message payloads.
+ */
+extern void dict_clear(dict *d);
+
+/*
+ *  @brief    Pre-size a dictionary
+ *  @param    d   dict to grow
+ *  @param    n   number of keys it will hold
+ *  @return   0 if Ok, -1 on allocation failure or if n is too big
+ *	 Grow the table once so that adding n keys never triggers a resize.
+ *  Useful for importers that know their entry count up front.
+ */
+extern int dict_reserve(dict *d, unsigned n);
+
+/*
+ *  @brief    Advance an incremental resize
+ *  @param    d   dict being resized
+ *  @param    n   slots of the old table to move, 0 for all
+ *  @return   1 if a resize is still in progress, 0 otherwise
+ *	 Resizes are normally spread over later inserts/deletes. Call this
+ *  from idle time, or with n = 0 before handing a dict to readers so
+ *  their lookups only probe one table.
+ */
+extern int dict_rehash(dict *d, unsigned n);
+
 /*
  *  @brief    Add an item to a dictionary
  *  @param    d       dict to add to
@@ -93,6 +129,19 @@ extern int    dict_add(dict *d, const char *key, const char *val);
  */
 extern const char *dict_get(dict *d, const char *key, const char *defval);
 
+/*
+ *  @brief    Length-aware variants of dict_get/dict_get_blob
+ *	 key need not be NUL terminated; saves the strlen() when the caller
+ *  already knows the length (paths being split, etc).
+ */
+extern const char *dict_getn(dict *d, const char *key, size_t keylen, const char *defval);
+extern void *dict_get_blobn(dict *d, const char *key, size_t keylen, const void **defval);
+
+/*
+ *  @brief    Hash len bytes of key (wyhash), as used by the dict internally
+ */
+extern unsigned long dict_hashn(const char *key, size_t len);
+
 /*
  *  @brief   Add a blob to the dictionary
  *		- used for storing arbitrary data
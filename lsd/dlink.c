@@ -40,6 +40,8 @@ void dlink_init(void) {
       fprintf(stderr, "dlink_init(): block allocator failed\n");
       raise(SIGSEGV);
    }
+
+   conf_watch_heap("tuning.heap.node", dlink_node_heap);
 }
 
 void dlink_fini(void) {
@@ -0,0 +1,213 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * lsd/ebr.c:
+ *	Epoch based memory reclamation
+ *
+ *	There is one global epoch. Each registered thread publishes the
+ * epoch it last saw at a quiescent point (0 while offline). The epoch
+ * may only move on once every online thread has seen the current one.
+ *
+ *	Retired objects are tagged with the epoch at the time they were
+ * unlinked. An object tagged e is unreachable for anyone who announced
+ * e + 1 or later, so once the global epoch reaches e + 2 every online
+ * thread has passed a quiescent point since, and it can go.
+ *
+ *	Retiring is a lock-free push onto one list; ebr_gc() takes the
+ * whole list, runs what is safe and puts the rest back.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "memory.h"
+#include "ebr.h"
+
+struct ebr_thread {
+   unsigned long epoch;		// last epoch seen, 0 if offline
+   int         dead;		// unregistered, free on next ebr_gc()
+   char        name[16];
+   struct ebr_thread *next;
+} __attribute__((aligned(64)));
+
+struct ebr_node {
+   struct ebr_node *next;
+   unsigned long epoch;		// global epoch when retired
+   void       *ptr;
+   void      (*fn)(void *);
+};
+
+static unsigned long ebr_epoch = 1;
+static unsigned long ebr_npending = 0;
+static struct ebr_node *ebr_limbo = NULL;
+static struct ebr_thread *ebr_threads = NULL;
+static pthread_mutex_t ebr_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct ebr_thread *ebr_self = NULL;
+
+void ebr_register(const char *name) {
+   struct ebr_thread *t;
+
+   if (ebr_self != NULL)
+      return;
+
+   if (posix_memalign((void **)&t, 64, sizeof(struct ebr_thread)) != 0)
+      return;
+
+   memset(t, 0, sizeof(struct ebr_thread));
+
+   if (name)
+      strncpy(t->name, name, sizeof(t->name) - 1);
+
+   __atomic_store_n(&t->epoch, __atomic_load_n(&ebr_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+
+   pthread_mutex_lock(&ebr_mutex);
+   t->next = ebr_threads;
+   ebr_threads = t;
+   pthread_mutex_unlock(&ebr_mutex);
+
+   ebr_self = t;
+}
+
+void ebr_unregister(void) {
+   struct ebr_thread *t = ebr_self;
+
+   if (t == NULL)
+      return;
+
+   __atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+   __atomic_store_n(&t->dead, 1, __ATOMIC_RELEASE);
+   ebr_self = NULL;
+}
+
+void ebr_quiescent(void) {
+   if (ebr_self == NULL)
+      return;
+
+   __atomic_store_n(&ebr_self->epoch, __atomic_load_n(&ebr_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+void ebr_offline(void) {
+   if (ebr_self == NULL)
+      return;
+
+   __atomic_store_n(&ebr_self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+void ebr_online(void) {
+   if (ebr_self == NULL)
+      return;
+
+   // Must be visible to ebr_gc() before we load any shared pointer
+   __atomic_store_n(&ebr_self->epoch, __atomic_load_n(&ebr_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+int ebr_is_online(void) {
+   return (ebr_self != NULL && __atomic_load_n(&ebr_self->epoch, __ATOMIC_RELAXED) != 0);
+}
+
+void ebr_retire(void *ptr, void (*fn)(void *)) {
+   struct ebr_node *n;
+
+   if (ptr == NULL)
+      return;
+
+   // Can't defer it, so leak it rather than free it under a reader
+   if (!(n = malloc(sizeof(struct ebr_node))))
+      return;
+
+   n->ptr = ptr;
+   n->fn = fn;
+   n->epoch = __atomic_load_n(&ebr_epoch, __ATOMIC_SEQ_CST);
+   n->next = __atomic_load_n(&ebr_limbo, __ATOMIC_RELAXED);
+
+   while (!__atomic_compare_exchange_n(&ebr_limbo, &n->next, n, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+
+   __atomic_add_fetch(&ebr_npending, 1, __ATOMIC_RELAXED);
+}
+
+// Caller holds ebr_mutex
+static void ebr_advance(void) {
+   struct ebr_thread *t, **tp;
+   unsigned long epoch = __atomic_load_n(&ebr_epoch, __ATOMIC_SEQ_CST), seen;
+
+   for (tp = &ebr_threads; (t = *tp) != NULL;) {
+      if (__atomic_load_n(&t->dead, __ATOMIC_ACQUIRE)) {
+         *tp = t->next;
+         free(t);
+         continue;
+      }
+
+      seen = __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST);
+
+      // Online and hasn't caught up yet
+      if (seen != 0 && seen != epoch)
+         return;
+
+      tp = &t->next;
+   }
+
+   __atomic_store_n(&ebr_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+int ebr_gc(void) {
+   struct ebr_node *n, *next, *keep = NULL, *tail = NULL;
+   unsigned long epoch;
+   int freed = 0;
+
+   // The collector itself is obviously not inside a read section
+   ebr_quiescent();
+
+   pthread_mutex_lock(&ebr_mutex);
+   ebr_advance();
+   epoch = __atomic_load_n(&ebr_epoch, __ATOMIC_SEQ_CST);
+   n = __atomic_exchange_n(&ebr_limbo, NULL, __ATOMIC_ACQUIRE);
+   pthread_mutex_unlock(&ebr_mutex);
+
+   for (; n != NULL; n = next) {
+      next = n->next;
+
+      if (n->epoch + 2 <= epoch) {
+         if (n->fn)
+            n->fn(n->ptr);
+         else
+            free(n->ptr);
+
+         free(n);
+         freed++;
+         continue;
+      }
+
+      n->next = keep;
+      keep = n;
+
+      if (tail == NULL)
+         tail = n;
+   }
+
+   // Put back whatever isn't safe yet
+   if (keep != NULL) {
+      tail->next = __atomic_load_n(&ebr_limbo, __ATOMIC_RELAXED);
+
+      while (!__atomic_compare_exchange_n(&ebr_limbo, &tail->next, keep, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+         ;
+   }
+
+   __atomic_sub_fetch(&ebr_npending, freed, __ATOMIC_RELAXED);
+   return freed;
+}
+
+unsigned long ebr_pending(void) {
+   return __atomic_load_n(&ebr_npending, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,60 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * lsd/ebr.h:
+ *	Epoch based memory reclamation (quiescent state flavour)
+ *
+ *	Lock-free readers can't tell a writer when they are done with an
+ * object, so writers unlink it and ebr_retire() it instead of freeing.
+ * Every registered thread periodically passes a quiescent point, where
+ * it holds no pointers into shared structures. Once all of them have
+ * done so twice since an object was retired, nobody can still see it
+ * and ebr_gc() frees it.
+ *
+ *	Rules for threads that read shared structures:
+ *	- ebr_register() once (thread_entry() does this for you)
+ *	- ebr_quiescent() whenever no shared pointers are held, e.g. at the
+ *	  top of a work loop
+ *	- ebr_offline() before blocking for a long time (sleep, poll, read
+ *	  from a terminal) and ebr_online() after, so a sleeping thread
+ *	  doesn't hold everyone else's garbage hostage
+ *
+ *	Threads that never register (or are offline) must not touch
+ * structures whose memory is reclaimed this way.
+ */
+#if	!defined(__LSD_EBR_H)
+#define	__LSD_EBR_H
+
+// Register/unregister the calling thread
+extern void ebr_register(const char *name);
+extern void ebr_unregister(void);
+
+// Calling thread holds no shared pointers right now
+extern void ebr_quiescent(void);
+// ... and won't until ebr_online(), however long that takes
+extern void ebr_offline(void);
+extern void ebr_online(void);
+// Nonzero if the calling thread is registered and online
+extern int ebr_is_online(void);
+
+// Call fn(ptr) (free(ptr) if fn is NULL) once no reader can hold ptr
+extern void ebr_retire(void *ptr, void (*fn)(void *));
+
+// Try to advance the epoch and run every callback that became safe.
+// Returns how many were run. Call periodically from one thread (the gc).
+extern int ebr_gc(void);
+
+// Objects waiting to be reclaimed
+extern unsigned long ebr_pending(void);
+
+#endif	// !defined(__LSD_EBR_H)
@@ -0,0 +1,68 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * lsd/hist.c:
+ *	Log-linear histograms
+ */
+#include "hist.h"
+
+void hist_merge(hist *dst, const hist *src) {
+   unsigned long v;
+   int i;
+
+   for (i = 0; i < HIST_BUCKETS; i++)
+      dst->bucket[i] += __atomic_load_n(&src->bucket[i], __ATOMIC_RELAXED);
+
+   dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+   dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+
+   if ((v = __atomic_load_n(&src->max, __ATOMIC_RELAXED)) > dst->max)
+      dst->max = v;
+}
+
+unsigned long hist_percentile(const hist *h, double pct) {
+   unsigned long total = 0, want, seen = 0, v;
+   int i;
+
+   // count may run ahead of or behind the buckets on a live histogram
+   for (i = 0; i < HIST_BUCKETS; i++)
+      total += h->bucket[i];
+
+   if (total == 0)
+      return 0;
+
+   want = (unsigned long)(total * pct / 100.0 + 0.5);
+
+   if (want == 0)
+      want = 1;
+
+   for (i = 0; i < HIST_BUCKETS; i++) {
+      if ((seen += h->bucket[i]) >= want) {
+         // Middle of the bucket, but never beyond the biggest value seen
+         v = hist_bucket_value(i) + (hist_bucket_value(i + 1) - hist_bucket_value(i)) / 2;
+         return (h->max && v > h->max ? h->max : v);
+      }
+   }
+
+   return h->max;
+}
+
+unsigned long hist_count_le(const hist *h, unsigned long v) {
+   unsigned long n = 0;
+   int i, last = hist_bucket(v);
+
+   for (i = 0; i <= last; i++)
+      n += h->bucket[i];
+
+   return n;
+}
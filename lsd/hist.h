@@ -0,0 +1,81 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * lsd/hist.h:
+ *	Log-linear (HDR style) histograms of unsigned values
+ *
+ *	Values below HIST_SUB get a bucket each; above that every power of
+ * two is split into HIST_SUB buckets, so any value is off by at most
+ * 1/HIST_SUB (~6%) of itself. Values of 2^HIST_MAX_BITS and up land in
+ * the last bucket.
+ *
+ *	A histogram has ONE writer (hist_record); any thread may read or
+ * merge it meanwhile and sees each counter either before or after an
+ * update. For many writers, give each thread its own and merge on read.
+ */
+#if	!defined(__LSD_HIST_H)
+#define	__LSD_HIST_H
+#include <sys/types.h>
+
+#define	HIST_SUB_BITS	4
+#define	HIST_SUB	(1 << HIST_SUB_BITS)
+#define	HIST_MAX_BITS	40
+#define	HIST_BUCKETS	((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct hist {
+   unsigned long count, sum, max;
+   unsigned long bucket[HIST_BUCKETS];
+} hist;
+
+// Bucket a value falls in, and the smallest value of a bucket
+static __inline int hist_bucket(unsigned long v) {
+   int msb;
+
+   if (v < HIST_SUB)
+      return (int)v;
+
+   if (v >= (1UL << HIST_MAX_BITS))
+      return HIST_BUCKETS - 1;
+
+   msb = 63 - __builtin_clzl(v);
+   return (msb - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static __inline unsigned long hist_bucket_value(int idx) {
+   if (idx < HIST_SUB)
+      return (unsigned long)idx;
+
+   return (unsigned long)(HIST_SUB + idx % HIST_SUB) << (idx / HIST_SUB - 1);
+}
+
+// Owner of h only
+static __inline void hist_record(hist *h, unsigned long v) {
+   int b = hist_bucket(v);
+
+   __atomic_store_n(&h->bucket[b], h->bucket[b] + 1, __ATOMIC_RELAXED);
+   __atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+
+   if (v > h->max)
+      __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+
+   __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+// Add src (which may be written to meanwhile) into dst
+extern void hist_merge(hist *dst, const hist *src);
+// Value at or below which pct percent (0-100) of the samples are
+extern unsigned long hist_percentile(const hist *h, double pct);
+// Samples in the buckets up to the one holding v (cumulative, for exporters)
+extern unsigned long hist_count_le(const hist *h, unsigned long v);
+
+#endif	// !defined(__LSD_HIST_H)
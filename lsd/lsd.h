@@ -36,9 +36,14 @@
 #include <lsd/dict.h>
 #include <lsd/atomicio.h>
 #include <lsd/balloc.h>
+#include <lsd/cdict.h>
 #include <lsd/dlink.h>
+#include <lsd/ebr.h>
+#include <lsd/hist.h>
 #include <lsd/list.h>
+#include <lsd/ring.h>
 #include <lsd/str.h>
 #include <lsd/timestr.h>
+#include <lsd/topology.h>
 #include <lsd/tree.h>
 #include <lsd/util.h>
@@ -0,0 +1,139 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * lsd/ring.c:
+ *	Bounded lock-free ring buffer (multiple producers, one consumer)
+ *
+ *	This is D. Vyukov's bounded queue: every slot carries a sequence
+ * number which tells producers whether it is free and the consumer
+ * whether it has been committed. Producers race for slots with a single
+ * CAS on head, the consumer owns tail outright.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+#include "ring.h"
+
+struct ring_slot {
+   unsigned long seq;		// sequence number, see above
+   unsigned long pos;		// position this slot was reserved at
+};
+
+#define	RING_HDR		(sizeof(struct ring_slot))
+#define	ring_slot(r, pos)	((struct ring_slot *)((r)->slots + ((pos) & (r)->mask) * (r)->stride))
+#define	ring_hdr(p)		((struct ring_slot *)((unsigned char *)(p) - RING_HDR))
+
+ring *ring_create(size_t elemsize, unsigned long nelems) {
+   ring *r = NULL;
+   unsigned long n = 2, i;
+
+   if (elemsize == 0 || nelems == 0)
+      return NULL;
+
+   while (n < nelems)
+      n <<= 1;
+
+   if (posix_memalign((void **)&r, 64, sizeof(ring)) != 0)
+      return NULL;
+
+   memset(r, 0, sizeof(ring));
+   r->elemsize = elemsize;
+   // Keep payloads 16 byte aligned so callers can store anything in them
+   r->stride = (RING_HDR + elemsize + 15) & ~(size_t)15;
+   r->mask = n - 1;
+
+   if (posix_memalign((void **)&r->slots, 64, r->stride * n) != 0) {
+      free(r);
+      return NULL;
+   }
+
+   for (i = 0; i < n; i++)
+      ring_slot(r, i)->seq = i;
+
+   return r;
+}
+
+void ring_destroy(ring *r) {
+   if (r == NULL)
+      return;
+
+   free(r->slots);
+   free(r);
+}
+
+void *ring_reserve(ring *r) {
+   struct ring_slot *s;
+   unsigned long pos, seq;
+   long dif;
+
+   pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+   for (;;) {
+      s = ring_slot(r, pos);
+      seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+      dif = (long)(seq - pos);
+
+      if (dif == 0) {
+         // Slot is free, try to claim it (pos is refreshed on failure)
+         if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            s->pos = pos;
+            return (unsigned char *)s + RING_HDR;
+         }
+      } else if (dif < 0) {
+         // The consumer hasn't caught up, we are full
+         __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+         return NULL;
+      } else
+         pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+   }
+}
+
+void ring_commit(ring *r, void *slot) {
+   struct ring_slot *s = ring_hdr(slot);
+
+   __atomic_store_n(&s->seq, s->pos + 1, __ATOMIC_RELEASE);
+}
+
+void *ring_peek(ring *r, unsigned long idx) {
+   struct ring_slot *s;
+   unsigned long pos;
+
+   if (idx > r->mask)
+      return NULL;
+
+   pos = r->tail + idx;
+   s = ring_slot(r, pos);
+
+   if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos + 1)
+      return NULL;
+
+   return (unsigned char *)s + RING_HDR;
+}
+
+void ring_release(ring *r, unsigned long count) {
+   unsigned long i, pos;
+
+   for (i = 0; i < count; i++) {
+      pos = r->tail + i;
+      // Hand the slot back to producers one lap from now
+      __atomic_store_n(&ring_slot(r, pos)->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+   }
+
+   __atomic_store_n(&r->tail, r->tail + count, __ATOMIC_RELEASE);
+}
+
+unsigned long ring_pending(ring *r) {
+   return __atomic_load_n(&r->head, __ATOMIC_RELAXED) -
+          __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+}
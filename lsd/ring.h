@@ -0,0 +1,51 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * lsd/ring.h:
+ *	Bounded lock-free ring buffer with fixed size slots.
+ *
+ *	Any number of threads may produce (ring_reserve/ring_commit) but
+ * only ONE thread at a time may consume (ring_peek/ring_release).
+ * Producers never block: if the ring is full, ring_reserve() returns
+ * NULL and the drop counter is bumped.
+ */
+#if	!defined(__LSD_RING_H)
+#define	__LSD_RING_H
+#include <sys/types.h>
+
+typedef struct ring {
+   unsigned long head __attribute__((aligned(64)));	// next slot to reserve (producers)
+   unsigned long tail __attribute__((aligned(64)));	// next slot to consume (consumer)
+   unsigned long dropped;	// records lost because the ring was full
+   unsigned long mask;		// slot count - 1
+   size_t      elemsize;	// usable bytes per slot
+   size_t      stride;		// bytes between slots (header + payload)
+   unsigned char *slots;	// slot storage
+} ring;
+
+// Create/destroy a ring of nelems (rounded up to a power of 2) slots
+extern ring *ring_create(size_t elemsize, unsigned long nelems);
+extern void ring_destroy(ring *r);
+
+// Producer side: claim a slot (NULL if full), fill it, then commit it
+extern void *ring_reserve(ring *r);
+extern void ring_commit(ring *r, void *slot);
+
+// Consumer side: look at the idx'th pending record, release count records
+extern void *ring_peek(ring *r, unsigned long idx);
+extern void ring_release(ring *r, unsigned long count);
+
+// Number of records committed or in flight (approximate)
+extern unsigned long ring_pending(ring *r);
+
+#endif	// !defined(__LSD_RING_H)
@@ -5,11 +5,16 @@ lsd_lib_so := lib/libsd.so
 libs += ${lsd_lib} ${lsd_lib_so}
 lsd_objs += .obj/lsd/atomicio.o
 lsd_objs += .obj/lsd/balloc.o
+lsd_objs += .obj/lsd/cdict.o
 lsd_objs += .obj/lsd/dict.o
 lsd_objs += .obj/lsd/dlink.o
+lsd_objs += .obj/lsd/ebr.o
+lsd_objs += .obj/lsd/hist.o
 lsd_objs += .obj/lsd/list.o
+lsd_objs += .obj/lsd/ring.o
 lsd_objs += .obj/lsd/str.o
 lsd_objs += .obj/lsd/timestr.o
+lsd_objs += .obj/lsd/topology.o
 lsd_objs += .obj/lsd/tree.o
 
 lib/libsd.a: ${lsd_objs}
@@ -22,3 +27,9 @@ lib/libsd.so: ${lsd_objs}
 	@echo "[CC].lib $< => $@"
 	@${CC} ${warn_flags} ${CFLAGS} -fPIC -o $@ -c $<
 clean_objs += ${lsd_objs} ${lsd_lib} ${lsd_lib_so}
+
+# standalone dict hash/lookup benchmark (not part of world)
+bin/dict-bench: lsd/dict.c lsd/dict.h
+	@echo "[LD] $@"
+	@${CC} ${warn_noerror} ${CFLAGS} -DMAIN -o $@ $<
+clean_objs += bin/dict-bench
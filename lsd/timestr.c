@@ -23,14 +23,15 @@
  * should be of the format [Xd][Xh][Xm][X][s].  e.g. 3600 is 3600s, or 1h.
  * either lower or upper case is acceptable. */
 time_t timestr_to_time(const char *str, const time_t def) {
-   char       *s;
+   char       *s, *buf;
    char       *s2;
    time_t      ret = 0;
 
    if (str == NULL)
       return def;
 
-   s = s2 = strdup(str);
+   if ((s = s2 = buf = strdup(str)) == NULL)
+      return def;
    while (*s2 != '\0') {
       *s2 = tolower(*s2);
       s2++;
@@ -55,6 +56,7 @@ time_t timestr_to_time(const char *str, const time_t def) {
       s = s2 + 1;
    }
    ret += strtol(s, NULL, 0);          /* seconds */
+   free(buf);
 
    return ret;
 }
@@ -0,0 +1,190 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * lsd/topology.c:
+ *	CPU/NUMA topology from sysfs
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include "topology.h"
+
+#if	!defined(MPOL_PREFERRED)
+#define	MPOL_PREFERRED	1
+#endif
+
+static pthread_once_t topo_once = PTHREAD_ONCE_INIT;
+static cpu_set_t topo_allowed_set;
+static cpu_set_t topo_node_set[TOPO_MAX_NODES];
+static int topo_nnodes = 1;
+
+/*
+ * Parse a sysfs list ("0-3,8,10-11") into set, returning the highest
+ * id seen or -1 if the file is missing or empty.
+ */
+static int topo_read_list(const char *path, cpu_set_t *set) {
+   FILE *fp;
+   char buf[4096], *p, *end;
+   long lo, hi, i, max = -1;
+
+   CPU_ZERO(set);
+
+   if (!(fp = fopen(path, "r")))
+      return -1;
+
+   if (!fgets(buf, sizeof(buf), fp))
+      buf[0] = '\0';
+
+   fclose(fp);
+
+   for (p = buf; *p != '\0' && *p != '\n';) {
+      lo = strtol(p, &end, 10);
+
+      if (end == p)
+         break;
+
+      hi = lo;
+
+      if (*end == '-')
+         hi = strtol(end + 1, &end, 10);
+
+      for (i = lo; i <= hi && i < CPU_SETSIZE; i++)
+         CPU_SET(i, set);
+
+      if (hi > max)
+         max = hi;
+
+      p = (*end == ',' ? end + 1 : end);
+   }
+
+   return max;
+}
+
+static void topo_scan(void) {
+   cpu_set_t online, cpus;
+   char path[PATH_MAX];
+   int node, max, i;
+
+   if (sched_getaffinity(0, sizeof(topo_allowed_set), &topo_allowed_set) != 0) {
+      CPU_ZERO(&topo_allowed_set);
+
+      for (i = 0; i < sysconf(_SC_NPROCESSORS_ONLN) && i < CPU_SETSIZE; i++)
+         CPU_SET(i, &topo_allowed_set);
+   }
+
+   // No NUMA info: a single node with everything in it
+   if ((max = topo_read_list("/sys/devices/system/node/online", &online)) < 0) {
+      CPU_OR(&topo_node_set[0], &topo_node_set[0], &topo_allowed_set);
+      return;
+   }
+
+   topo_nnodes = (max < TOPO_MAX_NODES ? max + 1 : TOPO_MAX_NODES);
+
+   for (node = 0; node <= max; node++) {
+      if (!CPU_ISSET(node, &online))
+         continue;
+
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+      if (topo_read_list(path, &cpus) < 0)
+         continue;
+
+      CPU_AND(&cpus, &cpus, &topo_allowed_set);
+      i = (node < TOPO_MAX_NODES ? node : 0);
+      CPU_OR(&topo_node_set[i], &topo_node_set[i], &cpus);
+   }
+}
+
+void topo_init(void) {
+   pthread_once(&topo_once, topo_scan);
+}
+
+void topo_allowed(cpu_set_t *set) {
+   topo_init();
+   memcpy(set, &topo_allowed_set, sizeof(cpu_set_t));
+}
+
+int topo_ncpus(void) {
+   topo_init();
+   return CPU_COUNT(&topo_allowed_set);
+}
+
+int topo_nodes(void) {
+   topo_init();
+   return topo_nnodes;
+}
+
+int topo_node_cpus(int node, cpu_set_t *set) {
+   topo_init();
+
+   if (node < 0 || node >= topo_nnodes) {
+      CPU_ZERO(set);
+      return 0;
+   }
+
+   memcpy(set, &topo_node_set[node], sizeof(cpu_set_t));
+   return CPU_COUNT(set);
+}
+
+int topo_cpu_node(int cpu) {
+   int node;
+
+   topo_init();
+
+   if (cpu < 0 || cpu >= CPU_SETSIZE)
+      return 0;
+
+   for (node = 0; node < topo_nnodes; node++)
+      if (CPU_ISSET(cpu, &topo_node_set[node]))
+         return node;
+
+   return 0;
+}
+
+int topo_this_node(void) {
+   return topo_cpu_node(sched_getcpu());
+}
+
+int topo_nth_cpu(int n) {
+   int ncpus, cpu;
+
+   if ((ncpus = topo_ncpus()) == 0 || n < 0)
+      return -1;
+
+   n %= ncpus;
+
+   for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &topo_allowed_set) && n-- == 0)
+         return cpu;
+
+   return -1;
+}
+
+int topo_mem_prefer(void *ptr, size_t len, int node) {
+   unsigned long mask;
+
+   if (node < 0 || node >= topo_nodes() || node >= (int)(sizeof(mask) * 8))
+      return -1;
+
+   // Single node hosts have nothing to gain
+   if (topo_nnodes == 1)
+      return 0;
+
+   mask = 1UL << node;
+   return syscall(SYS_mbind, ptr, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
@@ -0,0 +1,52 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * lsd/topology.h:
+ *	CPU/NUMA topology, read from sysfs (no libnuma needed)
+ *
+ *	Everything is limited to the CPUs the process was started with,
+ * which is the jail's cpuset when run under one. That set is captured
+ * on first use, so call topo_init() before pinning any thread.
+ *	Hosts without /sys/devices/system/node look like one node holding
+ * every CPU.
+ */
+#if	!defined(__LSD_TOPOLOGY_H)
+#define	__LSD_TOPOLOGY_H
+#include <sched.h>
+#include <stddef.h>
+
+// Nodes beyond this are folded into node 0
+#define	TOPO_MAX_NODES	64
+
+// Capture the allowed CPU set and node layout (safe to call repeatedly)
+extern void topo_init(void);
+
+// CPUs the process may run on
+extern void topo_allowed(cpu_set_t *set);
+extern int topo_ncpus(void);
+
+// Number of nodes (highest node id + 1), CPUs of a node (0 if none allowed)
+extern int topo_nodes(void);
+extern int topo_node_cpus(int node, cpu_set_t *set);
+
+// Node a CPU belongs to, and the node the caller is running on right now
+extern int topo_cpu_node(int cpu);
+extern int topo_this_node(void);
+
+// The n-th allowed CPU (wrapping around), -1 if there are none
+extern int topo_nth_cpu(int n);
+
+// Prefer node for pages of [ptr, ptr + len) that haven't been touched yet
+extern int topo_mem_prefer(void *ptr, size_t len, int node);
+
+#endif	// !defined(__LSD_TOPOLOGY_H)
@@ -16,6 +16,13 @@ CONFIG_DEBUGGER=y
 # debug block allocator? should be unneeded as it slows it down
 CONFIG_DEBUG_BALLOC=n
 
+# check that config readers are online with ebr? (see src/conf.h)
+CONFIG_DEBUG_EBR=n
+
+# least important log level compiled in (0 emerg .. 7 debug)
+# messages below this are removed entirely, regardless of log.level
+CONFIG_LOG_LEVEL=7
+
 # strip binaries? (breaks debugging, makes smaller binaries)
 CONFIG_STRIP_BINS=n
 
@@ -64,6 +71,17 @@ ifeq (y, ${CONFIG_PROFILING})
 CFLAGS += -pg -DCONFIG_PROFILING
 LDFLAGS += -pg -DCONFIG_PROFILING
 endif
+ifeq (y, ${CONFIG_DEBUG_BALLOC})
+CFLAGS += -DCONFIG_DEBUG_BALLOC
+endif
+ifeq (y, ${CONFIG_DEBUG_EBR})
+CFLAGS += -DCONFIG_DEBUG_EBR
+endif
 ifeq (y, ${CONFIG_DEBUGGER})
 CFLAGS += -DCONFIG_DEBUGGER
+# export our symbols so stack traces (watchdog) can name them
+LDFLAGS += -rdynamic
+endif
+ifneq (, ${CONFIG_LOG_LEVEL})
+CFLAGS += -DCONFIG_LOG_LEVEL=${CONFIG_LOG_LEVEL}
 endif
@@ -42,6 +42,8 @@ umount:
 
 tests-help:
 	@echo -e "*\ttest       - Run a test session"
+	@echo -e "*\tbench      - Benchmark FUSE workloads on a synthetic pool"
+	@echo -e "*\tbench-lsd  - Microbenchmarks for lsd/ (allocator, containers)"
 	@echo -e "*\ttestpkg    - Build packages for examples"
 	@echo -e "*\tclean-pkgs - Clean out package dir"
 	@echo -e "*\tqa         - Quality Assurance mode"
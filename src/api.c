@@ -16,59 +16,445 @@
  *
  *	We try to provide a thread safe way to commnicate
  * across threads and dispatch commands.
+ *
+ *	Nothing here takes a lock on the message path:
+ *	- messages come off a fixed pool through a tagged (ABA safe)
+ *	  lock-free stack
+ *	- each mailbox lane is an intrusive MPSC queue: producers swap
+ *	  themselves in as head, the single consumer walks from tail
+ *	- the eventfd is only written when the mailbox isn't already
+ *	  signalled, so a burst of messages costs one wakeup
  */
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <lsd/lsd.h>
 #include "conf.h"
 #include "memory.h"
 #include "shell.h"
+#include "logger.h"
 #include "hooks.h"
+#include "cron.h"
 #include "api.h"
+#include "watchdog.h"
+
+static APImsg *api_pool = NULL;			// preallocated messages
+static u_int32_t api_pool_size = 0;
+static u_int64_t api_pool_head = 0;		// (tag << 32) | (index + 1)
+static unsigned long api_pool_misses = 0;	// pool empty, fell back to malloc
+static cdict *api_mailboxes = NULL;		// name -> api_mailbox
+static api_mailbox *api_master = NULL;
+
+////////////////////
+// message pool //
+////////////////////
+static APImsg *api_pool_get(void) {
+    u_int64_t old, new;
+    u_int32_t idx;
+
+    old = __atomic_load_n(&api_pool_head, __ATOMIC_ACQUIRE);
+
+    do {
+       if ((idx = (u_int32_t)old) == 0)
+          return NULL;
+
+       // May be stale if someone beat us to it, the tag makes the CAS fail then
+       new = (((old >> 32) + 1) << 32) |
+             __atomic_load_n(&api_pool[idx - 1].pool_next, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&api_pool_head, &old, new, 1,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return &api_pool[idx - 1];
+}
 
-static BlockHeap *heap_api_msg = NULL;
+static void api_pool_put(APImsg *msg) {
+    u_int64_t old, new;
+    u_int32_t idx = (u_int32_t)(msg - api_pool) + 1;
+
+    old = __atomic_load_n(&api_pool_head, __ATOMIC_RELAXED);
+
+    do {
+       __atomic_store_n(&msg->pool_next, (u_int32_t)old, __ATOMIC_RELAXED);
+       new = (((old >> 32) + 1) << 32) | idx;
+    } while (!__atomic_compare_exchange_n(&api_pool_head, &old, new, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
 APImsg *api_create_message(const char *sender, const char *dest, const char *cmd) {
     APImsg *p = NULL;
 
-    if (!(p = blockheap_alloc(heap_api_msg))) {
-       Log(LOG_EMERG, "out of memory attempting to create API message. halting!");
-       raise(SIGTERM);
+    if ((p = api_pool_get()) == NULL) {
+       __atomic_add_fetch(&api_pool_misses, 1, __ATOMIC_RELAXED);
+
+       if (!(p = mem_alloc(sizeof(APImsg))) || !(p->req = dict_new()) || !(p->res = dict_new())) {
+          Log(LOG_EMERG, "out of memory attempting to create API message. halting!");
+          raise(SIGTERM);
+          return NULL;
+       }
+       p->pooled = 0;
     }
 
-    // Create the command packet
-    memset(p, 0, sizeof(*p));
-    memcpy(p->sender, sender, API_ADDR_MAX);
-    memcpy(p->dest, dest, API_ADDR_MAX);
-    memcpy(p->cmd, cmd, API_CMD_MAX);
-    p->req = dict_new();
-    p->res = dict_new();
+    // Create the command packet (req/res are kept, already empty)
+    p->node.next = NULL;
+    p->flags = 0;
+    p->priority = 0;
+    snprintf(p->sender, sizeof(p->sender), "%s", (sender ? sender : ""));
+    snprintf(p->dest, sizeof(p->dest), "%s", (dest ? dest : ""));
+    snprintf(p->cmd, sizeof(p->cmd), "%s", (cmd ? cmd : ""));
 
     return p;
 }
 
 int api_destroy_message(APImsg *msg) {
-    dict_free(msg->req);
-    dict_free(msg->res);
-    blockheap_free(heap_api_msg, msg);
-    msg = NULL;
+    if (msg == NULL)
+       return -1;
+
+    if (!msg->pooled) {
+       dict_free(msg->req);
+       dict_free(msg->res);
+       mem_free(msg);
+       return 0;
+    }
+
+    dict_clear(msg->req);
+    dict_clear(msg->res);
+    api_pool_put(msg);
     return 0;
 }
 
+/////////////////
+// mailboxes //
+/////////////////
+static void api_lane_init(struct api_lane *l) {
+    l->stub.next = NULL;
+    l->head = l->tail = &l->stub;
+}
+
+static void api_lane_push(struct api_lane *l, struct api_node *n) {
+    struct api_node *prev;
+
+    __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&l->head, n, __ATOMIC_ACQ_REL);
+    // Between these two the queue looks empty past prev; api_lane_pop copes
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+// Consumer only. NULL if empty (or a push is half way through)
+static struct api_node *api_lane_pop(struct api_lane *l) {
+    struct api_node *tail = l->tail,
+                    *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &l->stub) {
+       if (next == NULL)
+          return NULL;
+
+       l->tail = next;
+       tail = next;
+       next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+       l->tail = next;
+       return tail;
+    }
+
+    if (tail != __atomic_load_n(&l->head, __ATOMIC_ACQUIRE))
+       return NULL;
+
+    // tail is the last one, put the stub behind it so it can be handed out
+    api_lane_push(l, &l->stub);
+
+    if ((next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE)) != NULL) {
+       l->tail = next;
+       return tail;
+    }
+
+    return NULL;
+}
+
+static void api_wakeup(api_mailbox *mb) {
+    u_int64_t one = 1;
+
+    if (__atomic_exchange_n(&mb->signalled, 1, __ATOMIC_SEQ_CST) == 0 && mb->evfd >= 0) {
+       if (write(mb->evfd, &one, sizeof(one)) != sizeof(one)) {
+          // counter can't overflow in practice, the owner is awake anyway
+       }
+    }
+}
+
+// Owner is about to look at the queues: later senders must signal again
+static void api_wakeup_ack(api_mailbox *mb) {
+    u_int64_t junk;
+
+    if (mb->evfd >= 0 && read(mb->evfd, &junk, sizeof(junk)) != sizeof(junk)) {
+       // nothing pending
+    }
+
+    __atomic_store_n(&mb->signalled, 0, __ATOMIC_SEQ_CST);
+}
+
+// Built-in commands every mailbox answers
+static int api_default_handler(api_mailbox *mb, APImsg *msg, void *arg) {
+    if (msg->flags & API_F_REPLY)
+       return 0;
+
+    if (strcmp(msg->cmd, "ping") == 0) {
+       dict_add(msg->res, "reply", "pong");
+       return 0;
+    }
+
+    Debug(DEBUG_THREADS, "api: %s: unknown command '%s' from %s", mb->name, msg->cmd, msg->sender);
+    return -ENOSYS;
+}
+
+int api_dispatch(api_mailbox *mb) {
+    struct api_node *n;
+    APImsg *msg;
+    int handled = 0, lane, rv;
+
+    while (handled < API_BATCH) {
+       // Always go back to the highest lane with something in it
+       for (n = NULL, lane = 0; lane < API_LANES && n == NULL; lane++)
+          n = api_lane_pop(&mb->lane[lane]);
+
+       if (n == NULL)
+          break;
+
+       msg = (APImsg *)n;
+       rv = mb->handler(mb, msg, mb->arg);
+       handled++;
+
+       if ((msg->flags & API_F_WANT_REPLY) && !(msg->flags & API_F_REPLY)) {
+          if (rv < 0)
+             msg->flags |= API_F_ERROR;
+
+          if (api_reply(msg) == 0)
+             continue;
+       }
+
+       api_destroy_message(msg);
+    }
+
+    mb->received += handled;
+
+    // Out of budget, let the loop run something else and come back
+    if (handled == API_BATCH)
+       api_wakeup(mb);
+
+    return handled;
+}
+
+int api_send(APImsg *msg) {
+    api_mailbox *mb;
+    int lane;
+
+    if (msg == NULL)
+       return -EINVAL;
+
+    if (!(mb = api_mailbox_find(msg->dest))) {
+       Log(LOG_ERR, "api: %s sent '%s' to unknown mailbox %s", msg->sender, msg->cmd, msg->dest);
+       return -ENOENT;
+    }
+
+    if (msg->priority >= API_PRIO_HIGH)
+       lane = 0;
+    else if (msg->priority >= API_PRIO_LOW)
+       lane = 1;
+    else
+       lane = 2;
+
+    api_lane_push(&mb->lane[lane], &msg->node);
+    api_wakeup(mb);
+    return 0;
+}
+
+int api_reply(APImsg *msg) {
+    char tmp[API_ADDR_MAX];
+
+    memcpy(tmp, msg->dest, sizeof(tmp));
+    memcpy(msg->dest, msg->sender, sizeof(msg->dest));
+    memcpy(msg->sender, tmp, sizeof(msg->sender));
+    msg->flags |= API_F_REPLY;
+
+    return api_send(msg);
+}
+
+api_mailbox *api_mailbox_find(const char *name) {
+    return (api_mailbox *)cdict_get_blob(api_mailboxes, name, NULL);
+}
+
+api_mailbox *api_mailbox_create(const char *name, api_handler handler, void *arg) {
+    api_mailbox *mb;
+    int i;
+
+    if (name == NULL || api_mailbox_find(name) != NULL) {
+       Log(LOG_ERR, "api: mailbox %s already exists", name);
+       return NULL;
+    }
+
+    if (posix_memalign((void **)&mb, 64, sizeof(api_mailbox)) != 0) {
+       Log(LOG_ERR, "api: out of memory creating mailbox %s", name);
+       return NULL;
+    }
+
+    memset(mb, 0, sizeof(api_mailbox));
+    snprintf(mb->name, sizeof(mb->name), "%s", name);
+    mb->handler = (handler ? handler : api_default_handler);
+    mb->arg = arg;
+
+    for (i = 0; i < API_LANES; i++)
+       api_lane_init(&mb->lane[i]);
+
+    if ((mb->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+       Log(LOG_ERR, "api: eventfd for mailbox %s: %s (%d)", name, strerror(errno), errno);
+       free(mb);
+       return NULL;
+    }
+
+    cdict_add_blob(api_mailboxes, mb->name, mb);
+    return mb;
+}
+
+// Runs from ebr_gc(), once no sender can still be holding mb
+static void api_mailbox_free(void *ptr) {
+    api_mailbox *mb = (api_mailbox *)ptr;
+    struct api_node *n;
+    int i;
+
+    // Anything still queued (or sent since destroy) is dropped
+    for (i = 0; i < API_LANES; i++)
+       while ((n = api_lane_pop(&mb->lane[i])) != NULL)
+          api_destroy_message((APImsg *)n);
+
+    close(mb->evfd);
+    free(mb);
+}
+
+void api_mailbox_destroy(api_mailbox *mb) {
+    if (mb == NULL)
+       return;
+
+    cdict_del(api_mailboxes, mb->name);
+
+    if (mb->loop)
+       ev_io_stop(mb->loop, &mb->evt);
+
+    // A sender may have just looked us up and still write to evfd: if it
+    // were closed now, the number could be reused by an unrelated file
+    ebr_retire(mb, api_mailbox_free);
+}
+
+static void api_mailbox_evt(struct ev_loop *loop, ev_io *w, int revents) {
+    static int wd_slot = -1;
+    api_mailbox *mb = (api_mailbox *)w->data;
+
+    if (wd_slot < 0)
+       wd_slot = watchdog_register("api.mailbox");
+
+    watchdog_enter(wd_slot);
+    api_wakeup_ack(mb);
+    api_dispatch(mb);
+    watchdog_leave(wd_slot);
+}
+
+int api_mailbox_attach(api_mailbox *mb, struct ev_loop *loop) {
+    if (mb == NULL || loop == NULL)
+       return -1;
+
+    mb->loop = loop;
+    ev_io_init(&mb->evt, api_mailbox_evt, mb->evfd, EV_READ);
+    mb->evt.data = mb;
+    ev_io_start(loop, &mb->evt);
+    return 0;
+}
+
+int api_mailbox_wait(api_mailbox *mb, int timeout_ms) {
+    struct pollfd pfd;
+
+    if (mb == NULL) {
+       usleep(timeout_ms * 1000);
+       return 0;
+    }
+
+    pfd.fd = mb->evfd;
+    pfd.events = POLLIN;
+
+    if (!__atomic_load_n(&mb->signalled, __ATOMIC_ACQUIRE)) {
+       ebr_offline();
+       poll(&pfd, 1, timeout_ms);
+       ebr_online();
+    }
+
+    api_wakeup_ack(mb);
+    return api_dispatch(mb);
+}
+
+///////////
+// setup //
+///////////
 int api_gc(void) {
-    blockheap_garbagecollect(heap_api_msg);
+    unsigned long misses = __atomic_exchange_n(&api_pool_misses, 0, __ATOMIC_RELAXED);
+
+    // Messages live in a fixed pool, just say if it's too small
+    if (misses > 0)
+       Log(LOG_INFO, "api: message pool (%u) ran dry %lu times, consider raising tuning.heap.api-msg",
+           api_pool_size, misses);
+
     return 0;
 }
 
 int api_init(void) {
-    heap_api_msg = blockheap_create(sizeof(APImsg), dconf_get_int("tuning.heap.api-msg", 512), "api messages");
+    u_int32_t i;
+
+    api_pool_size = dconf_get_int("tuning.heap.api-msg", 512);
+
+    if (!(api_pool = mem_calloc(api_pool_size, sizeof(APImsg)))) {
+       Log(LOG_EMERG, "api_init: failed allocating message pool");
+       raise(SIGABRT);
+    }
+
+    for (i = 0; i < api_pool_size; i++) {
+       api_pool[i].req = dict_new();
+       api_pool[i].res = dict_new();
+       api_pool[i].pooled = 1;
+       api_pool[i].pool_next = (i + 1 < api_pool_size ? i + 2 : 0);
+    }
+
+    api_pool_head = (api_pool_size > 0 ? 1 : 0);
+    api_mailboxes = cdict_new(0);
 
     // Return success
     return 0;
 }
 
 int api_fini(void) {
-    blockheap_destroy(heap_api_msg);
-    heap_api_msg = NULL;
+    u_int32_t i;
+
+    for (i = 0; i < api_pool_size; i++) {
+       dict_free(api_pool[i].req);
+       dict_free(api_pool[i].res);
+    }
+
+    mem_free(api_pool);
+    api_pool = NULL;
+    api_pool_size = 0;
+    api_pool_head = 0;
+    cdict_free(api_mailboxes);
+    api_mailboxes = NULL;
 
     // Return success
     return 0;
 }
+
+// The main thread's mailbox, serviced from evt_loop
+int api_master_init(void) {
+    if (!(api_master = api_mailbox_create("main", NULL, NULL)))
+       return -1;
+
+    return api_mailbox_attach(api_master, evt_loop);
+}
+
+int api_master_fini(void) {
+    api_mailbox_destroy(api_master);
+    api_master = NULL;
+    return 0;
+}
@@ -13,9 +13,20 @@
  *
  * src/api.h:
  *		Inter-thread API using dict objects
+ *
+ *	Every thread that takes requests owns a mailbox, found by name.
+ * Senders never block: a message is pushed onto one of the mailbox's
+ * lock-free queues (one per priority lane) and the owner is woken
+ * through an eventfd, either from its libev loop (api_mailbox_attach)
+ * or from api_mailbox_wait() in threads without one.
+ *
+ *	Messages come from a preallocated pool and keep their req/res
+ * dicts between uses, so a request/response round trip allocates
+ * nothing once the pool is warm.
  */
 #if	!defined(__API_H)
 #define	__API_H
+#include <ev.h>
 
 #define	API_VERSION		0x0001
 #define	API_CMD_MAX		64
@@ -26,8 +37,22 @@
 #define	API_F_REQ_ERROR		0x0002	// Request contained an error
 #define	API_F_ERROR		0x0004	// Error response from remote
 #define	API_F_SECURITY		0x0008	// Security restriction denied request
+#define	API_F_WANT_REPLY	0x0010	// Sender is waiting for a response
+
+// Priority lanes: lane 0 is always drained first
+#define	API_LANES		3
+#define	API_PRIO_HIGH		192	// priority >= this goes in lane 0
+#define	API_PRIO_LOW		64	// priority < this goes in lane 2
+// Most messages handled per wakeup before yielding back to the loop
+#define	API_BATCH		64
+
+// Link for the lock-free queues
+struct api_node {
+   struct api_node *next;
+};
 
 struct API_Message {
+   struct api_node node;		// queue link (must be first)
    char 	sender[API_ADDR_MAX];	// (port/secret) Address of sender
    char 	dest[API_ADDR_MAX];	// (port/secret) Address of destination
    char 	cmd[API_CMD_MAX];   	// API_F_* flags
@@ -36,9 +61,52 @@ struct API_Message {
 
    dict		*req,			// Request data
    		*res;			// Response data
+
+   u_int32_t	pool_next;		// free list link (index + 1, 0 = end)
+   u_int8_t	pooled;			// came from the pool (else malloc)
 };
 typedef struct API_Message APImsg;
 
+// Multiple producer, single consumer queue (D. Vyukov's intrusive MPSC)
+struct api_lane {
+   struct api_node *head __attribute__((aligned(64)));	// producers push here
+   struct api_node *tail __attribute__((aligned(64)));	// consumer pops here
+   struct api_node stub;
+};
+
+struct api_mailbox;
+typedef int (*api_handler)(struct api_mailbox *mb, APImsg *msg, void *arg);
+
+typedef struct api_mailbox {
+   struct api_lane lane[API_LANES];
+   char        name[API_ADDR_MAX];
+   int         evfd;			// eventfd the owner sleeps on
+   int         signalled;		// evfd already written, skip the syscall
+   api_handler handler;
+   void       *arg;
+   struct ev_loop *loop;		// loop we're attached to, if any
+   ev_io       evt;
+   unsigned long received;		// messages dispatched
+} api_mailbox;
+
+// Messages (any thread)
+extern APImsg *api_create_message(const char *sender, const char *dest, const char *cmd);
+extern int api_destroy_message(APImsg *msg);
+extern int api_send(APImsg *msg);
+// Turn msg around to its sender as a response and send it
+extern int api_reply(APImsg *msg);
+
+// Mailboxes: create/destroy from the owning thread
+extern api_mailbox *api_mailbox_create(const char *name, api_handler handler, void *arg);
+extern void api_mailbox_destroy(api_mailbox *mb);
+extern api_mailbox *api_mailbox_find(const char *name);
+// Wake up in loop whenever mail arrives (call from the thread running loop)
+extern int api_mailbox_attach(api_mailbox *mb, struct ev_loop *loop);
+// For threads without a loop: wait up to timeout_ms for mail and handle it
+extern int api_mailbox_wait(api_mailbox *mb, int timeout_ms);
+// Handle up to API_BATCH queued messages, highest lane first
+extern int api_dispatch(api_mailbox *mb);
+
 // Called by the main thread
 extern int api_master_init(void);
 extern int api_master_fini(void);
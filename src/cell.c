@@ -21,6 +21,8 @@
 #include "conf.h"
 #include "shell.h"
 #include "threads.h"
+#include "prefetch.h"
+#include "vfs-shm.h"
 
 // XXX: Detect what namespaces are enabled and use what we can
 // CLONE_NEWUSER|CLONE_NEWCGROUP missing...
@@ -67,7 +69,18 @@ static int	jail_namespace_init(void) {
 
 // Environment should be empty...
 static void jail_env_init(void) {
+    const char *name, *lib;
+
     Log(LOG_DEBUG, "[cell] setting default environment");
+
+    // Point lib/libfspkg.so at the shared index; init runs chroot()ed into the mount
+    if ((name = vfs_shm_name()) != NULL) {
+       setenv(VFS_SHM_ENV, name, 1);
+       setenv(VFS_SHM_ENV_ROOT, "/", 1);
+
+       if ((lib = dconf_get_str("preload.lib", NULL)) != NULL)
+          setenv("LD_PRELOAD", lib, 1);
+    }
 }
 
 void jail_container_launch(void) {
@@ -112,11 +125,17 @@ void *thread_cell_init(void *data) {
        // Supervise the task
        Log(LOG_INFO, "[cell] init: a new inmate has arrived in the cell.");
 
+       // Warm up what init used last time while it starts, and note what it uses now
+       prefetch_replay();
+       prefetch_record();
+
        // Start the init command
        jail_container_launch();
 
        // If process unexpectedly dies, reset the container and start over...
+       ebr_offline();
        sleep(100000);
+       ebr_online();
        Log(LOG_INFO, "[cell] cell has exceeded maximum TTL and is being restarted.");
     }
     return NULL;
@@ -19,23 +19,236 @@
  * This code wouldn't be possible without N. Devillard's dictionary.[ch]
  * from the iniparser package. See dict.[ch] for slightly modified version
  * Thanks!!
+ *
+ * The loaded dictionary is never modified in place: every change builds
+ * a new pre-parsed snapshot (struct conf_snap) which is swapped in with
+ * a single atomic store, so the dconf_get_* calls are lock-free.
  */
+#include <stddef.h>
+#include <signal.h>
 #include <strings.h>
+#include <pthread.h>
 #include <lsd/lsd.h>
 #include "conf.h"
 #include "module.h"
 #include "shell.h"
+#include "logger.h"
 #define	JAILCONF_SIZE	16384		// should be plenty...
 
 struct conf conf;
 
+// Used until a configuration is loaded and for keys which are missing
+struct conf_snap conf_defaults = {
+   .log_level = "info",
+   .path_pkg = "/pkg",
+   .path_cache = NULL,
+   .path_mountpoint = NULL,
+   .cache_type = "host",
+   .jail_name = NULL,
+   .vfs_locking_host = 0,
+   .pkgdir_inotify = 0,
+   .pkgdir_prescan = 0,
+   .timer_blockheap_gc = 60,
+   .timer_pkg_gc = 60,
+   .timer_global_gc = 60,
+   .timer_vfs_gc = 1200,
+   .cron_max_load = 0,
+   .cron_max_defer = 300,
+   .gc_budget = 2.0,
+   .gc_high_water = 15.0,
+   .gc_low_water = 5.0,
+};
+
+// Well-known keys, copied into typed fields of each snapshot
+struct conf_known {
+   const char *key;
+   enum { CONF_STR = 0, CONF_BOOL, CONF_TIME, CONF_DOUBLE } type;
+   size_t offset;
+};
+
+#define	CONF_FIELD(f)	offsetof(struct conf_snap, f)
+static struct conf_known conf_known[] = {
+   { "log.level", CONF_STR, CONF_FIELD(log_level) },
+   { "path.pkg", CONF_STR, CONF_FIELD(path_pkg) },
+   { "path.cache", CONF_STR, CONF_FIELD(path_cache) },
+   { "path.mountpoint", CONF_STR, CONF_FIELD(path_mountpoint) },
+   { "cache.type", CONF_STR, CONF_FIELD(cache_type) },
+   { "jail.name", CONF_STR, CONF_FIELD(jail_name) },
+   { "vfs.locking.host", CONF_BOOL, CONF_FIELD(vfs_locking_host) },
+   { "pkgdir.inotify", CONF_BOOL, CONF_FIELD(pkgdir_inotify) },
+   { "pkgdir.prescan", CONF_BOOL, CONF_FIELD(pkgdir_prescan) },
+   { "tuning.timer.blockheap_gc", CONF_TIME, CONF_FIELD(timer_blockheap_gc) },
+   { "tuning.timer.pkg_gc", CONF_TIME, CONF_FIELD(timer_pkg_gc) },
+   { "tuning.timer.global_gc", CONF_TIME, CONF_FIELD(timer_global_gc) },
+   { "tuning.timer.vfs_gc", CONF_TIME, CONF_FIELD(timer_vfs_gc) },
+   { "tuning.cron.max_load", CONF_DOUBLE, CONF_FIELD(cron_max_load) },
+   { "tuning.cron.max_defer", CONF_TIME, CONF_FIELD(cron_max_defer) },
+   { "tuning.gc.budget", CONF_DOUBLE, CONF_FIELD(gc_budget) },
+   { "tuning.gc.high_water", CONF_DOUBLE, CONF_FIELD(gc_high_water) },
+   { "tuning.gc.low_water", CONF_DOUBLE, CONF_FIELD(gc_low_water) },
+   { NULL, 0, 0 }
+};
+
+// Serializes snapshot publishers, conf_notified and watchers
+static pthread_mutex_t conf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *conf_file = NULL;
+
+// Last snapshot the watchers have seen: conf_tick() retires it, not the publisher
+static struct conf_snap *conf_notified = NULL;
+static volatile sig_atomic_t conf_reload_pending = 0;
+
+static struct conf_watcher {
+   const char *key;
+   size_t keylen;
+   conf_watch_cb cb;
+   void *arg;
+} conf_watchers[CONF_MAX_WATCHERS];
+static int conf_nwatchers = 0;
+
+static void conf_parse_val(struct conf_val *v, const char *str) {
+   v->str = str;
+   v->num = strtol(str, NULL, 0);
+   v->dbl = atof(str);
+   v->time = timestr_to_time(str, 0);
+   v->flag = (strcasecmp(str, "true") == 0 || strcasecmp(str, "on") == 0 ||
+              strcasecmp(str, "yes") == 0 || v->num == 1);
+}
+
+// Parse every value in d once and fill in the typed fields
+static struct conf_snap *conf_snap_build(dict *d) {
+   struct conf_snap *cs;
+   struct conf_known *kp;
+   struct conf_val *v;
+   const char *key, *val;
+   time_t ts;
+   int rank = 0;
+   char *field;
+
+   cs = mem_alloc(sizeof(struct conf_snap));
+   memcpy(cs, &conf_defaults, sizeof(struct conf_snap));
+   cs->dict = d;
+
+   if (d->used > 0)
+      cs->vals = mem_calloc(d->used, sizeof(struct conf_val));
+
+   // Finish any pending resize, so readers only ever probe one table
+   dict_rehash(d, 0);
+
+   // Updating the blob of an existing key never moves entries, so this is safe
+   while ((rank = dict_enumerate(d, rank, &key, &val, &ts)) >= 0) {
+      if (val == NULL || cs->nvals >= d->used)
+         continue;
+
+      v = &cs->vals[cs->nvals++];
+      conf_parse_val(v, val);
+      dict_add_blob_ts(d, key, (const void **)v, ts);
+   }
+
+   for (kp = conf_known; kp->key != NULL; kp++) {
+      if ((v = dict_get_blob(d, kp->key, NULL)) == NULL)
+         continue;
+
+      field = (char *)cs + kp->offset;
+
+      if (kp->type == CONF_STR)
+         *(const char **)field = v->str;
+      else if (kp->type == CONF_BOOL)
+         *(int *)field = v->flag;
+      else if (kp->type == CONF_TIME && v->time > 0)
+         *(time_t *)field = v->time;
+      else if (kp->type == CONF_DOUBLE)
+         *(double *)field = v->dbl;
+   }
+
+   return cs;
+}
+
+static void conf_snap_free(struct conf_snap *cs) {
+   dict_free(cs->dict);
+
+   if (cs->vals)
+      mem_free(cs->vals);
+
+   mem_free(cs);
+}
+
+static void conf_snap_retire_cb(void *ptr) {
+   conf_snap_free((struct conf_snap *)ptr);
+}
+
+// Copy the current configuration (for copy-on-write updates)
+static dict *conf_dict_copy(void) {
+   const struct conf_snap *cs = conf_get();
+   dict *d = dict_new();
+   const char *key, *val;
+   time_t ts;
+   int rank = 0;
+
+   if (cs->dict == NULL)
+      return d;
+
+   // Room for the copy plus the key about to be set
+   dict_reserve(d, cs->dict->used + 1);
+
+   while ((rank = dict_enumerate(cs->dict, rank, &key, &val, &ts)) >= 0)
+      dict_add_ts(d, key, val, ts);
+
+   return d;
+}
+
+// Caller holds conf_mutex
+static void conf_publish_locked(dict *d) {
+   struct conf_snap *cs, *old;
+
+   cs = conf_snap_build(d);
+   old = conf.snap;
+   cs->gen = (old ? old->gen + 1 : 1);
+
+   __atomic_store_n(&conf.snap, cs, __ATOMIC_RELEASE);
+   conf.dict = d;
+
+   // Readers may still hold old; conf_tick() needs conf_notified for the diff
+   if (old && old != conf_notified)
+      ebr_retire(old, conf_snap_retire_cb);
+}
+
+// Make d (which we now own) the current configuration
+void conf_publish(dict *d) {
+   if (d == NULL)
+      return;
+
+   pthread_mutex_lock(&conf_mutex);
+   conf_publish_locked(d);
+   pthread_mutex_unlock(&conf_mutex);
+
+   log_level_refresh();
+}
+
 void dconf_fini(void) {
-   dict_free(_CONF_DICT);
-   _CONF_DICT = NULL;
+   struct conf_snap *cs;
+
+   pthread_mutex_lock(&conf_mutex);
+   if ((cs = conf_notified) != NULL && cs != conf.snap)
+      conf_snap_free(cs);
+   conf_notified = NULL;
+
+   if ((cs = conf.snap) != NULL) {
+      __atomic_store_n(&conf.snap, NULL, __ATOMIC_RELEASE);
+      conf.dict = NULL;
+      conf_snap_free(cs);
+   }
+   pthread_mutex_unlock(&conf_mutex);
 }
 
 void dconf_init(const char *file) {
-   _CONF_DICT = dconf_load(file);
+   dict *d;
+
+   if (conf_file)
+      mem_free(conf_file);
+   conf_file = str_dup(file);
+
+   if ((d = dconf_load(file)) != NULL)
+      conf_publish(d);
 }
 
 /////////////////
@@ -62,12 +275,13 @@ dict *dconf_load(const char *file) {
 
    if (!(fp = fopen(file, "r"))) {
       Log(LOG_ERR, "%s: Failed loading %s", __FUNCTION__, file);
-      fclose(fp);
-      return false;
+      dict_free(cp);
+      return NULL;
    }
 
 #if	defined(CONFIG_MODULES)
-   Modules = create_list();
+   if (Modules == NULL)
+      Modules = create_list();
 #endif
    // This could use some cleanup... But it does work.
    // We need to use safer string functions...
@@ -83,10 +297,9 @@ dict *dconf_load(const char *file) {
 
       // Delete trailing newlines or white space
       end = buf + strlen(buf);
-      do {
-        *end = '\0';
-        end--;
-      } while(*end == '\r' || *end == '\n' || *end == ' ');
+      while (end > skip && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' '))
+        *--end = '\0';
+      end--;
 
       // did we eat the whole line?
       if ((end - skip) <= 0)
@@ -108,6 +321,8 @@ dict *dconf_load(const char *file) {
            *skip == '#' || *skip == ';')
          continue;
       else if (*skip == '[' && *end == ']') {		// section
+         if (section)
+            free(section);
          section = strndup(skip + 1, strlen(skip) - 2);
          Log(LOG_DEBUG, "cfg.section.open: '%s'", section);
          continue;
@@ -132,6 +347,7 @@ dict *dconf_load(const char *file) {
 
       // @END exits a section early
       if (strncasecmp(skip, "@END", 4) == 0) {
+         free(section);
          section = NULL;
          continue;
       }
@@ -146,6 +362,10 @@ dict *dconf_load(const char *file) {
          dict_add(cp, key, val);
 #if	defined(CONFIG_MODULES)
       } else if (strncasecmp(section, "modules", 8) == 0) {
+         // Modules are only loaded at startup, not on reload
+         if (conf.snap != NULL)
+            continue;
+
          Log(LOG_DEBUG, "Loading module %s", skip);
 
          if (module_load(skip) != 0)
@@ -177,6 +397,9 @@ dict *dconf_load(const char *file) {
    Log(LOG_INFO, "configuration loaded with %d errors and %d warnings from %s (%d lines)", errors, warnings, file, line);
    fclose(fp);
 
+   if (section)
+      free(section);
+
    return cp;
 }
 
@@ -241,60 +464,241 @@ int dconf_write(dict *cp, const char *file) {
    return true;
 }
 
+// Find the pre-parsed value for key in the current snapshot
+static inline const struct conf_val *dconf_lookup(const char *key) {
+   const struct conf_snap *cs = conf_get();
+
+   if (cs->dict == NULL || key == NULL)
+      return NULL;
+
+   return dict_get_blob(cs->dict, key, NULL);
+}
+
 int dconf_get_bool(const char *key, const int def) {
-   char       *tmp;
-   int         rv = 0;
+   const struct conf_val *v;
 
-   if ((tmp = dconf_get_str(key, NULL)) == NULL)
+   if ((v = dconf_lookup(key)) == NULL)
       return def;
-   else if (strcasecmp(tmp, "true") == 0 || strcasecmp(tmp, "on") == 0 ||
-            strcasecmp(tmp, "yes") == 0 || (int)strtol(tmp, NULL, 0) == 1)
-      rv = 1;
-   else if (strcasecmp(tmp, "false") == 0 || strcasecmp(tmp, "off") == 0 ||
-            strcasecmp(tmp, "no") == 0 || (int)strtol(tmp, NULL, 0) == 0)
-      rv = 0;
 
-   return rv;
+   return v->flag;
 }
 
 double dconf_get_double(const char *key, const double def) {
-   char       *tmp;
+   const struct conf_val *v;
 
-   if ((tmp = dconf_get_str(key, NULL)) == NULL)
+   if ((v = dconf_lookup(key)) == NULL)
       return def;
 
-   return atof(tmp);
+   return v->dbl;
 }
 
 int dconf_get_int(const char *key, const int def) {
-   char       *tmp;
+   const struct conf_val *v;
 
-   if ((tmp = dconf_get_str(key, NULL)) == NULL)
+   if ((v = dconf_lookup(key)) == NULL)
       return def;
 
-   return (int)strtol(tmp, NULL, 0);
+   return (int)v->num;
 }
 
 char       *dconf_get_str(const char *key, const char *def) {
-   if (_CONF_DICT == NULL || key == NULL)
-      return NULL;
+   const struct conf_val *v;
 
-   return (char *)dict_get(_CONF_DICT, key, def);
+   if ((v = dconf_lookup(key)) == NULL)
+      return (char *)def;
+
+   return (char *)v->str;
 }
 
 time_t dconf_get_time(const char *key, const time_t def) {
-   return (timestr_to_time(dconf_get_str(key, NULL), def));
+   const struct conf_val *v;
+
+   if ((v = dconf_lookup(key)) == NULL)
+      return def;
+
+   return v->time;
 }
 
 int dconf_set(const char *key, const char *val) {
-   return dict_add(_CONF_DICT, key, val);
+   dict *d;
+   int rv;
+
+   if (key == NULL)
+      return -1;
+
+   pthread_mutex_lock(&conf_mutex);
+   d = conf_dict_copy();
+
+   if ((rv = dict_add(d, key, val)) == 0)
+      conf_publish_locked(d);
+   else
+      dict_free(d);
+   pthread_mutex_unlock(&conf_mutex);
+
+   log_level_refresh();
+   return rv;
 }
 
 void dconf_unset(const char *key) {
-   dict_del(_CONF_DICT, key);
+   dict *d;
+
+   if (key == NULL)
+      return;
+
+   pthread_mutex_lock(&conf_mutex);
+   d = conf_dict_copy();
+
+   if (dict_del(d, key) == 0)
+      conf_publish_locked(d);
+   else
+      dict_free(d);
+   pthread_mutex_unlock(&conf_mutex);
+
+   log_level_refresh();
 }
 
+// Re-read the configuration file and publish it
 void conf_reload(void) {
-   // Reload config
-   Log(LOG_INFO, "conf_reload stub called");
+   dict *d;
+
+   if (conf_file == NULL)
+      return;
+
+   if ((d = dconf_load(conf_file)) == NULL) {
+      Log(LOG_ERR, "conf_reload: failed loading %s, keeping current configuration", conf_file);
+      return;
+   }
+
+   conf_publish(d);
+   Log(LOG_INFO, "configuration reloaded from %s (generation %lu)", conf_file, conf_get()->gen);
+}
+
+// Called from the SIGHUP handler/shell: reload on the next cron tick
+void conf_reload_request(void) {
+   conf_reload_pending = 1;
+}
+
+int conf_watch(const char *key, conf_watch_cb cb, void *arg) {
+   struct conf_watcher *w;
+
+   if (key == NULL || cb == NULL)
+      return -1;
+
+   pthread_mutex_lock(&conf_mutex);
+   if (conf_nwatchers >= CONF_MAX_WATCHERS) {
+      pthread_mutex_unlock(&conf_mutex);
+      Log(LOG_ERR, "conf_watch: too many watchers, not watching %s", key);
+      return -1;
+   }
+
+   w = &conf_watchers[conf_nwatchers];
+   w->key = key;
+   w->keylen = strlen(key);
+   w->cb = cb;
+   w->arg = arg;
+   conf_nwatchers++;
+   pthread_mutex_unlock(&conf_mutex);
+
+   return 0;
+}
+
+static void conf_heap_changed(const char *key, const struct conf_val *oldv,
+                              const struct conf_val *newv, void *arg) {
+   if (newv == NULL || newv->num <= 0)
+      return;
+
+   blockheap_set_elems((BlockHeap *)arg, newv->num);
+   Log(LOG_INFO, "BlockHeap %s: %ld elements per block for new blocks", ((BlockHeap *)arg)->name, newv->num);
+}
+
+int conf_watch_heap(const char *key, BlockHeap *bh) {
+   char hkey[128];
+
+   // Block source only matters for blocks yet to come, so it's read once
+   snprintf(hkey, sizeof(hkey), "%s.huge", key);
+   blockheap_set_huge(bh, blockheap_huge_parse(dconf_get_str(hkey, "none")));
+
+   return conf_watch(key, conf_heap_changed, bh);
+}
+
+static void conf_fire(const char *key, const struct conf_val *oldv, const struct conf_val *newv) {
+   struct conf_watcher *w;
+   int i, n;
+
+   Log(LOG_INFO, "config: %s changed: %s => %s", key,
+       (oldv ? oldv->str : "(unset)"), (newv ? newv->str : "(unset)"));
+
+   n = __atomic_load_n(&conf_nwatchers, __ATOMIC_ACQUIRE);
+   for (i = 0; i < n; i++) {
+      w = &conf_watchers[i];
+
+      if (w->key[w->keylen - 1] == '.' ? strncmp(key, w->key, w->keylen) == 0
+                                        : strcmp(key, w->key) == 0)
+         w->cb(key, oldv, newv, w->arg);
+   }
+}
+
+// Tell watchers about every key which differs between two snapshots
+static void conf_diff(const struct conf_snap *a, const struct conf_snap *b) {
+   const struct conf_val *ov, *nv;
+   const char *key, *val;
+   time_t ts;
+   int rank = 0;
+
+   while ((rank = dict_enumerate(b->dict, rank, &key, &val, &ts)) >= 0) {
+      nv = dict_get_blob(b->dict, key, NULL);
+      ov = (a->dict ? dict_get_blob(a->dict, key, NULL) : NULL);
+
+      if (ov == NULL && nv == NULL)
+         continue;
+
+      if (ov == NULL || nv == NULL || strcmp(ov->str, nv->str) != 0)
+         conf_fire(key, ov, nv);
+   }
+
+   if (a->dict == NULL)
+      return;
+
+   rank = 0;
+   while ((rank = dict_enumerate(a->dict, rank, &key, &val, &ts)) >= 0) {
+      if ((ov = dict_get_blob(a->dict, key, NULL)) == NULL)
+         continue;
+
+      if (dict_get_blob(b->dict, key, NULL) == NULL)
+         conf_fire(key, ov, NULL);
+   }
+}
+
+/*
+ * Run once a second by cron_tick(), on the main loop. Performs requested
+ * reloads and pushes changes out to subsystems, which can then safely
+ * touch timers and other main loop state.
+ */
+void conf_tick(void) {
+   struct conf_snap *cur, *prev;
+
+   if (conf_reload_pending) {
+      conf_reload_pending = 0;
+      conf_reload();
+   }
+
+   pthread_mutex_lock(&conf_mutex);
+   cur = conf.snap;
+   prev = conf_notified;
+
+   if (cur == prev) {
+      pthread_mutex_unlock(&conf_mutex);
+      return;
+   }
+
+   conf_notified = cur;
+   pthread_mutex_unlock(&conf_mutex);
+
+   // First configuration loaded, subsystems read it on init
+   if (prev == NULL || cur == NULL)
+      return;
+
+   // Nobody retired prev while it was conf_notified, so it's still ours
+   conf_diff(prev, cur);
+   ebr_retire(prev, conf_snap_retire_cb);
 }
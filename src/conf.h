@@ -16,15 +16,96 @@
 #define	__CONF_H
 #include <fcntl.h>
 #include <lsd/lsd.h>
+#if	defined(CONFIG_DEBUG_EBR)
+#include <assert.h>
+#endif
+
+// A configuration value, parsed once when its snapshot is built
+struct conf_val {
+   const char *str;		// raw string (owned by the snapshot's dict)
+   long        num;		// strtol(str, NULL, 0)
+   double      dbl;		// atof(str)
+   time_t      time;		// timestr_to_time(str)
+   int         flag;		// true/on/yes/1 => 1, anything else 0
+};
+
+/*
+ * Immutable, pre-parsed view of the configuration.
+ *
+ * A new snapshot is built and published whenever the configuration
+ * changes (dconf_set, conf_reload, ...); readers never take a lock.
+ * Replaced snapshots are handed to ebr_retire(), so pointers from
+ * conf_get() or dconf_get_str() stay valid until the calling thread's
+ * next quiescent point (see lsd/ebr.h) - copy them if they must live
+ * longer than that.
+ *
+ * For the same reason, only threads which are registered with ebr and
+ * online may call conf_get() or dconf_get_*(): thread_entry() takes care
+ * of the first, readers which go offline to block must read what they
+ * need before ebr_offline() or after ebr_online(). Signal handlers can
+ * interrupt any thread and must not read the config at all. Build with
+ * CONFIG_DEBUG_EBR=y to have conf_get() check this.
+ */
+struct conf_snap {
+   unsigned long gen;		// generation, bumped on every publish
+   dict       *dict;		// key/value pairs, conf_val stored as blob
+   struct conf_val *vals;
+   unsigned    nvals;
+
+   // Well-known keys (see conf_known[] in conf.c)
+   const char *log_level;		// log.level
+   const char *path_pkg;		// path.pkg
+   const char *path_cache;		// path.cache
+   const char *path_mountpoint;		// path.mountpoint
+   const char *cache_type;		// cache.type
+   const char *jail_name;		// jail.name
+   int         vfs_locking_host;	// vfs.locking.host
+   int         pkgdir_inotify;		// pkgdir.inotify
+   int         pkgdir_prescan;		// pkgdir.prescan
+   time_t      timer_blockheap_gc;	// tuning.timer.blockheap_gc
+   time_t      timer_pkg_gc;		// tuning.timer.pkg_gc
+   time_t      timer_global_gc;		// tuning.timer.global_gc
+   time_t      timer_vfs_gc;		// tuning.timer.vfs_gc
+   double      cron_max_load;		// tuning.cron.max_load
+   time_t      cron_max_defer;		// tuning.cron.max_defer
+   double      gc_budget;		// tuning.gc.budget (ms per tick)
+   double      gc_high_water;		// tuning.gc.high_water (% RAM available)
+   double      gc_low_water;		// tuning.gc.low_water
+};
+
+// Most change watchers which can be registered
+#define	CONF_MAX_WATCHERS	64
+
+/*
+ * Called from the main loop for each key that changed between two
+ * snapshots. oldv/newv are NULL if the key was added/removed.
+ */
+typedef void (*conf_watch_cb)(const char *key, const struct conf_val *oldv,
+                              const struct conf_val *newv, void *arg);
 
 struct conf {
    int         dying;
-   dict *dict;
+   dict *dict;				// current snapshot's dict (read-only!)
+   struct conf_snap *snap;		// current snapshot, use conf_get()
    time_t      born;
    time_t      now;
 };
 
 extern struct conf conf;
+extern struct conf_snap conf_defaults;
+
+// Current configuration snapshot (built-in defaults before loading)
+static inline const struct conf_snap *conf_get(void) {
+   const struct conf_snap *cs;
+
+#if	defined(CONFIG_DEBUG_EBR)
+   assert(ebr_is_online());
+#endif
+   cs = __atomic_load_n(&conf.snap, __ATOMIC_ACQUIRE);
+
+   return (cs ? cs : &conf_defaults);
+}
+
 extern void dconf_init(const char *file);
 extern void dconf_fini(void);
 extern int  dconf_get_bool(const char *key, const int def);
@@ -36,6 +117,15 @@ extern int  dconf_set(const char *key, const char *val);
 extern void dconf_unset(const char *key);
 extern dict *dconf_load(const char *file);
 extern int dconf_write(dict *cp, const char *file);
+extern void conf_publish(dict *d);
+extern void conf_reload(void);
+extern void conf_reload_request(void);
+extern void conf_tick(void);
+
+// Watch key (or every key below it, if it ends in '.') for changes
+extern int conf_watch(const char *key, conf_watch_cb cb, void *arg);
+// Apply tuning.heap.* style keys to a BlockHeap's future blocks
+extern int conf_watch_heap(const char *key, BlockHeap *bh);
 
 #define	_CONF_DICT conf.dict
 
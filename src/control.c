@@ -15,3 +15,348 @@
  *	Provides control API socket warden can use
  *  to manage the process.
  */
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <lsd/lsd.h>
+#include "conf.h"
+#include "control.h"
+#include "cron.h"
+#include "gc.h"
+#include "logger.h"
+#include "memstats.h"
+#include "pkg.h"
+#include "threads.h"
+#include "vfs.h"
+#include "vfs-stats.h"
+#include "watchdog.h"
+
+// Bucket bounds: latencies in ns (exported as seconds), read sizes in bytes
+static const unsigned long control_lat_le[] = {
+   1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000,
+   10000000, 50000000, 100000000, 500000000, 1000000000, 5000000000UL
+};
+static const unsigned long control_size_le[] = {
+   512, 4096, 16384, 65536, 131072, 262144, 1048576
+};
+#define	CONTROL_NLAT	(sizeof(control_lat_le) / sizeof(control_lat_le[0]))
+#define	CONTROL_NSIZE	(sizeof(control_size_le) / sizeof(control_size_le[0]))
+
+static int control_fd = -1;
+static char control_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static void control_head(FILE *fp, const char *name, const char *type, const char *help) {
+   fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * One histogram series. An le bucket also holds values up to the end
+ * of the hist bucket le falls in (at most 1/HIST_SUB above le).
+ *	Buckets are read one at a time while the owner keeps writing, so
+ * _count is taken from the buckets rather than h->count to keep +Inf
+ * and _count in agreement.
+ */
+static void control_hist(FILE *fp, const char *name, const char *label, const hist *h,
+                         const unsigned long *le, size_t nle, double scale) {
+   char sep[128];
+   unsigned long total;
+   size_t i;
+
+   snprintf(sep, sizeof(sep), "%s%s", label ? label : "", label ? "," : "");
+
+   for (i = 0; i < nle; i++)
+      fprintf(fp, "%s_bucket{%sle=\"%.9g\"} %lu\n", name, sep, le[i] * scale, hist_count_le(h, le[i]));
+
+   total = hist_count_le(h, ~0UL);
+   fprintf(fp, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, sep, total);
+
+   if (label) {
+      fprintf(fp, "%s_sum{%s} %.9g\n", name, label, h->sum * scale);
+      fprintf(fp, "%s_count{%s} %lu\n", name, label, total);
+   } else {
+      fprintf(fp, "%s_sum %.9g\n", name, h->sum * scale);
+      fprintf(fp, "%s_count %lu\n", name, total);
+   }
+}
+
+static void control_fuse(FILE *fp) {
+   struct vfs_stats *st;
+   unsigned long hit, miss;
+   char label[64];
+   int i;
+
+   if (!(st = vfs_stats_sum()))
+      return;
+
+   control_head(fp, "jailfs_fuse_ops_total", "counter", "FUSE requests handled");
+   for (i = 0; i < VFS_OP_MAX; i++)
+      fprintf(fp, "jailfs_fuse_ops_total{op=\"%s\"} %lu\n", vfs_stats_op_name(i), st->ops[i]);
+
+   control_head(fp, "jailfs_fuse_op_duration_seconds", "histogram", "FUSE request latency");
+   for (i = 0; i < VFS_OP_TIMED; i++) {
+      snprintf(label, sizeof(label), "op=\"%s\"", vfs_stats_op_name(i));
+      control_hist(fp, "jailfs_fuse_op_duration_seconds", label, &st->lat[i], control_lat_le, CONTROL_NLAT, 1e-9);
+   }
+
+   control_head(fp, "jailfs_fuse_read_request_bytes", "histogram", "Size of FUSE read requests");
+   control_hist(fp, "jailfs_fuse_read_request_bytes", NULL, &st->read_bytes, control_size_le, CONTROL_NSIZE, 1);
+
+   control_head(fp, "jailfs_cache_requests_total", "counter", "Metadata and extraction cache lookups");
+   fprintf(fp, "jailfs_cache_requests_total{cache=\"meta\",result=\"hit\"} %lu\n", st->ctr[VFS_CTR_META_HIT]);
+   fprintf(fp, "jailfs_cache_requests_total{cache=\"meta\",result=\"miss\"} %lu\n", st->ctr[VFS_CTR_META_MISS]);
+   fprintf(fp, "jailfs_cache_requests_total{cache=\"extract\",result=\"hit\"} %lu\n", st->ctr[VFS_CTR_EXTRACT_HIT]);
+   fprintf(fp, "jailfs_cache_requests_total{cache=\"extract\",result=\"miss\"} %lu\n", st->ctr[VFS_CTR_EXTRACT_MISS]);
+
+   control_head(fp, "jailfs_cache_hit_ratio", "gauge", "Cache hits over lookups since start");
+   hit = st->ctr[VFS_CTR_META_HIT], miss = st->ctr[VFS_CTR_META_MISS];
+   fprintf(fp, "jailfs_cache_hit_ratio{cache=\"meta\"} %g\n", hit + miss ? (double)hit / (hit + miss) : 0);
+   hit = st->ctr[VFS_CTR_EXTRACT_HIT], miss = st->ctr[VFS_CTR_EXTRACT_MISS];
+   fprintf(fp, "jailfs_cache_hit_ratio{cache=\"extract\"} %g\n", hit + miss ? (double)hit / (hit + miss) : 0);
+
+   control_head(fp, "jailfs_cache_extracted_bytes_total", "counter", "Bytes written into the extraction cache");
+   fprintf(fp, "jailfs_cache_extracted_bytes_total %lu\n", st->ctr[VFS_CTR_EXTRACT_BYTES]);
+
+   mem_free(st);
+}
+
+static void control_heaps(FILE *fp) {
+   const struct memstats_snap *snap;
+   const struct blockheap_stats *st;
+   size_t meta = 0;
+   int i;
+
+   if (!(snap = memstats_snapshot()))
+      return;
+
+   control_head(fp, "jailfs_heap_elements", "gauge", "BlockHeap elements by state");
+   for (i = 0; i < snap->count; i++) {
+      st = &snap->heap[i].st;
+      fprintf(fp, "jailfs_heap_elements{heap=\"%s\",state=\"used\"} %lu\n", st->name, st->used);
+      fprintf(fp, "jailfs_heap_elements{heap=\"%s\",state=\"free\"} %lu\n", st->name, st->elems - st->used);
+   }
+
+   control_head(fp, "jailfs_heap_bytes", "gauge", "BlockHeap memory by state");
+   for (i = 0; i < snap->count; i++) {
+      st = &snap->heap[i].st;
+      fprintf(fp, "jailfs_heap_bytes{heap=\"%s\",state=\"live\"} %lu\n", st->name, (unsigned long)st->live);
+      fprintf(fp, "jailfs_heap_bytes{heap=\"%s\",state=\"resident\"} %lu\n", st->name,
+              (unsigned long)(st->reserved - st->released));
+      fprintf(fp, "jailfs_heap_bytes{heap=\"%s\",state=\"released\"} %lu\n", st->name, (unsigned long)st->released);
+      meta += st->live;
+   }
+
+   control_head(fp, "jailfs_heap_allocs_total", "counter", "BlockHeap allocations");
+   for (i = 0; i < snap->count; i++)
+      fprintf(fp, "jailfs_heap_allocs_total{heap=\"%s\"} %lu\n", snap->heap[i].name, snap->heap[i].st.allocs);
+
+   control_head(fp, "jailfs_metadata_bytes", "gauge", "Live bytes in all BlockHeaps (inodes, files, packages, ...)");
+   fprintf(fp, "jailfs_metadata_bytes %lu\n", (unsigned long)meta);
+}
+
+static void control_process(FILE *fp) {
+   long pages = 0, rss = 0;
+   FILE *sfp;
+
+   control_head(fp, "jailfs_packages", "gauge", "Packages currently open");
+   fprintf(fp, "jailfs_packages %lu\n", pkg_count());
+   control_head(fp, "jailfs_packages_imported_total", "counter", "Packages imported since start");
+   fprintf(fp, "jailfs_packages_imported_total %lu\n", pkg_imports());
+   control_head(fp, "jailfs_vfs_paths", "gauge", "Paths in the metadata index");
+   fprintf(fp, "jailfs_vfs_paths %lu\n", vfs_path_count());
+
+   if ((sfp = fopen("/proc/self/statm", "r"))) {
+      if (fscanf(sfp, "%ld %ld", &pages, &rss) == 2) {
+         control_head(fp, "jailfs_resident_memory_bytes", "gauge", "Resident set size");
+         fprintf(fp, "jailfs_resident_memory_bytes %lu\n", (unsigned long)rss * sysconf(_SC_PAGESIZE));
+      }
+      fclose(sfp);
+   }
+
+   control_head(fp, "jailfs_uptime_seconds", "gauge", "Seconds since start");
+   fprintf(fp, "jailfs_uptime_seconds %lu\n", (unsigned long)(time(NULL) - conf.born));
+}
+
+// Only filled in while experimental.watchdog is on
+static void control_watchdog(FILE *fp) {
+   const struct watchdog_cb *cb;
+   char label[64];
+   int i, n = watchdog_count();
+
+   control_head(fp, "jailfs_event_loop_busy_seconds", "histogram", "Time spent per main loop pass");
+   control_hist(fp, "jailfs_event_loop_busy_seconds", NULL, watchdog_loop_hist(), control_lat_le, CONTROL_NLAT, 1e-9);
+
+   control_head(fp, "jailfs_callback_duration_seconds", "histogram", "Main loop callback run time");
+   for (i = 0; i < n; i++) {
+      cb = watchdog_callback(i);
+      snprintf(label, sizeof(label), "callback=\"%s\"", cb->name);
+      control_hist(fp, "jailfs_callback_duration_seconds", label, &cb->run, control_lat_le, CONTROL_NLAT, 1e-9);
+   }
+
+   control_head(fp, "jailfs_callback_stalls_total", "counter", "Callbacks that ran over watchdog.threshold");
+   for (i = 0; i < n; i++) {
+      cb = watchdog_callback(i);
+      fprintf(fp, "jailfs_callback_stalls_total{callback=\"%s\"} %lu\n", cb->name, cb->stalls);
+   }
+}
+
+int control_metrics(FILE *fp) {
+   struct gc_totals gc;
+
+   if (fp == NULL)
+      return -1;
+
+   control_fuse(fp);
+   control_heaps(fp);
+   control_process(fp);
+
+   gc_totals(&gc);
+   control_head(fp, "jailfs_gc_pause_seconds", "histogram", "Time spent per garbage collector tick");
+   control_hist(fp, "jailfs_gc_pause_seconds", NULL, gc.pauses, control_lat_le, CONTROL_NLAT, 1e-9);
+   control_head(fp, "jailfs_gc_released_bytes_total", "counter", "Bytes handed back to the OS by the collector");
+   fprintf(fp, "jailfs_gc_released_bytes_total %lu\n", (unsigned long)gc.released);
+   control_head(fp, "jailfs_gc_overruns_total", "counter", "Collector ticks that ran over twice their budget");
+   fprintf(fp, "jailfs_gc_overruns_total %lu\n", gc.overruns);
+   control_head(fp, "jailfs_gc_pressure", "gauge", "Memory pressure level (0-2)");
+   fprintf(fp, "jailfs_gc_pressure %d\n", gc.level);
+
+   control_head(fp, "jailfs_event_loop_lag_seconds", "histogram", "How late main loop timers fire");
+   control_hist(fp, "jailfs_event_loop_lag_seconds", NULL, cron_lag_hist(), control_lat_le, CONTROL_NLAT, 1e-9);
+
+   control_watchdog(fp);
+   return 0;
+}
+
+static int control_listen(void) {
+   struct sockaddr_un addr;
+   char dir[PATH_MAX];
+   const char *path;
+   int fd;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+
+   if ((path = dconf_get_str("path.control", NULL)) != NULL) {
+      if (strlen(path) >= sizeof(control_path)) {
+         Log(LOG_WARNING, "control: path.control %s is too long", path);
+         return -1;
+      }
+
+      strcpy(control_path, path);
+   } else {
+      if ((path = dconf_get_str("path.statedir", NULL)) == NULL)
+         return -1;
+
+      strncpy(dir, path, sizeof(dir) - 1);
+      dir[sizeof(dir) - 1] = '\0';
+
+      if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+         Log(LOG_WARNING, "control: can't create %s: %s", dir, strerror(errno));
+         return -1;
+      }
+
+      if (snprintf(control_path, sizeof(control_path), "%s/control.sock", dir) >= (int)sizeof(control_path)) {
+         Log(LOG_WARNING, "control: socket path under %s is too long", dir);
+         return -1;
+      }
+   }
+
+   memcpy(addr.sun_path, control_path, sizeof(addr.sun_path));
+
+   if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+      Log(LOG_WARNING, "control: socket: %s", strerror(errno));
+      return -1;
+   }
+
+   // A stale socket from a previous run
+   unlink(control_path);
+
+   if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+      Log(LOG_WARNING, "control: can't listen on %s: %s", control_path, strerror(errno));
+      close(fd);
+      return -1;
+   }
+
+   chmod(control_path, 0600);
+   Log(LOG_INFO, "control: metrics on %s", control_path);
+   return fd;
+}
+
+static void control_serve(int fd) {
+   struct timeval tv = { 1, 0 };
+   char req[1024], *buf = NULL;
+   size_t len = 0, off;
+   ssize_t n;
+   FILE *fp;
+
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+   // Plain clients may send nothing at all; don't wait long for them
+   if (poll(&(struct pollfd){ .fd = fd, .events = POLLIN }, 1, 100) > 0)
+      n = recv(fd, req, sizeof(req) - 1, 0);
+   else
+      n = 0;
+
+   req[n > 0 ? n : 0] = '\0';
+
+   if (!(fp = open_memstream(&buf, &len)))
+      return;
+
+   if (strncmp(req, "GET ", 4) == 0)
+      fprintf(fp, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+
+   // Nothing below may be freed while we build the reply
+   ebr_online();
+   control_metrics(fp);
+   ebr_offline();
+   fclose(fp);
+
+   for (off = 0; off < len; off += n)
+      if ((n = send(fd, buf + off, len - off, MSG_NOSIGNAL)) <= 0)
+         break;
+
+   free(buf);
+}
+
+void *thread_control_init(void *data) {
+   struct pollfd pfd;
+   int fd;
+
+   thread_entry((dict *)data);
+
+   // Reads path.* from the config, so has to run while we're online
+   if ((control_fd = control_listen()) < 0) {
+      ebr_unregister();
+      return NULL;
+   }
+
+   // Blocks in poll() most of the time
+   ebr_offline();
+
+   pfd.fd = control_fd;
+   pfd.events = POLLIN;
+
+   while (!conf.dying) {
+      if (poll(&pfd, 1, 1000) <= 0)
+         continue;
+
+      if ((fd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+         continue;
+
+      control_serve(fd);
+      close(fd);
+   }
+
+   return NULL;
+}
+
+void *thread_control_fini(void *data) {
+   if (control_fd >= 0) {
+      close(control_fd);
+      unlink(control_path);
+      control_fd = -1;
+   }
+
+   thread_exit((dict *)data);
+   return NULL;
+}
@@ -13,4 +13,22 @@
  *
  * src/control.h:
  *	socket based control interface for managing via warden
+ *
+ *	For now it only serves metrics: connect to path.control (default
+ * <path.statedir>/control.sock) and read the Prometheus text format.
+ * Clients that send an HTTP GET get HTTP headers in front, so a
+ * scraper that speaks HTTP over UNIX sockets can be pointed straight
+ * at it. Building the reply never takes a lock the VFS or main loop
+ * might be holding.
  */
+#if	!defined(__CONTROL_H)
+#define	__CONTROL_H
+#include <stdio.h>
+
+// Every metric, in the Prometheus text exposition format
+extern int control_metrics(FILE *fp);
+
+extern void *thread_control_init(void *data);
+extern void *thread_control_fini(void *data);
+
+#endif	// !defined(__CONTROL_H)
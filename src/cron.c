@@ -19,53 +19,436 @@
 #include "conf.h"
 #include "ev.h"
 #include "shell.h"
-#include "gc.h"
+#include "logger.h"
+#include "watchdog.h"
 struct ev_loop *evt_loop = NULL;
+static ev_prepare evt_idle_enter;
+static ev_check evt_idle_leave;
+
+// The loop is about to block: nothing we hold points into shared memory
+static void evt_idle_enter_cb(struct ev_loop *loop, ev_prepare *w, int revents) {
+   watchdog_loop_idle();
+   ebr_offline();
+}
+
+static void evt_idle_leave_cb(struct ev_loop *loop, ev_check *w, int revents) {
+   ebr_online();
+   watchdog_loop_wake();
+}
 
 void evt_init(void) {
    evt_loop = ev_default_loop(0);
+
+   // Every pass through the main loop is a quiescent point (see lsd/ebr.h)
+   ebr_register("main");
+   ev_prepare_init(&evt_idle_enter, evt_idle_enter_cb);
+   ev_prepare_start(evt_loop, &evt_idle_enter);
+   ev_check_init(&evt_idle_leave, evt_idle_leave_cb);
+   ev_check_start(evt_loop, &evt_idle_leave);
+}
+
+//////////////////
+// Timing wheel //
+//////////////////
+#define	CRON_MASK	(CRON_WHEEL_SLOTS - 1)
+#define	CRON_LEVEL_TICKS(l)	(1UL << (CRON_WHEEL_BITS * (l)))
+#define	CRON_INDEX(t, l)	(((t) >> (CRON_WHEEL_BITS * (l))) & CRON_MASK)
+#define	CRON_MAX_DELTA		(CRON_LEVEL_TICKS(CRON_LEVELS) - 1)
+
+// Internal job flags
+#define	CRON_F_RUNNING	0x0100		// callback in progress
+#define	CRON_F_DEAD	0x0200		// stopped while running, free when it returns
+
+static pthread_mutex_t cron_lock = PTHREAD_MUTEX_INITIALIZER;
+static cron_job *cron_wheel[CRON_LEVELS][CRON_WHEEL_SLOTS];
+static cron_job *cron_expired = NULL;	// slot being run (see cron_run)
+static cron_job *cron_all = NULL;
+static unsigned long cron_now = 0;	// current tick
+static unsigned long cron_njobs = 0;
+static unsigned int cron_seed = 0;
+static ev_tstamp cron_epoch = 0;
+static hist cron_lag;			// ns the timer fired late (main loop lag)
+static ev_timer cron_timer;
+
+static int cron_del_locked(cron_job *job);
+
+static unsigned long cron_ticks(time_t secs) {
+   return (secs > 0 ? (unsigned long)secs * CRON_HZ : 0);
 }
 
-ev_timer   *evt_timer_add_periodic(void *callback, const char *name, int interval) {
-   ev_timer   *timer = mem_alloc(sizeof(ev_timer));
-   ev_timer_init(timer, callback, 0, interval);
-   ev_timer_start(evt_loop, timer);
-   return timer;
+static void cron_link(cron_job **head, cron_job *job) {
+   if ((job->next = *head) != NULL)
+      job->next->pprev = &job->next;
+
+   *head = job;
+   job->pprev = head;
 }
 
-/* MAKE DAMN SURE YOUR CALLBACK DOES A mem_free() ON TIMER!!! */
-ev_timer   *evt_timer_add_oneshot(void *callback, const char *name, int timeout) {
-   ev_timer   *timer = mem_alloc(sizeof(ev_timer));
-   ev_timer_init(timer, callback, timeout, 0);
-   ev_timer_start(evt_loop, timer);
-   return timer;
+static void cron_unlink(cron_job *job) {
+   if (job->pprev == NULL)
+      return;
+
+   if ((*job->pprev = job->next) != NULL)
+      job->next->pprev = job->pprev;
+
+   job->next = NULL;
+   job->pprev = NULL;
 }
 
-// We need to keep things tight here as we run once every second!
-static void cron_tick(int fd, short event, void *arg) {
-   // Update the global time reference (reduces syscalls...)
-   conf.now = time(NULL);
+// Caller holds cron_lock
+static void cron_queue(cron_job *job) {
+   unsigned long expires = job->expires, delta = expires - cron_now;
+   int level;
+
+   // Already due: next tick
+   if ((long)delta < 0) {
+      cron_link(&cron_wheel[0][CRON_INDEX(cron_now, 0)], job);
+      return;
+   }
+
+   // Too far out: park it at the end, cron_run() queues it again from there
+   if (delta > CRON_MAX_DELTA)
+      expires = cron_now + CRON_MAX_DELTA;
+
+   for (level = 0; level < CRON_LEVELS - 1; level++)
+      if (expires - cron_now < CRON_LEVEL_TICKS(level + 1))
+         break;
+
+   cron_link(&cron_wheel[level][CRON_INDEX(expires, level)], job);
+}
+
+// Caller holds cron_lock. Due delay ticks after base
+static void cron_schedule(cron_job *job, unsigned long base, unsigned long delay) {
+   job->expires = base + delay;
+
+   if (job->jitter > 0)
+      job->expires += rand_r(&cron_seed) % (job->jitter + 1);
+
+   cron_queue(job);
+}
+
+// Move a whole slot one level down. Returns the slot's index
+static int cron_cascade(int level, int idx) {
+   cron_job *job, *list = cron_wheel[level][idx];
 
-   // Garbage collect
-   if (conf.now % (timestr_to_time(dconf_get_str("tuning.timer.global_gc", NULL), 60)) == 1) {
-      // XXX: Store before stats.
-      // Force garbage collection of all BlockHeaps
-      gc_all();
-      // XXX: Log before/after stats
+   cron_wheel[level][idx] = NULL;
+
+   while ((job = list) != NULL) {
+      list = job->next;
+      job->pprev = NULL;
+      cron_queue(job);
    }
 
-   // XXX: Determine if cron jobs are ready to run
-   // XXX: Schedule them to be ran soon
-   // XXX: Run pending jobs, if CPU load allows, else reschedule
+   return idx;
+}
+
+// Host too busy for deferrable jobs? (load average per CPU over tuning.cron.max_load)
+static int cron_busy(void) {
+   static time_t sampled = 0;
+   static int busy = 0;
+   double max = conf_get()->cron_max_load, load;
+
+   if (max <= 0)
+      return 0;
+
+   if (sampled != conf.now) {
+      sampled = conf.now;
+      busy = (getloadavg(&load, 1) == 1 && load / topo_ncpus() > max);
+   }
+
+   return busy;
+}
+
+// Run a job due at tick. Caller holds cron_lock, which is dropped around the callback
+static void cron_fire(cron_job *job, unsigned long tick) {
+   time_t max_defer = conf_get()->cron_max_defer;
+
+   if ((job->flags & CRON_DEFER) && cron_busy()) {
+      if (job->deferred == 0)
+         job->deferred = conf.now;
+
+      if (conf.now - job->deferred < max_defer) {
+         job->defers++;
+         Debug(DEBUG_CRON, "cron: %s deferred, host busy", job->name);
+         cron_schedule(job, cron_now, cron_ticks(CRON_DEFER_RETRY));
+         return;
+      }
+
+      Log(LOG_NOTICE, "cron: %s held back for %lu seconds, running it anyway", job->name, conf.now - job->deferred);
+   }
+
+   job->deferred = 0;
+   job->flags |= CRON_F_RUNNING;
+   pthread_mutex_unlock(&cron_lock);
+
+   Debug(DEBUG_CRON, "cron: running %s", job->name);
+   watchdog_enter(job->wd_slot);
+   job->fn(job->arg);
+   watchdog_leave(job->wd_slot);
+
+   pthread_mutex_lock(&cron_lock);
+   job->flags &= ~CRON_F_RUNNING;
+   job->runs++;
+   job->last_run = conf.now;
+
+   // Keep the period from the tick it was due at, not from when the callback finished
+   if (job->interval > 0 && !(job->flags & CRON_F_DEAD)) {
+      cron_schedule(job, tick, job->interval);
+      return;
+   }
+
+   // One-shot or stopped from its own callback
+   if (!(job->flags & CRON_F_DEAD))
+      cron_del_locked(job);
+   else
+      mem_free(job);
+}
+
+// Advance the wheel one tick and run whatever is due
+static void cron_run(void) {
+   unsigned long tick = cron_now;
+   int idx = CRON_INDEX(tick, 0), level;
+   cron_job *job;
+
+   // Wrapped around: pull the next slot of each level above down
+   for (level = 1; idx == 0 && level < CRON_LEVELS; level++)
+      if (cron_cascade(level, CRON_INDEX(tick, level)) != 0)
+         break;
+
+   cron_now++;
+
+   // Callbacks may add and stop jobs (even these), so keep the list where cron_unlink() can reach it
+   if ((cron_expired = cron_wheel[0][idx]) != NULL)
+      cron_expired->pprev = &cron_expired;
+   cron_wheel[0][idx] = NULL;
+
+   while ((job = cron_expired) != NULL) {
+      cron_unlink(job);
+
+      // Parked at the far end of the wheel, not actually due yet
+      if ((long)(job->expires - tick) > 0) {
+         cron_queue(job);
+         continue;
+      }
+
+      cron_fire(job, tick);
+   }
+}
+
+static void cron_timer_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+   unsigned long target = (unsigned long)((ev_now(loop) - cron_epoch) * CRON_HZ);
+   ev_tstamp late;
+
+   pthread_mutex_lock(&cron_lock);
+
+   // How long after its tick was due we got here: the loop's lag
+   if ((late = ev_time() - (cron_epoch + (double)(cron_now + 1) / CRON_HZ)) < 0)
+      late = 0;
+   hist_record(&cron_lag, (unsigned long)(late * 1000000000.0));
+
+   // Catch up if the loop was busy (or we were stopped)
+   while ((long)(target - cron_now) > 0)
+      cron_run();
+
+   pthread_mutex_unlock(&cron_lock);
+}
+
+//////////
+// Jobs //
+//////////
+static cron_job *cron_new(const char *name, cron_fn fn, void *arg, int flags) {
+   cron_job *job;
+
+   if (fn == NULL || !(job = mem_alloc(sizeof(cron_job))))
+      return NULL;
+
+   snprintf(job->name, sizeof(job->name), "%s", (name ? name : "unnamed"));
+   job->fn = fn;
+   job->arg = arg;
+   job->flags = flags & ~(CRON_F_RUNNING | CRON_F_DEAD);
+   job->wd_slot = watchdog_register(job->name);
+   return job;
+}
+
+static void cron_register(cron_job *job, unsigned long delay) {
+   pthread_mutex_lock(&cron_lock);
+
+   if ((job->all_next = cron_all) != NULL)
+      cron_all->all_pprev = &job->all_next;
+   cron_all = job;
+   job->all_pprev = &cron_all;
+   cron_njobs++;
+
+   cron_schedule(job, cron_now, delay);
+   pthread_mutex_unlock(&cron_lock);
+
+   Debug(DEBUG_CRON, "cron: added %s (every %lu ticks, jitter %lu)", job->name, job->interval, job->jitter);
+}
+
+cron_job *cron_add(const char *name, cron_fn fn, void *arg, time_t interval, time_t jitter, int flags) {
+   cron_job *job;
+
+   if (interval <= 0 || !(job = cron_new(name, fn, arg, flags)))
+      return NULL;
+
+   job->interval = cron_ticks(interval);
+   job->jitter = cron_ticks(jitter);
+   cron_register(job, job->interval);
+   return job;
+}
+
+int cron_once(const char *name, cron_fn fn, void *arg, time_t delay, int flags) {
+   cron_job *job;
+
+   if (!(job = cron_new(name, fn, arg, flags)))
+      return -1;
+
+   cron_register(job, cron_ticks(delay));
+   return 0;
+}
+
+// Caller holds cron_lock
+static int cron_del_locked(cron_job *job) {
+   if (job->all_pprev == NULL)
+      return -1;
+
+   cron_unlink(job);
+
+   if ((*job->all_pprev = job->all_next) != NULL)
+      job->all_next->all_pprev = job->all_pprev;
+   job->all_pprev = NULL;
+   cron_njobs--;
+
+   // cron_fire() frees it once the callback returns
+   if (job->flags & CRON_F_RUNNING)
+      job->flags |= CRON_F_DEAD;
+   else
+      mem_free(job);
+
+   return 0;
+}
+
+int cron_del(cron_job *job) {
+   int rv;
+
+   if (job == NULL)
+      return -1;
+
+   pthread_mutex_lock(&cron_lock);
+   rv = cron_del_locked(job);
+   pthread_mutex_unlock(&cron_lock);
+   return rv;
+}
+
+int cron_stop(const char *name) {
+   cron_job *job, *next;
+   int stopped = 0;
+
+   if (name == NULL)
+      return 0;
+
+   pthread_mutex_lock(&cron_lock);
+
+   for (job = cron_all; job != NULL; job = next) {
+      next = job->all_next;
+
+      if (strcmp(job->name, name) == 0 && cron_del_locked(job) == 0)
+         stopped++;
+   }
+
+   pthread_mutex_unlock(&cron_lock);
+   return stopped;
+}
+
+int cron_reschedule(const char *name, time_t interval) {
+   cron_job *job;
+   int n = 0;
+
+   if (name == NULL || interval <= 0)
+      return 0;
+
+   pthread_mutex_lock(&cron_lock);
+
+   for (job = cron_all; job != NULL; job = job->all_next) {
+      if (job->interval == 0 || strcmp(job->name, name) != 0)
+         continue;
+
+      job->interval = cron_ticks(interval);
+
+      // A running job picks the new interval up when it's done
+      if (!(job->flags & CRON_F_RUNNING)) {
+         cron_unlink(job);
+         cron_schedule(job, cron_now, job->interval);
+      }
+      n++;
+   }
+
+   pthread_mutex_unlock(&cron_lock);
+   return n;
+}
+
+static void cron_conf_changed(const char *key, const struct conf_val *oldv,
+                              const struct conf_val *newv, void *arg) {
+   const char *name = (const char *)arg;
+
+   if (newv == NULL || newv->time <= 0)
+      return;
+
+   if (cron_reschedule(name, newv->time) > 0)
+      Log(LOG_INFO, "cron: %s rescheduled to every %lu seconds (%s)", name, newv->time, key);
+}
+
+int cron_watch(const char *name, const char *key) {
+   char *copy;
+
+   // Jobs may come and go, so the watcher finds them by name
+   if (name == NULL || !(copy = strdup(name)))
+      return -1;
+
+   return conf_watch(key, cron_conf_changed, copy);
+}
+
+void cron_dump(void) {
+   cron_job *job;
+   unsigned long now;
+
+   pthread_mutex_lock(&cron_lock);
+   now = cron_now;
+   Log(LOG_SHELL, "%lu jobs, %d Hz wheel at tick %lu", cron_njobs, CRON_HZ, now);
+
+   for (job = cron_all; job != NULL; job = job->all_next)
+      Log(LOG_SHELL, "  %-24s every %6.1fs  next in %6.1fs  runs %lu  deferred %lu%s",
+          job->name, (double)job->interval / CRON_HZ,
+          (double)(long)(job->expires - now) / CRON_HZ, job->runs, job->defers,
+          (job->deferred ? " (held back)" : ""));
+
+   pthread_mutex_unlock(&cron_lock);
+}
+
+const hist *cron_lag_hist(void) {
+   return &cron_lag;
+}
+
+unsigned long cron_count(void) {
+   return __atomic_load_n(&cron_njobs, __ATOMIC_RELAXED);
+}
+
+// Once a second: keep conf.now current, push config changes to subsystems
+static void cron_tick(void *arg) {
+   conf.now = time(NULL);
+   conf_tick();
 }
 
 int cron_init(void) {
-    int rv = EXIT_FAILURE;
+    cron_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    cron_epoch = ev_now(evt_loop);
+
+    cron_add("cron.tick", cron_tick, NULL, 1, 0, 0);
 
-    // Call cron once per second to update conf.now and
-    // schedule any pending jobs
-    evt_timer_add_periodic(cron_tick, "tick", 1);
+    // One libev timer drives every job
+    ev_timer_init(&cron_timer, cron_timer_cb, 1.0 / CRON_HZ, 1.0 / CRON_HZ);
+    ev_timer_start(evt_loop, &cron_timer);
     Log(LOG_DEBUG, "starting periodic task scheduler (cron)");
 
-    return rv;
+    return EXIT_SUCCESS;
 }
@@ -10,16 +10,75 @@
  * on github - https://github.com/bigfluffycloud/jailfs/
  *
  * No warranty of any kind. Good luck!
+ *
+ * src/cron.h:
+ *	Periodic event scheduler
+ *
+ *	Jobs live on a hierarchical timing wheel (CRON_LEVELS levels of
+ * CRON_WHEEL_SLOTS slots) driven by a single libev timer, CRON_HZ ticks
+ * a second. Adding, stopping and firing a job is O(1) no matter how many
+ * there are; a job due further out than the lowest level covers is moved
+ * down a level at a time (cascaded) as its time approaches.
+ *
+ *	Callbacks run on the main loop. Jobs may be added or stopped from
+ * any thread, including from inside a callback.
  */
 #if	!defined(__CRON_H)
 #define	__CRON_H
+#include <time.h>
 #include <ev.h>
+#include <lsd/hist.h>
 extern struct ev_loop *evt_loop;
-extern	int	cron_init(void);
+
+#define	CRON_HZ		10		// wheel ticks per second
+#define	CRON_WHEEL_BITS	6
+#define	CRON_WHEEL_SLOTS	(1 << CRON_WHEEL_BITS)
+#define	CRON_LEVELS	4		// covers 2^24 ticks (~19 days), longer is re-queued
+#define	CRON_NAMELEN	32
+#define	CRON_DEFER_RETRY	5	// seconds between tries while deferred
+
+// Job flags
+#define	CRON_DEFER	0x0001		// may be held back while the host is busy (tuning.cron.*)
+
+typedef void (*cron_fn)(void *arg);
+
+typedef struct cron_job {
+   char        name[CRON_NAMELEN];
+   cron_fn     fn;
+   void       *arg;
+   int         flags;
+   unsigned long interval,		// ticks, 0 for one-shot jobs
+                 jitter;		// random extra delay, up to this many ticks
+   unsigned long expires;		// tick it is due at
+   time_t      deferred;		// held back by load since, or 0
+   unsigned long runs, defers;
+   time_t      last_run;
+   int         wd_slot;			// watchdog_register(name)
+   struct cron_job *next, **pprev;	// wheel slot
+   struct cron_job *all_next,		// every job (cron_dump, cron_stop)
+                   **all_pprev;
+} cron_job;
+
+extern int cron_init(void);
 extern void evt_init(void);
-extern ev_timer *evt_timer_add_periodic(void *callback, const char *name, int interval);
-/* MAKE DAMN SURE YOUR CALLBACK DOES A mem_free() ON TIMER!!! */
-extern ev_timer *evt_timer_add_oneshot(void *callback, const char *name, int timeout);
 
-#endif	// !defined(__CRON_H)
+// Run fn(arg) every interval seconds (one-shot: once, after delay seconds),
+// plus up to jitter seconds to keep many jails from firing in lockstep.
+// A one-shot job is freed as soon as it has run, so cron_once() hands out
+// no pointer: cancel it by name with cron_stop()
+extern cron_job *cron_add(const char *name, cron_fn fn, void *arg, time_t interval, time_t jitter, int flags);
+extern int  cron_once(const char *name, cron_fn fn, void *arg, time_t delay, int flags);
+// Stop a job (pending one-shots are dropped); by name stops every job called that
+extern int cron_del(cron_job *job);
+extern int cron_stop(const char *name);
+// Change the interval of every job called name, effective from now
+extern int cron_reschedule(const char *name, time_t interval);
+// Reschedule the job called name whenever config key (a time) changes
+extern int cron_watch(const char *name, const char *key);
+// List jobs on the shell
+extern void cron_dump(void);
+extern unsigned long cron_count(void);
+// How late each timer tick ran, in ns: a measure of main loop lag
+extern const hist *cron_lag_hist(void);
 
+#endif	// !defined(__CRON_H)
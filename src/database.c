@@ -22,6 +22,7 @@
 #include "vfs.h"
 #include "shell.h"
 #include "threads.h"
+#include "api.h"
 extern int g_pkgid;	// pkg.c
 
 static pthread_mutex_t db_mutex;
@@ -72,11 +73,16 @@ int db_file_remove(int pkg, const char *path) {
 void *thread_db_init(void *data) {
     thread_entry((dict *)data);
 
+    api_mailbox *mb = api_mailbox_create("db", NULL, NULL);
+
+    // Handle requests as they come in, wake up every 3s regardless
     while (!conf.dying) {
-        sleep(3);
+        api_mailbox_wait(mb, 3000);
         pthread_yield();
     }
 
+    api_mailbox_destroy(mb);
+
     return NULL;
 }
 
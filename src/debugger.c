@@ -15,13 +15,19 @@
  * debugger.c:
  *	Extends the shell(.c) to add a debuggger
  */
-#if	defined(CONFIG_DEBUGGER)
-#include <sys/gmon.h>
+#define	UNW_LOCAL_ONLY
+#include <sys/syscall.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <time.h>
 #include <lsd/lsd.h>
 #include "debugger.h"
 #include "shell.h"
 #include "conf.h"
 #include "cron.h"
+#include "logger.h"
+#if	defined(CONFIG_DEBUGGER)
+#include <sys/gmon.h>
 #include "hooks.h"
 #include "i18n.h"
 #include "linenoise.h"
@@ -165,3 +171,520 @@ void profiling_toggle(void) {
    profiling_newmsg = 1;
 }
 #endif	// defined(CONFIG_PROFILING)
+
+///////////////////////
+// Sampling profiler //
+///////////////////////
+/*
+ * A process CPU-time timer raises SIGPROF every 1/hz seconds of CPU
+ * used, on whichever thread is burning it. The handler unwinds that
+ * thread's stack into a ring of its own (claimed on its first sample);
+ * a cron job empties the rings into a table of distinct stacks, and
+ * names are only looked up when the profile is written out.
+ */
+#define	PROF_MAX_THREADS	32	// threads sampled at once, the rest are lost
+#define	PROF_RING		512	// samples per thread between drains
+#define	PROF_FRAMES		32	// deepest stack kept
+#define	PROF_HZ			99
+
+struct prof_sample {
+   int         n;
+   unsigned long ip[PROF_FRAMES];	// leaf first
+};
+
+struct prof_ring {
+   pid_t       tid;			// owner, 0 if free
+   char        name[16];		// owner's name, filled in by the drain
+   unsigned long head, tail;		// written by the owner's handler / the drain
+   struct prof_sample s[PROF_RING];
+};
+
+struct prof_stack {
+   unsigned long hash, count;
+   pid_t       tid;
+   char        name[16];
+   struct prof_sample st;
+};
+
+struct prof_sym {
+   unsigned long addr, size;
+   char       *name;
+};
+
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prof_ring *prof_rings = NULL;
+static int prof_running = 0, prof_hz = 0;
+static unsigned long prof_gen = 0, prof_lost = 0, prof_samples = 0;
+static timer_t prof_timer;
+static time_t prof_started = 0, prof_stopped = 0;
+static __thread struct prof_ring *prof_mine = NULL;
+static __thread unsigned long prof_mine_gen = 0;
+
+// Distinct stacks, open addressing (prof_lock)
+static struct prof_stack *prof_tab = NULL;
+static size_t prof_tabsz = 0, prof_nstacks = 0;
+
+// Ring of the calling thread: signal context, so no locks and no malloc
+static struct prof_ring *prof_ring_get(void) {
+   unsigned long gen = __atomic_load_n(&prof_gen, __ATOMIC_ACQUIRE);
+   pid_t tid, none;
+   int i;
+
+   if (prof_mine_gen == gen)
+      return prof_mine;
+
+   tid = (pid_t)syscall(SYS_gettid);
+   prof_mine = NULL;
+
+   for (i = 0; i < PROF_MAX_THREADS; i++) {
+      none = 0;
+
+      if (__atomic_compare_exchange_n(&prof_rings[i].tid, &none, tid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+         prof_mine = &prof_rings[i];
+         break;
+      }
+   }
+
+   prof_mine_gen = gen;
+   return prof_mine;
+}
+
+static void prof_sig(int sig, siginfo_t *si, void *uctx) {
+   struct prof_ring *r;
+   struct prof_sample *s;
+   unw_cursor_t cursor;
+   unw_context_t ctx;
+   unw_word_t ip;
+   unsigned long head;
+   int n = 0, saved = errno;
+
+   if (!__atomic_load_n(&prof_running, __ATOMIC_ACQUIRE))
+      return;
+
+   if ((r = prof_ring_get()) == NULL) {
+      __atomic_add_fetch(&prof_lost, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   // Full: the drain is behind, drop rather than overwrite what it's reading
+   head = r->head;
+
+   if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= PROF_RING) {
+      __atomic_add_fetch(&prof_lost, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   s = &r->s[head % PROF_RING];
+   unw_getcontext(&ctx);
+
+   if (unw_init_local(&cursor, &ctx) == 0) {
+      while (n < PROF_FRAMES && unw_step(&cursor) > 0) {
+         // Everything before the interrupted frame is us
+         if (unw_is_signal_frame(&cursor) > 0)
+            n = 0;
+
+         if (unw_get_reg(&cursor, UNW_REG_IP, &ip) < 0)
+            break;
+
+         s->ip[n++] = ip;
+      }
+   }
+
+   s->n = n;
+   __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+   errno = saved;
+}
+
+static unsigned long prof_hash(pid_t tid, const struct prof_sample *s) {
+   unsigned long h = 1469598103934665603UL ^ (unsigned long)tid;
+   int i;
+
+   for (i = 0; i < s->n; i++)
+      h = (h ^ s->ip[i]) * 1099511628211UL;
+
+   return (h ? h : 1);
+}
+
+// Caller holds prof_lock
+static int prof_tab_grow(void) {
+   struct prof_stack *old = prof_tab, *e;
+   size_t oldsz = prof_tabsz, i, j;
+
+   prof_tabsz = (oldsz ? oldsz * 2 : 1024);
+
+   if (!(prof_tab = calloc(prof_tabsz, sizeof(struct prof_stack)))) {
+      prof_tab = old;
+      prof_tabsz = oldsz;
+      return -1;
+   }
+
+   for (i = 0; i < oldsz; i++) {
+      if (old[i].hash == 0)
+         continue;
+
+      for (j = old[i].hash & (prof_tabsz - 1); prof_tab[j].hash != 0; j = (j + 1) & (prof_tabsz - 1))
+         ;
+
+      e = &prof_tab[j];
+      memcpy(e, &old[i], sizeof(struct prof_stack));
+   }
+
+   free(old);
+   return 0;
+}
+
+// Caller holds prof_lock
+static void prof_count(const struct prof_ring *r, const struct prof_sample *s) {
+   unsigned long h = prof_hash(r->tid, s);
+   struct prof_stack *e;
+   size_t i;
+
+   if (prof_nstacks * 4 >= prof_tabsz * 3 && prof_tab_grow() != 0) {
+      __atomic_add_fetch(&prof_lost, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   for (i = h & (prof_tabsz - 1);; i = (i + 1) & (prof_tabsz - 1)) {
+      e = &prof_tab[i];
+
+      if (e->hash == 0) {
+         e->hash = h;
+         e->tid = r->tid;
+         memcpy(e->name, r->name, sizeof(e->name));
+         e->st.n = s->n;
+         memcpy(e->st.ip, s->ip, s->n * sizeof(unsigned long));
+         prof_nstacks++;
+         break;
+      }
+
+      if (e->hash == h && e->tid == r->tid && e->st.n == s->n &&
+          memcmp(e->st.ip, s->ip, s->n * sizeof(unsigned long)) == 0)
+         break;
+   }
+
+   e->count++;
+   prof_samples++;
+}
+
+static void prof_thread_name(pid_t tid, char *buf, size_t len) {
+   char path[64];
+   FILE *fp;
+
+   snprintf(path, sizeof(path), "/proc/self/task/%d/comm", (int)tid);
+   buf[0] = '\0';
+
+   if ((fp = fopen(path, "r"))) {
+      if (fgets(buf, len, fp))
+         buf[strcspn(buf, "\n")] = '\0';
+      fclose(fp);
+   }
+
+   if (buf[0] == '\0')
+      snprintf(buf, len, "tid-%d", (int)tid);
+}
+
+// Empty every ring into the table
+static void prof_drain(void *arg) {
+   struct prof_ring *r;
+   unsigned long head;
+   int i;
+
+   pthread_mutex_lock(&prof_lock);
+
+   for (i = 0; prof_rings != NULL && i < PROF_MAX_THREADS; i++) {
+      r = &prof_rings[i];
+      head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+      if (r->tail == head)
+         continue;
+
+      // Name it while the thread is still around
+      if (r->name[0] == '\0')
+         prof_thread_name(r->tid, r->name, sizeof(r->name));
+
+      for (; r->tail != head; r->tail++)
+         prof_count(r, &r->s[r->tail % PROF_RING]);
+
+      __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+   }
+
+   pthread_mutex_unlock(&prof_lock);
+}
+
+int profiler_start(int hz) {
+   struct sigevent sev;
+   struct itimerspec its;
+   struct sigaction sa;
+   int i;
+
+#if	defined(CONFIG_PROFILING)
+   // gprof owns SIGPROF
+   Log(LOG_ERR, "profiler: not available in a CONFIG_PROFILING build");
+   return -1;
+#endif
+
+   if (hz <= 0)
+      hz = dconf_get_int("profiling.hz", PROF_HZ);
+
+   if (hz > 1000)
+      hz = 1000;
+
+   pthread_mutex_lock(&prof_lock);
+
+   if (prof_running) {
+      pthread_mutex_unlock(&prof_lock);
+      return -1;
+   }
+
+   // Kept for good: a straggling signal from the last run may still write to them
+   if (prof_rings == NULL && !(prof_rings = calloc(PROF_MAX_THREADS, sizeof(struct prof_ring)))) {
+      pthread_mutex_unlock(&prof_lock);
+      Log(LOG_ERR, "profiler: out of memory");
+      return -1;
+   }
+
+   for (i = 0; i < PROF_MAX_THREADS; i++) {
+      prof_rings[i].head = prof_rings[i].tail = 0;
+      prof_rings[i].name[0] = '\0';
+      __atomic_store_n(&prof_rings[i].tid, 0, __ATOMIC_RELEASE);
+   }
+
+   if (prof_tab != NULL)
+      memset(prof_tab, 0, prof_tabsz * sizeof(struct prof_stack));
+   prof_nstacks = prof_samples = prof_lost = 0;
+
+   memset(&sa, 0, sizeof(sa));
+   sigemptyset(&sa.sa_mask);
+   sa.sa_sigaction = prof_sig;
+   sa.sa_flags = SA_SIGINFO | SA_RESTART;
+   sigaction(SIGPROF, &sa, NULL);
+
+   memset(&sev, 0, sizeof(sev));
+   sev.sigev_notify = SIGEV_SIGNAL;
+   sev.sigev_signo = SIGPROF;
+
+   if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &prof_timer) != 0) {
+      pthread_mutex_unlock(&prof_lock);
+      Log(LOG_ERR, "profiler: timer_create: %s", strerror(errno));
+      return -1;
+   }
+
+   __atomic_add_fetch(&prof_gen, 1, __ATOMIC_RELEASE);
+   __atomic_store_n(&prof_running, 1, __ATOMIC_RELEASE);
+   prof_hz = hz;
+   prof_started = time(NULL);
+   prof_stopped = 0;
+
+   its.it_interval.tv_sec = 0;
+   its.it_interval.tv_nsec = 1000000000L / hz;
+   its.it_value = its.it_interval;
+   timer_settime(prof_timer, 0, &its, NULL);
+   pthread_mutex_unlock(&prof_lock);
+
+   cron_add("profiler.drain", prof_drain, NULL, 1, 0, 0);
+   Log(LOG_INFO, "profiler: sampling at %d Hz of CPU time", hz);
+   return 0;
+}
+
+int profiler_stop(void) {
+   pthread_mutex_lock(&prof_lock);
+
+   if (!prof_running) {
+      pthread_mutex_unlock(&prof_lock);
+      return -1;
+   }
+
+   timer_delete(prof_timer);
+   __atomic_store_n(&prof_running, 0, __ATOMIC_RELEASE);
+   prof_stopped = time(NULL);
+   pthread_mutex_unlock(&prof_lock);
+
+   cron_stop("profiler.drain");
+   prof_drain(NULL);
+   Log(LOG_INFO, "profiler: stopped, %lu samples in %lu stacks (%lu lost)", prof_samples, prof_nstacks, prof_lost);
+   return 0;
+}
+
+void profiler_status(void) {
+   time_t end = (prof_stopped ? prof_stopped : time(NULL));
+
+   prof_drain(NULL);
+   Log(LOG_SHELL, "profiler %s at %d Hz, %lus of data: %lu samples in %lu stacks, %lu lost",
+       (prof_running ? "running" : "stopped"), prof_hz,
+       (unsigned long)(prof_started ? end - prof_started : 0), prof_samples, prof_nstacks, prof_lost);
+}
+
+static int prof_sym_cmp(const void *a, const void *b) {
+   const struct prof_sym *x = a, *y = b;
+
+   return (x->addr < y->addr ? -1 : x->addr > y->addr);
+}
+
+/*
+ * Function symbols from the symtab (`nm -Clp -f posix`, see mk/debug.mk),
+ * sorted by their address in this process. NULL if there isn't one.
+ */
+static struct prof_sym *prof_symtab(size_t *count) {
+   struct prof_sym *syms = NULL, *tmp;
+   unsigned long value, size, slide = 0;
+   size_t n = 0, max = 0, i;
+   char line[1024], name[512], type;
+   int have_slide = 0, fields;
+   FILE *fp;
+
+   *count = 0;
+
+   if (!(fp = fopen(dconf_get_str("path.symtab", "dbg/jailfs.symtab"), "r")))
+      return NULL;
+
+   while (fgets(line, sizeof(line), fp)) {
+      size = 0;
+
+      if ((fields = sscanf(line, "%511s %c %lx %lx", name, &type, &value, &size)) < 3)
+         continue;
+
+      if (type != 'T' && type != 't' && type != 'W' && type != 'w')
+         continue;
+
+      // PIE: symtab addresses are relative to wherever we got loaded
+      if (strcmp(name, "profiler_start") == 0) {
+         slide = (unsigned long)profiler_start - value;
+         have_slide = 1;
+      }
+
+      if (n == max) {
+         max = (max ? max * 2 : 4096);
+
+         if (!(tmp = realloc(syms, max * sizeof(struct prof_sym))))
+            break;
+         syms = tmp;
+      }
+
+      syms[n].addr = value;
+      syms[n].size = size;
+      syms[n].name = strdup(name);
+      n++;
+   }
+
+   fclose(fp);
+
+   // A symtab for some other binary is worse than none
+   if (!have_slide) {
+      for (i = 0; i < n; i++)
+         free(syms[i].name);
+      free(syms);
+      return NULL;
+   }
+
+   for (i = 0; i < n; i++)
+      syms[i].addr += slide;
+
+   qsort(syms, n, sizeof(struct prof_sym), prof_sym_cmp);
+   *count = n;
+   return syms;
+}
+
+static const char *prof_name(unsigned long ip, const struct prof_sym *syms, size_t nsyms, char *buf, size_t len) {
+   size_t lo = 0, hi = nsyms, mid;
+   Dl_info di;
+
+   // Last symbol starting at or below ip
+   while (lo < hi) {
+      mid = (lo + hi) / 2;
+
+      if (syms[mid].addr <= ip)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   if (lo > 0 && ip < syms[lo - 1].addr + syms[lo - 1].size)
+      return syms[lo - 1].name;
+
+   memset(&di, 0, sizeof(di));
+
+   if (dladdr((void *)ip, &di) && di.dli_sname != NULL)
+      return di.dli_sname;
+
+   if (di.dli_fname != NULL) {
+      snprintf(buf, len, "[%s]", basename(di.dli_fname));
+      return buf;
+   }
+
+   snprintf(buf, len, "0x%lx", ip);
+   return buf;
+}
+
+/*
+ * Collapsed stacks, one "thread;outer;...;leaf count" line per distinct
+ * stack: the input flamegraph.pl and most flame graph viewers take.
+ */
+struct prof_line {
+   char       *stack;
+   unsigned long count;
+};
+
+static int prof_line_cmp(const void *a, const void *b) {
+   return strcmp(((const struct prof_line *)a)->stack, ((const struct prof_line *)b)->stack);
+}
+
+int profiler_write(FILE *fp) {
+   struct prof_sym *syms;
+   struct prof_stack *e;
+   struct prof_line *out;
+   size_t nsyms, nout = 0, len, i;
+   char buf[64];
+   FILE *sfp;
+   int j, lines = 0;
+
+   prof_drain(NULL);
+
+   if ((syms = prof_symtab(&nsyms)) == NULL)
+      Log(LOG_DEBUG, "profiler: no usable symtab, naming frames with dladdr");
+
+   pthread_mutex_lock(&prof_lock);
+
+   if (!(out = calloc(prof_nstacks + 1, sizeof(struct prof_line)))) {
+      pthread_mutex_unlock(&prof_lock);
+      goto done;
+   }
+
+   for (i = 0; i < prof_tabsz; i++) {
+      e = &prof_tab[i];
+
+      if (e->hash == 0 || !(sfp = open_memstream(&out[nout].stack, &len)))
+         continue;
+
+      fputs(e->name, sfp);
+
+      // Callers' addresses are return addresses: step back into the call
+      for (j = e->st.n - 1; j >= 0; j--)
+         fprintf(sfp, ";%s", prof_name(e->st.ip[j] - (j > 0), syms, nsyms, buf, sizeof(buf)));
+
+      fclose(sfp);
+      out[nout++].count = e->count;
+   }
+
+   pthread_mutex_unlock(&prof_lock);
+
+   // Different addresses in the same functions are the same stack here
+   qsort(out, nout, sizeof(struct prof_line), prof_line_cmp);
+
+   for (i = 0; i < nout; i++) {
+      if (i + 1 < nout && strcmp(out[i].stack, out[i + 1].stack) == 0) {
+         out[i + 1].count += out[i].count;
+      } else {
+         fprintf(fp, "%s %lu\n", out[i].stack, out[i].count);
+         lines++;
+      }
+      free(out[i].stack);
+   }
+
+   free(out);
+
+done:
+   for (i = 0; i < nsyms; i++)
+      free(syms[i].name);
+   free(syms);
+   return lines;
+}
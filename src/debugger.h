@@ -13,6 +13,7 @@
  */
 #if	!defined(__debugger_h)
 #define	__debugger_h
+#include <stdio.h>
 #include <libunwind.h>
 extern void profiling_dump(void);
 extern void profiling_toggle(void);
@@ -20,6 +21,13 @@ extern int profiling_newmsg;
 extern char profiling_msg[512];
 extern const char *debug_symtab_lookup(const char *symbol, const char *symtab);
 
+// Sampling profiler (any build): SIGPROF every 1/hz s of CPU time, 0 for profiling.hz
+extern int profiler_start(int hz);
+extern int profiler_stop(void);
+extern void profiler_status(void);
+// Collapsed stacks for flamegraph.pl, returns the number of lines
+extern int profiler_write(FILE *fp);
+
 static __inline__ void stack_unwind(void) {
     unw_cursor_t cursor;
     unw_word_t ip, sp;  
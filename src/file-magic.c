@@ -15,13 +15,14 @@
  */
 #include "conf.h"
 #include "shell.h"
+#include "logger.h"
 #include "file-magic.h"
 
 magic_t mimetype_init(void) {
   magic_t tmp;
   int flags = MAGIC_SYMLINK|MAGIC_MIME|MAGIC_PRESERVE_ATIME;
 
-  if (dconf_get_bool("debug.vfs.mime", 0) == 1)
+  if (debug_enabled(DEBUG_VFS_MIME))
      flags |= MAGIC_DEBUG;
 
   tmp = magic_open(flags);
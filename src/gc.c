@@ -14,21 +14,349 @@
  * src/gc.c
  * 	Garbage collection tasks managed by the main thread
  */
+#include <malloc.h>
+#include <strings.h>
 #include <lsd/lsd.h>
-#include "vfs.h"
+#include "conf.h"
+#include "cron.h"
+#include "gc.h"
+#include "logger.h"
 #include "shell.h"
 #include "pkg.h"
 #include "api.h"
 extern BlockHeap *dlink_node_heap;
 
-int gc_all(void) {
-     int freed = 0;
-     freed += api_gc();
-     freed += shell_gc();
-     freed += pkg_gc();
-     freed += vfs_gc();
+struct gc_collector {
+   char        name[32];
+   gc_step_fn  fn;
+   void       *arg;
+   const char *key;			// base interval
+   time_t      def;
+   double      cost,			// ms per step (moving average)
+               worst;			// longest step seen
+   double      scale;			// interval multiplier, adapted after each pass
+   int         busy;			// in the middle of a pass
+   time_t      last;			// when the last pass finished
+   unsigned long grown;			// blockheap_grown() at the start of this pass
+   size_t      pass_released, released;
+   unsigned long pass_freed, passes, steps;
+};
 
-     blockheap_garbagecollect(dlink_node_heap);
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gc_collector gc_collectors[GC_MAX_COLLECTORS];
+static int gc_ncollectors = 0;
+static int gc_next = 0;			// where the next tick starts (round robin)
+static int gc_level = 0;		// memory pressure: 0 fine, 1 below high water, 2 below low water
+static size_t gc_released = 0;
+static unsigned long gc_overruns = 0;
+static hist gc_pauses;			// ns per tick that did any work (written by gc_tick only)
 
-     return freed;
+static double gc_now_ms(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Percent of RAM available, from /proc/meminfo (-1 if unknown)
+static double gc_mem_avail(void) {
+   FILE *fp;
+   char line[128];
+   unsigned long total = 0, avail = 0;
+
+   if (!(fp = fopen("/proc/meminfo", "r")))
+      return -1;
+
+   while (fgets(line, sizeof(line), fp) && (total == 0 || avail == 0)) {
+      if (strncmp(line, "MemTotal:", 9) == 0)
+         total = strtoul(line + 9, NULL, 10);
+      else if (strncmp(line, "MemAvailable:", 13) == 0)
+         avail = strtoul(line + 13, NULL, 10);
+   }
+
+   fclose(fp);
+   return (total ? avail * 100.0 / total : -1);
+}
+
+static int gc_pressure(void) {
+   const struct conf_snap *cs = conf_get();
+   double avail = gc_mem_avail();
+
+   if (avail < 0)
+      return 0;
+   else if (avail < cs->gc_low_water)
+      return 2;
+   else if (avail < cs->gc_high_water)
+      return 1;
+
+   return 0;
+}
+
+// Seconds between passes of c right now
+static time_t gc_interval(struct gc_collector *c) {
+   time_t t = dconf_get_time(c->key, c->def) * c->scale;
+
+   t >>= gc_level;
+   return (t > 0 ? t : 1);
+}
+
+static void gc_pass_begin(struct gc_collector *c) {
+   c->busy = 1;
+   c->grown = blockheap_grown();
+   c->pass_released = 0;
+   c->pass_freed = 0;
+}
+
+static void gc_pass_end(struct gc_collector *c) {
+   c->busy = 0;
+   c->last = conf.now;
+   c->passes++;
+   c->released += c->pass_released;
+   __atomic_store_n(&gc_released, gc_released + c->pass_released, __ATOMIC_RELAXED);
+
+   // Found garbage, or heaps grew meanwhile: come back sooner. Otherwise back off
+   if (c->pass_freed > 0 || blockheap_grown() != c->grown)
+      c->scale = (c->scale / 2 < GC_SCALE_MIN ? GC_SCALE_MIN : c->scale / 2);
+   else
+      c->scale = (c->scale * 2 > GC_SCALE_MAX ? GC_SCALE_MAX : c->scale * 2);
+
+   if (c->pass_freed > 0)
+      Debug(DEBUG_MEM, "gc: %s freed %lu, %lu bytes to the OS, next in %lus",
+            c->name, c->pass_freed, (unsigned long)c->pass_released, gc_interval(c));
+}
+
+static void gc_step(struct gc_collector *c) {
+   double t0 = gc_now_ms(), dt;
+   int more;
+
+   more = c->fn(c->arg, &c->pass_released, &c->pass_freed);
+   dt = gc_now_ms() - t0;
+
+   c->cost = c->cost * 0.75 + dt * 0.25;
+   if (dt > c->worst)
+      c->worst = dt;
+   c->steps++;
+
+   if (!more)
+      gc_pass_end(c);
+}
+
+/*
+ * Once a tick on the main loop: step through due collectors until the
+ * budget runs out. The first step always runs, so every tick makes some
+ * progress; where we stopped is where the next tick picks up.
+ */
+static void gc_tick(void *arg) {
+   struct gc_collector *c;
+   double start, budget;
+   int n, i, ran = 0;
+
+   pthread_mutex_lock(&gc_lock);
+   __atomic_store_n(&gc_level, gc_pressure(), __ATOMIC_RELAXED);
+   budget = conf_get()->gc_budget * (gc_level == 2 ? 4 : 1);
+   start = gc_now_ms();
+
+   for (n = 0; n < gc_ncollectors; n++) {
+      i = (gc_next + n) % gc_ncollectors;
+      c = &gc_collectors[i];
+
+      if (!c->busy) {
+         if (conf.now - c->last < gc_interval(c))
+            continue;
+
+         gc_pass_begin(c);
+      }
+
+      while (c->busy) {
+         if (ran && gc_now_ms() - start + c->cost > budget) {
+            gc_next = i;
+            goto out;
+         }
+
+         gc_step(c);
+         ran++;
+      }
+   }
+
+   if (gc_ncollectors > 0)
+      gc_next = (gc_next + 1) % gc_ncollectors;
+
+out:
+   if (ran > 0)
+      hist_record(&gc_pauses, (unsigned long)((gc_now_ms() - start) * 1000000.0));
+
+   if (gc_now_ms() - start > budget * 2) {
+      __atomic_store_n(&gc_overruns, gc_overruns + 1, __ATOMIC_RELAXED);
+      Debug(DEBUG_MEM, "gc: tick took %.2fms (budget %.2fms)", gc_now_ms() - start, budget);
+   }
+
+   pthread_mutex_unlock(&gc_lock);
+}
+
+size_t gc_all(void) {
+   struct gc_collector *c;
+   size_t released = 0;
+   int i;
+
+   pthread_mutex_lock(&gc_lock);
+
+   for (i = 0; i < gc_ncollectors; i++) {
+      c = &gc_collectors[i];
+
+      if (!c->busy)
+         gc_pass_begin(c);
+
+      while (c->busy)
+         gc_step(c);
+
+      released += c->pass_released;
+   }
+
+   pthread_mutex_unlock(&gc_lock);
+   return released;
+}
+
+int gc_register(const char *name, gc_step_fn fn, void *arg, double cost,
+                const char *key, time_t def) {
+   struct gc_collector *c;
+
+   pthread_mutex_lock(&gc_lock);
+
+   if (gc_ncollectors >= GC_MAX_COLLECTORS) {
+      pthread_mutex_unlock(&gc_lock);
+      Log(LOG_ERR, "gc: too many collectors, not registering %s", name);
+      return -1;
+   }
+
+   c = &gc_collectors[gc_ncollectors];
+   memset(c, 0, sizeof(*c));
+   snprintf(c->name, sizeof(c->name), "%s", name);
+   c->fn = fn;
+   c->arg = arg;
+   c->key = key;
+   c->def = def;
+   c->cost = cost;
+   c->scale = 1.0;
+   c->last = (conf.now ? conf.now : time(NULL));
+   gc_ncollectors++;
+   pthread_mutex_unlock(&gc_lock);
+
+   return 0;
+}
+
+static int gc_heap_step(void *arg, size_t *released, unsigned long *freed) {
+   size_t before = *released;
+   int more;
+
+   // Whole blocks first, then free pages inside the ones still in use
+   if (!(more = blockheap_collect((BlockHeap *)arg, GC_HEAP_STEP, released)))
+      more = blockheap_trim((BlockHeap *)arg, GC_HEAP_STEP, released);
+
+   if (*released > before)
+      (*freed)++;
+
+   return more;
+}
+
+// tuning.heap.release: how trimmed pages go back (off, dontneed, free)
+static void gc_release_set(const char *mode) {
+   if (strcasecmp(mode, "off") == 0 || strcasecmp(mode, "false") == 0)
+      blockheap_set_release(BH_RELEASE_OFF);
+   else if (strcasecmp(mode, "free") == 0)
+      blockheap_set_release(BH_RELEASE_FREE);
+   else
+      blockheap_set_release(BH_RELEASE_DONTNEED);
+}
+
+static void gc_release_changed(const char *key, const struct conf_val *oldv,
+                               const struct conf_val *newv, void *arg) {
+   gc_release_set(newv ? newv->str : "dontneed");
+}
+
+int gc_register_heap(BlockHeap *bh, const char *key, time_t def) {
+   char name[32];
+
+   if (bh == NULL)
+      return -1;
+
+   snprintf(name, sizeof(name), "heap:%.26s", bh->name);
+   return gc_register(name, gc_heap_step, bh, 0.05, key, def);
+}
+
+// Resident set size in bytes
+static size_t gc_rss(void) {
+   FILE *fp;
+   unsigned long size = 0, resident = 0;
+
+   if ((fp = fopen("/proc/self/statm", "r"))) {
+      if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+         resident = 0;
+      fclose(fp);
+   }
+
+   return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Hand free()d memory at the top of the heap and in arenas back to the OS
+static int gc_libc_step(void *arg, size_t *released, unsigned long *freed) {
+   size_t before = gc_rss(), after;
+
+   malloc_trim(0);
+
+   if ((after = gc_rss()) < before) {
+      *released += before - after;
+      (*freed)++;
+   }
+
+   return 0;
+}
+
+static int gc_api_step(void *arg, size_t *released, unsigned long *freed) {
+   *freed += api_gc();
+   return 0;
+}
+
+static int gc_ebr_step(void *arg, size_t *released, unsigned long *freed) {
+   int n = ebr_gc();
+
+   // Garbage still waiting for the epoch to move on counts as found, too
+   *freed += (n > 0 ? n : ebr_pending() > 0);
+   return 0;
+}
+
+void gc_dump(void) {
+   struct gc_collector *c;
+   int i;
+
+   pthread_mutex_lock(&gc_lock);
+   Log(LOG_SHELL, "%d collectors, %lu bytes returned to the OS, %lu ticks over budget, pressure %d",
+       gc_ncollectors, (unsigned long)gc_released, gc_overruns, gc_level);
+
+   for (i = 0; i < gc_ncollectors; i++) {
+      c = &gc_collectors[i];
+      Log(LOG_SHELL, "  %-24s every %5lus  passes %lu  steps %lu  %.3fms/step (worst %.3fms)  %lu bytes%s",
+          c->name, gc_interval(c), c->passes, c->steps, c->cost, c->worst,
+          (unsigned long)c->released, (c->busy ? "  (in pass)" : ""));
+   }
+
+   pthread_mutex_unlock(&gc_lock);
+}
+
+// Lock-free, for exporters
+void gc_totals(struct gc_totals *t) {
+   t->released = __atomic_load_n(&gc_released, __ATOMIC_RELAXED);
+   t->overruns = __atomic_load_n(&gc_overruns, __ATOMIC_RELAXED);
+   t->level = __atomic_load_n(&gc_level, __ATOMIC_RELAXED);
+   t->pauses = &gc_pauses;
+}
+
+void gc_init(void) {
+   gc_register("api", gc_api_step, NULL, 0.01, "tuning.timer.global_gc", 60);
+   gc_register("ebr", gc_ebr_step, NULL, 0.1, "tuning.timer.global_gc", 60);
+   gc_register_heap(dlink_node_heap, "tuning.timer.blockheap_gc", 60);
+   gc_release_set(dconf_get_str("tuning.heap.release", "dontneed"));
+   conf_watch("tuning.heap.release", gc_release_changed, NULL);
+   gc_register("libc", gc_libc_step, NULL, 0.5, "tuning.timer.global_gc", 60);
+
+   cron_add("gc", gc_tick, NULL, 1, 0, 0);
 }
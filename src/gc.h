@@ -13,10 +13,52 @@
  *
  * src/gc.h
  *	garbage collector
+ *
+ *	Subsystems register collectors; a coordinator on the main loop runs
+ * them a step at a time, within tuning.gc.budget milliseconds per tick,
+ * so a big collection never holds up FUSE replies for long. How often a
+ * collector gets a full pass adapts: passes that find nothing back off
+ * (up to GC_SCALE_MAX times its interval), passes that free memory, or
+ * heaps growing meanwhile, bring it closer (down to GC_SCALE_MIN). Below
+ * the free memory watermarks (tuning.gc.high_water/low_water, percent
+ * of RAM available) everything runs 2x/4x as often with a 4x budget.
  */
 #if	!defined(__GC_H)
 #define	__GC_H
+#include <stddef.h>
+#include <lsd/balloc.h>
+#include <lsd/hist.h>
+
+#define	GC_MAX_COLLECTORS	32
+#define	GC_HEAP_STEP		4	// blocks unmapped per step
+#define	GC_SCALE_MIN		0.25
+#define	GC_SCALE_MAX		4.0
+
+struct gc_totals {
+   size_t      released;		// bytes returned to the OS, ever
+   unsigned long overruns;		// ticks that took over twice their budget
+   int         level;			// memory pressure (0-2)
+   const hist *pauses;			// ns spent per tick (live, read with care)
+};
+
+/*
+ * Do one bounded piece of work. Add bytes given back to the OS to
+ * *released and objects freed to *freed (this drives the adaptation);
+ * return 1 if there is more to do in this pass, 0 when done.
+ */
+typedef int (*gc_step_fn)(void *arg, size_t *released, unsigned long *freed);
+
+// Register a collector whose base interval is config key (a time, default def).
+// cost is a first guess of the ms one step takes, it's measured from then on
+extern int gc_register(const char *name, gc_step_fn fn, void *arg, double cost,
+                       const char *key, time_t def);
+extern int gc_register_heap(BlockHeap *bh, const char *key, time_t def);
 
-extern int gc_all(void);
+extern void gc_init(void);
+// Run every collector to completion right now, returns bytes released
+extern size_t gc_all(void);
+// Print collector statistics on the shell
+extern void gc_dump(void);
+extern void gc_totals(struct gc_totals *t);
 
 #endif	// !defined(__GC_H)
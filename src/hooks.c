@@ -9,8 +9,18 @@
 #include "hooks.h"
 #include "shell.h"
 
-/* Be gentle with this, it can and will explode if you touch it wrong */
-static dict *hooks = NULL;
+/*
+ * Be gentle with this, it can and will explode if you touch it wrong
+ *	Hooks are looked up from any thread, so they live in a cdict:
+ * lookups don't lock and a Hook stays valid until the caller's next
+ * quiescent point after hook_destroy().
+ */
+static cdict *hooks = NULL;
+static pthread_once_t hooks_once = PTHREAD_ONCE_INIT;
+
+static void hooks_init(void) {
+   hooks = cdict_new(0);
+}
 
 Hook *hook_find(const char *name) {
    Hook *hp = NULL;
@@ -18,8 +28,10 @@ Hook *hook_find(const char *name) {
    if (!name)
       return NULL;
 
+   pthread_once(&hooks_once, hooks_init);
+
    /* Query for hook pointer */
-   hp = (Hook *)dict_get_blob(hooks, name, NULL);
+   hp = (Hook *)cdict_get_blob(hooks, name, NULL);
 
    return hp;
 }
@@ -35,13 +47,15 @@ int hook_destroy(const char *name) {
    Hook *hp;
    int rv = 0;
 
-   if ((hp = hook_find(name)))
+   if (!(hp = hook_find(name)))
       return EFAULT;
 
    /* Cleanup dependants and allocated memory */
    hook_destroy_children(hp);
-   dict_del(hooks, name);
-   mem_free(hp);
+   cdict_del(hooks, name);
+   /* Someone may be calling it right now */
+   ebr_retire(hp->name, NULL);
+   ebr_retire(hp, NULL);
    return rv;
 }
 
@@ -60,7 +74,7 @@ Hook *hook_add(const char *name, int flags, HookFunc *func) {
    }
 
    if (tmp != NULL)
-      dict_add_blob(hooks, name, (void *)tmp);
+      cdict_add_blob(hooks, name, tmp);
    else
       Log(LOG_EMERG, "Failed registering hook %s");
 
@@ -0,0 +1,941 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a BSD license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/libfspkg.c:
+ *	LD_PRELOAD library: answer lookups from the shared index
+ */
+/*
+ * Here we provide a mechanism for using LD_PRELOAD to inject
+ * support for jailfs into unmodified programs.
+ *
+ * This was kind of abandoned when we rewrote jailfs for ##ProductnameSanitized##...
+ *
+ * I personally always preferred this to the overhead of FUSE...
+ *
+ * jailfs (preload.index=true) publishes its path index in shared memory
+ * (see src/vfs-shm.h); $JAILFS_INDEX names it. For paths under the mount
+ * ($JAILFS_ROOT, default path.mountpoint) we answer stat(), lstat(),
+ * readlink(), access() and opendir()/readdir() from the index ourselves,
+ * and read-only open()/fopen() of files jailfs has already extracted go
+ * straight to the file in the cache, so reading them never goes near
+ * FUSE either. Anything we can't answer (not in the index, not
+ * extracted yet, opened for writing, relative paths, ...) is passed on
+ * to the real call, and FUSE (which serves the same index) answers it.
+ *
+ * With preload.negative on, a path the index doesn't have is ENOENT
+ * without asking FUSE, but only below a top level directory the index
+ * has and the mount really serves: with JAILFS_ROOT=/ (the jail) /proc,
+ * /dev and other mounts on top aren't ours to deny. For the same reason
+ * the root's own listing is always the real one.
+ *
+ * Not covered (these still go through FUSE): statx(), fstatat() and
+ * friends, and dirfd() on a directory we opened.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#define	VFS_SHM_CLIENT
+#include "vfs-shm.h"
+
+// Only used when libc has no stat() of its own (glibc < 2.33 on x86_64)
+#if	!defined(_STAT_VER)
+#define	_STAT_VER	1
+#endif
+
+#define	PKG_REAL	-2		// not ours: make the real call
+#define	PKG_ROOT	-3		// the mountpoint itself
+#define	PKG_FDS		1024		// fstat() knows files opened below this fd
+#define	PKG_DIR_MAGIC	0x726964676b70666aUL
+#define	PKG_MAX_LINKS	40
+#define	PKG_OWNED	256		// top level directories negative answers can cover
+
+struct file_op {
+   /*
+    * file ops
+    */
+   int         (*open) (const char *pathname, int flags, ...);
+   int         (*open64) (const char *pathname, int flags, ...);
+   int         (*openat) (int dirfd, const char *pathname, int flags, ...);
+   int         (*openat64) (int dirfd, const char *pathname, int flags, ...);
+   FILE       *(*fopen) (const char *pathname, const char *mode);
+   FILE       *(*fopen64) (const char *pathname, const char *mode);
+               ssize_t(*readlink) (const char *path, char *buf, size_t bufsiz);
+
+   /*
+    * access ops
+    */
+   int         (*access) (const char *pathname, int mode);
+   int         (*stat) (const char *path, struct stat *buf);
+   int         (*stat64) (const char *path, struct stat64 *buf);
+   int         (*lstat) (const char *path, struct stat *buf);
+   int         (*lstat64) (const char *path, struct stat64 *buf);
+   int         (*fstat) (int fd, struct stat *buf);
+   int         (*fstat64) (int fd, struct stat64 *buf);
+   int         (*xstat) (int ver, const char *path, struct stat *buf);
+   int         (*xstat64) (int ver, const char *path, struct stat64 *buf);
+   int         (*lxstat) (int ver, const char *path, struct stat *buf);
+   int         (*lxstat64) (int ver, const char *path, struct stat64 *buf);
+   int         (*fxstat) (int ver, int fd, struct stat *buf);
+   int         (*fxstat64) (int ver, int fd, struct stat64 *buf);
+
+   /*
+    * directory ops
+    */
+   DIR        *(*opendir) (const char *name);
+   struct dirent *(*readdir) (DIR * dirp);
+   struct dirent64 *(*readdir64) (DIR * dirp);
+   int         (*closedir) (DIR * dirp);
+   void        (*rewinddir) (DIR * dirp);
+   long        (*telldir) (DIR * dirp);
+   void        (*seekdir) (DIR * dirp, long pos);
+   int         (*dirfd) (DIR * dirp);
+};
+
+struct file_op real_ops;
+
+// A directory we opened: its listing, copied out of the index
+struct pkg_dir {
+   u_int64_t   magic;			// PKG_DIR_MAGIC, where a real DIR has its fd
+   u_int32_t   n, pos;
+   struct dirent de;
+   struct dirent64 de64;
+   struct {
+      u_int64_t ino;
+      u_int32_t name;			// offset into names
+      u_int8_t  type;
+   }          *ent;
+   char       *names;
+};
+
+// A file we opened in the cache: what fstat() should say about it
+struct pkg_fd {
+   dev_t       dev;			// the cache file
+   ino_t       ino;
+   struct vfs_shm_entry e;
+};
+
+// Held shared for every lookup, exclusive to swap in a new index
+static pthread_rwlock_t pkg_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct vfs_shm_header *pkg_idx = NULL;
+static char pkg_shm[NAME_MAX];
+static char pkg_root[PATH_MAX];
+static size_t pkg_rootlen = 0;
+static dev_t pkg_dev = 0;
+static u_int8_t pkg_owned[PKG_OWNED];	// root children the mount serves (preload.negative)
+static time_t pkg_retry = 0;
+static struct pkg_fd pkg_fds[PKG_FDS];
+
+#define FAIL	{ \
+        fprintf(stderr, "%s:%d:%s failed loading real symbol", __FILE__, __LINE__, __FUNCTION__); \
+        abort(); \
+}
+static void _init_lib(void) {
+   // RTLD_NEXT: RTLD_DEFAULT would find us
+   if (!(real_ops.open = dlsym(RTLD_NEXT, "open")))
+      FAIL;
+   if (!(real_ops.open64 = dlsym(RTLD_NEXT, "open64")))
+      FAIL;
+   if (!(real_ops.openat = dlsym(RTLD_NEXT, "openat")))
+      FAIL;
+   if (!(real_ops.openat64 = dlsym(RTLD_NEXT, "openat64")))
+      FAIL;
+   if (!(real_ops.fopen = dlsym(RTLD_NEXT, "fopen")))
+      FAIL;
+   if (!(real_ops.fopen64 = dlsym(RTLD_NEXT, "fopen64")))
+      FAIL;
+   if (!(real_ops.readlink = dlsym(RTLD_NEXT, "readlink")))
+      FAIL;
+   if (!(real_ops.access = dlsym(RTLD_NEXT, "access")))
+      FAIL;
+   if (!(real_ops.opendir = dlsym(RTLD_NEXT, "opendir")))
+      FAIL;
+   if (!(real_ops.readdir = dlsym(RTLD_NEXT, "readdir")))
+      FAIL;
+   if (!(real_ops.readdir64 = dlsym(RTLD_NEXT, "readdir64")))
+      FAIL;
+   if (!(real_ops.closedir = dlsym(RTLD_NEXT, "closedir")))
+      FAIL;
+   if (!(real_ops.rewinddir = dlsym(RTLD_NEXT, "rewinddir")))
+      FAIL;
+   if (!(real_ops.telldir = dlsym(RTLD_NEXT, "telldir")))
+      FAIL;
+   if (!(real_ops.seekdir = dlsym(RTLD_NEXT, "seekdir")))
+      FAIL;
+   if (!(real_ops.dirfd = dlsym(RTLD_NEXT, "dirfd")))
+      FAIL;
+
+   // Older libcs only have the __xstat() family, newer ones only stat() and friends
+   real_ops.stat = dlsym(RTLD_NEXT, "stat");
+   real_ops.stat64 = dlsym(RTLD_NEXT, "stat64");
+   real_ops.lstat = dlsym(RTLD_NEXT, "lstat");
+   real_ops.lstat64 = dlsym(RTLD_NEXT, "lstat64");
+   real_ops.fstat = dlsym(RTLD_NEXT, "fstat");
+   real_ops.fstat64 = dlsym(RTLD_NEXT, "fstat64");
+   real_ops.xstat = dlsym(RTLD_NEXT, "__xstat");
+   real_ops.xstat64 = dlsym(RTLD_NEXT, "__xstat64");
+   real_ops.lxstat = dlsym(RTLD_NEXT, "__lxstat");
+   real_ops.lxstat64 = dlsym(RTLD_NEXT, "__lxstat64");
+   real_ops.fxstat = dlsym(RTLD_NEXT, "__fxstat");
+   real_ops.fxstat64 = dlsym(RTLD_NEXT, "__fxstat64");
+
+   if (!(real_ops.stat || real_ops.xstat) || !(real_ops.stat64 || real_ops.xstat64) ||
+       !(real_ops.lstat || real_ops.lxstat) || !(real_ops.lstat64 || real_ops.lxstat64) ||
+       !(real_ops.fstat || real_ops.fxstat) || !(real_ops.fstat64 || real_ops.fxstat64))
+      FAIL;
+}
+
+//
+// The real calls, whichever way libc spells them
+//
+static int real_stat(int ver, const char *path, struct stat *sb) {
+   return (real_ops.stat ? real_ops.stat(path, sb) : real_ops.xstat(ver, path, sb));
+}
+
+static int real_stat64(int ver, const char *path, struct stat64 *sb) {
+   return (real_ops.stat64 ? real_ops.stat64(path, sb) : real_ops.xstat64(ver, path, sb));
+}
+
+static int real_lstat(int ver, const char *path, struct stat *sb) {
+   return (real_ops.lstat ? real_ops.lstat(path, sb) : real_ops.lxstat(ver, path, sb));
+}
+
+static int real_lstat64(int ver, const char *path, struct stat64 *sb) {
+   return (real_ops.lstat64 ? real_ops.lstat64(path, sb) : real_ops.lxstat64(ver, path, sb));
+}
+
+static int real_fstat(int ver, int fd, struct stat *sb) {
+   return (real_ops.fstat ? real_ops.fstat(fd, sb) : real_ops.fxstat(ver, fd, sb));
+}
+
+static int real_fstat64(int ver, int fd, struct stat64 *sb) {
+   return (real_ops.fstat64 ? real_ops.fstat64(fd, sb) : real_ops.fxstat64(ver, fd, sb));
+}
+
+////////////////
+// the index //
+////////////////
+// Called with pkg_lock held exclusive
+static void pkg_map(void) {
+   const struct vfs_shm_entry *e;
+   struct vfs_shm_header *h;
+   const char *root;
+   char path[PATH_MAX];
+   struct stat sb;
+   u_int32_t i;
+   int fd;
+
+   if (pkg_idx != NULL) {
+      munmap(pkg_idx, pkg_idx->size);
+      pkg_idx = NULL;
+   }
+
+   if ((fd = shm_open(pkg_shm, O_RDONLY | O_CLOEXEC, 0)) < 0) {
+      pkg_retry = time(NULL) + 1;
+      return;
+   }
+
+   if (real_fstat(_STAT_VER, fd, &sb) != 0 || sb.st_size < (off_t)sizeof(*h) ||
+       (h = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+      close(fd);
+      pkg_retry = time(NULL) + 1;
+      return;
+   }
+
+   close(fd);
+
+   if (memcmp(h->magic, VFS_SHM_MAGIC, sizeof(h->magic)) != 0 || h->version != VFS_SHM_VERSION ||
+       h->size != (u_int64_t)sb.st_size || h->nbuckets == 0) {
+      munmap(h, sb.st_size);
+      pkg_retry = time(NULL) + 1;
+      return;
+   }
+
+   if ((root = getenv(VFS_SHM_ENV_ROOT)) == NULL)
+      root = h->root;
+
+   snprintf(pkg_root, sizeof(pkg_root), "%s", root);
+
+   for (pkg_rootlen = strlen(pkg_root); pkg_rootlen > 0 && pkg_root[pkg_rootlen - 1] == '/'; pkg_rootlen--)
+      pkg_root[pkg_rootlen - 1] = '\0';
+
+   // What FUSE would say st_dev is
+   pkg_dev = (real_stat(_STAT_VER, (pkg_rootlen ? pkg_root : "/"), &sb) == 0 ? sb.st_dev : 0);
+
+   // Which of the index's top level directories aren't covered up by another mount
+   memset(pkg_owned, 0, sizeof(pkg_owned));
+   e = VFS_SHM_ENTRIES(h);
+
+   for (i = 0; (h->flags & VFS_SHM_NEGATIVE) && pkg_dev != 0 && i < h->root_count && i < PKG_OWNED; i++) {
+      if (!S_ISDIR(e[h->root_first + i].mode) ||
+          snprintf(path, sizeof(path), "%s/%s", pkg_root, VFS_SHM_STRINGS(h) + e[h->root_first + i].name) >= (int)sizeof(path))
+         continue;
+
+      pkg_owned[i] = (real_lstat(_STAT_VER, path, &sb) == 0 && S_ISDIR(sb.st_mode) && sb.st_dev == pkg_dev);
+   }
+
+   pkg_idx = h;
+}
+
+// The current index, with pkg_lock held shared (pkg_put() it), or NULL
+static struct vfs_shm_header *pkg_get(void) {
+   struct vfs_shm_header *h;
+
+   if (pkg_shm[0] == '\0')
+      return NULL;
+
+   pthread_rwlock_rdlock(&pkg_lock);
+
+   if ((h = pkg_idx) != NULL && !__atomic_load_n(&h->stale, __ATOMIC_ACQUIRE))
+      return h;
+
+   pthread_rwlock_unlock(&pkg_lock);
+
+   // jailfs isn't there (yet, or any more): don't go looking on every call
+   if (h == NULL && time(NULL) < __atomic_load_n(&pkg_retry, __ATOMIC_RELAXED))
+      return NULL;
+
+   pthread_rwlock_wrlock(&pkg_lock);
+
+   if (pkg_idx == NULL || __atomic_load_n(&pkg_idx->stale, __ATOMIC_ACQUIRE))
+      pkg_map();
+
+   pthread_rwlock_unlock(&pkg_lock);
+   pthread_rwlock_rdlock(&pkg_lock);
+
+   if ((h = pkg_idx) != NULL && !__atomic_load_n(&h->stale, __ATOMIC_ACQUIRE))
+      return h;
+
+   pthread_rwlock_unlock(&pkg_lock);
+   return NULL;
+}
+
+static void pkg_put(void) {
+   pthread_rwlock_unlock(&pkg_lock);
+}
+
+// cur (clen bytes) isn't in the index: gone, or somebody else's to answer?
+static long pkg_miss(const struct vfs_shm_header *h, const char *cur, size_t clen) {
+   const char *slash;
+   long top;
+
+   if (!(h->flags & VFS_SHM_NEGATIVE))
+      return PKG_REAL;
+
+   // Only below a top level directory of ours: the root itself has other mounts on it
+   if ((slash = memchr(cur, '/', clen)) == NULL || (top = vfs_shm_find(h, cur, slash - cur)) < 0 ||
+       top < (long)h->root_first || top - h->root_first >= PKG_OWNED || !pkg_owned[top - h->root_first])
+      return PKG_REAL;
+
+   errno = ENOENT;
+   return -1;
+}
+
+// Step back from cur to its parent
+static long pkg_parent(const struct vfs_shm_header *h, const char *cur, size_t *clen) {
+   while (*clen > 0 && cur[*clen - 1] != '/')
+      (*clen)--;
+
+   if (*clen > 0)
+      (*clen)--;
+
+   return (*clen ? vfs_shm_find(h, cur, *clen) : PKG_ROOT);
+}
+
+//
+// Resolve an absolute path under the mount like the kernel would: the
+// index entry, PKG_ROOT, PKG_REAL or -1 (errno set). follow: does a
+// symlink at the end count?
+//
+static long pkg_resolve(const struct vfs_shm_header *h, const char *path, int follow) {
+   const struct vfs_shm_entry *e = VFS_SHM_ENTRIES(h);
+   const char *str = VFS_SHM_STRINGS(h), *p, *next, *target;
+   char cur[PATH_MAX], work[PATH_MAX], tmp[PATH_MAX];
+   size_t clen = 0, len;
+   long idx = PKG_ROOT;
+   int links = 0, slash, trail = 0;
+
+   if (path == NULL || path[0] != '/' || strncmp(path, pkg_root, pkg_rootlen) != 0 ||
+       (path[pkg_rootlen] != '/' && path[pkg_rootlen] != '\0'))
+      return PKG_REAL;
+
+   if (snprintf(work, sizeof(work), "%s", path + pkg_rootlen) >= (int)sizeof(work))
+      return PKG_REAL;
+
+   for (p = work; ; p = next) {
+      while (*p == '/')
+         p++;
+
+      if (*p == '\0')
+         break;
+
+      for (len = 0; p[len] != '\0' && p[len] != '/'; len++)
+         ;
+
+      next = p + len;
+      slash = (*next == '/');
+
+      while (*next == '/')
+         next++;
+
+      trail = (slash && *next == '\0');
+
+      if (len == 1 && p[0] == '.')
+         continue;
+
+      if (len == 2 && p[0] == '.' && p[1] == '.') {
+         if ((idx = pkg_parent(h, cur, &clen)) == -1)
+            return PKG_REAL;
+
+         continue;
+      }
+
+      // ENOTDIR and friends: let the kernel say so
+      if ((idx >= 0 && !S_ISDIR(e[idx].mode)) || clen + len + 2 > sizeof(cur))
+         return PKG_REAL;
+
+      if (clen > 0)
+         cur[clen++] = '/';
+
+      memcpy(cur + clen, p, len);
+      clen += len;
+
+      if ((idx = vfs_shm_find(h, cur, clen)) < 0)
+         return pkg_miss(h, cur, clen);
+
+      // "link/" follows, lstat("link") doesn't
+      if (!S_ISLNK(e[idx].mode) || (*next == '\0' && !slash && !follow))
+         continue;
+
+      if (++links > PKG_MAX_LINKS || e[idx].link == 0)
+         return PKG_REAL;
+
+      // Start over from the link's target, with whatever was left after it
+      target = str + e[idx].link;
+
+      if (target[0] == '/') {
+         // Absolute to whoever is asking, so it has to lead back under the mount
+         if (strncmp(target, pkg_root, pkg_rootlen) != 0 ||
+             (target[pkg_rootlen] != '/' && target[pkg_rootlen] != '\0'))
+            return PKG_REAL;
+
+         target += pkg_rootlen;
+         clen = 0;
+         idx = PKG_ROOT;
+      } else if ((idx = pkg_parent(h, cur, &clen)) == -1)
+         return PKG_REAL;
+
+      if (snprintf(tmp, sizeof(tmp), "%s%s%s", target, (*next || slash ? "/" : ""), next) >= (int)sizeof(tmp))
+         return PKG_REAL;
+
+      memcpy(work, tmp, strlen(tmp) + 1);
+      next = work;
+   }
+
+   // "file/" is ENOTDIR
+   if (trail && idx >= 0 && !S_ISDIR(e[idx].mode))
+      return PKG_REAL;
+
+   return idx;
+}
+
+// Copy out what stat() needs: 0, PKG_REAL or -1 (errno set)
+static int pkg_lookup(const char *path, int follow, struct vfs_shm_entry *out) {
+   struct vfs_shm_header *h;
+   long idx;
+
+   if ((h = pkg_get()) == NULL)
+      return PKG_REAL;
+
+   if ((idx = pkg_resolve(h, path, follow)) >= 0)
+      *out = VFS_SHM_ENTRIES(h)[idx];
+
+   pkg_put();
+   return (idx >= 0 ? 0 : (idx == PKG_ROOT ? PKG_REAL : (int)idx));
+}
+
+#define	PKG_FILL_STAT(sb, e) do { \
+   memset((sb), 0, sizeof(*(sb))); \
+   (sb)->st_dev = pkg_dev; \
+   (sb)->st_ino = (e)->ino; \
+   (sb)->st_mode = (e)->mode; \
+   (sb)->st_nlink = (S_ISDIR((e)->mode) ? 2 : 1); \
+   (sb)->st_uid = (e)->uid; \
+   (sb)->st_gid = (e)->gid; \
+   (sb)->st_size = (e)->size; \
+   (sb)->st_blksize = 4096; \
+   (sb)->st_blocks = ((e)->size + 511) / 512; \
+   (sb)->st_atime = (sb)->st_mtime = (sb)->st_ctime = (e)->mtime; \
+} while (0)
+
+#define	PKG_STAT(path, follow, sb, fallback) do { \
+   struct vfs_shm_entry e; \
+   int r; \
+   if ((r = pkg_lookup((path), (follow), &e)) == PKG_REAL) \
+      return (fallback); \
+   if (r == 0) \
+      PKG_FILL_STAT((sb), &e); \
+   return r; \
+} while (0)
+
+// The file was opened from the cache: make fstat() agree with stat()
+#define	PKG_FSTAT(fd, sb, r) do { \
+   if ((r) == 0 && (fd) >= 0 && (fd) < PKG_FDS && pkg_fds[(fd)].ino != 0 && \
+       pkg_fds[(fd)].ino == (sb)->st_ino && pkg_fds[(fd)].dev == (sb)->st_dev) \
+      PKG_FILL_STAT((sb), &pkg_fds[(fd)].e); \
+} while (0)
+
+// Would the kernel let us read this?
+static int pkg_readable(const struct vfs_shm_entry *e) {
+   uid_t uid = geteuid();
+
+   if (uid == 0)
+      return 1;
+
+   if (uid == e->uid)
+      return (e->mode & S_IRUSR);
+
+   return (getegid() == e->gid ? (e->mode & S_IRGRP) : (e->mode & S_IROTH));
+}
+
+//
+// open() read-only: the file in the cache, if it's been extracted.
+// Returns the fd, -1 (errno set) or PKG_REAL
+//
+static int pkg_open(const char *path, int flags) {
+   struct vfs_shm_header *h;
+   struct vfs_shm_entry e;
+   char cache[PATH_MAX];
+   struct stat sb;
+   long idx;
+   int fd, err = errno;
+
+   if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC | O_DIRECTORY | O_PATH)))
+      return PKG_REAL;
+
+   if ((h = pkg_get()) == NULL)
+      return PKG_REAL;
+
+   if ((idx = pkg_resolve(h, path, !(flags & O_NOFOLLOW))) < 0) {
+      pkg_put();
+      return (idx == PKG_ROOT ? PKG_REAL : (int)idx);
+   }
+
+   e = VFS_SHM_ENTRIES(h)[idx];
+   e.flags = __atomic_load_n(&VFS_SHM_ENTRIES(h)[idx].flags, __ATOMIC_ACQUIRE);
+   snprintf(cache, sizeof(cache), "%s/%u-%016lx", h->cache, e.pkgid, (unsigned long)e.cache_hash);
+   pkg_put();
+
+   // Not extracted yet: the real open() goes to FUSE
+   if (!S_ISREG(e.mode) || !(e.flags & VFS_SHM_CACHED) || !pkg_readable(&e))
+      return PKG_REAL;
+
+   if ((fd = real_ops.open(cache, flags & ~O_NOFOLLOW)) < 0) {
+      errno = err;
+      return PKG_REAL;
+   }
+
+   if (fd < PKG_FDS) {
+      if (real_fstat(_STAT_VER, fd, &sb) == 0) {
+         pkg_fds[fd].dev = sb.st_dev;
+         pkg_fds[fd].ino = sb.st_ino;
+         pkg_fds[fd].e = e;
+      } else
+         pkg_fds[fd].ino = 0;
+   }
+
+   return fd;
+}
+
+//
+// Below we dispatch to the appropriate (real or virtual) vfs op
+//
+#define	PKG_OPEN_MODE(flags, mode) do { \
+   va_list ap; \
+   if ((flags) & (O_CREAT | O_TMPFILE)) { \
+      va_start(ap, flags); \
+      (mode) = va_arg(ap, int); \
+      va_end(ap); \
+   } \
+} while (0)
+
+int open(const char *pathname, int flags, ...) {
+   mode_t mode = 0;
+   int fd;
+
+   PKG_OPEN_MODE(flags, mode);
+
+   if ((fd = pkg_open(pathname, flags)) != PKG_REAL)
+      return fd;
+
+   return real_ops.open(pathname, flags, mode);
+}
+
+int open64(const char *pathname, int flags, ...) {
+   mode_t mode = 0;
+   int fd;
+
+   PKG_OPEN_MODE(flags, mode);
+
+   if ((fd = pkg_open(pathname, flags)) != PKG_REAL)
+      return fd;
+
+   return real_ops.open64(pathname, flags, mode);
+}
+
+int openat(int dirfd, const char *pathname, int flags, ...) {
+   mode_t mode = 0;
+   int fd;
+
+   PKG_OPEN_MODE(flags, mode);
+
+   // Relative to dirfd: can't tell where that is
+   if (pathname[0] == '/' && (fd = pkg_open(pathname, flags)) != PKG_REAL)
+      return fd;
+
+   return real_ops.openat(dirfd, pathname, flags, mode);
+}
+
+int openat64(int dirfd, const char *pathname, int flags, ...) {
+   mode_t mode = 0;
+   int fd;
+
+   PKG_OPEN_MODE(flags, mode);
+
+   // Relative to dirfd: can't tell where that is
+   if (pathname[0] == '/' && (fd = pkg_open(pathname, flags)) != PKG_REAL)
+      return fd;
+
+   return real_ops.openat64(dirfd, pathname, flags, mode);
+}
+
+// libc's fopen() doesn't come through our open()
+static FILE *pkg_fopen(const char *pathname, const char *mode, FILE *(*fallback)(const char *, const char *)) {
+   FILE *fp;
+   int fd;
+
+   if (mode[0] != 'r' || strchr(mode, '+') != NULL ||
+       (fd = pkg_open(pathname, O_RDONLY | (strchr(mode, 'e') ? O_CLOEXEC : 0))) == PKG_REAL)
+      return fallback(pathname, mode);
+
+   if (fd < 0)
+      return NULL;
+
+   if ((fp = fdopen(fd, mode)) == NULL)
+      close(fd);
+
+   return fp;
+}
+
+FILE *fopen(const char *pathname, const char *mode) {
+   return pkg_fopen(pathname, mode, real_ops.fopen);
+}
+
+FILE *fopen64(const char *pathname, const char *mode) {
+   return pkg_fopen(pathname, mode, real_ops.fopen64);
+}
+
+ssize_t readlink(const char *path, char *buf, size_t bufsiz) {
+   struct vfs_shm_header *h;
+   const struct vfs_shm_entry *e;
+   size_t len;
+   long idx;
+
+   if ((h = pkg_get()) == NULL)
+      return real_ops.readlink(path, buf, bufsiz);
+
+   if ((idx = pkg_resolve(h, path, 0)) == PKG_REAL || idx == PKG_ROOT ||
+       (idx >= 0 && S_ISLNK(VFS_SHM_ENTRIES(h)[idx].mode) && VFS_SHM_ENTRIES(h)[idx].link == 0)) {
+      pkg_put();
+      return real_ops.readlink(path, buf, bufsiz);
+   }
+
+   if (idx < 0) {
+      pkg_put();
+      return -1;
+   }
+
+   e = &VFS_SHM_ENTRIES(h)[idx];
+
+   if (!S_ISLNK(e->mode)) {
+      pkg_put();
+      errno = EINVAL;
+      return -1;
+   }
+
+   // No terminating NUL, truncated to fit
+   if ((len = strlen(VFS_SHM_STRINGS(h) + e->link)) > bufsiz)
+      len = bufsiz;
+
+   memcpy(buf, VFS_SHM_STRINGS(h) + e->link, len);
+   pkg_put();
+   return len;
+}
+
+int access(const char *path, int mode) {
+   struct vfs_shm_entry e;
+   int r;
+
+   // Only answer what the index can't get wrong
+   if ((r = pkg_lookup(path, 1, &e)) == PKG_REAL || (r == 0 && mode != F_OK))
+      return real_ops.access(path, mode);
+
+   return r;
+}
+
+int stat(const char *path, struct stat *sb) {
+   PKG_STAT(path, 1, sb, real_stat(_STAT_VER, path, sb));
+}
+
+int stat64(const char *path, struct stat64 *sb) {
+   PKG_STAT(path, 1, sb, real_stat64(_STAT_VER, path, sb));
+}
+
+int lstat(const char *path, struct stat *sb) {
+   PKG_STAT(path, 0, sb, real_lstat(_STAT_VER, path, sb));
+}
+
+int lstat64(const char *path, struct stat64 *sb) {
+   PKG_STAT(path, 0, sb, real_lstat64(_STAT_VER, path, sb));
+}
+
+int __xstat(int ver, const char *path, struct stat *sb) {
+   PKG_STAT(path, 1, sb, (real_ops.xstat ? real_ops.xstat(ver, path, sb) : real_ops.stat(path, sb)));
+}
+
+int __xstat64(int ver, const char *path, struct stat64 *sb) {
+   PKG_STAT(path, 1, sb, (real_ops.xstat64 ? real_ops.xstat64(ver, path, sb) : real_ops.stat64(path, sb)));
+}
+
+int __lxstat(int ver, const char *path, struct stat *sb) {
+   PKG_STAT(path, 0, sb, (real_ops.lxstat ? real_ops.lxstat(ver, path, sb) : real_ops.lstat(path, sb)));
+}
+
+int __lxstat64(int ver, const char *path, struct stat64 *sb) {
+   PKG_STAT(path, 0, sb, (real_ops.lxstat64 ? real_ops.lxstat64(ver, path, sb) : real_ops.lstat64(path, sb)));
+}
+
+int fstat(int fd, struct stat *sb) {
+   int r = real_fstat(_STAT_VER, fd, sb);
+
+   PKG_FSTAT(fd, sb, r);
+   return r;
+}
+
+int fstat64(int fd, struct stat64 *sb) {
+   int r = real_fstat64(_STAT_VER, fd, sb);
+
+   PKG_FSTAT(fd, sb, r);
+   return r;
+}
+
+int __fxstat(int ver, int fd, struct stat *sb) {
+   int r = (real_ops.fxstat ? real_ops.fxstat(ver, fd, sb) : real_ops.fstat(fd, sb));
+
+   PKG_FSTAT(fd, sb, r);
+   return r;
+}
+
+int __fxstat64(int ver, int fd, struct stat64 *sb) {
+   int r = (real_ops.fxstat64 ? real_ops.fxstat64(ver, fd, sb) : real_ops.fstat64(fd, sb));
+
+   PKG_FSTAT(fd, sb, r);
+   return r;
+}
+
+/////////////////
+// directories //
+/////////////////
+static struct pkg_dir *pkg_dir(DIR *dirp) {
+   struct pkg_dir *d = (struct pkg_dir *)dirp;
+
+   return ((d != NULL && d->magic == PKG_DIR_MAGIC) ? d : NULL);
+}
+
+// Copy the listing of dir (an index entry) out: the index may be replaced while it's being read
+static struct pkg_dir *pkg_dir_open(const struct vfs_shm_header *h, long dir) {
+   const struct vfs_shm_entry *e = VFS_SHM_ENTRIES(h);
+   const char *str = VFS_SHM_STRINGS(h);
+   u_int32_t first = e[dir].first, count = e[dir].count, i, n = 0;
+   u_int64_t ino = e[dir].ino, parent = 1;
+   size_t size = sizeof(".") + sizeof("..");
+   struct pkg_dir *d;
+   char *names;
+   long p;
+
+   // Our parent's inode for ".." (name follows "parent/")
+   if ((i = e[dir].name - e[dir].path) > 0 && (p = vfs_shm_find(h, str + e[dir].path, i - 1)) >= 0)
+      parent = e[p].ino;
+
+   for (i = 0; i < count; i++)
+      size += strlen(str + e[first + i].name) + 1;
+
+   if ((d = malloc(sizeof(*d) + (count + 2) * sizeof(*d->ent) + size)) == NULL)
+      return NULL;
+
+   memset(d, 0, sizeof(*d));
+   d->magic = PKG_DIR_MAGIC;
+   d->ent = (void *)(d + 1);
+   d->names = names = (char *)(d->ent + count + 2);
+
+   d->ent[n].ino = ino;
+   d->ent[n].type = DT_DIR;
+   d->ent[n++].name = 0;
+   strcpy(names, ".");
+   size = sizeof(".");
+
+   d->ent[n].ino = parent;
+   d->ent[n].type = DT_DIR;
+   d->ent[n++].name = size;
+   strcpy(names + size, "..");
+   size += sizeof("..");
+
+   for (i = 0; i < count; i++, n++) {
+      d->ent[n].ino = e[first + i].ino;
+      d->ent[n].type = IFTODT(e[first + i].mode);
+      d->ent[n].name = size;
+      strcpy(names + size, str + e[first + i].name);
+      size += strlen(names + size) + 1;
+   }
+
+   d->n = n;
+   return d;
+}
+
+DIR        *opendir(const char *name) {
+   struct vfs_shm_header *h;
+   struct pkg_dir *d = NULL;
+   long idx;
+
+   if ((h = pkg_get()) == NULL)
+      return real_ops.opendir(name);
+
+   // The root's listing has to show whatever is mounted on it, too
+   if ((idx = pkg_resolve(h, name, 1)) == PKG_REAL || idx == PKG_ROOT) {
+      pkg_put();
+      return real_ops.opendir(name);
+   }
+
+   if (idx >= 0 && !S_ISDIR(VFS_SHM_ENTRIES(h)[idx].mode))
+      errno = ENOTDIR;
+   else if (idx >= 0)
+      d = pkg_dir_open(h, idx);
+
+   pkg_put();
+   return (DIR *)d;
+}
+
+static void pkg_dirent_fill(struct pkg_dir *d, u_int32_t i) {
+   d->de.d_ino = d->de64.d_ino = d->ent[i].ino;
+   d->de.d_off = d->de64.d_off = i + 1;
+   d->de.d_reclen = sizeof(d->de);
+   d->de64.d_reclen = sizeof(d->de64);
+   d->de.d_type = d->de64.d_type = d->ent[i].type;
+   snprintf(d->de.d_name, sizeof(d->de.d_name), "%s", d->names + d->ent[i].name);
+   memcpy(d->de64.d_name, d->de.d_name, sizeof(d->de64.d_name));
+}
+
+struct dirent *readdir(DIR * dirp) {
+   struct pkg_dir *d;
+
+   if ((d = pkg_dir(dirp)) == NULL)
+      return real_ops.readdir(dirp);
+
+   if (d->pos >= d->n)
+      return NULL;
+
+   pkg_dirent_fill(d, d->pos++);
+   return &d->de;
+}
+
+struct dirent64 *readdir64(DIR * dirp) {
+   struct pkg_dir *d;
+
+   if ((d = pkg_dir(dirp)) == NULL)
+      return real_ops.readdir64(dirp);
+
+   if (d->pos >= d->n)
+      return NULL;
+
+   pkg_dirent_fill(d, d->pos++);
+   return &d->de64;
+}
+
+int closedir(DIR * dirp) {
+   struct pkg_dir *d;
+
+   if ((d = pkg_dir(dirp)) == NULL)
+      return real_ops.closedir(dirp);
+
+   d->magic = 0;
+   free(d);
+   return 0;
+}
+
+void rewinddir(DIR * dirp) {
+   struct pkg_dir *d;
+
+   if ((d = pkg_dir(dirp)) == NULL)
+      real_ops.rewinddir(dirp);
+   else
+      d->pos = 0;
+}
+
+long telldir(DIR * dirp) {
+   struct pkg_dir *d;
+
+   if ((d = pkg_dir(dirp)) == NULL)
+      return real_ops.telldir(dirp);
+
+   return d->pos;
+}
+
+void seekdir(DIR * dirp, long pos) {
+   struct pkg_dir *d;
+
+   if ((d = pkg_dir(dirp)) == NULL)
+      real_ops.seekdir(dirp, pos);
+   else if (pos >= 0)
+      d->pos = pos;
+}
+
+// There's no fd behind our directories
+int dirfd(DIR * dirp) {
+   if (pkg_dir(dirp) == NULL)
+      return real_ops.dirfd(dirp);
+
+   errno = ENOTSUP;
+   return -1;
+}
+
+static void __attribute__((constructor)) _init(void) {
+   const char *name;
+
+   _init_lib();
+
+   // Not running under jailfs: everything goes to the real calls
+   if ((name = getenv(VFS_SHM_ENV)) != NULL && name[0] != '\0')
+      snprintf(pkg_shm, sizeof(pkg_shm), "%s%s", (name[0] == '/' ? "" : "/"), name);
+}
@@ -0,0 +1,471 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/logger.c:
+ *	Log message handling.
+ *
+ *	Log() only filters on a cached level, formats the message body
+ * into a slot of a lock-free ring and returns. The logger thread
+ * (main:logger) drains the ring, adds the timestamp/level prefix and
+ * writes whole batches with writev(). Until that thread is running
+ * (and again after log_fini()) messages are written synchronously.
+ *
+ *	If the ring fills up, messages are dropped rather than making the
+ * caller wait - we never want a FUSE reply stuck behind the log file.
+ */
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <lsd/lsd.h>
+#include "conf.h"
+#include "shell.h"
+#include "logger.h"
+#include "threads.h"
+
+struct log_levels {
+   char *str;
+   int level;
+};
+
+static struct log_levels log_levels[] = {
+   { "debug", LOG_DEBUG },
+   { "info", LOG_INFO },
+   { "notice", LOG_NOTICE },
+   { "warn", LOG_WARNING },
+   { "warning", LOG_WARNING },
+   { "error", LOG_ERR },
+   { "crit", LOG_CRIT },
+   { "alert", LOG_ALERT },
+   { "emerg", LOG_EMERG },
+   { "shell", LOG_SHELL },
+   { NULL, -1 },
+};
+
+struct debug_flags {
+   char *key;
+   unsigned int bit;
+};
+
+static struct debug_flags debug_flags[] = {
+   { "debug.db", DEBUG_DB },
+   { "debug.jail", DEBUG_JAIL },
+   { "debug.mem", DEBUG_MEM },
+   { "debug.net", DEBUG_NET },
+   { "debug.pkg", DEBUG_PKG },
+   { "debug.threads", DEBUG_THREADS },
+   { "debug.vfs", DEBUG_VFS },
+   { "debug.vfs.mime", DEBUG_VFS_MIME },
+   { "debug.cron", DEBUG_CRON },
+   { NULL, 0 },
+};
+
+// Log target
+typedef struct {
+  enum { NONE = 0, SYSLOG, STDOUT, LOGFILE, FIFO } type;
+  FILE *fp;
+} LogHndl;
+static LogHndl *mainlog;
+
+// A queued log message
+struct log_rec {
+   time_t      ts;
+   int         level;
+   int         len;
+   char        msg[LOG_REC_MAX];
+};
+
+static ring *log_ring = NULL;
+static int log_async = 0;		// logger thread is draining log_ring
+static int log_sleeping = 0;		// logger thread is waiting in poll()
+static int log_evfd = -1;		// wakes the logger thread
+int log_min_level = LOG_INFO;		// cached log.level
+unsigned int debug_mask = 0;		// cached debug.* flags
+
+// Serializes writers to the log target (the logger thread or sync callers)
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Formatted timestamp, refreshed at most once per second (log_mutex held)
+static time_t log_ts_cached = 0;
+static char log_ts_buf[64];
+
+// Convert numeric log level to string
+static inline const char *LogName(int level) {
+   struct log_levels *lp = log_levels;
+
+   do {
+      if (lp->level == level)
+         return lp->str;
+
+      lp++;
+   } while(lp->str != NULL);
+
+   return NULL;
+}
+
+// Convert string log level to integer
+static inline const int LogLevel(const char *name) {
+   struct log_levels *lp = log_levels;
+
+   if (name == NULL)
+      return -1;
+
+   do {
+      if (strcasecmp(lp->str, name) == 0)
+         return lp->level;
+      lp++;
+   } while(lp->str != NULL);
+   return -1;
+}
+
+void log_level_refresh(void) {
+   struct debug_flags *dp;
+   unsigned int mask = 0;
+   int lvl = LogLevel(conf_get()->log_level);
+
+   if (lvl < 0)
+      lvl = LOG_INFO;
+
+   for (dp = debug_flags; dp->key != NULL; dp++)
+      if (dconf_get_bool(dp->key, 0) == 1)
+         mask |= dp->bit;
+
+   __atomic_store_n(&log_min_level, lvl, __ATOMIC_RELAXED);
+   __atomic_store_n(&debug_mask, mask, __ATOMIC_RELAXED);
+}
+
+unsigned long log_dropped(void) {
+   if (log_ring == NULL)
+      return 0;
+
+   return __atomic_load_n(&log_ring->dropped, __ATOMIC_RELAXED);
+}
+
+static const char *log_timestamp(time_t t) {
+   struct tm lt;
+
+   if (t == log_ts_cached)
+      return log_ts_buf;
+
+   if (localtime_r(&t, &lt) == NULL)
+      return "0000/00/00 00:00:00";
+
+   snprintf(log_ts_buf, sizeof(log_ts_buf), "%d/%02d/%02d %02d:%02d:%02d",
+      lt.tm_year + 1900, lt.tm_mon + 1, lt.tm_mday, lt.tm_hour, lt.tm_min, lt.tm_sec);
+   log_ts_cached = t;
+
+   return log_ts_buf;
+}
+
+// writev() the whole vector, coping with short writes
+static void log_writev(int fd, struct iovec *iov, int cnt) {
+   ssize_t     rv;
+
+   while (cnt > 0) {
+      if ((rv = writev(fd, iov, cnt)) < 0) {
+         if (errno == EINTR)
+            continue;
+         return;
+      }
+
+      while (cnt > 0 && (size_t)rv >= iov->iov_len) {
+         rv -= iov->iov_len;
+         iov++;
+         cnt--;
+      }
+
+      if (cnt > 0) {
+         iov->iov_base = (char *)iov->iov_base + rv;
+         iov->iov_len -= rv;
+      }
+   }
+}
+
+// Write a batch of records to the log target. Caller holds log_mutex
+static void log_write(struct log_rec **recs, int n) {
+   struct iovec iov[LOG_BATCH * 3], echo[LOG_BATCH * 2];
+   char        pfx[LOG_BATCH][96];
+   int         i, niov = 0, necho = 0;
+   int         fd = STDOUT_FILENO;
+   int         do_echo = 0;
+   const char *name;
+
+   if (mainlog) {
+      if (mainlog->type == SYSLOG) {
+         for (i = 0; i < n; i++)
+            if (recs[i]->level <= LOG_DEBUG)
+               syslog(recs[i]->level, "%s", recs[i]->msg);
+      }
+
+      if (mainlog->type != STDOUT && mainlog->fp) {
+         fd = fileno(mainlog->fp);
+         do_echo = 1;
+      }
+   }
+
+   for (i = 0; i < n && i < LOG_BATCH; i++) {
+      name = LogName(recs[i]->level);
+      snprintf(pfx[i], sizeof(pfx[i]), "%s %5s: ", log_timestamp(recs[i]->ts), name ? name : "?");
+
+      iov[niov].iov_base = pfx[i];
+      iov[niov++].iov_len = strlen(pfx[i]);
+      iov[niov].iov_base = recs[i]->msg;
+      iov[niov++].iov_len = recs[i]->len;
+      iov[niov].iov_base = "\n";
+      iov[niov++].iov_len = 1;
+
+      // Mirror the bare message onto the console
+      if (do_echo) {
+         echo[necho].iov_base = recs[i]->msg;
+         echo[necho++].iov_len = recs[i]->len;
+         echo[necho].iov_base = "\n";
+         echo[necho++].iov_len = 1;
+      }
+   }
+
+   log_writev(fd, iov, niov);
+
+   if (necho > 0)
+      log_writev(STDOUT_FILENO, echo, necho);
+}
+
+static void log_wakeup(void) {
+   u_int64_t   one = 1;
+
+   // Pairs with the fence implied by the logger setting log_sleeping
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+   if (__atomic_load_n(&log_sleeping, __ATOMIC_RELAXED) && log_evfd >= 0) {
+      if (write(log_evfd, &one, sizeof(one)) != sizeof(one)) {
+         // The logger polls with a timeout anyways
+      }
+   }
+}
+
+void Log(int level, const char *msg, ...) {
+   va_list ap;
+   struct log_rec *rec, tmp;
+   int len;
+
+   if (!msg)
+      return;
+
+   // If log level of message is lower than minimum level, ignore it
+   if (!log_enabled(level))
+      return;
+
+   if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE)) {
+      // Ring is full, the drop is counted and reported by the logger
+      if ((rec = ring_reserve(log_ring)) == NULL)
+         return;
+   } else
+      rec = &tmp;
+
+   rec->ts = (conf.now ? conf.now : time(NULL));
+   rec->level = level;
+
+   va_start(ap, msg);
+   len = vsnprintf(rec->msg, sizeof(rec->msg), msg, ap);
+   va_end(ap);
+
+   if (len < 0)
+      len = 0;
+   else if (len >= (int)sizeof(rec->msg)) {
+      len = sizeof(rec->msg) - 1;
+      memcpy(rec->msg + len - 3, "...", 3);
+   }
+   rec->len = len;
+
+   if (rec != &tmp) {
+      ring_commit(log_ring, rec);
+      log_wakeup();
+      return;
+   }
+
+   pthread_mutex_lock(&log_mutex);
+   log_write(&rec, 1);
+   pthread_mutex_unlock(&log_mutex);
+}
+
+void log_open(const char *target) {
+   LogHndl *lh, *old;
+   int err = 0;
+
+   if (target == NULL)
+      target = "stdout";
+
+   lh = mem_alloc(sizeof(LogHndl));
+
+   if (strcasecmp(target, "syslog") == 0) {
+      lh->type = SYSLOG;
+      openlog("jailfs", LOG_NDELAY|LOG_PID, LOG_DAEMON);
+   } else if (strcasecmp(target, "stdout") == 0) {
+      lh->type = STDOUT;
+      lh->fp = stdout;
+   } else if (strncasecmp(target, "fifo://", 7) == 0) {
+      if (is_fifo(target + 7) || is_file(target + 7))
+         unlink(target + 7);
+
+      mkfifo(target+7, 0600);
+
+      if (!(lh->fp = fopen(target + 7, "w"))) {
+         err = errno;
+         lh->fp = stdout;
+      } else
+         lh->type = FIFO;
+   } else if (strncasecmp(target, "file://", 7) == 0) {
+      if (!(lh->fp = fopen(target + 7, "w+"))) {
+         err = errno;
+         lh->fp = stdout;
+      } else
+         lh->type = LOGFILE;
+   }
+
+   // Swap targets under the lock so the logger never writes to a closed file
+   pthread_mutex_lock(&log_mutex);
+   old = mainlog;
+   mainlog = lh;
+   pthread_mutex_unlock(&log_mutex);
+
+   if (old) {
+      if (old->type == LOGFILE || old->type == FIFO)
+         fclose(old->fp);
+      mem_free(old);
+   }
+
+   if (err)
+      Log(LOG_ERR, "failed opening log target '%s': %s (%d)", target, strerror(err), err);
+}
+
+void log_close(void) {
+   LogHndl *lh;
+
+   pthread_mutex_lock(&log_mutex);
+   lh = mainlog;
+   mainlog = NULL;
+   pthread_mutex_unlock(&log_mutex);
+
+   if (lh == NULL)
+      return;
+
+   if (lh->type == LOGFILE || lh->type == FIFO)
+      fclose(lh->fp);
+   else if (lh->type == SYSLOG)
+      closelog();
+
+   mem_free(lh);
+}
+
+// Write out up to LOG_BATCH pending records. Caller holds log_mutex
+static int log_drain(void) {
+   struct log_rec *batch[LOG_BATCH];
+   int n = 0;
+
+   while (n < LOG_BATCH && (batch[n] = ring_peek(log_ring, n)) != NULL)
+      n++;
+
+   if (n > 0) {
+      log_write(batch, n);
+      ring_release(log_ring, n);
+   }
+
+   return n;
+}
+
+void log_fini(void) {
+   u_int64_t one = 1;
+
+   if (log_ring == NULL || !__atomic_exchange_n(&log_async, 0, __ATOMIC_ACQ_REL))
+      return;
+
+   if (log_evfd >= 0 && write(log_evfd, &one, sizeof(one)) != sizeof(one)) {
+      // not fatal, the logger notices log_async on its next pass
+   }
+
+   // Once we hold the lock the logger thread can't be mid-batch
+   pthread_mutex_lock(&log_mutex);
+   while (log_drain() > 0)
+      ;
+   pthread_mutex_unlock(&log_mutex);
+}
+
+////////////
+// thread //
+////////////
+void *thread_logger_init(void *data) {
+   struct pollfd pfd;
+   u_int64_t   junk;
+   unsigned long dropped, last_dropped = 0;
+   int         n;
+
+   thread_entry((dict *)data);
+
+   if (!(log_ring = ring_create(sizeof(struct log_rec), dconf_get_int("tuning.log.ring", 1024)))) {
+      Log(LOG_ERR, "logger: failed allocating ring buffer, logging synchronously");
+      ebr_unregister();
+      return NULL;
+   }
+
+   if ((log_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+      Log(LOG_WARNING, "logger: eventfd: %s (%d), falling back to polling", strerror(errno), errno);
+
+   pfd.fd = log_evfd;
+   pfd.events = POLLIN;
+
+   __atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+   LogLvl(LOG_DEBUG, "logger: async writer started with %lu slots", log_ring->mask + 1);
+
+   for (;;) {
+      pthread_mutex_lock(&log_mutex);
+
+      // log_fini() took over, it will flush what's left
+      if (!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE)) {
+         pthread_mutex_unlock(&log_mutex);
+         break;
+      }
+
+      n = log_drain();
+      pthread_mutex_unlock(&log_mutex);
+
+      if ((dropped = log_dropped()) != last_dropped) {
+         Log(LOG_WARNING, "logger: ring full, dropped %lu messages", dropped - last_dropped);
+         last_dropped = dropped;
+      }
+
+      if (n > 0)
+         continue;
+
+      // Nothing to do, sleep until a producer kicks us (or timeout)
+      __atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+
+      if (ring_peek(log_ring, 0) == NULL) {
+         ebr_quiescent();
+         if (poll(&pfd, (log_evfd >= 0 ? 1 : 0), 100) > 0) {
+            if (read(log_evfd, &junk, sizeof(junk)) != sizeof(junk)) {
+               // spurious wakeup
+            }
+         }
+      }
+
+      __atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+   }
+
+   return NULL;
+}
+
+void *thread_logger_fini(void *data) {
+   log_fini();
+   log_close();
+   thread_exit((dict *)data);
+   return NULL;
+}
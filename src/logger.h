@@ -0,0 +1,85 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/logger.h:
+ *	Asynchronous log writer. Log() itself is declared in shell.h
+ *
+ *	Code on hot paths should use LogLvl()/Debug() instead of calling
+ * Log() directly: messages below CONFIG_LOG_LEVEL compile away and the
+ * rest are filtered before their arguments are evaluated.
+ */
+#if	!defined(__LOGGER_H)
+#define	__LOGGER_H
+#include "shell.h"
+
+// Least important level compiled in (see mk/config.mk)
+#if	!defined(CONFIG_LOG_LEVEL)
+#define	CONFIG_LOG_LEVEL	LOG_DEBUG
+#endif
+
+// Per-subsystem debug flags, one bit per debug.* key in the config
+#define	DEBUG_DB	0x0001		// debug.db
+#define	DEBUG_JAIL	0x0002		// debug.jail
+#define	DEBUG_MEM	0x0004		// debug.mem
+#define	DEBUG_NET	0x0008		// debug.net
+#define	DEBUG_PKG	0x0010		// debug.pkg
+#define	DEBUG_THREADS	0x0020		// debug.threads
+#define	DEBUG_VFS	0x0040		// debug.vfs
+#define	DEBUG_VFS_MIME	0x0080		// debug.vfs.mime
+#define	DEBUG_CRON	0x0100		// debug.cron
+
+// Cached copies of log.level and debug.*, see log_level_refresh()
+extern int log_min_level;
+extern unsigned int debug_mask;
+
+#define	log_enabled(level) \
+   ((level) == LOG_SHELL || ((level) <= CONFIG_LOG_LEVEL && \
+    (level) <= __atomic_load_n(&log_min_level, __ATOMIC_RELAXED)))
+
+#define	debug_enabled(sys) \
+   (LOG_DEBUG <= CONFIG_LOG_LEVEL && \
+    __builtin_expect((__atomic_load_n(&debug_mask, __ATOMIC_RELAXED) & (sys)) != 0, 0))
+
+// Log() that vanishes at compile time if level is below CONFIG_LOG_LEVEL
+#define	LogLvl(level, ...) do { \
+   if (log_enabled(level)) \
+      Log((level), __VA_ARGS__); \
+} while (0)
+
+// Debug message, only if debug.<subsystem> is enabled (and log.level allows)
+#define	Debug(sys, ...) do { \
+   if (debug_enabled(sys) && log_enabled(LOG_DEBUG)) \
+      Log(LOG_DEBUG, __VA_ARGS__); \
+} while (0)
+
+// Largest message body kept per record (as before the ring), longer
+// messages are cut short and end in "..."
+#define	LOG_REC_MAX	4096
+// Most records written by a single writev() call
+#define	LOG_BATCH	64
+
+// Re-read log.level and debug.* from the configuration into the cache
+extern void log_level_refresh(void);
+// Stop the async writer and synchronously flush anything still queued
+extern void log_fini(void);
+// Close the log target (after log_fini())
+extern void log_close(void);
+
+// Messages lost because the ring was full (reported periodically)
+extern unsigned long log_dropped(void);
+
+// logger thread
+extern void *thread_logger_init(void *data);
+extern void *thread_logger_fini(void *data);
+
+#endif	// !defined(__LOGGER_H)
@@ -19,15 +19,20 @@
 #include "threads.h"
 #include "cron.h"
 #include "shell.h"
+#include "logger.h"
 #include "debugger.h"
 #include "module.h"
 #include "i18n.h"
 #include "cell.h"
 #include "gc.h"
+#include "memstats.h"
 #include "vfs.h"
 #include "database.h"
 #include "pkg.h"
 #include "api.h"
+#include "control.h"
+#include "watchdog.h"
+#include "trace.h"
 #include "shell.h"
 BlockHeap  *main_heap;
 ThreadPool *main_threadpool;
@@ -40,19 +45,22 @@ struct ThreadCreator {
    int isolated;
 } main_threads[] = {
   // The order here is sorta significant - logger must be first and shell last!
+  { "logger", thread_logger_init, thread_logger_fini, 0 },
   { "db", thread_db_init, thread_db_fini, 0 },
   { "vfs", thread_vfs_init, thread_vfs_fini, 0 },
   { "cell", thread_cell_init, thread_cell_fini, 1 },
+  { "control", thread_control_init, thread_control_fini, 0 },
+  { "watchdog", thread_watchdog_init, thread_watchdog_fini, 0 },
   { "shell", thread_shell_init, thread_shell_fini, 1 },
   { NULL, NULL, NULL }
 };
 
 // Called on exit to cleanup..
 void goodbye(void) {
-   char *pidfile = dconf_get_str("path.pid", NULL);
    char *mp = NULL;
    Log(LOG_INFO, "shutting down...");
    conf.dying = true;
+   log_fini();					// Flush queued log messages
 
    dlink_fini();
    dconf_fini();
@@ -61,12 +69,39 @@ void goodbye(void) {
    exit(EXIT_SUCCESS);
 }
 
+/*
+ * FUSE requests are served from the main loop, so tuning.affinity.fuse
+ * places this thread. If that confines it to one NUMA node, the block
+ * heaps (inodes, file handles, ...) are kept on the same node.
+ */
+static void affinity_init(void) {
+   enum thread_affinity policy;
+   int node;
+
+   // Must see the cpuset before anything gets pinned
+   topo_init();
+   Log(LOG_INFO, "%d CPUs in %d NUMA node(s) available", topo_ncpus(), topo_nodes());
+
+   if (thread_affinity_parse(dconf_get_str("tuning.affinity.fuse", "cpuset"), &policy, &node) != 0) {
+      Log(LOG_ERR, "invalid tuning.affinity.fuse, using cpuset");
+      policy = THR_AFF_CPUSET;
+   }
+
+   if ((node = thread_set_affinity(pthread_self(), policy, node, 0)) >= 0 &&
+       dconf_get_bool("tuning.heap.numa-local", 1) && topo_nodes() > 1) {
+      blockheap_set_node(node);
+      Log(LOG_INFO, "block heaps allocate from NUMA node %d", node);
+   }
+}
+
 static void usage(int argc, char **argv) {
    printf("Usage: %s <jaildir> [action]\n", basename(argv[0]));
    printf("Compose a chroot jail based on a shared package pool.\n\n");
    printf("Options:\n");
    printf("\t<jaildir>\t\tThe directory containing jailfs.cf, etc for the desired jail\n");
-   printf("\t[action]\t\tOptionally an action to take on the jail ([start]|stop|status)\n\n");
+   printf("\t[action]\t\tOptionally an action to take on the jail ([start]|stop|status)\n");
+   printf("\t--bench-import <dir>\tImport every package in <dir> and report where the time goes\n");
+   printf("\t--trace-report <file> [order]\tSummarize an access trace, optionally writing the access order\n\n");
    printf("Your jaildir must be properly laid out (see man jailfs.cf for details).\n");
    exit(1);
 }
@@ -78,6 +113,12 @@ int main(int argc, char **argv) {
    // XXX: Parse commandline arguments (should be minimal)
    // -d --debug: Debug mode
    // -f --fg --foreground: Foregroun mode
+   if (argc > 2 && strcmp(argv[1], "--bench-import") == 0)
+      return pkg_bench_import(argv[2]);
+
+   if (argc > 2 && strcmp(argv[1], "--trace-report") == 0)
+      return trace_report(argv[2], (argc > 3 ? argv[3] : NULL));
+
    Log(LOG_INFO, "jailfs: container filesystem %s starting up...", PKG_VERSION);
    Log(LOG_INFO, "Copyright (C) 2012-2019 bigfluffy.cloud -- See LICENSE in distribution package for terms of use");
 
@@ -95,29 +136,30 @@ int main(int argc, char **argv) {
    host_init();					// Platform initialization
    conf.born = conf.now = time(NULL);		// Set birthday and clock (cron maintains)
    umask(0077);					// Restrict umask on new files
+   ebr_register("main");			// Config readers must be (see conf.h)
+   dconf_init("jailfs.cf");			// Load config
    api_init();					// Initialize MASTER thread
-   conf.dict = dconf_load("jailfs.cf");		// Load config
    evt_init();					// Socket event handler
+   watchdog_init();				// Main loop stall detector
+   api_master_init();				// Main thread's mailbox
+   affinity_init();				// CPU/NUMA placement
    blockheap_init();				// Block heap allocator
 
-   // Start garbage collector
-   evt_timer_add_periodic(gc_all,
-     "gc.blockheap",
-      timestr_to_time(dconf_get_str("tuning.timer.blockheap_gc", NULL), 60));
-
    log_open(dconf_get_str("path.log", "file://jailfs.log"));
 
    cron_init();					// Periodic events
    i18n_init();					// Load translations
    dlink_init();				// Doubly linked lists
    pkg_init();					// Package utilities
+   gc_init();					// Garbage collector
+   memstats_init();				// Heap statistics
 
    if (pidfile_open(dconf_get_str("path.pid", NULL))) {
       Log(LOG_EMERG, "Failed opening PID file. Are we already running?");
       return 1;
    }
 
-   if (strcasecmp(dconf_get_str("log.level", "debug"), "debug") == 0) {
+   if (strcasecmp(conf_get()->log_level, "debug") == 0) {
       Log(LOG_WARNING, "Log level is set to DEBUG. Please use info or lower in production");
       Log(LOG_WARNING, "You can disable uninteresting debug sources by setting config:[general]/debug.* to false");
    }
@@ -156,6 +198,10 @@ int main(int argc, char **argv) {
       i++;
    } while (i <= thr_cnt);
 
+   // Task workers for background jobs (0: one per CPU)
+   if (threadpool_start(main_threadpool, dconf_get_int("tuning.threads.workers", 0)) <= 0)
+      Log(LOG_WARNING, "no task workers, background jobs will not run");
+
 #if	defined(CONFIG_DEBUGGER)
    // Test symbol lookup (needed for debugger) and generate log error if cannot find symtab...
    debug_symtab_lookup("Log", NULL);
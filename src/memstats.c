@@ -0,0 +1,174 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/memstats.c:
+ *	BlockHeap statistics
+ */
+#include <ctype.h>
+#include <lsd/lsd.h>
+#include "cron.h"
+#include "logger.h"
+#include "memstats.h"
+#include "shell.h"
+
+// Percent of the resident part of a heap not holding live objects
+static double memstats_frag(const struct blockheap_stats *st) {
+   size_t resident = st->reserved - st->released;
+
+   return (resident ? 100.0 - st->live * 100.0 / resident : 0);
+}
+
+// Heap name as a key component ("shell hints" => shell_hints)
+static void memstats_key(char *buf, size_t len, const char *name) {
+   size_t i;
+
+   for (i = 0; i < len - 1 && name[i] != '\0'; i++)
+      buf[i] = (isalnum((unsigned char)name[i]) ? name[i] : '_');
+
+   buf[i] = '\0';
+}
+
+// High-water marks already reported under debug.mem
+static struct {
+   BlockHeap  *bh;
+   unsigned long peak;
+} memstats_seen[MEMSTATS_MAX_HEAPS];
+
+static void memstats_tick_one(BlockHeap *bh, void *arg) {
+   struct blockheap_stats st;
+   int i;
+
+   for (i = 0; i < MEMSTATS_MAX_HEAPS - 1; i++)
+      if (memstats_seen[i].bh == bh || memstats_seen[i].bh == NULL)
+         break;
+
+   // Only new high-water marks, not every regrowth after a GC
+   if (memstats_seen[i].bh == bh && memstats_seen[i].peak >= bh->peakBlocks)
+      return;
+
+   blockheap_stats(bh, &st);
+
+   if (memstats_seen[i].bh == bh)
+      Debug(DEBUG_MEM, "heap %s: grew to %lu blocks, %lu/%lu elements used (%.0f allocs/sec)",
+            st.name, st.blocks, st.used, st.elems, st.rate);
+
+   memstats_seen[i].bh = bh;
+   memstats_seen[i].peak = st.peak_blocks;
+}
+
+// Latest copy of every heap's stats, for readers off the main loop
+static struct memstats_snap *memstats_snap = NULL;
+
+static void memstats_snap_one(BlockHeap *bh, void *arg) {
+   struct memstats_snap *snap = (struct memstats_snap *)arg;
+   struct memstats_heap *h;
+
+   if (snap->count >= MEMSTATS_MAX_HEAPS)
+      return;
+
+   h = &snap->heap[snap->count++];
+   blockheap_stats(bh, &h->st);
+   memstats_key(h->name, sizeof(h->name), h->st.name);
+   h->st.name = h->name;
+}
+
+static void memstats_tick(void *arg) {
+   struct memstats_snap *snap;
+
+   blockheap_stats_tick(1.0);
+   blockheap_foreach(memstats_tick_one, NULL);
+
+   if (!(snap = calloc(1, sizeof(struct memstats_snap) + MEMSTATS_MAX_HEAPS * sizeof(struct memstats_heap))))
+      return;
+
+   blockheap_foreach(memstats_snap_one, snap);
+   ebr_retire(__atomic_exchange_n(&memstats_snap, snap, __ATOMIC_ACQ_REL), NULL);
+}
+
+const struct memstats_snap *memstats_snapshot(void) {
+   return __atomic_load_n(&memstats_snap, __ATOMIC_ACQUIRE);
+}
+
+static void memstats_dump_one(BlockHeap *bh, void *arg) {
+   struct blockheap_stats st;
+
+   blockheap_stats(bh, &st);
+   Log(LOG_SHELL, "  %-20s %5lu %7lu/%-7lu %7lu %3lu/%-3lu %8.1f %10lu %10lu %5.1f%%",
+       st.name, (unsigned long)st.elem_size, st.used, st.elems, st.peak_used,
+       st.blocks, st.peak_blocks, st.rate, (unsigned long)st.live,
+       (unsigned long)(st.reserved - st.released), memstats_frag(&st));
+}
+
+void memstats_dump(void) {
+   Log(LOG_SHELL, "  %-20s %5s %15s %7s %7s %8s %10s %10s %6s",
+       "heap", "size", "used/elems", "peak", "blocks", "allocs/s", "live", "resident", "frag");
+   blockheap_foreach(memstats_dump_one, NULL);
+}
+
+static void memstats_site_one(const char *file, int line, unsigned long live, void *arg) {
+   if (file)
+      Log(LOG_SHELL, "    %6lu  %s:%d", live, file, line);
+   else
+      Log(LOG_SHELL, "    %6lu  (other sites)", live);
+}
+
+static void memstats_sites_one(BlockHeap *bh, void *arg) {
+   Log(LOG_SHELL, "  %s: %lu outstanding", bh->name, bh->totalElems - bh->freeElems);
+   blockheap_sites(bh, memstats_site_one, NULL);
+}
+
+void memstats_sites(void) {
+   if (blockheap_sites(NULL, memstats_site_one, NULL) < 0) {
+      Log(LOG_SHELL, "Allocation sites are only tracked with CONFIG_DEBUG_BALLOC=y");
+      return;
+   }
+
+   blockheap_foreach(memstats_sites_one, NULL);
+}
+
+static void memstats_write_one(BlockHeap *bh, void *arg) {
+   struct blockheap_stats st;
+   FILE *fp = (FILE *)arg;
+   char key[64];
+
+   blockheap_stats(bh, &st);
+   memstats_key(key, sizeof(key), st.name);
+
+   fprintf(fp, "heap.%s.elem_size=%lu\n", key, (unsigned long)st.elem_size);
+   fprintf(fp, "heap.%s.elems=%lu\n", key, st.elems);
+   fprintf(fp, "heap.%s.used=%lu\n", key, st.used);
+   fprintf(fp, "heap.%s.peak_used=%lu\n", key, st.peak_used);
+   fprintf(fp, "heap.%s.blocks=%lu\n", key, st.blocks);
+   fprintf(fp, "heap.%s.peak_blocks=%lu\n", key, st.peak_blocks);
+   fprintf(fp, "heap.%s.elems_per_block=%lu\n", key, bh->elemsPerBlock);
+   fprintf(fp, "heap.%s.allocs=%lu\n", key, st.allocs);
+   fprintf(fp, "heap.%s.frees=%lu\n", key, st.frees);
+   fprintf(fp, "heap.%s.allocs_per_sec=%.2f\n", key, st.rate);
+   fprintf(fp, "heap.%s.live_bytes=%lu\n", key, (unsigned long)st.live);
+   fprintf(fp, "heap.%s.reserved_bytes=%lu\n", key, (unsigned long)st.reserved);
+   fprintf(fp, "heap.%s.released_bytes=%lu\n", key, (unsigned long)st.released);
+   fprintf(fp, "heap.%s.trimmed_bytes=%lu\n", key, (unsigned long)st.trimmed);
+   fprintf(fp, "heap.%s.fragmentation=%.2f\n", key, memstats_frag(&st));
+}
+
+int memstats_write(FILE *fp) {
+   if (fp == NULL)
+      return -1;
+
+   blockheap_foreach(memstats_write_one, fp);
+   return 0;
+}
+
+void memstats_init(void) {
+   cron_add("memstats", memstats_tick, NULL, 1, 0, 0);
+}
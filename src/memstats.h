@@ -0,0 +1,50 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/memstats.h:
+ *	BlockHeap statistics, for sizing the tuning.heap.* knobs
+ *
+ *	Every second the allocation rates of all heaps are updated, and
+ * with debug.mem on, heaps growing past their high-water mark are
+ * logged. Outstanding objects per allocation site are only tracked
+ * when built with CONFIG_DEBUG_BALLOC.
+ */
+#if	!defined(__MEMSTATS_H)
+#define	__MEMSTATS_H
+#include <stdio.h>
+#include <lsd/balloc.h>
+
+#define	MEMSTATS_MAX_HEAPS	64
+
+// Stats of every heap as of the last tick, names made key-safe
+struct memstats_heap {
+   char        name[64];
+   struct blockheap_stats st;
+};
+
+struct memstats_snap {
+   int         count;
+   struct memstats_heap heap[];
+};
+
+extern void memstats_init(void);
+// Heap table / outstanding objects by allocation site, on the shell
+extern void memstats_dump(void);
+extern void memstats_sites(void);
+// heap.<name>.<counter>=<value> lines, one per counter, for scripts
+extern int memstats_write(FILE *fp);
+// Lock-free; valid until the caller's next quiescent point (NULL before
+// the first tick)
+extern const struct memstats_snap *memstats_snapshot(void);
+
+#endif	// !defined(__MEMSTATS_H)
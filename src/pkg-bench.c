@@ -0,0 +1,131 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/pkg-bench.c:
+ *	jailfs --bench-import <dir>: package import throughput
+ *
+ *	Imports every package in dir into an empty index, the same way a
+ * starting jail does (minus FUSE and the threads), and prints where
+ * the time went for each one and for each format, so we know which
+ * packages are worth converting to a cheaper format.
+ */
+#include <dirent.h>
+#include <lsd/lsd.h>
+#include "conf.h"
+#include "logger.h"
+#include "pkg.h"
+#include "vfs.h"
+
+#define	PKG_BENCH_FORMATS	16
+
+struct pkg_bench_total {
+   struct pkg_import_stats st;
+   unsigned long pkgs;
+};
+
+static struct pkg_bench_total pkg_bench_fmt[PKG_BENCH_FORMATS];
+static int pkg_bench_nfmt = 0;
+
+static void pkg_bench_add(struct pkg_import_stats *dst, const struct pkg_import_stats *src) {
+   dst->entries += src->entries;
+   dst->bytes += src->bytes;
+   dst->data_bytes += src->data_bytes;
+   dst->open_ns += src->open_ns;
+   dst->header_ns += src->header_ns;
+   dst->vfs_ns += src->vfs_ns;
+   dst->db_ns += src->db_ns;
+}
+
+static void pkg_bench_print(const char *name, const char *format, unsigned long pkgs,
+                            const struct pkg_import_stats *st) {
+   unsigned long total = st->open_ns + st->header_ns + st->vfs_ns + st->db_ns;
+   double secs = (total ? total / 1e9 : 1e-9);
+
+   printf("%-28.28s %-8s %5lu %9.2f %8lu %8.1f %8.1f %8.1f %8.1f %9.1f %11.0f\n",
+          name, format, pkgs, st->bytes / 1048576.0, st->entries,
+          st->open_ns / 1e6, st->header_ns / 1e6, st->vfs_ns / 1e6, st->db_ns / 1e6,
+          st->bytes / 1048576.0 / secs, st->entries / secs);
+}
+
+static void pkg_bench_one(const char *path, const struct pkg_import_stats *st, void *arg) {
+   int i;
+
+   for (i = 0; i < pkg_bench_nfmt; i++)
+      if (strcmp(pkg_bench_fmt[i].st.format, st->format) == 0)
+         break;
+
+   if (i == pkg_bench_nfmt && pkg_bench_nfmt < PKG_BENCH_FORMATS) {
+      memcpy(pkg_bench_fmt[i].st.format, st->format, sizeof(st->format));
+      pkg_bench_nfmt++;
+   }
+
+   if (i < PKG_BENCH_FORMATS) {
+      pkg_bench_add(&pkg_bench_fmt[i].st, st);
+      pkg_bench_fmt[i].pkgs++;
+   }
+
+   pkg_bench_print(basename(path), st->format, 1, st);
+}
+
+static int pkg_bench_filter(const struct dirent *de) {
+   return (de->d_name[0] != '.');
+}
+
+int pkg_bench_import(const char *dir) {
+   struct pkg_bench_total all;
+   struct dirent **list;
+   char path[PATH_MAX];
+   int i, n, failed = 0;
+
+   if ((n = scandir(dir, &list, pkg_bench_filter, alphasort)) < 0) {
+      fprintf(stderr, "bench-import: %s: %s\n", dir, strerror(errno));
+      return 1;
+   }
+
+   blockheap_init();
+   dlink_init();
+   pkg_init();
+   vfs_index_init();
+   pkg_import_profile(pkg_bench_one, NULL);
+
+   printf("%-28s %-8s %5s %9s %8s %8s %8s %8s %8s %9s %11s\n", "package", "format", "pkgs",
+          "MB", "entries", "open ms", "hdrs ms", "vfs ms", "db ms", "MB/s", "entries/s");
+
+   for (i = 0; i < n; i++) {
+      snprintf(path, sizeof(path), "%s/%s", dir, list[i]->d_name);
+
+      if (!is_dir(path) && pkg_open(path) == NULL) {
+         fprintf(stderr, "bench-import: %s: import failed\n", path);
+         failed++;
+      }
+
+      free(list[i]);
+   }
+
+   free(list);
+   pkg_import_profile(NULL, NULL);
+
+   // One line per format, then everything
+   memset(&all, 0, sizeof(all));
+   printf("\n");
+
+   for (i = 0; i < pkg_bench_nfmt; i++) {
+      pkg_bench_print("(all)", pkg_bench_fmt[i].st.format, pkg_bench_fmt[i].pkgs, &pkg_bench_fmt[i].st);
+      pkg_bench_add(&all.st, &pkg_bench_fmt[i].st);
+      all.pkgs += pkg_bench_fmt[i].pkgs;
+   }
+
+   pkg_bench_print("(all)", "*", all.pkgs, &all.st);
+   printf("\n%lu paths indexed, %d package(s) failed\n", vfs_path_count(), failed);
+   return (failed ? 1 : 0);
+}
@@ -44,8 +44,11 @@
 #include "conf.h"
 #include "database.h"
 #include "cron.h"
+#include "gc.h"
 #include "shell.h"
+#include "logger.h"
 #include "pkg.h"
+#include "trace.h"
 #include "vfs.h"
 
 /* This seems to be a BSD thing- it's not fatal if missing, so stub it */
@@ -57,7 +60,9 @@
 static BlockHeap *heap_pkg = NULL;            	// BlockHeap for packages
 static BlockHeap *heap_pkg_file = NULL;	// BlockHeap for package files
 static dlink_list pkg_list;            	// List of currently opened packages
-static time_t pkg_lifetime = 0;        	// see pkg_init() for initialization
+static unsigned long pkg_imported = 0;		// packages opened (and indexed), ever
+static pkg_import_cb pkg_profile_fn = NULL;	// see pkg_import_profile()
+static void *pkg_profile_arg = NULL;
 int g_pkgid = 1;
 
 static dlink_node *pkg_findnode(struct pkg_handle *pkg) {
@@ -72,13 +77,12 @@ static dlink_node *pkg_findnode(struct pkg_handle *pkg) {
 }
 
 /*
- * release the package handle
- *
- * Should only be called by the Garbage Collector
- * unless we get tight on memory (XXX: Add this)
+ * Tear down a package handle nobody can reach any more
+ *	Runs from ebr_gc(), once every thread that might have been using
+ * the handle when it was released has passed a quiescent point.
  */
-static void pkg_release(struct pkg_handle *pkg) {
-   dlink_node *ptr;
+static void pkg_release_deferred(void *ptr) {
+   struct pkg_handle *pkg = (struct pkg_handle *)ptr;
 
    // XXX: Purge files
    // XXX: - Free file contents cache
@@ -91,7 +95,7 @@ static void pkg_release(struct pkg_handle *pkg) {
    }
 
    // Unlock the package source file
-   if (dconf_get_bool("vfs.locking.host", 0))
+   if (conf_get()->vfs_locking_host)
       flock(pkg->fd, LOCK_UN);
 
    // close handle, if exists 
@@ -100,10 +104,26 @@ static void pkg_release(struct pkg_handle *pkg) {
       pkg->fd = -1;
    }
 
-   if ((ptr = pkg_findnode((struct pkg_handle *)pkg)) != NULL) {
-      dlink_delete(ptr, &pkg_list);
-      blockheap_free(heap_pkg, ptr->data);
-   }
+   blockheap_free(heap_pkg, pkg);
+}
+
+/*
+ * release the package handle
+ *
+ * Should only be called by the Garbage Collector
+ * unless we get tight on memory (XXX: Add this)
+ *
+ * The handle is unlinked right away so nobody new finds it, but another
+ * thread may be in the middle of reading through it, so the fd and
+ * memory are only given back once it's safe (see lsd/ebr.h).
+ */
+static void pkg_release(struct pkg_handle *pkg) {
+   dlink_node *ptr;
+
+   if ((ptr = pkg_findnode((struct pkg_handle *)pkg)) != NULL)
+      dlink_destroy(ptr, &pkg_list);
+
+   ebr_retire(pkg, pkg_release_deferred);
 }
 
 /*
@@ -126,6 +146,21 @@ struct pkg_handle *pkg_handle_byname(const char *path) {
 }
 
 
+// Same again, by the pkgid pkg_open() assigned
+struct pkg_handle *pkg_handle_byid(u_int32_t pkgid) {
+   dlink_node *ptr, *tptr;
+   struct pkg_handle *p;
+
+   DLINK_FOREACH_SAFE(ptr, tptr, pkg_list.head) {
+      p = (struct pkg_handle *)ptr->data;
+
+      if (p->pkgid == pkgid)
+         return p;
+   }
+
+   return NULL;
+}
+
 /*
  * reduce the package's reference count
  *
@@ -135,7 +170,7 @@ struct pkg_handle *pkg_handle_byname(const char *path) {
  */
 void pkg_close(struct pkg_handle *pkg) {
    pkg->refcnt--;
-   Log(LOG_DEBUG, "pkg_close: pkg %s refcnt == %d", pkg->name, pkg->refcnt);
+   Debug(DEBUG_PKG, "pkg_close: pkg %s refcnt == %d", pkg->name, pkg->refcnt);
 }
 
 /* Handle vfs_watch REMOVED event */
@@ -185,6 +220,39 @@ struct pkg_file_mapping *pkg_map_file(const char *path, size_t len, off_t offset
    return p;
 }
 
+void pkg_import_profile(pkg_import_cb fn, void *arg) {
+   pkg_profile_arg = arg;
+   pkg_profile_fn = fn;
+}
+
+static unsigned long pkg_now_ns(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// "tar.gz" and friends, for the profile
+static void pkg_format_name(struct archive *a, char *buf, size_t len) {
+   const char *filter = archive_filter_name(a, 0);
+
+   if ((archive_format(a) & ARCHIVE_FORMAT_BASE_MASK) != ARCHIVE_FORMAT_TAR) {
+      snprintf(buf, len, "%s", archive_format_name(a) ? archive_format_name(a) : "unknown");
+      return;
+   }
+
+   if (filter == NULL || strcmp(filter, "none") == 0)
+      snprintf(buf, len, "tar");
+   else if (strcmp(filter, "gzip") == 0)
+      snprintf(buf, len, "tar.gz");
+   else if (strcmp(filter, "zstd") == 0)
+      snprintf(buf, len, "tar.zst");
+   else if (strcmp(filter, "bzip2") == 0)
+      snprintf(buf, len, "tar.bz2");
+   else
+      snprintf(buf, len, "tar.%s", filter);
+}
+
 struct archive *pkg_archive_open(const char *path) {
    struct archive *ret = archive_read_new();
    int r = -1;
@@ -217,12 +285,21 @@ struct pkg_handle *pkg_open(const char *path) {
    struct archive_entry *aentry;
    int r;
    char _f_type = '-';
+   pkg_import_cb prof = pkg_profile_fn;
+   struct pkg_import_stats ps;
+   struct stat sb;
+   unsigned long t0 = 0, t1;
    
-   Log(LOG_DEBUG, "pkg_open: beginning for: %s", path);
+   Debug(DEBUG_PKG, "pkg_open: beginning for: %s", path);
 
    // try to find an existing handle for the package
    // If this fails, create one and cache it...
    if ((t = pkg_handle_byname(path)) == NULL) {
+      if (prof) {
+         memset(&ps, 0, sizeof(ps));
+         t0 = pkg_now_ns();
+      }
+
       // Start transaction
       db_begin();
 
@@ -230,15 +307,20 @@ struct pkg_handle *pkg_open(const char *path) {
       t->name = str_dup(path);
       t->pkgid = db_pkg_add(path);
 
+      if (prof)
+         ps.db_ns += pkg_now_ns() - t0;
+
       if ((t->fd = open(t->name, O_RDONLY)) < 0) {
          Log(LOG_ERR, "failed opening pkg %s, bailing...", t->name);
+         db_rollback();
          pkg_release(t);
          return NULL;
       }
 
       // Try to acquire an exclusive lock, fail if we cant 
-      if (dconf_get_bool("vfs.locking.host", 0) && flock(t->fd, LOCK_EX | LOCK_NB) == -1) {
+      if (conf_get()->vfs_locking_host && flock(t->fd, LOCK_EX | LOCK_NB) == -1) {
          Log(LOG_ERR, "failed locking package %s, bailing...", t->name);
+         db_rollback();
          pkg_release(t);
          return NULL;
       }
@@ -247,18 +329,37 @@ struct pkg_handle *pkg_open(const char *path) {
       dlink_add_tail_alloc(t, &pkg_list);
 
       // begin...
-      if (dconf_get_bool("debug.pkg", 0) == 1)
-         Log(LOG_DEBUG, "BEGIN import pkg %s", basename(path));
+      Debug(DEBUG_PKG, "BEGIN import pkg %s", basename(path));
+
+      if (prof) {
+         if (fstat(t->fd, &sb) == 0)
+            ps.bytes = sb.st_size;
+         t0 = pkg_now_ns();
+      }
 
       // Open the archive file
-      if ((a = pkg_archive_open(path)) == NULL)
+      if ((a = pkg_archive_open(path)) == NULL) {
+         db_rollback();
+         pkg_release(t);
          return NULL;
+      }
+      __atomic_add_fetch(&pkg_imported, 1, __ATOMIC_RELAXED);
+
+      if (prof)
+         ps.open_ns += pkg_now_ns() - t0;
 
-      Log(LOG_DEBUG, "package %s appears valid, assigning pkgid %d", path, t->pkgid);
+      Debug(DEBUG_PKG, "package %s appears valid, assigning pkgid %d", path, t->pkgid);
 
       // Add the achive's file entries to the database...
       while (TRUE) {
+         if (prof)
+            t0 = pkg_now_ns();
+
          r = archive_read_next_header(a, &aentry);
+
+         if (prof)
+            ps.header_ns += (t1 = pkg_now_ns()) - t0;
+
          if (r == ARCHIVE_EOF)
             break;
 
@@ -287,21 +388,40 @@ struct pkg_handle *pkg_open(const char *path) {
          else
             _f_type = 'f';
 
-         vfs_add_path(_f_type, t->pkgid, _f_name, _f_uid, _f_gid, _f_owner, _f_group, st->st_mode, st->st_size, time(NULL));
+         vfs_add_path(_f_type, t->pkgid, _f_name, (_f_type == 'l' ? archive_entry_symlink(aentry) : NULL), _f_uid, _f_gid, _f_owner, _f_group, st->st_mode, st->st_size, time(NULL));
+
+         if (prof) {
+            ps.vfs_ns += pkg_now_ns() - t1;
+            ps.entries++;
+            ps.data_bytes += st->st_size;
+         }
 
-         if (dconf_get_bool("debug.pkg", 0) == 1)
-            Log(LOG_DEBUG, "+ %s:%s (user: %d %s) (group: %d %s) mode=%o perms=%s size:%lu@%lu",
+         Debug(DEBUG_PKG, "+ %s:%s (user: %d %s) (group: %d %s) mode=%o perms=%s size:%lu@%lu",
                 basename(path), _f_name, _f_uid, _f_owner, _f_gid, _f_group, _f_mode, _f_perm, st->st_size, 0);
       }
 
+      if (prof) {
+         pkg_format_name(a, ps.format, sizeof(ps.format));
+         t0 = pkg_now_ns();
+      }
+
       archive_read_close(a);
 
       if ((r = archive_read_free(a)) != ARCHIVE_OK)
          Log(LOG_ERR, "possible memory leak! archive_read_free() returned %d", r);
 
+      if (prof)
+         ps.open_ns += (t1 = pkg_now_ns()) - t0;
+
       db_commit();
+      trace_package(t->pkgid, path);
+
+      if (prof) {
+         ps.db_ns += pkg_now_ns() - t1;
+         prof(path, &ps, pkg_profile_arg);
+      }
 
-      if (dconf_get_bool("debug.pkg", 0) == 1)
+      if (debug_enabled(DEBUG_PKG))
          Log(LOG_INFO, "SUCCESS import pkg %s", basename(path));
    }
 
@@ -313,65 +433,107 @@ struct pkg_handle *pkg_open(const char *path) {
 }
 
 
+//
+// pkg_extract_file: Copy one file out of an open package into path.cache
+// Returns where it went (mem_free() it when done) or NULL. The file only
+// shows up under its final name once it's complete, so two threads
+// extracting the same file at once don't trip over each other.
 char *pkg_extract_file(u_int32_t pkgid, const char *path) {
-   int         db_id = -1, r = 0;
    struct archive *a;
    struct archive_entry *aentry;
    struct pkg_handle *pkg;
-   char _f_type = '-';
+   const char *cache, *p;
    char *cache_path = NULL;
+   char dst[PATH_MAX], tmp[PATH_MAX];
+   unsigned long hash = 14695981039346656037UL;
+   int r, fd;
 
-   if (dconf_get_bool("debug.pkg", 0) == 1)
-      Log(LOG_DEBUG, "BEGIN extractfile <%d> %s", pkgid, basename(path));
+   if ((pkg = pkg_handle_byid(pkgid)) == NULL) {
+      Log(LOG_ERR, "pkg_extract_file: no package open with pkgid %u (%s)", pkgid, path);
+      return NULL;
+   }
+
+   if ((cache = dconf_get_str("path.cache", NULL)) == NULL)
+      return NULL;
+
+   Debug(DEBUG_PKG, "BEGIN extractfile <%d> %s", pkgid, path);
 
-   // Find package by pkgid, so we can look up it's path....
-   pkg = pkg_open(path);
+   // Cache files are named for the package and a hash (FNV-1a) of the path
+   for (p = path; *p != '\0'; p++)
+      hash = (hash ^ (unsigned char)*p) * 1099511628211UL;
 
-   // Open the archive file
-   a = pkg_archive_open(path);
+   snprintf(dst, sizeof(dst), "%s/%u-%016lx", cache, pkgid, hash);
+   snprintf(tmp, sizeof(tmp), "%s/.%u-%016lx.%lx", cache, pkgid, hash, (unsigned long)pthread_self());
 
-   // Add the package to the database & get the pkg->pkgid for it
-   pkg->pkgid = db_pkg_add(path);
-   Log(LOG_DEBUG, "package %s appears valid, assigning pkgid %d", path, pkg->pkgid);
+   if ((a = pkg_archive_open(pkg->name)) == NULL)
+      return NULL;
+
+   while ((r = archive_read_next_header(a, &aentry)) == ARCHIVE_OK) {
+      if (strcmp(archive_entry_pathname(aentry), path) != 0)
+         continue;
 
-   while (TRUE) {
-      r = archive_read_next_header(a, &aentry);
-      if (r == ARCHIVE_EOF)
+      // World readable in the package, world readable here (lib/libfspkg.so opens these)
+      if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600 | (archive_entry_perm(aentry) & S_IROTH))) < 0) {
+         Log(LOG_ERR, "pkg_extract_file: %s: %s", tmp, strerror(errno));
          break;
+      }
 
-      if (r != ARCHIVE_OK) {
-         Log(LOG_DEBUG, "pkg_open: libarchive read_next_header error %d: %s", r, archive_error_string(a));
+      r = archive_read_data_into_fd(a, fd);
+
+      if (close(fd) != 0 || r != ARCHIVE_OK || rename(tmp, dst) != 0) {
+         Log(LOG_ERR, "pkg_extract_file: failed extracting %s from %s: %s", path, pkg->name,
+             (r != ARCHIVE_OK ? archive_error_string(a) : strerror(errno)));
+         unlink(tmp);
          break;
       }
-      // extract it...
+
+      cache_path = str_dup(dst);
+      break;
    }
+
+   if (r != ARCHIVE_OK && r != ARCHIVE_EOF)
+      Log(LOG_DEBUG, "pkg_extract_file: libarchive read_next_header error %d: %s", r, archive_error_string(a));
+
    archive_read_close(a);
 
    if ((r = archive_read_free(a)) != ARCHIVE_OK)
       Log(LOG_ERR, "possible memory leak! archive_read_free() returned %d", r);
 
-   db_commit();
-
-   if (dconf_get_bool("debug.pkg", 0) == 1)
-      Log(LOG_INFO, "SUCCESS extract file to cache: <%d> %s", pkg->pkgid, basename(path));
+   if (cache_path != NULL && debug_enabled(DEBUG_PKG))
+      Log(LOG_INFO, "SUCCESS extract file to cache: <%d> %s", pkgid, path);
 
    return cache_path;
 }
 
+// Release packages nobody has had open for a while, returns how many
 int pkg_gc(void) {
    dlink_node *ptr, *tptr;
    struct pkg_handle *p;
+   int released = 0;
 
    DLINK_FOREACH_SAFE(ptr, tptr, pkg_list.head) {
       p = (struct pkg_handle *)ptr->data;
 
-      if (p->refcnt == 0 && (time(NULL) > p->otime + pkg_lifetime))
+      if (p->refcnt == 0 && (time(NULL) > p->otime + conf_get()->timer_pkg_gc)) {
          pkg_release(p);
+         released++;
+      }
    }
 
-   blockheap_garbagecollect(heap_pkg_file);
-   blockheap_garbagecollect(heap_pkg);
+   return released;
+}
+
+// For metrics: read from other threads without taking anything
+unsigned long pkg_count(void) {
+   return __atomic_load_n(&pkg_list.length, __ATOMIC_RELAXED);
+}
 
+unsigned long pkg_imports(void) {
+   return __atomic_load_n(&pkg_imported, __ATOMIC_RELAXED);
+}
+
+static int pkg_gc_step(void *arg, size_t *released, unsigned long *freed) {
+   *freed += pkg_gc();
    return 0;
 }
 
@@ -388,9 +550,13 @@ void pkg_init(void) {
       raise(SIGABRT);
    }
 
+   conf_watch_heap("tuning.heap.pkg", heap_pkg);
+   conf_watch_heap("tuning.heap.files", heap_pkg_file);
+
    // We take care of package file cleanup here too...
-   pkg_lifetime = timestr_to_time(dconf_get_str("tuning.timer.pkg_gc", NULL), 60);
-   evt_timer_add_periodic(pkg_gc, "gc.pkg", pkg_lifetime);
+   gc_register("pkg", pkg_gc_step, NULL, 0.1, "tuning.timer.pkg_gc", 60);
+   gc_register_heap(heap_pkg, "tuning.timer.pkg_gc", 60);
+   gc_register_heap(heap_pkg_file, "tuning.timer.pkg_gc", 60);
 }
 
 void pkg_fini(void) {
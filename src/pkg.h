@@ -51,13 +51,14 @@ extern void pkg_init(void);
 /* Release our instance of package */
 extern void pkg_close(struct pkg_handle *pkg);
 
-//
+// Copy one file from a package into path.cache, returns the cache path
 extern char *pkg_extract_file(u_int32_t pkgid, const char *path);
 
 // Stuff for mmap()ing files from packages - XXX: BROKEN!
 extern void pkg_unmap_file(struct pkg_file_mapping *p);
 extern struct pkg_file_mapping *pkg_map_file(const char *path, size_t len, off_t offset);
 extern struct pkg_handle *pkg_handle_byname(const char *path);
+extern struct pkg_handle *pkg_handle_byid(u_int32_t pkgid);
 
 /* Open a package */
 extern struct pkg_handle *pkg_open(const char *path);
@@ -70,4 +71,28 @@ extern int  pkg_forget(const char *path);
 // garbage collect
 extern int pkg_gc(void);
 
+/*
+ * Import profiling: while a callback is set, pkg_open() times each
+ * phase of every import and hands the numbers over when it's done.
+ */
+struct pkg_import_stats {
+   char        format[32];		// tar, tar.gz, tar.xz, tar.zst, zip, ...
+   unsigned long entries;
+   size_t      bytes;			// size of the package file
+   size_t      data_bytes;		// sum of the entries' sizes
+   unsigned long open_ns;		// archive open, close and free
+   unsigned long header_ns;		// walking headers (decompresses everything)
+   unsigned long vfs_ns;		// vfs_add_path()
+   unsigned long db_ns;			// database registration, transaction
+};
+typedef void (*pkg_import_cb)(const char *path, const struct pkg_import_stats *st, void *arg);
+
+extern void pkg_import_profile(pkg_import_cb fn, void *arg);
+// jailfs --bench-import <dir>: import every package in dir, print a report
+extern int pkg_bench_import(const char *dir);
+
+// Packages open right now, and opened since startup
+extern unsigned long pkg_count(void);
+extern unsigned long pkg_imports(void);
+
 #endif	// !defined(__PKG_H)
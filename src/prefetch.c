@@ -0,0 +1,258 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/prefetch.c:
+ *	Boot profile recording and replay
+ */
+#include <sys/types.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <lsd/lsd.h>
+#include "conf.h"
+#include "cron.h"
+#include "logger.h"
+#include "threads.h"
+#include "prefetch.h"
+
+// One replay, shared by the workers running it
+struct prefetch_job {
+   char      **paths;
+   unsigned long n;
+   unsigned long next;			// next path to take
+   unsigned long done;			// files extracted
+   int         running;			// workers still at it
+   unsigned long t0;
+};
+
+// Recording: first touches since launch, in order
+static vfs_cache_entry **prefetch_seen = NULL;
+static unsigned long prefetch_nseen = 0, prefetch_max = 0;
+static unsigned long prefetch_deadline = 0;	// ns, 0 when not recording
+static u_int32_t prefetch_gen = 0;		// bumped every launch
+static int prefetch_window = 0;
+
+static unsigned long prefetch_now(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int prefetch_path(char *buf, size_t len) {
+   const char *dir;
+
+   if ((dir = dconf_get_str("path.statedir", NULL)) == NULL)
+      return -1;
+
+   snprintf(buf, len, "%s/boot.profile", dir);
+   return 0;
+}
+
+////////////
+// record //
+////////////
+void prefetch_touch(vfs_cache_entry *fe) {
+   unsigned long deadline = __atomic_load_n(&prefetch_deadline, __ATOMIC_ACQUIRE), idx;
+   u_int32_t gen, old;
+
+   if (deadline == 0 || prefetch_now() > deadline)
+      return;
+
+   // Only the first touch since this launch
+   gen = __atomic_load_n(&prefetch_gen, __ATOMIC_RELAXED);
+   old = __atomic_load_n(&fe->boot_gen, __ATOMIC_RELAXED);
+
+   if (old == gen || !__atomic_compare_exchange_n(&fe->boot_gen, &old, gen, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return;
+
+   if ((idx = __atomic_fetch_add(&prefetch_nseen, 1, __ATOMIC_RELAXED)) < prefetch_max)
+      __atomic_store_n(&prefetch_seen[idx], fe, __ATOMIC_RELEASE);
+}
+
+// Window's over: write the profile out
+static void prefetch_save(void *arg) {
+   vfs_cache_entry *fe;
+   char path[PATH_MAX], tmp[PATH_MAX + 8];
+   unsigned long i, n, saved = 0;
+   FILE *fp;
+
+   __atomic_store_n(&prefetch_deadline, 0, __ATOMIC_RELEASE);
+
+   if ((n = __atomic_load_n(&prefetch_nseen, __ATOMIC_ACQUIRE)) > prefetch_max)
+      n = prefetch_max;
+
+   // A launch that never got going shouldn't wipe out a good profile
+   if (n == 0 || prefetch_path(path, sizeof(path)) != 0) {
+      Log(LOG_INFO, "boot profile: nothing touched in the first %d s, keeping the old one", prefetch_window);
+      return;
+   }
+
+   snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+   if ((fp = fopen(tmp, "w")) == NULL) {
+      Log(LOG_WARNING, "boot profile: can't write %s: %s", tmp, strerror(errno));
+      return;
+   }
+
+   for (i = 0; i < n; i++) {
+      if ((fe = __atomic_load_n(&prefetch_seen[i], __ATOMIC_ACQUIRE)) == NULL)
+         continue;
+
+      fprintf(fp, "%s\n", fe->path);
+      saved++;
+   }
+
+   if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+      Log(LOG_WARNING, "boot profile: can't write %s: %s", path, strerror(errno));
+      unlink(tmp);
+      return;
+   }
+
+   Log(LOG_INFO, "boot profile: %lu files touched in the first %d s saved to %s", saved, prefetch_window, path);
+}
+
+void prefetch_record(void) {
+   int max;
+
+   if ((prefetch_window = dconf_get_int("boot.profile.window", PREFETCH_WINDOW)) <= 0)
+      return;
+
+   if (prefetch_seen == NULL) {
+      if ((max = dconf_get_int("boot.profile.max", PREFETCH_MAX)) < 0)
+         Log(LOG_WARNING, "boot profile: boot.profile.max %d is negative, not recording", max);
+
+      if (max <= 0 || (prefetch_seen = mem_calloc(max, sizeof(*prefetch_seen))) == NULL)
+         return;
+
+      prefetch_max = max;
+   }
+
+   // Relaunched before the last window closed: start that one over
+   __atomic_store_n(&prefetch_deadline, 0, __ATOMIC_RELEASE);
+   cron_stop("prefetch.save");
+
+   memset(prefetch_seen, 0, prefetch_max * sizeof(*prefetch_seen));
+   __atomic_store_n(&prefetch_nseen, 0, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&prefetch_gen, 1, __ATOMIC_RELAXED);
+   __atomic_store_n(&prefetch_deadline, prefetch_now() + prefetch_window * 1000000000UL, __ATOMIC_RELEASE);
+
+   cron_once("prefetch.save", prefetch_save, NULL, prefetch_window, 0);
+}
+
+////////////
+// replay //
+////////////
+static void prefetch_job_done(struct prefetch_job *job) {
+   unsigned long i;
+
+   Log(LOG_INFO, "boot prefetch: %lu of %lu files extracted in %.1f ms", job->done, job->n,
+       (prefetch_now() - job->t0) / 1e6);
+
+   for (i = 0; i < job->n; i++)
+      mem_free(job->paths[i]);
+
+   mem_free(job->paths);
+   mem_free(job);
+}
+
+static void prefetch_task(void *arg) {
+   struct prefetch_job *job = (struct prefetch_job *)arg;
+   unsigned long i;
+   int waited;
+
+   // The vfs thread may still be importing packages
+   for (waited = 0; !vfs_index_ready() && !conf.dying && waited < PREFETCH_WAIT * 100; waited++)
+      usleep(10000);
+
+   // Directories, links and missing paths are just looked up (that warms the index too)
+   while (!conf.dying && (i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n)
+      if (vfs_precache(job->paths[i]) == 0)
+         __atomic_add_fetch(&job->done, 1, __ATOMIC_RELAXED);
+
+   if (__atomic_sub_fetch(&job->running, 1, __ATOMIC_ACQ_REL) == 0)
+      prefetch_job_done(job);
+}
+
+int prefetch_replay(void) {
+   struct prefetch_job *job;
+   char path[PATH_MAX], line[PATH_MAX], **paths;
+   unsigned long n, size = 0;
+   int i, jobs;
+   size_t len;
+   FILE *fp;
+
+   if (!dconf_get_bool("boot.prefetch", 1) || prefetch_path(path, sizeof(path)) != 0)
+      return 0;
+
+   if ((fp = fopen(path, "r")) == NULL)
+      return 0;
+
+   if ((job = mem_alloc(sizeof(*job))) == NULL) {
+      fclose(fp);
+      return -1;
+   }
+
+   while (fgets(line, sizeof(line), fp) != NULL) {
+      if ((len = strlen(line)) > 0 && line[len - 1] == '\n')
+         line[--len] = '\0';
+
+      if (len == 0)
+         continue;
+
+      if (job->n == size) {
+         size = (size ? size * 2 : 256);
+
+         if ((paths = mem_realloc(job->paths, size * sizeof(*paths))) == NULL)
+            break;
+
+         job->paths = paths;
+      }
+
+      job->paths[job->n++] = str_dup(line);
+   }
+
+   fclose(fp);
+
+   if (job->n == 0) {
+      if (job->paths != NULL)
+         mem_free(job->paths);
+
+      mem_free(job);
+      return 0;
+   }
+
+   if ((jobs = dconf_get_int("boot.prefetch.jobs", PREFETCH_JOBS)) <= 0)
+      jobs = 1;
+
+   // The last worker frees job, maybe before we're done here
+   n = job->n;
+   job->t0 = prefetch_now();
+   job->running = jobs;
+
+   for (i = 0; i < jobs; i++) {
+      if (threadpool_submit(main_threadpool, prefetch_task, job) != 0) {
+         if (i == 0)
+            Log(LOG_WARNING, "boot prefetch: no task workers, not prefetching");
+
+         // The ones that never started won't be counting down
+         if (__atomic_sub_fetch(&job->running, jobs - i, __ATOMIC_ACQ_REL) == 0)
+            prefetch_job_done(job);
+
+         return (i ? i : -1);
+      }
+   }
+
+   Log(LOG_INFO, "boot prefetch: %lu paths from %s on %d workers", n, path, jobs);
+   return jobs;
+}
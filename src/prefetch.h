@@ -0,0 +1,43 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/prefetch.h:
+ *	Boot profile: record what init touches, prefetch it next time
+ *
+ *	A jail's init does the same thing every time it starts. For the
+ * first boot.profile.window seconds after the cell launches init, the
+ * first touch of every file is noted (in order); when the window
+ * closes the list goes to <path.statedir>/boot.profile, one path per
+ * line (jailfs --trace-report can write one too).
+ *	On the next launch the cell hands that list to boot.prefetch.jobs
+ * task workers, which look each path up and extract and read ahead
+ * the files while init is being exec'd.
+ *	Touches come from vfs_lookup() (FUSE lookups) and vfs_op_read().
+ */
+#if	!defined(__PREFETCH_H)
+#define	__PREFETCH_H
+#include "vfs.h"
+
+#define	PREFETCH_WINDOW		30	// seconds, if boot.profile.window is unset
+#define	PREFETCH_MAX		8192	// files, if boot.profile.max is unset
+#define	PREFETCH_JOBS		4	// workers, if boot.prefetch.jobs is unset
+#define	PREFETCH_WAIT		30	// seconds to wait for the package index
+
+// Cell thread, right before launching init
+extern int prefetch_replay(void);
+extern void prefetch_record(void);
+
+// Hook: a process in the jail used fe
+extern void prefetch_touch(vfs_cache_entry *fe);
+
+#endif	// !defined(__PREFETCH_H)
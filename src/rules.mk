@@ -1,4 +1,5 @@
 bins += bin/jailfs
+extra_targets += lib/libfspkg.so
 
 
 jailfs_objs += .obj/api.o
@@ -14,16 +15,34 @@ jailfs_objs += .obj/hooks.o
 jailfs_objs += .obj/i18n.o
 jailfs_objs += .obj/kilo.o
 jailfs_objs += .obj/linenoise.o
+jailfs_objs += .obj/logger.o
 jailfs_objs += .obj/main.o
+jailfs_objs += .obj/memstats.o
 ifeq (y, ${CONFIG_MODULES})
 jailfs_objs += .obj/module.o
 endif
 jailfs_objs += .obj/pkg.o
+jailfs_objs += .obj/pkg-bench.o
+jailfs_objs += .obj/prefetch.o
 jailfs_objs += .obj/scripting.o
 jailfs_objs += .obj/shell.o
 jailfs_objs += .obj/threads.o
+jailfs_objs += .obj/trace.o
+jailfs_objs += .obj/trace-report.o
 jailfs_objs += .obj/unix.o
 jailfs_objs += .obj/vfs.o
+jailfs_objs += .obj/vfs-shm.o
+jailfs_objs += .obj/vfs-stats.o
+jailfs_objs += .obj/watchdog.o
 warden_objs += .obj/warden.o
 
-clean_objs += ${jailfs_objs} ${warden_objs}
+# LD_PRELOAD library serving lookups from the shared index (not linked into jailfs!)
+lib/libfspkg.so: src/libfspkg.c src/vfs-shm.h
+	@echo "[LD] $< => $@"
+	${CC} ${warn_flags} ${CFLAGS} -U_FILE_OFFSET_BITS -shared -pthread -o $@ $< -ldl
+ifeq (${CONFIG_STRIP_LIBS}, y)
+	@echo "[STRIP] $@"
+	@strip $@
+endif
+
+clean_objs += ${jailfs_objs} ${warden_objs} lib/libfspkg.so
@@ -33,7 +33,16 @@
 #include "unix.h"
 #include "conf.h"
 #include "threads.h"
+#include "cron.h"
 #include "gc.h"
+#include "logger.h"
+#include "memstats.h"
+#include "vfs-stats.h"
+#include "trace.h"
+#include "vfs-shm.h"
+#include "control.h"
+#include "debugger.h"
+#include "watchdog.h"
 
 static BlockHeap *heap_shell_hints = NULL;
 // extern from kilo.c
@@ -43,193 +52,6 @@ extern int kilo_main(const char *filename);
 static char shell_prompt[64];
 static char shell_level[40];
 
-struct log_levels {
-   char *str;
-   int level;
-};
-
-static struct log_levels log_levels[] = {
-   { "debug", LOG_DEBUG },
-   { "info", LOG_INFO },
-   { "notice", LOG_NOTICE },
-   { "warn", LOG_WARNING },
-   { "error", LOG_ERR },
-   { "crit", LOG_CRIT },
-   { "alert", LOG_ALERT },
-   { "emerg", LOG_EMERG },
-   { "shell", LOG_SHELL },
-   { NULL, -1 },
-};
-
-// Internal thread-local state keeping
-typedef struct {
-  enum { NONE = 0, SYSLOG, STDOUT, LOGFILE, FIFO } type;
-  FILE *fp;
-} LogHndl;
-static LogHndl *mainlog;
-
-//////////////////////////////////////////////////////////
-// Initial (early) log support, storing messages in memory until logfile is open
-//
-// This isn't finished, but wil
-static char *logger_earlylog = NULL,
-            *earlylog_p = NULL;
-
-static void *earlylog_init(size_t bufsz) {
-     if (logger_earlylog != NULL) {
-        Log(LOG_DEBUG, "earlylog_init() called twice, why? check your code...");
-        return logger_earlylog;
-     }
-
-     if ((logger_earlylog = mem_alloc(MAX_EARLYLOG)) != NULL)
-        return logger_earlylog;
-
-     return NULL;
-}
-
-static int earlylog_append(const char *line) {
-    // XXX: Add to the end of the log
-    if (earlylog_p != NULL) {
-       // Append it
-       Log(LOG_SHELL, "early-log: %s", line);
-    }
-    return 0;
-}
-
-static void earlylog_fini(void) {
-    if (logger_earlylog != NULL) {
-       memset(logger_earlylog, 0, MAX_EARLYLOG);
-       mem_free(logger_earlylog);
-    }
-    logger_earlylog = NULL;
-}
-////////////////////////////////////////////
-   
-// Convert numeric log level to string
-static inline const char *LogName(int level) {
-   struct log_levels *lp = log_levels;
-
-   do {
-      if (lp->level == level)
-         return lp->str;
-
-      lp++;
-   } while(lp->str != NULL);
-
-   return NULL;
-}
-
-// Convert string log level to integer
-static inline const int LogLevel(const char *name) {
-   struct log_levels *lp = log_levels;
-
-   do {
-      if (strcmp(lp->str, name) == 0)
-         return lp->level;
-      lp++;
-   } while(lp->str != NULL);
-   return -1;
-}
-
-void Log(int level, const char *msg, ...) {
-   va_list ap;
-   char buf[4096];
-   time_t t;
-   struct tm *lt;
-   int min_lvl;
-   FILE *fp = stdout;
-
-   if (!msg)
-      return;   
-
-   va_start(ap, msg);
-   t = time(NULL);
-
-   if ((lt = localtime(&t)) == NULL) {
-      perror("localtime");
-      return;
-   }
-
-   // If configuration isn't up yet, all messages are info priority
-   if (conf.dict != NULL)
-      min_lvl = LogLevel(dconf_get_str("log.level", "info"));
-   else
-      min_lvl = LogLevel("info");
-
-#if	0
-   // If log level of message is lower than minimum level, ignore it
-   if (min_lvl > level) {
-      printf("min_lvl: %d <%s> || level: %d <%s>\n", min_lvl, LogLevel(min_lvl), level, LogLevel(level));
-      return;
-   }
-#endif	// 0
-
-   if (mainlog) {
-      if (mainlog->type == SYSLOG)
-         vsyslog(level, msg, ap);
-
-      if (mainlog->type != STDOUT && mainlog->fp)
-         fp = mainlog->fp;
-   }
-
-   vsnprintf(buf, sizeof(buf) - 1, msg, ap);
-   fprintf(fp, "%d/%02d/%02d %02d:%02d:%02d %5s: %s\n",
-      lt->tm_year + 1900, lt->tm_mon + 1, lt->tm_mday, lt->tm_hour, lt->tm_min, lt->tm_sec,
-      LogName(level), buf);
-
-   if (fp != stdout) {
-      printf("%s\n", buf);
-      fflush(stdout);
-   }
-
-   va_end(ap);
-}
-
-void log_open(const char *target) {
-   if (mainlog)
-      mem_free(mainlog);
-
-   mainlog = mem_alloc(sizeof(Log));
-
-   if (strcasecmp(target, "syslog") == 0) {
-      mainlog->type = SYSLOG;
-      openlog("jailfs", LOG_NDELAY|LOG_PID, LOG_DAEMON);
-   } else if (strcasecmp(target, "stdout") == 0) {
-      mainlog->type = STDOUT;
-      mainlog->fp = stdout;
-   } else if (strncasecmp(target, "fifo://", 7) == 0) {
-      if (is_fifo(target + 7) || is_file(target + 7))
-         unlink(target + 7);
-
-      mkfifo(target+7, 0600);
-
-      if (!(mainlog->fp = fopen(target + 7, "w"))) {
-         Log(LOG_ERR, "Failed opening log fifo '%s' %s (%d)", target+7, errno, strerror(errno));
-         mainlog->fp = stdout;
-      } else
-         mainlog->type = FIFO;
-   } else if (strncasecmp(target, "file://", 7) == 0) {
-      if (!(mainlog->fp = fopen(target + 7, "w+"))) {
-         Log(LOG_ERR, "failed opening log file '%s' %s (%d)", target+7, errno, strerror(errno));
-         mainlog->fp = stdout;
-      } else
-         mainlog->type = LOGFILE;
-   }
-}
-
-static void log_close(void) {
-   if (mainlog == NULL)
-      return;
-
-   if (mainlog->type == LOGFILE || mainlog->type == FIFO)
-      fclose(mainlog->fp);
-   else if (mainlog->type == SYSLOG)
-      closelog();
-
-   mem_free(mainlog);
-   mainlog = NULL;
-}
-
 // this is in src/kilo.c
 void cmd_edit(dict *args) {
    char *ac;
@@ -295,8 +117,119 @@ void cmd_reload(dict *args) {
    return;
 }
 
+// Same as a scrape of the control socket
 static void cmd_stats(dict *args) {
-   Log(LOG_SHELL, "stats requested by user:");
+   control_metrics(stdout);
+   fflush(stdout);
+}
+
+// Reload jailfs.cf (on the main loop, like SIGHUP)
+static void cmd_conf_load(dict *args) {
+   Log(LOG_SHELL, "Reloading configuration...");
+   conf_reload_request();
+}
+
+static void cmd_gc_now(dict *args) {
+   size_t released = gc_all();
+
+   Log(LOG_SHELL, "Garbage collection returned %lu bytes to the OS", (unsigned long)released);
+}
+
+static void cmd_gc_stats(dict *args) {
+   gc_dump();
+}
+
+static void cmd_heap_stats(dict *args) {
+   memstats_dump();
+}
+
+static void cmd_heap_sites(dict *args) {
+   memstats_sites();
+}
+
+// Machine-readable statistics, to a file if one is given
+static void cmd_heap_dump(dict *args) {
+   const char *path = dict_get(args, "1", NULL);
+   FILE *fp = stdout;
+
+   if (path != NULL && (fp = fopen(path, "w")) == NULL) {
+      Log(LOG_SHELL, "Can't open %s: %s", path, strerror(errno));
+      return;
+   }
+
+   memstats_write(fp);
+
+   if (fp != stdout) {
+      fclose(fp);
+      Log(LOG_SHELL, "Heap statistics written to %s", path);
+   }
+}
+
+static void cmd_vfs_stats(dict *args) {
+   vfs_stats_dump();
+}
+
+static void cmd_vfs_trace(dict *args) {
+   trace_dump();
+}
+
+static void cmd_vfs_preload(dict *args) {
+   vfs_shm_dump();
+}
+
+static void cmd_cron_jobs(dict *args) {
+   cron_dump();
+}
+
+static void cmd_cron_callbacks(dict *args) {
+   watchdog_dump();
+}
+
+static void cmd_cron_stop(dict *args) {
+   const char *name = dict_get(args, "1", NULL);
+
+   if (name == NULL)
+      return;
+
+   if (cron_stop(name) > 0)
+      Log(LOG_SHELL, "Stopped job %s", name);
+   else
+      Log(LOG_SHELL, "No such job: %s", name);
+}
+
+static void cmd_profile_start(dict *args) {
+   const char *hz = dict_get(args, "1", NULL);
+
+   if (profiler_start(hz ? atoi(hz) : 0) != 0)
+      Log(LOG_SHELL, "Profiler is already running (or can't start, see the log)");
+}
+
+static void cmd_profile_stop(dict *args) {
+   if (profiler_stop() != 0)
+      Log(LOG_SHELL, "Profiler isn't running");
+}
+
+static void cmd_profile_status(dict *args) {
+   profiler_status();
+}
+
+// Collapsed stacks, to a file if one is given (flamegraph.pl file > out.svg)
+static void cmd_profile_save(dict *args) {
+   const char *path = dict_get(args, "1", NULL);
+   FILE *fp = stdout;
+   int n;
+
+   if (path != NULL && (fp = fopen(path, "w")) == NULL) {
+      Log(LOG_SHELL, "Can't open %s: %s", path, strerror(errno));
+      return;
+   }
+
+   n = profiler_write(fp);
+
+   if (fp != stdout) {
+      fclose(fp);
+      Log(LOG_SHELL, "%d stacks written to %s", n, path);
+   }
 }
 
 static void cmd_conf_dump(dict *args) {
@@ -334,7 +267,7 @@ static struct shell_cmd menu_value[] = {
 
 static struct shell_cmd menu_conf[] = {
    { "dump", "Dump config values", HINT_CYAN, 1, 0, 0, 0, cmd_conf_dump, NULL },
-   { "load", "Load saved config file", HINT_CYAN, 1, 0, 1, 1, NULL, NULL },
+   { "load", "Reload config file", HINT_CYAN, 1, 0, 0, 0, cmd_conf_load, NULL },
    { "save", "Write config file", HINT_CYAN, 1, 0, 1, 1, NULL, NULL },
    { "set", "Set config value", HINT_CYAN, 1, 0, 3, 3, NULL, NULL },
    { "show", "Get config value", HINT_CYAN, 1, 0, 1, 3, NULL, NULL },
@@ -343,8 +276,9 @@ static struct shell_cmd menu_conf[] = {
 
 static struct shell_cmd menu_cron[] = {
    { "debug", "show/toggle debugging status", HINT_RED, 0, 1, 0, 1, NULL, menu_value },
-   { "jobs", "Show scheduled events", HINT_CYAN, 1, 0, 0, 0, NULL, NULL },
-   { "stop", "Stop a scheduled event", HINT_CYAN, 1, 0, 1, 1, NULL, NULL },
+   { "callbacks", "Main loop callback run times (watchdog)", HINT_CYAN, 1, 0, 0, 0, cmd_cron_callbacks, NULL },
+   { "jobs", "Show scheduled events", HINT_CYAN, 1, 0, 0, 0, cmd_cron_jobs, NULL },
+   { "stop", "Stop a scheduled event", HINT_CYAN, 1, 0, 1, 1, cmd_cron_stop, NULL },
    { .cmd = NULL, .desc = NULL, .menu = NULL },
 };
 
@@ -371,7 +305,10 @@ static struct shell_cmd menu_vfs[] = {
    { "less", "Show contents of a file (with pager)", HINT_CYAN, 1, 0, 1, 1, NULL, NULL },
    { "ls", "Display directory listing", HINT_CYAN, 1, 0, 0, 1, NULL, NULL },
    { "mv", "Move file/dir in jail", HINT_RED, 0, 0, 1, -1, NULL, NULL },
+   { "preload", "Shared metadata index for libfspkg.so", HINT_CYAN, 1, 0, 0, 0, cmd_vfs_preload, NULL },
    { "rm", "Remove file/directory in jail", HINT_RED, 0, 0, 1, -1, NULL, NULL },
+   { "stats", "FUSE operation latencies and cache hit rates", HINT_CYAN, 1, 0, 0, 0, cmd_vfs_stats, NULL },
+   { "trace", "Package access tracer status", HINT_CYAN, 1, 0, 0, 0, cmd_vfs_trace, NULL },
    { .cmd = NULL, .desc = NULL, .menu = NULL },
 };
 
@@ -381,7 +318,8 @@ static struct shell_cmd menu_logging[] = {
 
 static struct shell_cmd menu_mem_gc[] = {
    { "debug", "show/toggle debugging status", HINT_CYAN, 1, 1, 0, 1, NULL, menu_value },
-   { "now", "Run garbage collection now", HINT_CYAN, 1, 0, 0, 0, NULL, NULL },
+   { "now", "Run garbage collection now", HINT_CYAN, 1, 0, 0, 0, cmd_gc_now, NULL },
+   { "stats", "Show collector statistics", HINT_CYAN, 1, 0, 0, 0, cmd_gc_stats, NULL },
    { .cmd = NULL, .desc = NULL, .menu = NULL },
 };
 
@@ -398,6 +336,9 @@ static struct shell_cmd menu_mem_bh_tuning[] = {
 
 static struct shell_cmd menu_mem_bh[] = {
    { "debug", "show/toggle debugging status", HINT_CYAN, 1, 1, 0, 1, NULL, menu_value },
+   { "dump", "Write statistics as key=value lines", HINT_CYAN, 1, 0, 0, 1, cmd_heap_dump, NULL },
+   { "sites", "Outstanding objects by allocation site", HINT_CYAN, 1, 0, 0, 0, cmd_heap_sites, NULL },
+   { "stats", "Show per heap statistics", HINT_CYAN, 1, 0, 0, 0, cmd_heap_stats, NULL },
    { "tuning", "Tuning knobs", HINT_CYAN, 1, 1, 0, -1, NULL, menu_mem_bh_tuning },
    { .cmd = NULL, .desc = NULL, .menu = NULL },
 };
@@ -427,7 +368,10 @@ static struct shell_cmd menu_pkg[] = {
 
 static struct shell_cmd menu_profiling[] = {
    { "enable", "show/toggle profiling status", HINT_CYAN, 1, 1, 0, 1, NULL, menu_value },
-   { "save", "Save profiling data to disk", HINT_CYAN, 1, 0, 0, 0, NULL, NULL },
+   { "save", "Save profiling data to disk (collapsed stacks)", HINT_CYAN, 1, 0, 0, 1, cmd_profile_save, NULL },
+   { "start", "Start the sampling profiler [hz]", HINT_CYAN, 1, 0, 0, 1, cmd_profile_start, NULL },
+   { "status", "Show sampling profiler status", HINT_CYAN, 1, 0, 0, 0, cmd_profile_status, NULL },
+   { "stop", "Stop the sampling profiler", HINT_CYAN, 1, 0, 0, 0, cmd_profile_stop, NULL },
    { .cmd = NULL, .desc = NULL, .menu = NULL },
 };
 
@@ -540,8 +484,10 @@ static int shell_command(const char *line) {
       cmd_shutdown(args);
    } else if (strcasecmp(line, "conf dump") == 0) {
       cmd_conf_dump(args);
+   } else if (strcasecmp(line, "conf load") == 0) {
+      cmd_conf_load(args);
    } else if (strcasecmp(line, "gc now") == 0) {
-      Log(LOG_SHELL, "gc: Freed %d objects", gc_all());
+      cmd_gc_now(args);
    } else {	// Attempt to render the menu..
       menu = shell_get_menu(line);
       i = 0;
@@ -712,6 +658,7 @@ void *thread_shell_init(void *data) {
    char *line = NULL;
    thread_entry((dict *)data);
    heap_shell_hints = blockheap_create(SHELL_HINT_MAX, 32, "shell hints");
+   gc_register_heap(heap_shell_hints, "tuning.timer.blockheap_gc", 60);
 
    // Configure the input widget appropriately
    linenoiseSetMultiLine(0);
@@ -738,7 +685,9 @@ void *thread_shell_init(void *data) {
       lines = w.ws_row;
       columns = w.ws_col;
       printf("[%d;0[K", lines-1);
+      ebr_offline();					// Could be a while...
       line = linenoise(shell_prompt);				// Show prompt
+      ebr_online();
 
       if (line == NULL)
          continue;
@@ -759,13 +708,8 @@ void *thread_shell_init(void *data) {
 // Shell destructor
 void *thread_shell_fini(void *data) {
    linenoiseHistorySave("state/.shell.history");	// Save history
-   log_close();
    blockheap_destroy(heap_shell_hints);
    thread_exit((dict *)data);
    return NULL;
 }
 
-int shell_gc(void) {
-   blockheap_garbagecollect(heap_shell_hints);
-   return 0;
-}
@@ -61,7 +61,4 @@ extern void log_open(const char *target);
 extern void *thread_shell_init(void *data);
 extern void *thread_shell_fini(void *data);
 
-// garbage collect
-extern int shell_gc(void);
-
 #endif	// !defined(__SHELL_H)
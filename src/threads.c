@@ -12,8 +12,11 @@
  * No warranty of any kind. Good luck!
  */
 /* Thread pools */
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include <lsd/lsd.h>
 #include "shell.h"
+#include "logger.h"
 #include "threads.h"
 #include "unix.h"
 #include "conf.h"
@@ -23,6 +26,7 @@ pthread_cond_t core_ready_c;
 
 ThreadPool *threadpool_init(const char *name, const char *opts) {
   ThreadPool *r;
+  char key[128];
   int tmp;
 
   if (!(r = (ThreadPool *)mem_alloc(sizeof(ThreadPool)))) {
@@ -35,21 +39,107 @@ ThreadPool *threadpool_init(const char *name, const char *opts) {
      return NULL;
   }
 
-  if ((tmp = dict_getInt(conf.dict, "tuning.threads.stacksz", 0)) > 0) {
+  if ((tmp = dconf_get_int("tuning.threads.stacksz", 0)) > 0) {
      if (pthread_attr_setstacksize(&(r->pth_attr), tmp) != 0)
         Log(LOG_ERR, "%s: Unable to set stack size: %s (%d)", __FUNCTION__, strerror(errno), errno);
   }
 
   r->name = strdup(name);
   r->list = create_list();
+  pthread_mutex_init(&r->inject_lock, NULL);
+
+  snprintf(key, sizeof(key), "tuning.affinity.%s", name);
+
+  if (thread_affinity_parse(dconf_get_str(key, "cpuset"), &r->affinity, &r->aff_node) != 0) {
+     Log(LOG_ERR, "%s: invalid %s, using cpuset", __FUNCTION__, key);
+     r->affinity = THR_AFF_CPUSET;
+  }
 
   return r;
 }
 
+static void threadpool_stop(ThreadPool *pool);
+
+int thread_affinity_parse(const char *str, enum thread_affinity *policy, int *node) {
+   char *end;
+
+   *node = -1;
+
+   if (str == NULL || strcasecmp(str, "cpuset") == 0 || strcasecmp(str, "none") == 0)
+      *policy = THR_AFF_CPUSET;
+   else if (strcasecmp(str, "pin") == 0)
+      *policy = THR_AFF_PIN;
+   else if (strcasecmp(str, "spread") == 0)
+      *policy = THR_AFF_SPREAD;
+   else if (strncasecmp(str, "node:", 5) == 0) {
+      *policy = THR_AFF_NODE;
+      *node = strtol(str + 5, &end, 10);
+
+      if (end == str + 5 || *end != '\0' || *node < 0)
+         return -1;
+   } else
+      return -1;
+
+   return 0;
+}
+
+int thread_set_affinity(pthread_t thr, enum thread_affinity policy, int node, int idx) {
+   cpu_set_t set;
+   int cpu, i, nodes = topo_nodes();
+
+   switch (policy) {
+      case THR_AFF_PIN:
+         if ((cpu = topo_nth_cpu(idx)) < 0)
+            return -1;
+
+         CPU_ZERO(&set);
+         CPU_SET(cpu, &set);
+         node = topo_cpu_node(cpu);
+         break;
+      case THR_AFF_SPREAD:
+         // Deal to nodes that have CPUs in our cpuset
+         for (i = 0; i < nodes; i++)
+            if (topo_node_cpus((idx + i) % nodes, &set) > 0)
+               break;
+
+         node = (i < nodes ? (idx + i) % nodes : -1);
+         break;
+      case THR_AFF_NODE:
+         if (topo_node_cpus(node, &set) == 0) {
+            Log(LOG_ERR, "%s: node %d has no CPUs in our cpuset", __FUNCTION__, node);
+            node = -1;
+         }
+         break;
+      default:
+         node = -1;
+         break;
+   }
+
+   // Threads inherit their creator's mask, which may be narrower than the cpuset
+   if (node < 0) {
+      topo_allowed(&set);
+      node = (topo_nodes() == 1 ? 0 : -1);
+   }
+
+   if ((i = pthread_setaffinity_np(thr, sizeof(set), &set)) != 0) {
+      Log(LOG_ERR, "%s: pthread_setaffinity_np: %s (%d)", __FUNCTION__, strerror(i), i);
+      return -1;
+   }
+
+   return node;
+}
+
+static int threadpool_place(ThreadPool *pool, pthread_t thr) {
+   return thread_set_affinity(thr, pool->affinity, pool->aff_node,
+                              __atomic_fetch_add(&pool->nplaced, 1, __ATOMIC_RELAXED));
+}
+
 int threadpool_destroy(ThreadPool *pool) {
     if (pool == NULL)
        return -1;
 
+    threadpool_stop(pool);
+
     if (pool->list != NULL) {
        destroy_list(pool->list);
        pool->list = NULL;
@@ -78,6 +168,8 @@ Thread *thread_create(ThreadPool *pool, void *(*init)(void *), void *(*fini)(voi
      return NULL;
   }
 
+  threadpool_place(pool, tmp->thr_info);
+
   // update refcnt
   tmp->refcnt++;
 
@@ -88,8 +180,7 @@ Thread *thread_create(ThreadPool *pool, void *(*init)(void *), void *(*fini)(voi
   /* Add to thread pool */
   list_add(pool->list, tmp, sizeof(tmp));
 
-  if (dconf_get_bool("debug.threads", 0) == 1)
-     Log(LOG_DEBUG, "new thread %x (%s) created in pool %s", tmp, descr, pool->name);
+  Debug(DEBUG_THREADS, "new thread %x (%s) created in pool %s", tmp, descr, pool->name);
 
   // Set up the thread name (for ps/htop/etc)
   memset(thrname, 0, sizeof(thrname));
@@ -115,7 +206,7 @@ Thread *thread_shutdown(ThreadPool *pool, Thread *thr) {
     * Side-cases:
     */
    if (thr->refcnt <= 0) {
-      if (dconf_get_bool("debug.threads", 0) == 1) {
+      if (debug_enabled(DEBUG_THREADS)) {
          Log(LOG_DEBUG, "unallocating thread %x due to refcnt == 0", thr);
 
          if (thr->refcnt < 0)
@@ -133,6 +224,308 @@ Thread *thread_shutdown(ThreadPool *pool, Thread *thr) {
    return thr;
 }
 
+////////////////////
+// task scheduler //
+////////////////////
+#define	TP_DEQUE_MIN	256
+
+static __thread struct tp_worker *tp_self = NULL;
+
+static int tp_futex(int *addr, int op, int val, const struct timespec *ts) {
+   return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+
+static struct tp_deque_buf *tp_buf_new(long size) {
+   struct tp_deque_buf *b;
+
+   if (!(b = mem_calloc(1, sizeof(struct tp_deque_buf) + size * sizeof(struct tp_task *))))
+      return NULL;
+
+   b->size = size;
+   return b;
+}
+
+#define	tp_slot_get(b, i)	__atomic_load_n(&(b)->slot[(i) & ((b)->size - 1)], __ATOMIC_RELAXED)
+#define	tp_slot_set(b, i, t)	__atomic_store_n(&(b)->slot[(i) & ((b)->size - 1)], (t), __ATOMIC_RELAXED)
+
+/*
+ * Chase-Lev deque, as in Le, Pop, Cohen & Zappa Nardelli,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models" (2013)
+ */
+static int tp_deque_push(struct tp_deque *dq, struct tp_task *t) {
+   long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED),
+        top = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+   struct tp_deque_buf *buf = __atomic_load_n(&dq->buf, __ATOMIC_RELAXED), *nbuf;
+   long i;
+
+   // Full: double it. Thieves may still be reading the old one
+   if (b - top > buf->size - 1) {
+      if (!(nbuf = tp_buf_new(buf->size * 2)))
+         return -1;
+
+      for (i = top; i < b; i++)
+         tp_slot_set(nbuf, i, tp_slot_get(buf, i));
+
+      __atomic_store_n(&dq->buf, nbuf, __ATOMIC_RELEASE);
+      ebr_retire(buf, NULL);
+      buf = nbuf;
+   }
+
+   tp_slot_set(buf, b, t);
+   // Publishes the task to thieves (a release store rather than a fence, same thing on x86)
+   __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELEASE);
+   return 0;
+}
+
+// Owner end
+static struct tp_task *tp_deque_take(struct tp_deque *dq) {
+   long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1, t;
+   struct tp_deque_buf *buf = __atomic_load_n(&dq->buf, __ATOMIC_RELAXED);
+   struct tp_task *x = NULL;
+
+   __atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+   if (t <= b) {
+      x = tp_slot_get(buf, b);
+
+      // Last one: race the thieves for it
+      if (t == b) {
+         if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            x = NULL;
+         __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+      }
+   } else
+      __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+
+   return x;
+}
+
+// Thief end
+static struct tp_task *tp_deque_steal(struct tp_deque *dq) {
+   long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE), b;
+   struct tp_deque_buf *buf;
+   struct tp_task *x;
+
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+
+   if (t >= b)
+      return NULL;
+
+   buf = __atomic_load_n(&dq->buf, __ATOMIC_ACQUIRE);
+   x = tp_slot_get(buf, t);
+
+   if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      return NULL;
+
+   return x;
+}
+
+static int tp_deque_empty(struct tp_deque *dq) {
+   return (__atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE) <=
+           __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE));
+}
+
+static struct tp_task *tp_inject_pop(ThreadPool *pool) {
+   struct tp_task *t;
+
+   if (__atomic_load_n(&pool->inject_head, __ATOMIC_ACQUIRE) == NULL)
+      return NULL;
+
+   pthread_mutex_lock(&pool->inject_lock);
+
+   if ((t = pool->inject_head) != NULL) {
+      __atomic_store_n(&pool->inject_head, t->next, __ATOMIC_RELEASE);
+
+      if (pool->inject_head == NULL)
+         pool->inject_tail = NULL;
+   }
+
+   pthread_mutex_unlock(&pool->inject_lock);
+   return t;
+}
+
+static struct tp_task *tp_find_work(struct tp_worker *w) {
+   ThreadPool *pool = w->pool;
+   struct tp_task *t;
+   int i, victim;
+
+   if ((t = tp_deque_take(&w->dq)) || (t = tp_inject_pop(pool)))
+      return t;
+
+   // Try everyone once, starting somewhere random
+   victim = rand_r(&w->rng) % pool->nworkers;
+
+   for (i = 0; i < pool->nworkers; i++, victim = (victim + 1) % pool->nworkers) {
+      if (victim == w->id)
+         continue;
+
+      if ((t = tp_deque_steal(&pool->workers[victim].dq))) {
+         w->stolen++;
+         return t;
+      }
+   }
+
+   return NULL;
+}
+
+static int tp_have_work(ThreadPool *pool) {
+   int i;
+
+   if (__atomic_load_n(&pool->inject_head, __ATOMIC_ACQUIRE) != NULL)
+      return 1;
+
+   for (i = 0; i < pool->nworkers; i++)
+      if (!tp_deque_empty(&pool->workers[i].dq))
+         return 1;
+
+   return 0;
+}
+
+static void *tp_worker_main(void *data) {
+   struct tp_worker *w = (struct tp_worker *)data;
+   ThreadPool *pool = w->pool;
+   struct tp_task *t;
+   char thrname[16];
+   int seq;
+
+   // Named before thread_entry(), which registers us with ebr under it
+   snprintf(thrname, sizeof(thrname), "%.10s/%u", pool->name, (unsigned int)w->id % 1000);
+   pthread_setname_np(pthread_self(), thrname);
+   tp_self = w;
+   thread_entry(NULL);
+
+   for (;;) {
+      if ((t = tp_find_work(w))) {
+         t->fn(t->arg);
+         mem_free(t);
+         w->executed++;
+         // Tasks don't hold on to shared pointers between runs
+         ebr_quiescent();
+         continue;
+      }
+
+      // Park: read the futex word first, so a submit after this wakes us
+      seq = __atomic_load_n(&pool->futex, __ATOMIC_SEQ_CST);
+
+      if (tp_have_work(pool))
+         continue;
+
+      if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE))
+         break;
+
+      __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+      ebr_offline();
+      tp_futex(&pool->futex, FUTEX_WAIT_PRIVATE, seq, NULL);
+      ebr_online();
+      __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+   }
+
+   ebr_unregister();
+   return NULL;
+}
+
+int threadpool_start(ThreadPool *pool, int nworkers) {
+   int i;
+
+   if (pool == NULL || pool->workers != NULL)
+      return -1;
+
+   if (nworkers <= 0 && (nworkers = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+      nworkers = 1;
+
+   if (posix_memalign((void **)&pool->workers, 64, nworkers * sizeof(struct tp_worker)) != 0) {
+      Log(LOG_ERR, "%s: allocation failed for %d workers", __FUNCTION__, nworkers);
+      return -1;
+   }
+
+   memset(pool->workers, 0, nworkers * sizeof(struct tp_worker));
+   pool->nworkers = nworkers;
+
+   for (i = 0; i < nworkers; i++) {
+      struct tp_worker *w = &pool->workers[i];
+
+      w->pool = pool;
+      w->id = i;
+      w->rng = (unsigned int)time(NULL) ^ (i * 2654435761u);
+      w->dq.buf = tp_buf_new(TP_DEQUE_MIN);
+   }
+
+   // Nobody looks at workers[] past nworkers, so a failed start just shrinks the pool
+   for (i = 0; i < nworkers; i++) {
+      if (pthread_create(&pool->workers[i].thr, &pool->pth_attr, tp_worker_main, &pool->workers[i]) != 0) {
+         Log(LOG_ERR, "%s: %s: worker %d creation failed: %s (%d)", __FUNCTION__, pool->name, i, strerror(errno), errno);
+         pool->nworkers = i;
+         break;
+      }
+
+      threadpool_place(pool, pool->workers[i].thr);
+   }
+
+   Log(LOG_INFO, "thread pool %s: %d workers started", pool->name, pool->nworkers);
+   return pool->nworkers;
+}
+
+int threadpool_submit(ThreadPool *pool, threadpool_fn fn, void *arg) {
+   struct tp_task *t;
+
+   if (pool == NULL || fn == NULL || pool->nworkers == 0)
+      return -1;
+
+   if (!(t = mem_alloc(sizeof(struct tp_task))))
+      return -1;
+
+   t->fn = fn;
+   t->arg = arg;
+   t->next = NULL;
+
+   // Our own workers keep what they spawn, everyone else goes through the queue
+   if (tp_self == NULL || tp_self->pool != pool || tp_deque_push(&tp_self->dq, t) != 0) {
+      pthread_mutex_lock(&pool->inject_lock);
+
+      if (pool->inject_tail)
+         pool->inject_tail->next = t;
+      else
+         __atomic_store_n(&pool->inject_head, t, __ATOMIC_RELEASE);
+
+      pool->inject_tail = t;
+      pthread_mutex_unlock(&pool->inject_lock);
+   }
+
+   __atomic_add_fetch(&pool->submitted, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&pool->futex, 1, __ATOMIC_SEQ_CST);
+
+   if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0)
+      tp_futex(&pool->futex, FUTEX_WAKE_PRIVATE, 1, NULL);
+
+   return 0;
+}
+
+// Let the workers finish what's queued, then join them
+static void threadpool_stop(ThreadPool *pool) {
+   int i;
+
+   if (pool->workers == NULL)
+      return;
+
+   __atomic_store_n(&pool->stopping, 1, __ATOMIC_RELEASE);
+   __atomic_add_fetch(&pool->futex, 1, __ATOMIC_SEQ_CST);
+   tp_futex(&pool->futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+
+   for (i = 0; i < pool->nworkers; i++) {
+      pthread_join(pool->workers[i].thr, NULL);
+      mem_free(pool->workers[i].dq.buf);
+   }
+
+   free(pool->workers);
+   pool->workers = NULL;
+   pool->nworkers = 0;
+}
+
 /*
  * You *MUST* call these at the beginning and end of your threads or bad things will happen
  */
@@ -145,8 +538,15 @@ void thread_entry(dict *_conf) {
 
     pthread_mutex_unlock(&core_ready_m);
     host_init();
+
+    // Lock-free structures only free memory once every thread has moved on
+    char thrname[16];
+    if (pthread_getname_np(pthread_self(), thrname, sizeof(thrname)) != 0)
+       thrname[0] = '\0';
+    ebr_register(thrname);
 }
 
 void thread_exit(dict *_conf) {
+    ebr_unregister();
     pthread_exit(NULL);
 }
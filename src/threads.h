@@ -24,16 +24,94 @@ typedef struct thread {
    char		*argv;
 } Thread;
 
+/*
+ * Task scheduler
+ *	A pool may also run worker threads (threadpool_start) which execute
+ * small tasks handed to threadpool_submit(). Each worker owns a
+ * Chase-Lev deque: it pushes/pops its own end without locks and idle
+ * workers steal from the other end. Tasks submitted from outside the
+ * pool go through a shared injection queue. Workers with nothing to do
+ * sleep on a futex until new work shows up.
+ */
+typedef void (*threadpool_fn)(void *arg);
+
+struct tp_task {
+   threadpool_fn fn;
+   void       *arg;
+   struct tp_task *next;		// injection queue link
+};
+
+struct tp_deque_buf {
+   long        size;			// slots (power of 2)
+   struct tp_task *slot[];
+};
+
+struct tp_deque {
+   long        top __attribute__((aligned(64)));	// thieves take from here
+   long        bottom __attribute__((aligned(64)));	// owner pushes/pops here
+   struct tp_deque_buf *buf;
+};
+
+/*
+ * Where a pool's threads may run, from tuning.affinity.<pool>:
+ *	cpuset	anywhere in the jail's cpuset (default)
+ *	pin	each thread on its own CPU, round robin
+ *	spread	threads dealt round robin to NUMA nodes, free within the node
+ *	node:N	every thread on node N
+ */
+enum thread_affinity {
+   THR_AFF_CPUSET = 0,
+   THR_AFF_PIN,
+   THR_AFF_SPREAD,
+   THR_AFF_NODE
+};
+
+struct ThreadPool;
+struct tp_worker {
+   struct tp_deque dq;
+   pthread_t   thr;
+   struct ThreadPool *pool;
+   int         id;
+   unsigned int rng;			// victim selection
+   unsigned long executed,		// tasks run
+                 stolen;		// ... of which taken from another worker
+} __attribute__((aligned(64)));
+
 typedef struct ThreadPool {
   char       *name;
   list_p      list;
   pthread_attr_t pth_attr;
+  enum thread_affinity affinity;
+  int         aff_node;			// THR_AFF_NODE target
+  int         nplaced;			// threads placed so far (round robin)
+
+  // Scheduler (only if threadpool_start() was called)
+  int         nworkers;
+  struct tp_worker *workers;
+  pthread_mutex_t inject_lock;
+  struct tp_task *inject_head,
+                 *inject_tail;
+  int         futex;			// bumped on every submit, workers sleep on it
+  int         sleepers;			// workers parked on futex
+  int         stopping;
+  unsigned long submitted;
 } ThreadPool;
 
 extern ThreadPool *threadpool_init(const char *name, const char *opts);
 extern int threadpool_destroy(ThreadPool *pool);
+// Start nworkers task threads (0: one per online CPU)
+extern int threadpool_start(ThreadPool *pool, int nworkers);
+// Queue fn(arg) to run on one of pool's workers
+extern int threadpool_submit(ThreadPool *pool, threadpool_fn fn, void *arg);
+// Core threads and the task workers (src/main.c)
+extern ThreadPool *main_threadpool;
 extern Thread *thread_create(ThreadPool *pool, void *(*init)(void *), void *(*fini)(void *), void *arg, const char *descr);
 extern Thread *thread_detach(ThreadPool *pool, Thread *thr);
+// Parse an affinity policy ("cpuset", "pin", "spread", "node:N")
+extern int thread_affinity_parse(const char *str, enum thread_affinity *policy, int *node);
+// Apply policy to thr as the idx'th thread placed. Returns the node it is
+// confined to, or -1 if it may run on more than one
+extern int thread_set_affinity(pthread_t thr, enum thread_affinity policy, int node, int idx);
 
 extern void thread_entry(dict *_conf);
 extern void thread_exit(dict *_conf);
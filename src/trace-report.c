@@ -0,0 +1,414 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/trace-report.c:
+ *	Package access tracer: reading traces back
+ *
+ *	jailfs --trace-report <file> [order] prints the hottest files, the
+ * order files were first touched in, I/O per package and the packages
+ * nothing touched at all. If order is given, the files go there too,
+ * one path per line in first access order. trace_precache() uses the
+ * same order to warm the cache at startup.
+ */
+#include <sys/types.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lsd/lsd.h>
+#include "conf.h"
+#include "logger.h"
+#include "trace.h"
+#include "vfs.h"
+
+#define	TRACE_REPORT_TOP	20	// rows in the hot file / access order tables
+#define	TRACE_MAX_ID	(1U << 24)	// larger inode/package numbers mean a corrupt trace
+
+struct trace_file_stat {
+   char       *path;
+   u_int32_t   ino;
+   u_int32_t   pkgid;
+   u_int64_t   size;
+   u_int64_t   first;			// ts of the first access
+   unsigned long lookups, reads;
+   u_int64_t   bytes;			// asked for by reads
+};
+
+struct trace_pkg_stat {
+   char       *path;
+   unsigned long files;			// distinct files touched
+   unsigned long lookups, reads;
+   u_int64_t   bytes;
+};
+
+// Both indexed by the number they had in the traced run
+struct trace_index {
+   struct trace_file_stat *files;
+   u_int32_t   nfiles;
+   struct trace_pkg_stat *pkgs;
+   u_int32_t   npkgs;
+   unsigned long events;
+   unsigned long bad;			// records with ids >= TRACE_MAX_ID
+   u_int64_t   last;			// ts of the last record
+   pid_t       pids[64];		// distinct pids, up to 64
+   int         npids;
+};
+
+/////////////
+// loading //
+/////////////
+int trace_load(const char *file, trace_cb fn, void *arg) {
+   struct trace_header th;
+   struct trace_rec rec;
+   char name[PATH_MAX];
+   FILE *fp;
+   int n = 0;
+
+   if ((fp = fopen(file, "r")) == NULL)
+      return -1;
+
+   if (fread(&th, sizeof(th), 1, fp) != 1 || memcmp(th.magic, TRACE_MAGIC, sizeof(th.magic)) != 0 ||
+       th.recsize != sizeof(struct trace_rec)) {
+      fclose(fp);
+      errno = EINVAL;
+      return -1;
+   }
+
+   // A short record at the end means we died halfway through a flush
+   while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+      name[0] = '\0';
+
+      if (rec.type == TRACE_FILE || rec.type == TRACE_PKG) {
+         if (rec.namelen >= sizeof(name) || fread(name, 1, rec.namelen, fp) != rec.namelen)
+            break;
+
+         name[rec.namelen] = '\0';
+      }
+
+      fn(&rec, name, arg);
+      n++;
+   }
+
+   fclose(fp);
+   return n;
+}
+
+// Grow a table indexed by id so id fits, zeroing the new part
+static void *trace_grow(void *tab, u_int32_t *n, u_int32_t id, size_t size) {
+   u_int32_t want = (*n ? *n : 256);
+   void *p;
+
+   if (id < *n)
+      return tab;
+
+   // Also keeps want from overflowing below
+   if (id >= TRACE_MAX_ID) {
+      errno = ERANGE;
+      return NULL;
+   }
+
+   while (want <= id)
+      want *= 2;
+
+   if ((p = mem_realloc(tab, want * size)) == NULL)
+      return NULL;
+
+   memset((char *)p + *n * size, 0, (want - *n) * size);
+   *n = want;
+   return p;
+}
+
+static struct trace_file_stat *trace_index_file(struct trace_index *ti, u_int32_t ino) {
+   struct trace_file_stat *files;
+
+   if ((files = trace_grow(ti->files, &ti->nfiles, ino, sizeof(*files))) == NULL)
+      return NULL;
+
+   ti->files = files;
+   files[ino].ino = ino;
+   return &files[ino];
+}
+
+static struct trace_pkg_stat *trace_index_pkg(struct trace_index *ti, u_int32_t pkgid) {
+   struct trace_pkg_stat *pkgs;
+
+   if ((pkgs = trace_grow(ti->pkgs, &ti->npkgs, pkgid, sizeof(*pkgs))) == NULL)
+      return NULL;
+
+   ti->pkgs = pkgs;
+   return &pkgs[pkgid];
+}
+
+static void trace_index_rec(const struct trace_rec *rec, const char *name, void *arg) {
+   struct trace_index *ti = (struct trace_index *)arg;
+   struct trace_file_stat *fs;
+   struct trace_pkg_stat *ps;
+   int i;
+
+   if (rec->ts > ti->last)
+      ti->last = rec->ts;
+
+   if (rec->type == TRACE_PKG) {
+      if ((ps = trace_index_pkg(ti, rec->pkgid)) == NULL)
+         ti->bad++;
+      else if (ps->path == NULL)
+         ps->path = str_dup(name);
+      return;
+   }
+
+   if ((fs = trace_index_file(ti, rec->ino)) == NULL) {
+      ti->bad++;
+      return;
+   }
+
+   if (rec->type == TRACE_FILE) {
+      if (fs->path == NULL)
+         fs->path = str_dup(name);
+      fs->size = rec->off;
+      return;
+   }
+
+   // An access
+   ti->events++;
+   fs->pkgid = rec->pkgid;
+
+   if (fs->lookups + fs->reads == 0 || rec->ts < fs->first)
+      fs->first = rec->ts;
+
+   if (rec->type == TRACE_READ) {
+      fs->reads++;
+      fs->bytes += rec->len;
+   } else
+      fs->lookups++;
+
+   for (i = 0; i < ti->npids && ti->pids[i] != rec->pid; i++)
+      ;
+
+   if (i == ti->npids && i < (int)(sizeof(ti->pids) / sizeof(ti->pids[0])))
+      ti->pids[ti->npids++] = rec->pid;
+}
+
+static void trace_index_free(struct trace_index *ti) {
+   u_int32_t i;
+
+   for (i = 0; i < ti->nfiles; i++)
+      if (ti->files[i].path != NULL)
+         mem_free(ti->files[i].path);
+
+   for (i = 0; i < ti->npkgs; i++)
+      if (ti->pkgs[i].path != NULL)
+         mem_free(ti->pkgs[i].path);
+
+   if (ti->files != NULL)
+      mem_free(ti->files);
+
+   if (ti->pkgs != NULL)
+      mem_free(ti->pkgs);
+}
+
+static int trace_by_first(const void *a, const void *b) {
+   const struct trace_file_stat *x = *(struct trace_file_stat * const *)a, *y = *(struct trace_file_stat * const *)b;
+
+   if (x->first != y->first)
+      return (x->first < y->first ? -1 : 1);
+
+   return (x->ino < y->ino ? -1 : x->ino > y->ino);
+}
+
+static int trace_by_heat(const void *a, const void *b) {
+   const struct trace_file_stat *x = *(struct trace_file_stat * const *)a, *y = *(struct trace_file_stat * const *)b;
+
+   if (x->bytes != y->bytes)
+      return (x->bytes > y->bytes ? -1 : 1);
+
+   if (x->reads + x->lookups != y->reads + y->lookups)
+      return (x->reads + x->lookups > y->reads + y->lookups ? -1 : 1);
+
+   return (x->ino < y->ino ? -1 : x->ino > y->ino);
+}
+
+// Files that were accessed and have a path, in first access order (mem_free() it)
+static struct trace_file_stat **trace_index_order(struct trace_index *ti, unsigned long *count) {
+   struct trace_file_stat **order;
+   unsigned long n = 0;
+   u_int32_t i;
+
+   if ((order = mem_alloc(sizeof(*order) * (ti->nfiles + 1))) == NULL)
+      return NULL;
+
+   for (i = 0; i < ti->nfiles; i++)
+      if (ti->files[i].path != NULL && ti->files[i].lookups + ti->files[i].reads > 0)
+         order[n++] = &ti->files[i];
+
+   qsort(order, n, sizeof(*order), trace_by_first);
+   *count = n;
+   return order;
+}
+
+//////////////
+// precache //
+//////////////
+int trace_precache(void) {
+   struct trace_index ti;
+   struct trace_file_stat **order;
+   char file[PATH_MAX];
+   const char *p;
+   unsigned long i, n = 0, done = 0;
+
+   if ((p = dconf_get_str("path.trace", NULL)) != NULL)
+      snprintf(file, sizeof(file), "%s.prev", p);
+   else if ((p = dconf_get_str("path.statedir", NULL)) != NULL)
+      snprintf(file, sizeof(file), "%s/access.trace.prev", p);
+   else
+      return 0;
+
+   if (!file_exists(file))
+      return 0;
+
+   memset(&ti, 0, sizeof(ti));
+
+   if (trace_load(file, trace_index_rec, &ti) < 0) {
+      Log(LOG_WARNING, "precache: can't read %s: %s", file, strerror(errno));
+      return -1;
+   }
+
+   if (ti.bad > 0) {
+      Log(LOG_WARNING, "precache: %s has %lu records with impossible inode/package numbers, ignoring it", file, ti.bad);
+      trace_index_free(&ti);
+      return -1;
+   }
+
+   if ((order = trace_index_order(&ti, &n)) != NULL) {
+      for (i = 0; i < n; i++)
+         if (vfs_precache(order[i]->path) == 0)
+            done++;
+
+      mem_free(order);
+   }
+
+   Log(LOG_INFO, "precache: extracted %lu of %lu files the last run used", done, n);
+   trace_index_free(&ti);
+   return done;
+}
+
+////////////
+// report //
+////////////
+static const char *trace_pkg_name(struct trace_index *ti, u_int32_t pkgid) {
+   if (pkgid < ti->npkgs && ti->pkgs[pkgid].path != NULL)
+      return basename(ti->pkgs[pkgid].path);
+
+   return "?";
+}
+
+int trace_report(const char *file, const char *order_file) {
+   struct trace_index ti;
+   struct trace_file_stat **order = NULL;
+   struct trace_file_stat *fs;
+   struct trace_pkg_stat *ps;
+   unsigned long i, n = 0, used = 0, unused = 0;
+   u_int64_t total = 0;
+   FILE *fp;
+
+   memset(&ti, 0, sizeof(ti));
+
+   if (trace_load(file, trace_index_rec, &ti) < 0) {
+      fprintf(stderr, "trace-report: %s: %s\n", file,
+              (errno == EINVAL ? "not a jailfs trace" : strerror(errno)));
+      return 1;
+   }
+
+   if (ti.bad > 0) {
+      fprintf(stderr, "trace-report: %s: %lu records with inode/package numbers of %u or more, corrupt?\n",
+              file, ti.bad, TRACE_MAX_ID);
+      trace_index_free(&ti);
+      return 1;
+   }
+
+   if ((order = trace_index_order(&ti, &n)) == NULL) {
+      trace_index_free(&ti);
+      return 1;
+   }
+
+   // Roll files up into their packages
+   for (i = 0; i < n; i++) {
+      fs = order[i];
+      total += fs->bytes;
+
+      if ((ps = trace_index_pkg(&ti, fs->pkgid)) != NULL) {
+         ps->files++;
+         ps->lookups += fs->lookups;
+         ps->reads += fs->reads;
+         ps->bytes += fs->bytes;
+      }
+   }
+
+   printf("%s: %lu accesses to %lu files over %.1f s by %d%s processes, %.2f MB read\n\n",
+          file, ti.events, n, ti.last / 1e9, ti.npids, (ti.npids == 64 ? "+" : ""), total / 1048576.0);
+
+   printf("First accessed:\n%10s  %-24s %s\n", "at ms", "package", "path");
+
+   for (i = 0; i < n && i < TRACE_REPORT_TOP; i++)
+      printf("%10.1f  %-24.24s %s\n", order[i]->first / 1e6, trace_pkg_name(&ti, order[i]->pkgid), order[i]->path);
+
+   if (n > TRACE_REPORT_TOP)
+      printf("%10s  (%lu more)\n", "...", n - TRACE_REPORT_TOP);
+
+   // Write the full order out before the table gets sorted again
+   if (order_file != NULL) {
+      if ((fp = fopen(order_file, "w")) == NULL) {
+         fprintf(stderr, "trace-report: %s: %s\n", order_file, strerror(errno));
+      } else {
+         for (i = 0; i < n; i++)
+            fprintf(fp, "%s\n", order[i]->path);
+
+         fclose(fp);
+      }
+   }
+
+   qsort(order, n, sizeof(*order), trace_by_heat);
+   printf("\nHot files:\n%10s %8s %8s %12s  %-24s %s\n", "MB read", "reads", "lookups", "size", "package", "path");
+
+   for (i = 0; i < n && i < TRACE_REPORT_TOP; i++)
+      printf("%10.2f %8lu %8lu %12lu  %-24.24s %s\n", order[i]->bytes / 1048576.0, order[i]->reads,
+             order[i]->lookups, (unsigned long)order[i]->size, trace_pkg_name(&ti, order[i]->pkgid), order[i]->path);
+
+   printf("\nPackages:\n%10s %8s %8s %8s  %s\n", "MB read", "files", "reads", "lookups", "package");
+
+   for (i = 0; i < ti.npkgs; i++) {
+      ps = &ti.pkgs[i];
+
+      if (ps->files == 0)
+         continue;
+
+      printf("%10.2f %8lu %8lu %8lu  %s\n", ps->bytes / 1048576.0, ps->files, ps->reads, ps->lookups,
+             (ps->path ? ps->path : "?"));
+      used++;
+   }
+
+   printf("\nNever used:\n");
+
+   for (i = 0; i < ti.npkgs; i++) {
+      ps = &ti.pkgs[i];
+
+      if (ps->path != NULL && ps->files == 0) {
+         printf("  %s\n", ps->path);
+         unused++;
+      }
+   }
+
+   printf("\n%lu package(s) used, %lu never used\n", used, unused);
+   mem_free(order);
+   trace_index_free(&ti);
+   return 0;
+}
@@ -0,0 +1,255 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/trace.c:
+ *	Package access tracer: recording side
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <lsd/lsd.h>
+#include <lsd/ring.h>
+#include "conf.h"
+#include "cron.h"
+#include "logger.h"
+#include "shell.h"
+#include "trace.h"
+
+// Records written per ring_release()
+#define	TRACE_BATCH	256
+
+// A path waiting for the next flush
+struct trace_name {
+   struct trace_name *next;
+   struct trace_rec rec;
+   char        path[];
+};
+
+static ring *trace_ring = NULL;
+static int trace_on = 0;
+static unsigned long trace_t0 = 0;		// monotonic ns at ts 0
+static char trace_file[PATH_MAX];
+
+// Paths are rare (once per file per run), so they just take a lock
+static pthread_mutex_t trace_name_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_name *trace_names = NULL, **trace_names_tail = &trace_names;
+
+// Only one flush at a time: the ring has a single consumer
+static pthread_mutex_t trace_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_fp = NULL;
+static unsigned long trace_records = 0;
+
+static unsigned long trace_now(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+int trace_enabled(void) {
+   return __atomic_load_n(&trace_on, __ATOMIC_ACQUIRE);
+}
+
+static void trace_name(u_int8_t type, u_int32_t ino, u_int32_t pkgid, u_int64_t size, const char *path) {
+   struct trace_name *tn;
+   size_t len = strlen(path);
+
+   if (len >= PATH_MAX)
+      len = PATH_MAX - 1;
+
+   if ((tn = mem_alloc(sizeof(*tn) + len)) == NULL)
+      return;
+
+   tn->next = NULL;
+   tn->rec.type = type;
+   tn->rec.namelen = len;
+   tn->rec.ino = ino;
+   tn->rec.pkgid = pkgid;
+   tn->rec.ts = trace_now() - trace_t0;
+   tn->rec.off = size;
+   memcpy(tn->path, path, len);
+
+   pthread_mutex_lock(&trace_name_lock);
+   *trace_names_tail = tn;
+   trace_names_tail = &tn->next;
+   pthread_mutex_unlock(&trace_name_lock);
+}
+
+static void trace_event(u_int8_t type, vfs_cache_entry *fe, off_t off, size_t len, pid_t pid) {
+   struct trace_rec *r;
+
+   if (!trace_enabled())
+      return;
+
+   // First time anybody touched this file: its path goes out too
+   if (!__atomic_load_n(&fe->traced, __ATOMIC_RELAXED) &&
+       !__atomic_exchange_n(&fe->traced, 1, __ATOMIC_ACQ_REL))
+      trace_name(TRACE_FILE, fe->ino, fe->pkgid, fe->size, fe->path);
+
+   // Full: the ring counts it as dropped
+   if ((r = ring_reserve(trace_ring)) == NULL)
+      return;
+
+   memset(r, 0, sizeof(*r));
+   r->type = type;
+   r->ino = fe->ino;
+   r->pkgid = fe->pkgid;
+   r->pid = pid;
+   r->len = len;
+   r->ts = trace_now() - trace_t0;
+   r->off = off;
+   ring_commit(trace_ring, r);
+}
+
+void trace_lookup(vfs_cache_entry *fe, pid_t pid) {
+   trace_event(TRACE_LOOKUP, fe, 0, 0, pid);
+}
+
+void trace_read(vfs_cache_entry *fe, off_t off, size_t len, pid_t pid) {
+   trace_event(TRACE_READ, fe, off, len, pid);
+}
+
+// Every imported package gets a record, so the report can tell which were never used
+void trace_package(u_int32_t pkgid, const char *path) {
+   if (trace_enabled())
+      trace_name(TRACE_PKG, 0, pkgid, 0, path);
+}
+
+static void trace_flush(void) {
+   struct trace_name *tn, *next;
+   struct trace_rec *r;
+   unsigned long n;
+
+   pthread_mutex_lock(&trace_flush_lock);
+
+   if (trace_fp == NULL) {
+      pthread_mutex_unlock(&trace_flush_lock);
+      return;
+   }
+
+   // Paths first: none of them belong to an event from an earlier flush
+   pthread_mutex_lock(&trace_name_lock);
+   tn = trace_names;
+   trace_names = NULL;
+   trace_names_tail = &trace_names;
+   pthread_mutex_unlock(&trace_name_lock);
+
+   for (; tn != NULL; tn = next) {
+      next = tn->next;
+      fwrite(&tn->rec, sizeof(tn->rec), 1, trace_fp);
+      fwrite(tn->path, 1, tn->rec.namelen, trace_fp);
+      trace_records++;
+      mem_free(tn);
+   }
+
+   do {
+      for (n = 0; n < TRACE_BATCH && (r = ring_peek(trace_ring, n)) != NULL; n++)
+         fwrite(r, sizeof(*r), 1, trace_fp);
+
+      ring_release(trace_ring, n);
+      trace_records += n;
+   } while (n == TRACE_BATCH);
+
+   if (fflush(trace_fp) != 0) {
+      Log(LOG_ERR, "trace: writing %s failed (%s), tracing stopped", trace_file, strerror(errno));
+      __atomic_store_n(&trace_on, 0, __ATOMIC_RELEASE);
+      fclose(trace_fp);
+      trace_fp = NULL;
+   }
+
+   pthread_mutex_unlock(&trace_flush_lock);
+}
+
+static void trace_flush_cb(void *arg) {
+   trace_flush();
+}
+
+void trace_init(void) {
+   struct trace_header th;
+   const char *file, *dir;
+   char prev[PATH_MAX + 8];
+
+   if ((file = dconf_get_str("path.trace", NULL)) != NULL)
+      snprintf(trace_file, sizeof(trace_file), "%s", file);
+   else if ((dir = dconf_get_str("path.statedir", NULL)) != NULL)
+      snprintf(trace_file, sizeof(trace_file), "%s/access.trace", dir);
+   else
+      return;
+
+   // Keep the last run's trace for trace_precache() and --trace-report
+   snprintf(prev, sizeof(prev), "%s.prev", trace_file);
+
+   if (file_exists(trace_file) && rename(trace_file, prev) != 0)
+      Log(LOG_WARNING, "trace: can't move %s out of the way: %s", trace_file, strerror(errno));
+
+   if (!dconf_get_bool("trace.enabled", 0))
+      return;
+
+   // Never freed: a hook may still be holding a slot after trace_fini()
+   if (trace_ring == NULL &&
+       (trace_ring = ring_create(sizeof(struct trace_rec), dconf_get_int("tuning.trace.ring", TRACE_RING))) == NULL) {
+      Log(LOG_ERR, "trace: can't allocate the ring, not tracing");
+      return;
+   }
+
+   if ((trace_fp = fopen(trace_file, "w")) == NULL) {
+      Log(LOG_ERR, "trace: can't write %s: %s", trace_file, strerror(errno));
+      return;
+   }
+
+   memset(&th, 0, sizeof(th));
+   memcpy(th.magic, TRACE_MAGIC, sizeof(th.magic));
+   th.started = time(NULL);
+   th.recsize = sizeof(struct trace_rec);
+   fwrite(&th, sizeof(th), 1, trace_fp);
+
+   trace_t0 = trace_now();
+   __atomic_store_n(&trace_on, 1, __ATOMIC_RELEASE);
+
+   cron_add("trace.flush", trace_flush_cb, NULL, dconf_get_time("tuning.timer.trace", TRACE_FLUSH), 0, CRON_DEFER);
+   cron_watch("trace.flush", "tuning.timer.trace");
+   Log(LOG_INFO, "trace: recording package accesses to %s", trace_file);
+}
+
+void trace_fini(void) {
+   if (!trace_enabled())
+      return;
+
+   // Whatever is still in the ring; producers see trace_on = 0 from here
+   __atomic_store_n(&trace_on, 0, __ATOMIC_RELEASE);
+   trace_flush();
+
+   pthread_mutex_lock(&trace_flush_lock);
+
+   if (trace_fp != NULL) {
+      fclose(trace_fp);
+      trace_fp = NULL;
+   }
+
+   pthread_mutex_unlock(&trace_flush_lock);
+}
+
+void trace_dump(void) {
+   pthread_mutex_lock(&trace_flush_lock);
+   Log(LOG_SHELL, "trace %s: %s", (trace_enabled() ? "on" : "off (trace.enabled)"),
+       (trace_file[0] ? trace_file : "no path.statedir"));
+
+   if (trace_ring != NULL)
+      Log(LOG_SHELL, "  %lu records written, %lu pending, %lu dropped (ring full)",
+          trace_records, ring_pending(trace_ring), __atomic_load_n(&trace_ring->dropped, __ATOMIC_RELAXED));
+
+   pthread_mutex_unlock(&trace_flush_lock);
+}
@@ -0,0 +1,88 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/trace.h:
+ *	Package access tracer (trace.enabled)
+ *
+ *	Lookups and reads made on behalf of jailed processes go into a
+ * lock-free ring as fixed size records, which a cron job appends to
+ * path.trace (default <path.statedir>/access.trace) every
+ * tuning.timer.trace seconds. Inode and package numbers only mean
+ * something within one run, so the first time a file or package shows
+ * up a TRACE_FILE/TRACE_PKG record carrying its path is written too
+ * (possibly after the file's first events, never in an earlier flush).
+ *	At startup the last run's trace is kept as <path.trace>.prev; with
+ * pkg.precache on, the files it touched are extracted in the order it
+ * first touched them. 'jailfs --trace-report <file>' reads one back.
+ *	vfs_lookup() (from vfs_op_lookup) and vfs_op_read() feed it.
+ */
+#if	!defined(__TRACE_H)
+#define	__TRACE_H
+#include <sys/types.h>
+#include "vfs.h"
+
+#define	TRACE_MAGIC	"JFTRACE1"
+#define	TRACE_RING	16384		// records, if tuning.trace.ring is unset
+#define	TRACE_FLUSH	5		// seconds, if tuning.timer.trace is unset
+
+enum trace_type {
+   TRACE_LOOKUP = 1,			// path resolved to ino
+   TRACE_READ,				// len bytes of ino at off
+   TRACE_FILE,				// ino's path, in package pkgid; off is its size
+   TRACE_PKG				// pkgid's path
+};
+
+// File header, then records; host byte order throughout
+struct trace_header {
+   char        magic[8];		// TRACE_MAGIC
+   u_int64_t   started;		// wall clock seconds at ts 0
+   u_int32_t   recsize;		// sizeof(struct trace_rec)
+   u_int32_t   flags;
+};
+
+struct trace_rec {
+   u_int8_t    type;			// enum trace_type
+   u_int8_t    pad;
+   u_int16_t   namelen;		// TRACE_FILE/TRACE_PKG: path bytes after the record
+   u_int32_t   ino;
+   u_int32_t   pkgid;
+   u_int32_t   pid;			// process in the jail
+   u_int32_t   len;
+   u_int32_t   reserved;
+   u_int64_t   ts;			// ns since the trace started
+   u_int64_t   off;
+};
+
+// Reads path.trace/trace.enabled, starts the flusher (before any pkg_open())
+extern void trace_init(void);
+extern void trace_fini(void);
+extern int trace_enabled(void);
+
+// Hooks: these return straight away unless tracing
+extern void trace_lookup(vfs_cache_entry *fe, pid_t pid);
+extern void trace_read(vfs_cache_entry *fe, off_t off, size_t len, pid_t pid);
+extern void trace_package(u_int32_t pkgid, const char *path);
+
+// Walk a trace file: fn gets every record, name is the path for TRACE_FILE/TRACE_PKG
+typedef void (*trace_cb)(const struct trace_rec *rec, const char *name, void *arg);
+extern int trace_load(const char *file, trace_cb fn, void *arg);
+
+// Extract what the last run read, in the order it first read it
+extern int trace_precache(void);
+// Status on the shell
+extern void trace_dump(void);
+
+// jailfs --trace-report <file> [order]
+extern int trace_report(const char *file, const char *order);
+
+#endif	// !defined(__TRACE_H)
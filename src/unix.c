@@ -29,7 +29,6 @@ char **g_argv = NULL;
 /* src/module.c */
 extern int module_dying(int signal);
 /* src/conf.c */
-extern void conf_reload(void);
 static char pidfile_name[PATH_MAX];
 static FILE *pidfile = NULL;
 
@@ -70,7 +69,8 @@ static void signal_handler(int signal) {
       profiling_toggle();
 #endif
    } else if (signal == SIGHUP) {
-      conf_reload();
+      // Not safe to do here, the main loop picks it up
+      conf_reload_request();
    } else if (signal == SIGCHLD) { /* Prevent zombies */
       while(waitpid(-1, NULL, WNOHANG) > 0)
          ;
@@ -0,0 +1,367 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/vfs-shm.c:
+ *	Publish the VFS path index to shared memory for lib/libfspkg.so
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <lsd/lsd.h>
+#include "conf.h"
+#include "cron.h"
+#include "logger.h"
+#include "shell.h"
+#include "vfs-shm.h"
+
+// Where shm_open() keeps its objects (rename() needs the real path)
+#define	VFS_SHM_DIR	"/dev/shm"
+
+// One path while an index is being built
+struct vfs_shm_src {
+   vfs_cache_entry *fe;
+   const char *path;			// canonical: fe->path without ./, / or trailing /
+   size_t      len;
+   size_t      plen;			// parent's length (0: child of /)
+};
+
+struct vfs_shm_list {
+   struct vfs_shm_src *src;
+   unsigned long n, max;
+};
+
+static int shm_on = 0;
+static int shm_dirty = 0;
+static char shm_name[NAME_MAX];
+// Protects the current mapping: publishing swaps and unmaps it
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct vfs_shm_header *shm_cur = NULL;
+static u_int64_t shm_gen = 0;
+static unsigned long shm_published = 0, shm_cached = 0;
+
+static void vfs_shm_collect(const char *key, const char *val, void *blob, void *arg) {
+   struct vfs_shm_list *l = (struct vfs_shm_list *)arg;
+   vfs_cache_entry *fe = (vfs_cache_entry *)blob;
+   struct vfs_shm_src *s, *src;
+   size_t i;
+
+   if (fe == NULL)
+      return;
+
+   if (l->n == l->max) {
+      l->max = (l->max ? l->max * 2 : 1024);
+
+      if ((src = mem_realloc(l->src, l->max * sizeof(*src))) == NULL) {
+         l->max = l->n;
+         return;
+      }
+
+      l->src = src;
+   }
+
+   s = &l->src[l->n];
+   s->fe = fe;
+   s->path = vfs_canon(fe->path, &s->len);
+
+   // The root itself isn't an entry
+   if (s->len == 0)
+      return;
+
+   for (i = s->len; i > 0 && s->path[i - 1] != '/'; i--)
+      ;
+
+   s->plen = (i ? i - 1 : 0);
+   l->n++;
+}
+
+// By parent, then name: every directory's children end up side by side
+static int vfs_shm_cmp(const void *a, const void *b) {
+   const struct vfs_shm_src *x = (const struct vfs_shm_src *)a, *y = (const struct vfs_shm_src *)b;
+   size_t xn = x->len - x->plen, yn = y->len - y->plen;
+   int r;
+
+   if ((r = memcmp(x->path, y->path, (x->plen < y->plen ? x->plen : y->plen))) != 0)
+      return r;
+
+   if (x->plen != y->plen)
+      return (x->plen < y->plen ? -1 : 1);
+
+   if ((r = memcmp(x->path + x->plen, y->path + y->plen, (xn < yn ? xn : yn))) != 0)
+      return r;
+
+   return (xn == yn ? 0 : (xn < yn ? -1 : 1));
+}
+
+static int vfs_shm_publish(void) {
+   struct vfs_shm_list l = { NULL, 0, 0 };
+   struct vfs_shm_header *h, *old;
+   struct vfs_shm_entry *e;
+   struct vfs_shm_src *s;
+   u_int32_t *bucket, nbuckets, n, i, b;
+   char tmp[NAME_MAX + 32], from[PATH_MAX], to[PATH_MAX];
+   const char *root, *cache;
+   size_t strsize = 1, off, size;
+   long parent;
+   char *str;
+   int fd;
+
+   vfs_index_foreach(vfs_shm_collect, &l);
+
+   if (l.n > 0)
+      qsort(l.src, l.n, sizeof(*l.src), vfs_shm_cmp);
+
+   // Directories shared between packages may be spelled differently
+   for (i = n = 0; i < l.n; i++) {
+      if (n > 0 && vfs_shm_cmp(&l.src[n - 1], &l.src[i]) == 0)
+         continue;
+
+      l.src[n++] = l.src[i];
+      strsize += l.src[i].len + 1;
+
+      if (l.src[i].fe->link != NULL)
+         strsize += strlen(l.src[i].fe->link) + 1;
+   }
+
+   for (nbuckets = 16; nbuckets < 2 * n; nbuckets <<= 1)
+      ;
+
+   off = (sizeof(*h) + 7) & ~7UL;
+   size = off + n * sizeof(*e) + nbuckets * sizeof(*bucket) + strsize;
+
+   if (strsize > UINT_MAX) {
+      Log(LOG_ERR, "preload: %u paths is too many for the shared index", n);
+      mem_free(l.src);
+      return -1;
+   }
+
+   pthread_mutex_lock(&shm_lock);
+   snprintf(tmp, sizeof(tmp), "%s.%lu", shm_name, (unsigned long)(shm_gen + 1));
+   shm_unlink(tmp);
+
+   if ((fd = shm_open(tmp, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0 || ftruncate(fd, size) != 0 ||
+       (h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+      Log(LOG_ERR, "preload: can't create shared memory %s: %s", tmp, strerror(errno));
+
+      if (fd >= 0) {
+         close(fd);
+         shm_unlink(tmp);
+      }
+
+      pthread_mutex_unlock(&shm_lock);
+      mem_free(l.src);
+      return -1;
+   }
+
+   close(fd);
+
+   // ftruncate() gave us zeroes
+   memcpy(h->magic, VFS_SHM_MAGIC, sizeof(h->magic));
+   h->version = VFS_SHM_VERSION;
+   h->generation = shm_gen + 1;
+   h->size = size;
+   h->flags = (dconf_get_bool("preload.negative", 0) ? VFS_SHM_NEGATIVE : 0);
+   h->nentries = n;
+   h->nbuckets = nbuckets;
+   h->entries = off;
+   h->buckets = h->entries + n * sizeof(*e);
+   h->strings = h->buckets + nbuckets * sizeof(*bucket);
+
+   if ((root = dconf_get_str("preload.root", NULL)) == NULL)
+      root = conf_get()->path_mountpoint;
+
+   if ((cache = dconf_get_str("preload.cache", NULL)) == NULL)
+      cache = dconf_get_str("path.cache", NULL);
+
+   snprintf(h->root, sizeof(h->root), "%s", (root ? root : "/"));
+   snprintf(h->cache, sizeof(h->cache), "%s", (cache ? cache : ""));
+
+   e = VFS_SHM_ENTRIES(h);
+   bucket = VFS_SHM_BUCKETS(h);
+   str = VFS_SHM_STRINGS(h);
+   off = 1;
+
+   for (i = 0; i < n; i++) {
+      s = &l.src[i];
+      e[i].hash = vfs_shm_hash(s->path, s->len);
+      e[i].cache_hash = vfs_shm_hash(s->fe->path, strlen(s->fe->path));
+      e[i].size = s->fe->size;
+      e[i].mtime = s->fe->ctime;
+      e[i].ino = s->fe->ino;
+      e[i].pkgid = s->fe->pkgid;
+      e[i].mode = s->fe->mode;
+      e[i].uid = s->fe->uid;
+      e[i].gid = s->fe->gid;
+
+      if (__atomic_load_n(&s->fe->cached, __ATOMIC_ACQUIRE) == VFS_CACHE_DONE)
+         e[i].flags = VFS_SHM_CACHED;
+
+      e[i].path = off;
+      e[i].name = off + s->plen + (s->plen ? 1 : 0);
+      memcpy(str + off, s->path, s->len);
+      off += s->len + 1;
+
+      if (s->fe->link != NULL) {
+         e[i].link = off;
+         strcpy(str + off, s->fe->link);
+         off += strlen(s->fe->link) + 1;
+      }
+
+      for (b = e[i].hash & (nbuckets - 1); bucket[b] != 0; b = (b + 1) & (nbuckets - 1))
+         ;
+
+      bucket[b] = i + 1;
+   }
+
+   // Sorted by parent, so children are runs of entries
+   for (i = 0; i < n; i++) {
+      s = &l.src[i];
+
+      if (s->plen == 0) {
+         if (h->root_count++ == 0)
+            h->root_first = i;
+      } else if ((parent = vfs_shm_find(h, s->path, s->plen)) >= 0 && S_ISDIR(e[parent].mode)) {
+         if (e[parent].count++ == 0)
+            e[parent].first = i;
+      }
+   }
+
+   mem_free(l.src);
+
+   // Readers holding the old one see 'stale' and come looking here
+   snprintf(from, sizeof(from), "%s%s", VFS_SHM_DIR, tmp);
+   snprintf(to, sizeof(to), "%s%s", VFS_SHM_DIR, shm_name);
+
+   if (rename(from, to) != 0) {
+      Log(LOG_ERR, "preload: can't publish %s: %s", to, strerror(errno));
+      munmap(h, size);
+      shm_unlink(tmp);
+      pthread_mutex_unlock(&shm_lock);
+      return -1;
+   }
+
+   if ((old = shm_cur) != NULL) {
+      __atomic_store_n(&old->stale, 1, __ATOMIC_RELEASE);
+      munmap(old, old->size);
+   }
+
+   shm_cur = h;
+   shm_gen++;
+   shm_published++;
+   pthread_mutex_unlock(&shm_lock);
+
+   Debug(DEBUG_VFS, "preload: published %u paths (%lu bytes) as %s, generation %lu",
+         n, (unsigned long)size, shm_name, (unsigned long)shm_gen);
+   return 0;
+}
+
+static void vfs_shm_tick(void *arg) {
+   if (__atomic_exchange_n(&shm_dirty, 0, __ATOMIC_ACQ_REL))
+      vfs_shm_publish();
+}
+
+void vfs_shm_changed(void) {
+   if (__atomic_load_n(&shm_on, __ATOMIC_RELAXED))
+      __atomic_store_n(&shm_dirty, 1, __ATOMIC_RELEASE);
+}
+
+// Clients may go straight to the cache file from now on
+void vfs_shm_cached(vfs_cache_entry *fe) {
+   struct vfs_shm_entry *e;
+   const char *path;
+   size_t len;
+   long i;
+
+   if (!__atomic_load_n(&shm_on, __ATOMIC_RELAXED))
+      return;
+
+   path = vfs_canon(fe->path, &len);
+   pthread_mutex_lock(&shm_lock);
+
+   if (shm_cur != NULL && (i = vfs_shm_find(shm_cur, path, len)) >= 0) {
+      e = VFS_SHM_ENTRIES(shm_cur);
+      __atomic_or_fetch(&e[i].flags, VFS_SHM_CACHED, __ATOMIC_RELEASE);
+      shm_cached++;
+   }
+
+   pthread_mutex_unlock(&shm_lock);
+}
+
+int vfs_shm_init(void) {
+   const char *name;
+
+   if (!dconf_get_bool("preload.index", 0))
+      return 0;
+
+   if ((name = dconf_get_str("preload.shm", NULL)) != NULL)
+      snprintf(shm_name, sizeof(shm_name), "%s%s", (name[0] == '/' ? "" : "/"), name);
+   else
+      snprintf(shm_name, sizeof(shm_name), "/jailfs-%s", dconf_get_str("jail.name", "default"));
+
+   __atomic_store_n(&shm_on, 1, __ATOMIC_RELEASE);
+
+   if (vfs_shm_publish() != 0) {
+      __atomic_store_n(&shm_on, 0, __ATOMIC_RELEASE);
+      return -1;
+   }
+
+   cron_add("vfs.shm", vfs_shm_tick, NULL, dconf_get_time("tuning.timer.preload", VFS_SHM_TIMER), 0, CRON_DEFER);
+   cron_watch("vfs.shm", "tuning.timer.preload");
+   Log(LOG_INFO, "preload: metadata index published, clients want %s=%s", VFS_SHM_ENV, shm_name);
+   return 0;
+}
+
+void vfs_shm_fini(void) {
+   if (!__atomic_exchange_n(&shm_on, 0, __ATOMIC_ACQ_REL))
+      return;
+
+   cron_stop("vfs.shm");
+   pthread_mutex_lock(&shm_lock);
+
+   // Clients go back to the real syscalls
+   if (shm_cur != NULL) {
+      shm_unlink(shm_name);
+      __atomic_store_n(&shm_cur->stale, 1, __ATOMIC_RELEASE);
+      munmap(shm_cur, shm_cur->size);
+      shm_cur = NULL;
+   }
+
+   pthread_mutex_unlock(&shm_lock);
+}
+
+const char *vfs_shm_name(void) {
+   return (__atomic_load_n(&shm_on, __ATOMIC_ACQUIRE) ? shm_name : NULL);
+}
+
+void vfs_shm_dump(void) {
+   pthread_mutex_lock(&shm_lock);
+
+   if (shm_cur == NULL)
+      Log(LOG_SHELL, "preload index: off (preload.index)");
+   else {
+      Log(LOG_SHELL, "preload index %s: generation %lu, %u paths, %lu bytes, root %s",
+          shm_name, (unsigned long)shm_cur->generation, shm_cur->nentries,
+          (unsigned long)shm_cur->size, shm_cur->root);
+      Log(LOG_SHELL, "  %lu published, %lu files marked extracted, %s",
+          shm_published, shm_cached, (shm_dirty ? "changes pending" : "up to date"));
+   }
+
+   pthread_mutex_unlock(&shm_lock);
+}
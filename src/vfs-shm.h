@@ -0,0 +1,133 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/vfs-shm.h:
+ *	Read-only metadata index in shared memory, for lib/libfspkg.so
+ *
+ *	With preload.index on, the VFS path index is published as a POSIX
+ * shared memory object (preload.shm, default /jailfs-<jail.name>) that
+ * the LD_PRELOAD library maps read-only and answers stat(), readlink(),
+ * opendir() and friends from, without a round trip through FUSE.
+ * Whatever it can't answer (a file nobody extracted yet, say) goes to
+ * the mount, which serves the same entries.
+ *
+ *	An index is never changed once published, except for the
+ * VFS_SHM_CACHED bit as files get extracted. When paths are added, a
+ * cron job (tuning.timer.preload) builds a new one, renames it over the
+ * old name and then sets 'stale' in the old one; readers check 'stale'
+ * on every call and map the new one when it's set.
+ *
+ * This header is shared with src/libfspkg.c: keep it free of jailfs
+ * (and lsd) types.
+ */
+#if	!defined(__VFS_SHM_H)
+#define	__VFS_SHM_H
+#include <sys/types.h>
+#include <string.h>
+
+#define	VFS_SHM_MAGIC		"JFINDEX1"
+#define	VFS_SHM_VERSION		1
+#define	VFS_SHM_TIMER		2	// seconds, if tuning.timer.preload is unset
+#define	VFS_SHM_ENV		"JAILFS_INDEX"	// shm name, for the library
+#define	VFS_SHM_ENV_ROOT	"JAILFS_ROOT"	// where the library sees the mount
+
+// vfs_shm_header.flags
+#define	VFS_SHM_NEGATIVE	0x0001	// misses under the index's own directories are ENOENT
+
+// vfs_shm_entry.flags
+#define	VFS_SHM_CACHED		0x0001	// extracted: <cache>/<pkgid>-<cache_hash> is complete
+
+struct vfs_shm_header {
+   char        magic[8];		// VFS_SHM_MAGIC
+   u_int32_t   version;		// VFS_SHM_VERSION
+   u_int32_t   stale;			// replaced: unmap and look again
+   u_int64_t   generation;		// bumped every publish
+   u_int64_t   size;			// whole object, bytes
+   u_int32_t   flags;			// VFS_SHM_*
+   u_int32_t   nentries;
+   u_int32_t   nbuckets;		// power of 2
+   u_int32_t   root_first;		// children of "/" (entries are sorted by parent)
+   u_int32_t   root_count;
+   u_int32_t   reserved;
+   u_int64_t   entries;		// offsets from the start of the object
+   u_int64_t   buckets;
+   u_int64_t   strings;
+   char        root[256];		// path.mountpoint, unless JAILFS_ROOT says otherwise
+   char        cache[256];		// path.cache as clients see it (preload.cache)
+};
+
+struct vfs_shm_entry {
+   u_int64_t   hash;			// vfs_shm_hash() of the path
+   u_int64_t   cache_hash;		// cache file name (see pkg_extract_file())
+   u_int64_t   size;
+   int64_t     mtime;
+   u_int32_t   path;			// string offsets: "usr/bin/ls" (no leading/trailing /)
+   u_int32_t   name;			// last component of path
+   u_int32_t   link;			// symlink target, 0 if none
+   u_int32_t   ino;
+   u_int32_t   pkgid;
+   u_int32_t   mode;			// st_mode, type bits included
+   u_int32_t   uid;
+   u_int32_t   gid;
+   u_int32_t   first;			// directories: children are entries[first .. first + count)
+   u_int32_t   count;
+   u_int32_t   flags;			// VFS_SHM_CACHED, updated in place
+   u_int32_t   reserved;
+};
+
+// buckets[] hold entry index + 1, 0 is empty; linear probing
+static inline u_int64_t vfs_shm_hash(const char *s, size_t len) {
+   u_int64_t hash = 14695981039346656037UL;
+
+   while (len-- > 0)
+      hash = (hash ^ (unsigned char)*s++) * 1099511628211UL;
+
+   return hash;
+}
+
+#define	VFS_SHM_ENTRIES(h)	((struct vfs_shm_entry *)((char *)(h) + (h)->entries))
+#define	VFS_SHM_BUCKETS(h)	((u_int32_t *)((char *)(h) + (h)->buckets))
+#define	VFS_SHM_STRINGS(h)	((char *)(h) + (h)->strings)
+
+// Index of path (len bytes, canonical) in h, or -1
+static inline long vfs_shm_find(const struct vfs_shm_header *h, const char *path, size_t len) {
+   const struct vfs_shm_entry *e = VFS_SHM_ENTRIES(h);
+   const u_int32_t *bucket = VFS_SHM_BUCKETS(h);
+   const char *str = VFS_SHM_STRINGS(h);
+   u_int64_t hash = vfs_shm_hash(path, len);
+   u_int32_t i, idx;
+
+   for (i = hash & (h->nbuckets - 1); (idx = bucket[i]) != 0; i = (i + 1) & (h->nbuckets - 1)) {
+      if (e[idx - 1].hash == hash && strncmp(str + e[idx - 1].path, path, len) == 0 &&
+          str[e[idx - 1].path + len] == '\0')
+         return idx - 1;
+   }
+
+   return -1;
+}
+
+#if	!defined(VFS_SHM_CLIENT)
+#include "vfs.h"
+
+// Called by the VFS: the path set changed / fe was just extracted
+extern void vfs_shm_changed(void);
+extern void vfs_shm_cached(vfs_cache_entry *fe);
+// Publish now (after the startup scan), then keep it current
+extern int vfs_shm_init(void);
+extern void vfs_shm_fini(void);
+// What clients should set VFS_SHM_ENV to, NULL if not publishing
+extern const char *vfs_shm_name(void);
+extern void vfs_shm_dump(void);
+#endif
+
+#endif	// !defined(__VFS_SHM_H)
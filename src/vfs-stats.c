@@ -0,0 +1,248 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/vfs-stats.c:
+ *	FUSE operation statistics
+ */
+#include <lsd/lsd.h>
+#include "conf.h"
+#include "cron.h"
+#include "logger.h"
+#include "shell.h"
+#include "vfs-stats.h"
+
+struct vfs_stats_shard {
+   struct vfs_stats st;
+   struct vfs_stats_shard *next;
+} __attribute__((aligned(64)));
+
+static const char *vfs_op_names[VFS_OP_MAX] = {
+   "lookup", "getattr", "open", "read", "readdir", "access", "create",
+   "getxattr", "link", "listxattr", "mkdir", "mknod", "opendir", "readlink",
+   "release", "releasedir", "removexattr", "rename", "rmdir", "setattr",
+   "setxattr", "statfs", "symlink", "unlink", "write"
+};
+
+static const char *vfs_ctr_names[VFS_CTR_MAX] = {
+   "cache.meta.hit", "cache.meta.miss", "cache.extract.hit", "cache.extract.miss",
+   "cache.extract.bytes"
+};
+
+// Every shard ever made; they're never freed, so totals survive their threads
+static struct vfs_stats_shard *vfs_shards = NULL;
+static __thread struct vfs_stats_shard *vfs_shard = NULL;
+
+static struct vfs_stats_shard *vfs_stats_self(void) {
+   struct vfs_stats_shard *s;
+
+   if ((s = vfs_shard) != NULL)
+      return s;
+
+   if (posix_memalign((void **)&s, 64, sizeof(*s)) != 0)
+      return NULL;
+
+   memset(s, 0, sizeof(*s));
+   s->next = __atomic_load_n(&vfs_shards, __ATOMIC_RELAXED);
+
+   while (!__atomic_compare_exchange_n(&vfs_shards, &s->next, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+
+   return (vfs_shard = s);
+}
+
+// Only the owning thread writes, so a plain load + store is enough
+#define	vfs_stats_inc(var)	__atomic_store_n(&(var), (var) + 1, __ATOMIC_RELAXED)
+
+unsigned long vfs_stats_start(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void vfs_stats_done(enum vfs_op op, unsigned long t0) {
+   struct vfs_stats_shard *s;
+
+   if ((s = vfs_stats_self()) == NULL)
+      return;
+
+   vfs_stats_inc(s->st.ops[op]);
+
+   if (op < VFS_OP_TIMED)
+      hist_record(&s->st.lat[op], vfs_stats_start() - t0);
+}
+
+void vfs_stats_count(enum vfs_op op) {
+   struct vfs_stats_shard *s;
+
+   if ((s = vfs_stats_self()) != NULL)
+      vfs_stats_inc(s->st.ops[op]);
+}
+
+void vfs_stats_bytes(unsigned long bytes) {
+   struct vfs_stats_shard *s;
+
+   if ((s = vfs_stats_self()) != NULL)
+      hist_record(&s->st.read_bytes, bytes);
+}
+
+void vfs_stats_add(enum vfs_ctr ctr, unsigned long n) {
+   struct vfs_stats_shard *s;
+
+   if ((s = vfs_stats_self()) != NULL)
+      __atomic_store_n(&s->st.ctr[ctr], s->st.ctr[ctr] + n, __ATOMIC_RELAXED);
+}
+
+void vfs_stats_cache(enum vfs_ctr ctr) {
+   vfs_stats_add(ctr, 1);
+}
+
+struct vfs_stats *vfs_stats_sum(void) {
+   struct vfs_stats *sum;
+   struct vfs_stats_shard *s;
+   int i;
+
+   if (!(sum = mem_calloc(1, sizeof(*sum))))
+      return NULL;
+
+   for (s = __atomic_load_n(&vfs_shards, __ATOMIC_ACQUIRE); s != NULL; s = s->next) {
+      for (i = 0; i < VFS_OP_MAX; i++)
+         sum->ops[i] += __atomic_load_n(&s->st.ops[i], __ATOMIC_RELAXED);
+
+      for (i = 0; i < VFS_CTR_MAX; i++)
+         sum->ctr[i] += __atomic_load_n(&s->st.ctr[i], __ATOMIC_RELAXED);
+
+      for (i = 0; i < VFS_OP_TIMED; i++)
+         hist_merge(&sum->lat[i], &s->st.lat[i]);
+
+      hist_merge(&sum->read_bytes, &s->st.read_bytes);
+   }
+
+   return sum;
+}
+
+const char *vfs_stats_op_name(enum vfs_op op) {
+   return (op < VFS_OP_MAX ? vfs_op_names[op] : "unknown");
+}
+
+const char *vfs_stats_ctr_name(enum vfs_ctr ctr) {
+   return (ctr < VFS_CTR_MAX ? vfs_ctr_names[ctr] : "unknown");
+}
+
+static double vfs_stats_ratio(unsigned long hit, unsigned long miss) {
+   return (hit + miss ? hit * 100.0 / (hit + miss) : 0);
+}
+
+void vfs_stats_dump(void) {
+   struct vfs_stats *sum;
+   hist *h;
+   int i;
+
+   if ((sum = vfs_stats_sum()) == NULL)
+      return;
+
+   Log(LOG_SHELL, "  %-12s %10s %10s %10s %10s %10s  (microseconds)", "op", "count", "p50", "p90", "p99", "max");
+
+   for (i = 0; i < VFS_OP_TIMED; i++) {
+      h = &sum->lat[i];
+      Log(LOG_SHELL, "  %-12s %10lu %10.1f %10.1f %10.1f %10.1f", vfs_op_names[i], sum->ops[i],
+          hist_percentile(h, 50) / 1000.0, hist_percentile(h, 90) / 1000.0,
+          hist_percentile(h, 99) / 1000.0, h->max / 1000.0);
+   }
+
+   for (i = VFS_OP_TIMED; i < VFS_OP_MAX; i++)
+      if (sum->ops[i] > 0)
+         Log(LOG_SHELL, "  %-12s %10lu", vfs_op_names[i], sum->ops[i]);
+
+   h = &sum->read_bytes;
+   Log(LOG_SHELL, "  read sizes: p50 %lu  p99 %lu  max %lu bytes, %lu bytes asked for in total",
+       hist_percentile(h, 50), hist_percentile(h, 99), h->max, h->sum);
+   Log(LOG_SHELL, "  metadata index: %lu hits, %lu misses (%.1f%%)",
+       sum->ctr[VFS_CTR_META_HIT], sum->ctr[VFS_CTR_META_MISS],
+       vfs_stats_ratio(sum->ctr[VFS_CTR_META_HIT], sum->ctr[VFS_CTR_META_MISS]));
+   Log(LOG_SHELL, "  extraction cache: %lu hits, %lu misses (%.1f%%), %lu bytes extracted",
+       sum->ctr[VFS_CTR_EXTRACT_HIT], sum->ctr[VFS_CTR_EXTRACT_MISS],
+       vfs_stats_ratio(sum->ctr[VFS_CTR_EXTRACT_HIT], sum->ctr[VFS_CTR_EXTRACT_MISS]),
+       sum->ctr[VFS_CTR_EXTRACT_BYTES]);
+
+   mem_free(sum);
+}
+
+static void vfs_stats_write_hist(FILE *fp, const char *name, const hist *h) {
+   fprintf(fp, "vfs.%s.samples=%lu\n", name, h->count);
+   fprintf(fp, "vfs.%s.sum=%lu\n", name, h->sum);
+   fprintf(fp, "vfs.%s.p50=%lu\n", name, hist_percentile(h, 50));
+   fprintf(fp, "vfs.%s.p90=%lu\n", name, hist_percentile(h, 90));
+   fprintf(fp, "vfs.%s.p99=%lu\n", name, hist_percentile(h, 99));
+   fprintf(fp, "vfs.%s.max=%lu\n", name, h->max);
+}
+
+int vfs_stats_write(FILE *fp) {
+   struct vfs_stats *sum;
+   char name[32];
+   int i;
+
+   if (fp == NULL || (sum = vfs_stats_sum()) == NULL)
+      return -1;
+
+   fprintf(fp, "vfs.time=%lu\n", (unsigned long)conf.now);
+
+   for (i = 0; i < VFS_OP_MAX; i++)
+      fprintf(fp, "vfs.%s.count=%lu\n", vfs_op_names[i], sum->ops[i]);
+
+   for (i = 0; i < VFS_OP_TIMED; i++) {
+      snprintf(name, sizeof(name), "%s.ns", vfs_op_names[i]);
+      vfs_stats_write_hist(fp, name, &sum->lat[i]);
+   }
+
+   vfs_stats_write_hist(fp, "read.bytes", &sum->read_bytes);
+
+   for (i = 0; i < VFS_CTR_MAX; i++)
+      fprintf(fp, "vfs.%s=%lu\n", vfs_ctr_names[i], sum->ctr[i]);
+
+   mem_free(sum);
+   return 0;
+}
+
+// Write <path.statedir>/vfs-stats, replacing the last one in one go
+static void vfs_stats_save(void *arg) {
+   char path[PATH_MAX], tmp[PATH_MAX];
+   const char *dir;
+   FILE *fp;
+
+   if ((dir = dconf_get_str("path.statedir", NULL)) == NULL)
+      return;
+
+   if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+      return;
+
+   snprintf(path, sizeof(path), "%s/vfs-stats", dir);
+   snprintf(tmp, sizeof(tmp), "%s/.vfs-stats.tmp", dir);
+
+   if ((fp = fopen(tmp, "w")) == NULL) {
+      Log(LOG_WARNING, "vfs-stats: can't write %s: %s", tmp, strerror(errno));
+      return;
+   }
+
+   vfs_stats_write(fp);
+
+   if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+      Log(LOG_WARNING, "vfs-stats: can't write %s: %s", path, strerror(errno));
+      unlink(tmp);
+   }
+}
+
+void vfs_stats_init(void) {
+   cron_add("vfs.stats", vfs_stats_save, NULL, dconf_get_time("tuning.timer.vfs_stats", 60), 0, CRON_DEFER);
+   cron_watch("vfs.stats", "tuning.timer.vfs_stats");
+}
@@ -0,0 +1,92 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/vfs-stats.h:
+ *	FUSE operation counters, latency histograms and cache hit rates
+ *
+ *	Each thread updates its own shard (no locks, no shared cache lines);
+ * readers add all shards up. Every tuning.timer.vfs_stats seconds a
+ * snapshot is written to <path.statedir>/vfs-stats.
+ */
+#if	!defined(__VFS_STATS_H)
+#define	__VFS_STATS_H
+#include <stdio.h>
+#include <lsd/hist.h>
+
+enum vfs_op {
+   // These get a latency histogram, the rest are only counted
+   VFS_OP_LOOKUP = 0,
+   VFS_OP_GETATTR,
+   VFS_OP_OPEN,
+   VFS_OP_READ,
+   VFS_OP_READDIR,
+   VFS_OP_ACCESS,
+   VFS_OP_CREATE,
+   VFS_OP_GETXATTR,
+   VFS_OP_LINK,
+   VFS_OP_LISTXATTR,
+   VFS_OP_MKDIR,
+   VFS_OP_MKNOD,
+   VFS_OP_OPENDIR,
+   VFS_OP_READLINK,
+   VFS_OP_RELEASE,
+   VFS_OP_RELEASEDIR,
+   VFS_OP_REMOVEXATTR,
+   VFS_OP_RENAME,
+   VFS_OP_RMDIR,
+   VFS_OP_SETATTR,
+   VFS_OP_SETXATTR,
+   VFS_OP_STATFS,
+   VFS_OP_SYMLINK,
+   VFS_OP_UNLINK,
+   VFS_OP_WRITE,
+   VFS_OP_MAX
+};
+#define	VFS_OP_TIMED	(VFS_OP_READDIR + 1)
+
+enum vfs_ctr {
+   VFS_CTR_META_HIT = 0,		// path found in the metadata index
+   VFS_CTR_META_MISS,
+   VFS_CTR_EXTRACT_HIT,			// file already in the extraction cache
+   VFS_CTR_EXTRACT_MISS,
+   VFS_CTR_EXTRACT_BYTES,		// bytes written into the extraction cache
+   VFS_CTR_MAX
+};
+
+struct vfs_stats {
+   unsigned long ops[VFS_OP_MAX];
+   unsigned long ctr[VFS_CTR_MAX];
+   hist        lat[VFS_OP_TIMED];	// nanoseconds
+   hist        read_bytes;
+};
+
+// Time an operation: t0 = vfs_stats_start(); ...; vfs_stats_done(op, t0);
+extern unsigned long vfs_stats_start(void);
+extern void vfs_stats_done(enum vfs_op op, unsigned long t0);
+extern void vfs_stats_count(enum vfs_op op);
+// Size of a read request
+extern void vfs_stats_bytes(unsigned long bytes);
+extern void vfs_stats_cache(enum vfs_ctr ctr);
+extern void vfs_stats_add(enum vfs_ctr ctr, unsigned long n);
+
+// Totals over every thread (free with mem_free()), and names for exporters
+extern struct vfs_stats *vfs_stats_sum(void);
+extern const char *vfs_stats_op_name(enum vfs_op op);
+extern const char *vfs_stats_ctr_name(enum vfs_ctr ctr);
+
+extern void vfs_stats_init(void);
+// Summary on the shell, vfs.<op>.<counter>=<value> lines for scripts
+extern void vfs_stats_dump(void);
+extern int vfs_stats_write(FILE *fp);
+
+#endif	// !defined(__VFS_STATS_H)
@@ -36,17 +36,27 @@
 #include <dirent.h>
 #include "conf.h"
 #include "shell.h"
+#include "logger.h"
 #include "threads.h"
 #include "cron.h"
+#include "gc.h"
 #include "vfs.h"
+#include "vfs-stats.h"
+#include "vfs-shm.h"
 #include "database.h"
 #include "pkg.h"
+#include "api.h"
+#include "watchdog.h"
+#include "trace.h"
+#include "prefetch.h"
 #include <fuse/fuse.h>
 #include <fuse/fuse_lowlevel.h>
 #include <fuse/fuse_opt.h>
 
 // Anywhere VFS recurses, hard limit it to this:
 #define	VFS_MAX_RECURSE		16
+// Seconds the kernel may keep our entries and attributes (they never change)
+#define	VFS_FUSE_TIMEOUT	60.0
 
 ///////////////////
 // Private stuff //
@@ -56,10 +66,19 @@ static BlockHeap *heap_vfs_cache = NULL,
           *heap_vfs_inode = NULL,
           *heap_vfs_watch = NULL;
 dlink_list vfs_watch_list;
-static pthread_mutex_t cache_mutex;
+// Serializes vfs_add_path(), readers don't take it
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 static char *mountpoint = NULL;
 static char *cache_path = NULL;
-static dict *cache_dict = NULL;
+// path -> vfs_cache_entry, read by every FUSE worker
+static cdict *path_cache = NULL;
+// Top level entries: the root has no cache entry of its own to list them
+static vfs_cache_entry *vfs_root_children = NULL;
+// Inode numbers, handed out as paths are added
+u_int32_t vfs_root_inode = 1;
+static u_int32_t vfs_last_ino = 1;
+// Set once the startup package scan is done
+static int vfs_ready = 0;
 
 // FUSE state
 static ev_io vfs_fuse_evt;
@@ -123,9 +142,18 @@ static void fill_statbuf(ext2_ino_t ino, pkg_inode_t * inode, struct stat *st) {
 // fuse interface //
 ////////////////////
 static void vfs_fuse_read_cb(struct ev_loop *loop, ev_io * w, int revents) {
+   static int  wd_slot = -1;
    int         res = 0;
 #if	1
-   struct fuse_chan *ch = fuse_session_next_chan(vfs_fuse_sess, NULL);
+   struct fuse_chan *ch;
+
+   // vfs_fuse_fini() got there first
+   if (vfs_fuse_sess == NULL) {
+      ev_io_stop(loop, w);
+      return;
+   }
+
+   ch = fuse_session_next_chan(vfs_fuse_sess, NULL);
    struct fuse_chan *tmpch = ch;
    size_t      bufsize = fuse_chan_bufsize(ch);
    char       *buf;
@@ -136,11 +164,17 @@ static void vfs_fuse_read_cb(struct ev_loop *loop, ev_io * w, int revents) {
       return;
    }
 
+   if (wd_slot < 0)
+      wd_slot = watchdog_register("fuse.read");
+
+   watchdog_enter(wd_slot);
    res = fuse_chan_recv(&tmpch, buf, bufsize);
 
    if (!(res == -EINTR || res <= 0))
       fuse_session_process(vfs_fuse_sess, buf, res, tmpch);
 
+   watchdog_leave(wd_slot);
+
    mem_free(buf);
    fuse_session_reset(vfs_fuse_sess);
 #endif
@@ -149,56 +183,66 @@ static void vfs_fuse_read_cb(struct ev_loop *loop, ev_io * w, int revents) {
 /* Write-type operations which should return EROFS */
 void vfs_op_setattr(fuse_req_t req, fuse_ino_t ino,
                              struct stat *attr, int to_set, struct fuse_file_info *fi) {
-   Log(LOG_DEBUG, "[%lu] %s:%d:%s", time(NULL), __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_SETATTR);
    fuse_reply_err(req, EROFS);
 }
 
 void vfs_op_mknod(fuse_req_t req, fuse_ino_t ino,
                            const char *name, mode_t mode, dev_t rdev) {
-   Log(LOG_DEBUG, "[%lu] %s:%d:%s", time(NULL), __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_MKNOD);
    fuse_reply_err(req, EROFS);
 }
 
 void vfs_op_mkdir(fuse_req_t req, fuse_ino_t ino, const char *name, mode_t mode) {
-   Log(LOG_DEBUG, "[%lu] %s:%d:%s", time(NULL), __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_MKDIR);
    fuse_reply_err(req, EROFS);
 }
 
 void vfs_op_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
-   Log(LOG_DEBUG, "[%lu] %s:%d:%s", time(NULL), __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_SYMLINK);
    fuse_reply_err(req, EROFS);
 }
 
 void vfs_op_unlink(fuse_req_t req, fuse_ino_t ino, const char *name) {
-   Log(LOG_DEBUG, "[%lu] %s:%d:%s", time(NULL), __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_UNLINK);
    fuse_reply_err(req, EROFS);
 }
 
 void vfs_op_rmdir(fuse_req_t req, fuse_ino_t ino, const char *namee) {
-   Log(LOG_DEBUG, "[%lu] %s:%d:%s", time(NULL), __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_RMDIR);
    fuse_reply_err(req, EROFS);
 }
 
 void vfs_op_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
                             fuse_ino_t newparent, const char *newname) {
-   Log(LOG_DEBUG, "[%lu] %s:%d:%s", time(NULL), __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_RENAME);
    fuse_reply_err(req, EROFS);
 }
 
 void vfs_op_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
-   Log(LOG_DEBUG, "[%lu] %s:%d:%s", time(NULL), __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_LINK);
    fuse_reply_err(req, EROFS);
 }
 
 void vfs_op_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
                            size_t size, off_t off, struct fuse_file_info *fi) {
-   Log(LOG_DEBUG, "[%lu] %s:%d:%s", time(NULL), __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_WRITE);
    fuse_reply_err(req, EROFS);
 }
 
 void vfs_op_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
                               const char *value, size_t size, int flags) {
-   Log(LOG_DEBUG, "[%lu] %s:%d:%s", time(NULL), __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_SETXATTR);
    fuse_reply_err(req, ENOTSUP);
 }
 
@@ -206,154 +250,320 @@ void vfs_op_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
    /*
     * XXX: which is proper: ENOSUP, EACCES, ENOATTR? 
     */
-   Log(LOG_DEBUG, "[%lu] %s:%d:%s", time(NULL), __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_REMOVEXATTR);
    fuse_reply_err(req, ENOTSUP);
 }
 
 void vfs_op_create(fuse_req_t req, fuse_ino_t ino, const char *name,
                             mode_t mode, struct fuse_file_info *fi) {
-   Log(LOG_DEBUG, "[%lu] %s:%d:%s", time(NULL), __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_CREATE);
    fuse_reply_err(req, EROFS);
 }
 
+// FUSE node ids are cache entry addresses, except the root (NULL here)
+static vfs_cache_entry *vfs_node(fuse_ino_t ino) {
+   return (ino == vfs_root_inode ? NULL : (vfs_cache_entry *)(uintptr_t)ino);
+}
+
+static fuse_ino_t vfs_nodeid(vfs_cache_entry *fe) {
+   return (fe == NULL ? vfs_root_inode : (fuse_ino_t)(uintptr_t)fe);
+}
+
+// Same answers lib/libfspkg.so gives from the shared index (PKG_FILL_STAT)
+static void vfs_fill_stat(const vfs_cache_entry *fe, struct stat *sb) {
+   memset(sb, 0, sizeof(*sb));
+   sb->st_blksize = 4096;
+
+   if (fe == NULL) {
+      sb->st_ino = vfs_root_inode;
+      sb->st_mode = S_IFDIR | 0755;
+      sb->st_nlink = 2;
+      sb->st_atime = sb->st_mtime = sb->st_ctime = conf.born;
+      return;
+   }
+
+   sb->st_ino = fe->ino;
+   sb->st_mode = fe->mode;
+   sb->st_nlink = (S_ISDIR(fe->mode) ? 2 : 1);
+   sb->st_uid = fe->uid;
+   sb->st_gid = fe->gid;
+   sb->st_size = fe->size;
+   sb->st_blocks = (fe->size + 511) / 512;
+   sb->st_atime = sb->st_mtime = sb->st_ctime = fe->ctime;
+}
+
 void vfs_op_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-   pkg_inode_t *i;
+   unsigned long t0 = vfs_stats_start();
    struct stat sb;
-   Log(LOG_DEBUG, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
 
-/*
-   if ((i = db_query(QUERY_INODE, "SELECT * FROM files WHERE inode = %d", (u_int32_t) ino)) != NULL) {
-      sb.st_ino = ino;
-      sb.st_mode = i->st_mode;
-      sb.st_size = i->st_size;
-      sb.st_uid = i->st_uid;
-      sb.st_gid = i->st_gid;
-      blockheap_free(heap_vfs_inode, i);
-   }
-*/
-   // Did we get a valid response?
-   if (sb.st_ino) {
-      fuse_reply_attr(req, &sb, 0.0);
-      Log(LOG_DEBUG, "got attr.st_ino: %d <mode:%o> <size:%lu> (%d:%d)", sb.st_ino,
-          sb.st_mode, sb.st_size, sb.st_uid, sb.st_gid);
-   } else {
-      Log(LOG_DEBUG, "couldn't find attr.st_ino");
-      fuse_reply_err(req, ENOENT);
-   }
+   vfs_fill_stat(vfs_node(ino), &sb);
+   fuse_reply_attr(req, &sb, VFS_FUSE_TIMEOUT);
+   vfs_stats_done(VFS_OP_GETATTR, t0);
 }
 
 void vfs_op_access(fuse_req_t req, fuse_ino_t ino, int mask) {
-   Log(LOG_DEBUG, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_ACCESS);
    fuse_reply_err(req, 0);             /* success */
 }
 
 void vfs_op_readlink(fuse_req_t req, fuse_ino_t ino) {
-   Log(LOG_DEBUG, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
-   fuse_reply_err(req, ENOSYS);
+   vfs_cache_entry *fe = vfs_node(ino);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_READLINK);
+
+   if (fe != NULL && fe->type == PKG_FTYPE_LINK && fe->link != NULL)
+      fuse_reply_readlink(req, fe->link);
+   else
+      fuse_reply_err(req, EINVAL);
+}
+
+// An open directory is its whole listing, built by opendir
+struct vfs_dirbuf {
+   char *buf;
+   size_t size;
+};
+
+static int vfs_dirbuf_add(fuse_req_t req, struct vfs_dirbuf *db, const char *name, u_int32_t ino, mode_t mode) {
+   size_t len = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+   struct stat sb;
+   char *p;
+
+   if (!(p = mem_realloc(db->buf, db->size + len)))
+      return -1;
+
+   memset(&sb, 0, sizeof(sb));
+   sb.st_ino = ino;
+   sb.st_mode = mode;
+   db->buf = p;
+   fuse_add_direntry(req, db->buf + db->size, len, name, &sb, db->size + len);
+   db->size += len;
+   return 0;
 }
 
 void vfs_op_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-   Log(LOG_DEBUG, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
-   fuse_reply_err(req, ENOENT);
+   vfs_cache_entry *dir = vfs_node(ino), *parent = NULL, *fe;
+   struct vfs_dirbuf *db;
+   char name[NAME_MAX + 1];
+   const char *p;
+   size_t len, i;
+   int err = 0;
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_OPENDIR);
+
+   if (dir != NULL && dir->type != PKG_FTYPE_DIR) {
+      fuse_reply_err(req, ENOTDIR);
+      return;
+   }
+
+   if (!(db = mem_alloc(sizeof(*db)))) {
+      fuse_reply_err(req, ENOMEM);
+      return;
+   }
+
+   if (dir != NULL) {
+      p = vfs_canon(dir->path, &len);
+
+      for (i = len; i > 0 && p[i - 1] != '/'; i--)
+         ;
+
+      if (i > 0)
+         parent = cdict_get_blobn(path_cache, p, i - 1, NULL);
+   }
+
+   if (vfs_dirbuf_add(req, db, ".", (dir ? dir->ino : vfs_root_inode), S_IFDIR) != 0 ||
+       vfs_dirbuf_add(req, db, "..", (parent ? parent->ino : vfs_root_inode), S_IFDIR) != 0)
+      err = ENOMEM;
+
+   // vfs_add_path() only ever puts entries on the front, and never takes them off
+   for (fe = __atomic_load_n((dir ? &dir->children : &vfs_root_children), __ATOMIC_ACQUIRE); fe != NULL && err == 0; fe = fe->sibling) {
+      p = vfs_canon(fe->path, &len);
+
+      for (i = len; i > 0 && p[i - 1] != '/'; i--)
+         ;
+
+      snprintf(name, sizeof(name), "%.*s", (int)(len - i), p + i);
+
+      if (vfs_dirbuf_add(req, db, name, fe->ino, fe->mode) != 0)
+         err = ENOMEM;
+   }
+
+   if (err != 0) {
+      if (db->buf != NULL)
+         mem_free(db->buf);
+
+      mem_free(db);
+      fuse_reply_err(req, err);
+      return;
+   }
+
+   fi->fh = (uint64_t)(uintptr_t)db;
+   fi->keep_cache = 1;
+   fuse_reply_open(req, fi);
 }
 
 void vfs_op_readdir(fuse_req_t req, fuse_ino_t ino,
                              size_t size, off_t off, struct fuse_file_info *fi) {
-   Log(LOG_DEBUG, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
-   fuse_reply_err(req, ENOENT);
+   unsigned long t0 = vfs_stats_start();
+   struct vfs_dirbuf *db = (struct vfs_dirbuf *)(uintptr_t)fi->fh;
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+
+   // Offsets are into the listing, whole entries at a time
+   if (off < (off_t)db->size)
+      fuse_reply_buf(req, db->buf + off, MIN(db->size - off, size));
+   else
+      fuse_reply_buf(req, NULL, 0);
+
+   vfs_stats_done(VFS_OP_READDIR, t0);
 }
 
 void vfs_op_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-   Log(LOG_DEBUG, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
-   fuse_reply_err(req, ENOENT);
+   struct vfs_dirbuf *db = (struct vfs_dirbuf *)(uintptr_t)fi->fh;
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_RELEASEDIR);
+
+   if (db != NULL) {
+      if (db->buf != NULL)
+         mem_free(db->buf);
+
+      mem_free(db);
+   }
+
+   fuse_reply_err(req, 0);             /* success */
 }
 
 void vfs_op_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+   unsigned long t0 = vfs_stats_start();
+   vfs_cache_entry *fe = vfs_node(ino);
    struct vfs_handle *fh;
-   fh = blockheap_alloc(heap_vfs_handle);
-   fi->fh = ((uint64_t) fh);
-   pkg_inode_t *i;
-   struct stat sb;
-   Log(LOG_DEBUG, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   int err = 0;
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+
+   // XXX: Writes should go to a spillover file, for now we're read-only
+   if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & (O_CREAT | O_TRUNC)))
+      err = EROFS;
+   else if (fe == NULL || fe->type == PKG_FTYPE_DIR)
+      err = EISDIR;
+   else if (fe->type != PKG_FTYPE_FILE)
+      err = EACCES;
+   // Pull it out of the package into path.cache, unless that's been done already
+   else if (vfs_unpack_tempfile(fe) != 0)
+      err = EIO;
+   else {
+      if (!(fh = blockheap_alloc(heap_vfs_handle)))
+         err = ENOMEM;
+      else {
+         memset(fh, 0, sizeof(*fh));
+         fh->pkgid = fe->pkgid;
+         fh->len = fe->size;
+         fh->fe = fe;
+
+         if ((fh->fd = open(fe->cache_path, O_RDONLY | O_CLOEXEC)) < 0) {
+            err = errno;
+            blockheap_free(heap_vfs_handle, fh);
+         }
+      }
 
-   // Check if a spillover file exists
-i =  0;
-/*
-   if ((i = db_query(QUERY_INODE, "SELECT * FROM spillover WHERE inode = %d", (u_int32_t) ino))) {
-     // if file doesn't exist in cache but exist in spillover, extract to cache
-     //
-     // if file exists in cache; use it
-     //
-   // If not, maybe this exists in a package?
-   } else if ((i = db_query(QUERY_INODE, "SELECT * FROM files WHERE inode = %d", (u_int32_t) ino))) {
-     // if file doesn't exist in cache but exists in pkg, extract it to cache
-     //
-     // if file exists in cache; use it
-     //
+      // vfs_unpack_tempfile() took a reference for the handle
+      if (err != 0)
+         __atomic_sub_fetch(&fe->refcnt, 1, __ATOMIC_RELAXED);
    }
-*/
-   // Nope, it doesn't exist
-   if (!i) {
-      // If process didn't use O_CREAT, return not found
-      if (!(fi->flags & O_CREAT)) {
-         fuse_reply_err(req, ENOENT);
-      } else {
-         // XXX: We should create a new fill in spillover
-         // and return it's inode. For now we return read-only
-         fuse_reply_err(req, EROFS);
-      }
+
+   if (err != 0)
+      fuse_reply_err(req, err);
+   else {
+      fi->fh = (uint64_t)(uintptr_t)fh;
+      // Package contents never change under us
+      fi->keep_cache = 1;
+      fuse_reply_open(req, fi);
    }
 
-   blockheap_free(heap_vfs_inode, i);
-   fuse_reply_open(req, fi);
+   vfs_stats_done(VFS_OP_OPEN, t0);
 }
 
 void vfs_op_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-   Log(LOG_DEBUG, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   struct vfs_handle *fh = (struct vfs_handle *)(uintptr_t)fi->fh;
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_RELEASE);
+
+   if (fh != NULL) {
+      close(fh->fd);
+      __atomic_sub_fetch(&fh->fe->refcnt, 1, __ATOMIC_RELAXED);
+      blockheap_free(heap_vfs_handle, fh);
+   }
+
    fuse_reply_err(req, 0);             /* success */
 }
 
 void vfs_op_read(fuse_req_t req, fuse_ino_t ino,
                           size_t size, off_t off, struct fuse_file_info *fi) {
-   Log(LOG_DEBUG, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
-/*      reply_buf_limited(req, hello_str, strlen(hello_str), off, size); */
-   fuse_reply_err(req, EBADF);
+   unsigned long t0 = vfs_stats_start();
+   struct vfs_handle *fh = (struct vfs_handle *)(uintptr_t)fi->fh;
+   struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+
+   trace_read(fh->fe, off, size, fuse_req_ctx(req)->pid);
+   prefetch_touch(fh->fe);
+
+   // Let FUSE read (or splice) straight from the cache file
+   buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+   buf.buf[0].fd = fh->fd;
+   buf.buf[0].pos = off;
+   fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+
+   if (off < (off_t)fh->len)
+      vfs_stats_bytes((fh->len - off < size ? fh->len - off : size));
+   vfs_stats_done(VFS_OP_READ, t0);
 }
 
 void vfs_op_statfs(fuse_req_t req, fuse_ino_t ino) {
-   Log(LOG_DEBUG, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_STATFS);
    fuse_reply_err(req, ENOSYS);
 }
 
 void vfs_op_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
-   Log(LOG_DEBUG, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_GETXATTR);
    fuse_reply_err(req, ENOTSUP);
 }
 
 void vfs_op_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
-   Log(LOG_DEBUG, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+   vfs_stats_count(VFS_OP_LISTXATTR);
    fuse_reply_err(req, ENOTSUP);
 }
 
 void vfs_op_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+   unsigned long t0 = vfs_stats_start();
+   vfs_cache_entry *dir = vfs_node(parent), *fe;
    struct fuse_entry_param e;
+   char path[PATH_MAX];
+   const char *p = "";
+   size_t len = 0;
 
-   Log(LOG_DEBUG, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
-#if	0
-   if (parent != 1)                    /* XXX: need checks here */
-#endif
+   Debug(DEBUG_VFS, "%s:%d:%s", __FILE__, __LINE__, __FUNCTION__);
+
+   if (dir != NULL)
+      p = vfs_canon(dir->path, &len);
+
+   if (snprintf(path, sizeof(path), "%.*s%s%s", (int)len, p, (len ? "/" : ""), name) >= (int)sizeof(path))
+      fuse_reply_err(req, ENAMETOOLONG);
+   else if ((fe = vfs_lookup(path, fuse_req_ctx(req)->pid)) == NULL)
       fuse_reply_err(req, ENOENT);
-#if	0
    else {
       memset(&e, 0, sizeof(e));
-      e.ino = 2;                       /* Inode number */
-      e.attr_timeout = 1.0;
-      e.entry_timeout = 1.0;
-      // XXX: stat 
-      vfs_op_stat(e.ino, &e.attr);
+      e.ino = vfs_nodeid(fe);
+      e.attr_timeout = VFS_FUSE_TIMEOUT;
+      e.entry_timeout = VFS_FUSE_TIMEOUT;
+      vfs_fill_stat(fe, &e.attr);
       fuse_reply_entry(req, &e);
    }
-#endif
+
+   vfs_stats_done(VFS_OP_LOOKUP, t0);
 }
 
 static void vfs_dir_walk_recurse(const char *path, int depth) {
@@ -397,7 +607,7 @@ int vfs_dir_walk(void) {
    char        buf[PATH_MAX];
    char       *p;
 
-   memcpy(buf, dconf_get_str("path.pkg", "/pkg"), PATH_MAX);
+   snprintf(buf, sizeof(buf), "%s", conf_get()->path_pkg);
 
    // recurse each part of the optionally ':' seperated list 
    for (p = strtok(buf, ":\n"); p; p = strtok(NULL, ":\n")) {
@@ -425,10 +635,8 @@ vfs_lookup_reply *vfs_resolve_path(const char *path) {
     // - Look in jail/pkg/
     // - Look in ../pkg/
     // If not found, create in spillover (if O_CREAT) or return ENOENT.
-    if (dconf_get_bool("debug.vfs", 0) == 1) {
-       Log(LOG_DEBUG, "vfs:resolve_path(%s): seq<%d> status<%d> pkg<%d> file<%d>",
-          res->seq, res->status, res->pkgid, res->fileid);
-    }
+    Debug(DEBUG_VFS, "vfs:resolve_path(%s): seq<%d> status<%d> pkg<%d> file<%d>",
+          path, res->seq, res->status, res->pkgid, res->fileid);
     return res;
 }
 
@@ -463,8 +671,12 @@ static struct fuse_lowlevel_ops vfs_fuse_ops = {
 /////////////////
 
 void vfs_fuse_fini(void) {
-   if (vfs_fuse_sess != NULL)
-      fuse_session_destroy(vfs_fuse_sess);
+   struct fuse_session *se = vfs_fuse_sess;
+
+   if (se != NULL) {
+      vfs_fuse_sess = NULL;
+      fuse_session_destroy(se);
+   }
 
    if (vfs_fuse_chan != NULL) {
 #if	0
@@ -477,6 +689,14 @@ void vfs_fuse_fini(void) {
       fuse_opt_free_args(&vfs_fuse_args);
 }
 
+// Runs on the main loop: evt_loop isn't ours to touch from the vfs thread
+static void vfs_fuse_attach(void *arg) {
+   // Register an interest in events on the fuse fd 
+   ev_io_init(&vfs_fuse_evt, vfs_fuse_read_cb, fuse_chan_fd(vfs_fuse_chan), EV_READ);
+   ev_io_start(evt_loop, &vfs_fuse_evt);
+   Log(LOG_INFO, "FUSE: serving %s", mountpoint);
+}
+
 void vfs_fuse_init(void) {
    Log(LOG_DEBUG, "mountpoint: (%s)%s", get_current_dir_name(), mountpoint);
 
@@ -484,8 +704,9 @@ void vfs_fuse_init(void) {
       Log(LOG_EMERG, "FUSE: mount error");
       conf.dying = 1;
       raise(SIGTERM);
+      return;
    }
-#if	0
+
    if ((vfs_fuse_sess = fuse_lowlevel_new(&vfs_fuse_args, &vfs_fuse_ops,
                                           sizeof(vfs_fuse_ops), NULL)) != NULL) {
       fuse_session_add_chan(vfs_fuse_sess, vfs_fuse_chan);
@@ -493,20 +714,19 @@ void vfs_fuse_init(void) {
       Log(LOG_EMERG, "FUSE: unable to create session");
       conf.dying = 1;
       raise(SIGTERM);
+      return;
    }
-   // Register an interest in events on the fuse fd 
-   ev_io_init(&vfs_fuse_evt, vfs_fuse_read_cb, fuse_chan_fd(vfs_fuse_chan), EV_READ);
-   ev_io_start(evt_loop, &vfs_fuse_evt);
-#endif
+
+   cron_once("vfs.fuse", vfs_fuse_attach, NULL, 0, 0);
 }
 
-// garbage collector
-int vfs_gc(void) {
-   blockheap_garbagecollect(heap_vfs_cache);
-   blockheap_garbagecollect(heap_vfs_handle);
-   blockheap_garbagecollect(heap_vfs_inode);
-   blockheap_garbagecollect(heap_vfs_watch);
-   return 0;
+// The path index pkg_open() fills (also used by --bench-import, without FUSE)
+void vfs_index_init(void) {
+    path_cache = cdict_new(dconf_get_int("tuning.heap.files", 1024));
+    if (!(heap_vfs_cache = blockheap_create(sizeof(vfs_cache_entry), dconf_get_int("tuning.heap.files", 1024), "cache entries"))) {
+       Log(LOG_EMERG, "vfs_init: block allocator failed");
+       raise(SIGABRT);
+    }
 }
 
 ////////////
@@ -520,11 +740,7 @@ void *thread_vfs_init(void *data) {
 
     thread_entry((dict *)data);
     cache = dconf_get_str("path.cache", NULL);
-    cache_dict = dict_new();
-    if (!(heap_vfs_cache = blockheap_create(sizeof(vfs_cache_entry), dconf_get_int("tuning.heap.files", 1024), "cache entries"))) {
-       Log(LOG_EMERG, "vfs_init: block allocator failed");
-       raise(SIGABRT);
-    }
+    vfs_index_init();
 
     if (!(heap_vfs_handle = blockheap_create(sizeof(vfs_handle_t), dconf_get_int("tuning.heap.vfs_handle", 128), "vfs_handle"))) {
        Log(LOG_EMERG, "vfs_init: block allocator failed");
@@ -541,6 +757,11 @@ void *thread_vfs_init(void *data) {
        raise(SIGABRT);
     }
 
+    conf_watch_heap("tuning.heap.files", heap_vfs_cache);
+    conf_watch_heap("tuning.heap.vfs_handle", heap_vfs_handle);
+    conf_watch_heap("tuning.heap.vfs_watch", heap_vfs_watch);
+    conf_watch_heap("tuning.heap.inode", heap_vfs_inode);
+
     // If .keepme exists in cachedir (from git), remove it or mount will fail
     char tmppath[PATH_MAX];
     memset(tmppath, 0, sizeof(tmppath));
@@ -549,7 +770,7 @@ void *thread_vfs_init(void *data) {
        unlink(tmppath);
 
     // Are we configured to use a tmpfs or host fs for cache?
-    if (strcasecmp("tmpfs", dconf_get_str("cache.type", NULL)) == 0) {
+    if (strcasecmp("tmpfs", conf_get()->cache_type) == 0) {
        if (cache != NULL) {
           int rv = -1;
 
@@ -562,14 +783,22 @@ void *thread_vfs_init(void *data) {
     }
 
     // Schedule garbage collection
-    evt_timer_add_periodic(vfs_gc, "gc:vfs", dconf_get_int("tuning.timer.vfs_gc", 1200));
+    gc_register_heap(heap_vfs_cache, "tuning.timer.vfs_gc", 1200);
+    gc_register_heap(heap_vfs_handle, "tuning.timer.vfs_gc", 1200);
+    gc_register_heap(heap_vfs_inode, "tuning.timer.vfs_gc", 1200);
+    gc_register_heap(heap_vfs_watch, "tuning.timer.vfs_gc", 1200);
     //hook_register_interest("gc", vfs_gc);
 
+    // Save per-operation latency stats (tuning.timer.vfs_stats)
+    vfs_stats_init();
+
     // Mount the virtual file system
-    if ((mountpoint = dconf_get_str("path.mountpoint", NULL)) == NULL) {
+    // Keep our own copy, configuration snapshots don't live forever
+    if (conf_get()->path_mountpoint == NULL) {
        Log(LOG_EMERG, "mountpoint not configured. exiting!");
        raise(SIGTERM);
-    }
+    } else
+       mountpoint = str_dup(conf_get()->path_mountpoint);
 
     mimetype_init();
     umount(mountpoint);
@@ -580,45 +809,76 @@ void *thread_vfs_init(void *data) {
 
     if ((fuse_opt_add_arg(&vfs_fuse_args, dconf_get_str("jail.name", NULL)) == -1 ||
          fuse_opt_add_arg(&vfs_fuse_args, "-o") == -1 ||
-         fuse_opt_add_arg(&vfs_fuse_args, "nonempty,allow_other") == -1)) {
+         fuse_opt_add_arg(&vfs_fuse_args, "nonempty,allow_other,default_permissions") == -1)) {
        Log(LOG_EMERG, "Failed to set FUSE options.");
        raise(SIGTERM);
     }
 
-    umount(mountpoint);
-//    vfs_fuse_init();
-
     // Add inotify watchers for paths in %{path.pkg}
-    if (dconf_get_bool("pkgdir.inotify", 0) == 1)
+    if (conf_get()->pkgdir_inotify)
        vfs_watch_init();
 
+    // Before any packages are imported, so they all make it into the trace
+    trace_init();
+
     // Load all packages in %{path.pkg}} if enabled
-    if (dconf_get_bool("pkgdir.prescan", 0) == 1)
+    if (conf_get()->pkgdir_prescan)
        vfs_dir_walk();
 
-    // Main loop for thread
+    __atomic_store_n(&vfs_ready, 1, __ATOMIC_RELEASE);
+
+    // Let lib/libfspkg.so in on the index
+    vfs_shm_init();
+
+    // Mount the virtual file system, now that there's something in it
+    umount(mountpoint);
+    vfs_fuse_init();
+
+    // Warm the cache with whatever the last run used
+    if (dconf_get_bool("pkg.precache", 0))
+       trace_precache();
+
+    api_mailbox *mb = api_mailbox_create("vfs", NULL, NULL);
+
+    // Main loop for thread: handle requests, wake up every 3s regardless
     while (!conf.dying) {
-       sleep(3);
+       api_mailbox_wait(mb, 3000);
        pthread_yield();
     }
 
+    api_mailbox_destroy(mb);
+
     return data;
 }
 
+static void vfs_free_link(const char *key, const char *val, void *blob, void *arg) {
+   vfs_cache_entry *fe = (vfs_cache_entry *)blob;
+
+   if (fe != NULL && fe->link != NULL)
+      mem_free(fe->link);
+}
+
 // thread:destructor
 void *thread_vfs_fini(void *data) {
    dict *args = (dict *)data;
    char *mp = NULL;
 
-   if ((mountpoint = dconf_get_str("path.mountpoint", NULL)) != NULL)
+   if (mountpoint != NULL) {
       umount(mountpoint);
+      mem_free(mountpoint);
+      mountpoint = NULL;
+   }
 
-   if (strcasecmp("tmpfs", dconf_get_str("cache.type", NULL)) == 0) {
+   if (strcasecmp("tmpfs", conf_get()->cache_type) == 0) {
       if ((mp = dconf_get_str("path.cache", NULL)) != NULL)
          umount(mp);
    }
    vfs_fuse_fini();
-   dict_free(cache_dict);
+   vfs_shm_fini();
+   trace_fini();
+   cdict_foreach(path_cache, vfs_free_link, NULL);
+   cdict_free(path_cache);
+   path_cache = NULL;
    blockheap_destroy(heap_vfs_cache);
    blockheap_destroy(heap_vfs_inode);
    blockheap_destroy(heap_vfs_watch);
@@ -656,10 +916,10 @@ static dlink_node *vfs_watch_findnode_byfd(const int fd) {
 }
 
 /*
- *    function: vfs_inotify_evt_get
+ *    function: vfs_inotify_read
  * description: process the events inotify has given us
  */
-void vfs_inotify_evt_get(struct ev_loop *loop, ev_io * w, int revents) {
+static void vfs_inotify_read(ev_io * w) {
    ssize_t     len, i = 0;
    char        buf[INOTIFY_BUFSIZE] = { 0 };
    char        path[PATH_MAX];
@@ -699,6 +959,17 @@ void vfs_inotify_evt_get(struct ev_loop *loop, ev_io * w, int revents) {
       i += sizeof(struct inotify_event) + e->len;
    }
 }
+
+void vfs_inotify_evt_get(struct ev_loop *loop, ev_io * w, int revents) {
+   static int  wd_slot = -1;
+
+   if (wd_slot < 0)
+      wd_slot = watchdog_register("vfs.inotify");
+
+   watchdog_enter(wd_slot);
+   vfs_inotify_read(w);
+   watchdog_leave(wd_slot);
+}
 vfs_watch_t *vfs_watch_add(const char *path) {
    vfs_watch_t *wh = blockheap_alloc(heap_vfs_watch);
 
@@ -756,7 +1027,7 @@ int vfs_watch_init(void) {
    /*
     * add all the paths in the config file 
     */
-   memcpy(buf, dconf_get_str("path.pkg", "/pkg"), PATH_MAX);
+   snprintf(buf, sizeof(buf), "%s", conf_get()->path_pkg);
    if (strchr(buf, ':') == NULL) {
       for (p = strtok(buf, ":\n"); p; p = strtok(NULL, ":\n")) {
          vfs_watch_add(p);
@@ -774,23 +1045,39 @@ int vfs_watch_init(void) {
 // cache bits //
 ////////////////
 
-// backend function that does the actual heavy lifting...
-int vfs_add_path(const char type, int pkgid, const char *path, uid_t uid, gid_t gid, const char *owner, const char *group,
-                 mode_t mode, size_t size, time_t ctime) {
-    vfs_cache_entry *fe = NULL;
+// Archives say ./usr/bin/, usr/bin or /usr/bin; the index says usr/bin
+const char *vfs_canon(const char *path, size_t *len) {
+    size_t n;
 
-    if (pkgid < 1) {
-       Log(LOG_ERR, "vfs_add_path: pkgid %d is not valid (<1)", pkgid);
-       return -1;
+    for (;;) {
+       if (path[0] == '/')
+          path++;
+       else if (path[0] == '.' && (path[1] == '/' || path[1] == '\0'))
+          path++;
+       else
+          break;
     }
 
-    if (path == NULL) {
-       Log(LOG_ERR, "vfs_add_path: in pkg %d got NULL path", pkgid);
-       return -1;
-    }
+    for (n = strlen(path); n > 0 && path[n - 1] == '/'; n--)
+       ;
+
+    *len = n;
+    return path;
+}
 
+// Caller holds cache_mutex
+static int vfs_insert(const char type, int pkgid, const char *path, const char *link, uid_t uid, gid_t gid, const char *owner, const char *group,
+                      mode_t mode, size_t size, time_t ctime) {
+    vfs_cache_entry *fe = NULL, *dir, **head = NULL;
+    char key[PATH_MAX];
+    const char *p;
+    size_t len, i;
+
+    if ((fe = vfs_find(path))) {
+       // Directories are shared between packages
+       if (type == 'd')
+          return 0;
 
-    if ((type != 'd') && (fe = vfs_find(path))) {
        Log(LOG_ERR, "vfs_add_path: %d:%s already exists in pkg %d", pkgid, path, fe->pkgid);
        return -1;
     }
@@ -802,14 +1089,15 @@ int vfs_add_path(const char type, int pkgid, const char *path, uid_t uid, gid_t
 
     // Set up the cache entry structure
     memset(fe, 0, sizeof(vfs_cache_entry));
-    memcpy(fe->path, path, sizeof(fe->path)-1);
+    strncpy(fe->path, path, sizeof(fe->path)-1);
 
     if (owner != NULL)
-       memcpy(fe->owner, owner, sizeof(fe->owner)-1);
+       strncpy(fe->owner, owner, sizeof(fe->owner)-1);
 
     if (group != NULL)
-       memcpy(fe->group, group, sizeof(fe->group)-1);
+       strncpy(fe->group, group, sizeof(fe->group)-1);
     fe->pkgid = pkgid;
+    fe->ino = __atomic_add_fetch(&vfs_last_ino, 1, __ATOMIC_RELAXED);
     fe->uid = uid;
     fe->gid = gid;
     fe->mode = mode;
@@ -825,6 +1113,9 @@ int vfs_add_path(const char type, int pkgid, const char *path, uid_t uid, gid_t
           break;
        case 'l':
           fe->type = PKG_FTYPE_LINK;
+
+          if (link != NULL)
+             fe->link = str_dup(link);
           break;
        case 'D':
           fe->type = PKG_FTYPE_DEV;
@@ -834,17 +1125,124 @@ int vfs_add_path(const char type, int pkgid, const char *path, uid_t uid, gid_t
           break;
     }
 
-    Log(LOG_DEBUG, "vfs_add_path: Added <%d> %c:%s", pkgid, type, path);
+    p = vfs_canon(path, &len);
+    snprintf(key, sizeof(key), "%.*s", (int)len, p);
+
+    if (cdict_add_blob(path_cache, key, fe) != 0) {
+       Log(LOG_ERR, "vfs_add_path: failed caching %d:%s", pkgid, path);
+
+       if (fe->link != NULL)
+          mem_free(fe->link);
+
+       blockheap_free(heap_vfs_cache, fe);
+       return -1;
+    }
+
+    // Onto its directory's listing, ready before opendir can see it
+    for (i = len; i > 0 && p[i - 1] != '/'; i--)
+       ;
+
+    if (i == 0)
+       head = &vfs_root_children;
+    else if ((dir = cdict_get_blobn(path_cache, p, i - 1, NULL)) != NULL && dir->type == PKG_FTYPE_DIR)
+       head = &dir->children;
+
+    if (head != NULL) {
+       fe->sibling = *head;
+       __atomic_store_n(head, fe, __ATOMIC_RELEASE);
+    }
+
+    vfs_shm_changed();
+    Debug(DEBUG_VFS, "vfs_add_path: Added <%d> %c:%s", pkgid, type, path);
     return 0;
 }
 
-// Find a cache entry
+// backend function that does the actual heavy lifting...
+int vfs_add_path(const char type, int pkgid, const char *path, const char *link, uid_t uid, gid_t gid, const char *owner, const char *group,
+                 mode_t mode, size_t size, time_t ctime) {
+    char dir[PATH_MAX];
+    const char *p;
+    size_t len, i, j;
+    int rv;
+
+    if (pkgid < 1) {
+       Log(LOG_ERR, "vfs_add_path: pkgid %d is not valid (<1)", pkgid);
+       return -1;
+    }
+
+    if (path == NULL) {
+       Log(LOG_ERR, "vfs_add_path: in pkg %d got NULL path", pkgid);
+       return -1;
+    }
+
+    // The root is always there
+    p = vfs_canon(path, &len);
+
+    if (len == 0)
+       return 0;
+
+    for (i = len; i > 0 && p[i - 1] != '/'; i--)
+       ;
+
+    pthread_mutex_lock(&cache_mutex);
+
+    // Packages don't always list a file's directories on their own, make up the missing ones
+    if (i > 1 && cdict_get_blobn(path_cache, p, i - 1, NULL) == NULL) {
+       for (j = 1; j < i; j++) {
+          if (p[j] != '/' || cdict_get_blobn(path_cache, p, j, NULL) != NULL)
+             continue;
+
+          snprintf(dir, sizeof(dir), "%.*s", (int)j, p);
+          vfs_insert('d', pkgid, dir, NULL, 0, 0, "root", "root", S_IFDIR | 0755, 0, ctime);
+       }
+    }
+
+    rv = vfs_insert(type, pkgid, path, link, uid, gid, owner, group, mode, size, ctime);
+    pthread_mutex_unlock(&cache_mutex);
+    return rv;
+}
+
+int vfs_index_ready(void) {
+    return __atomic_load_n(&vfs_ready, __ATOMIC_ACQUIRE);
+}
+
+// Paths in the metadata index
+unsigned long vfs_path_count(void) {
+    return cdict_count(path_cache);
+}
+
+void vfs_index_foreach(void (*fn)(const char *key, const char *val, void *blob, void *arg), void *arg) {
+    cdict_foreach(path_cache, fn, arg);
+}
+
+// Find a cache entry (lock-free, safe from any thread)
 vfs_cache_entry *vfs_find(const char *path) {
-    return NULL;
+    vfs_cache_entry *fe;
+    const char *p;
+    size_t len;
+
+    p = vfs_canon(path, &len);
+    fe = (vfs_cache_entry *)cdict_get_blobn(path_cache, p, len, NULL);
+
+    vfs_stats_cache(fe ? VFS_CTR_META_HIT : VFS_CTR_META_MISS);
+    return fe;
+}
+
+vfs_cache_entry *vfs_lookup(const char *path, pid_t pid) {
+    vfs_cache_entry *fe = vfs_find(path);
+
+    if (fe != NULL) {
+       trace_lookup(fe, pid);
+       prefetch_touch(fe);
+    }
+
+    return fe;
 }
 
 int vfs_unpack_tempfile(vfs_cache_entry *fe) {
     char *path = NULL;
+    struct stat sb;
+    u_int8_t state = VFS_CACHE_NONE;
 
     if (fe == NULL)
        return -1;
@@ -853,15 +1251,58 @@ int vfs_unpack_tempfile(vfs_cache_entry *fe) {
        // Find handle for existing file and return it instead
     }
 
+    // Somebody else (boot prefetch, another request) may be extracting it right now
+    while (!__atomic_compare_exchange_n(&fe->cached, &state, VFS_CACHE_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+       if (state == VFS_CACHE_DONE)
+          break;
+
+       usleep(1000);
+       state = VFS_CACHE_NONE;
+    }
+
     // We haven't extracted it yet...
-    if (fe->cache_path == NULL) {
+    if (state == VFS_CACHE_NONE) {
+       vfs_stats_cache(VFS_CTR_EXTRACT_MISS);
+
        // Extract it
-       path = pkg_extract_file(fe->pkgid, fe->path);
-       memcpy(fe->cache_path, path, sizeof(fe->cache_path)-1);
+       if ((path = pkg_extract_file(fe->pkgid, fe->path)) == NULL) {
+          __atomic_store_n(&fe->cached, VFS_CACHE_NONE, __ATOMIC_RELEASE);
+          return -1;
+       }
+       snprintf(fe->cache_path, sizeof(fe->cache_path), "%s", path);
+       mem_free(path);
+       __atomic_store_n(&fe->cached, VFS_CACHE_DONE, __ATOMIC_RELEASE);
+       vfs_shm_cached(fe);
+
+       if (stat(fe->cache_path, &sb) == 0)
+          vfs_stats_add(VFS_CTR_EXTRACT_BYTES, sb.st_size);
        // register the unpacked file
        
+    } else
+       vfs_stats_cache(VFS_CTR_EXTRACT_HIT);
+
+    __atomic_add_fetch(&fe->refcnt, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int vfs_precache(const char *path) {
+    vfs_cache_entry *fe = vfs_find(path);
+    int fd;
+
+    if (fe == NULL || fe->type != PKG_FTYPE_FILE)
+       return -1;
+
+    if (vfs_unpack_tempfile(fe) != 0)
+       return -1;
+
+    // Nobody has it open yet
+    __atomic_sub_fetch(&fe->refcnt, 1, __ATOMIC_RELAXED);
+
+    // Extracted on an earlier pass, it may have left the page cache since
+    if ((fd = open(fe->cache_path, O_RDONLY)) >= 0) {
+       posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+       close(fd);
     }
 
-    fe->refcnt++;
     return 0;
 }
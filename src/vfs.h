@@ -30,6 +30,8 @@ struct vfs_handle {
    size_t      len;                    /* length of file */
 //   off_t       offset;                 /* current offset in file */
    char       *maddr;                  /* mmap()'d region of package */
+   struct vfs_cache_entry *fe;         /* what was opened */
+   int         fd;                     /* its extracted copy in path.cache */
 };
 
 struct vfs_watch {
@@ -104,10 +106,22 @@ extern void vfs_inode_fini(void);
 ///////////////////
 // caching stuff //
 ///////////////////
+/*
+ * Entries are keyed by vfs_canon() of their path and never freed while
+ * we run, so FUSE uses their address as the node id (the root is 1).
+ * Directories packages don't list on their own are made up as needed.
+ * Each directory keeps its entries on a list (newest first) for readdir.
+ */
 struct vfs_cache_entry {
-   char path[PATH_MAX];		// VFS path
+   char path[PATH_MAX];		// VFS path, as the package spells it
    char cache_path[PATH_MAX];	// hash to find this in the cache
+   char *link;			// symlink target, NULL unless PKG_FTYPE_LINK
+   struct vfs_cache_entry *children, *sibling;	// directory listing
    u_int32_t pkgid;		// Owner package
+   u_int32_t ino;		// inode number (this run only)
+   u_int8_t traced;		// access tracer has written our path out
+   u_int8_t cached;		// VFS_CACHE_*: extracted into cache_path yet?
+   u_int32_t boot_gen;		// last launch whose boot profile has us
    size_t size;			// size in bytes
    u_int16_t refcnt;		// reference count
    enum { PKG_FTYPE_NONE = 0, PKG_FTYPE_LINK, PKG_FTYPE_DIR, PKG_FTYPE_FILE, PKG_FTYPE_FIFO, PKG_FTYPE_BLOCK, PKG_FTYPE_DEV } type;
@@ -124,13 +138,26 @@ struct vfs_cache_entry {
           atime;		// access time
 };
 typedef struct vfs_cache_entry vfs_cache_entry;
-extern int vfs_add_path(const char type, int pkgid, const char *path, uid_t uid, gid_t gid, const char *owner, const char *group, mode_t mode, size_t size, time_t ctime);
+enum { VFS_CACHE_NONE = 0, VFS_CACHE_BUSY, VFS_CACHE_DONE };
+extern int vfs_add_path(const char type, int pkgid, const char *path, const char *link, uid_t uid, gid_t gid, const char *owner, const char *group, mode_t mode, size_t size, time_t ctime);
 
+// How the index spells path: no leading "./" or "/", no trailing "/" (len bytes, not terminated)
+extern const char *vfs_canon(const char *path, size_t *len);
 // Look up a path, either returning NULL (maybe setting errno) or a valid cache entry
 extern vfs_cache_entry *vfs_find(const char *path);
+// vfs_find() on behalf of a process in the jail (feeds the access tracer)
+extern vfs_cache_entry *vfs_lookup(const char *path, pid_t pid);
+extern int vfs_unpack_tempfile(vfs_cache_entry *fe);
+// Extract a file into the cache ahead of time
+extern int vfs_precache(const char *path);
+extern unsigned long vfs_path_count(void);
+// Every entry in the index, blob is the vfs_cache_entry (see cdict_foreach())
+extern void vfs_index_foreach(void (*fn)(const char *key, const char *val, void *blob, void *arg), void *arg);
+extern void vfs_index_init(void);
+// Has the startup package scan finished?
+extern int vfs_index_ready(void);
 
 // garbage collect
-extern int vfs_gc(void);
 //
 extern int vfs_watch_init(void);
 #endif	// !defined(__VFS_H)
@@ -0,0 +1,306 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/watchdog.c:
+ *	Main loop stall detector
+ */
+#define	UNW_LOCAL_ONLY
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <libunwind.h>
+#include <lsd/lsd.h>
+#include "conf.h"
+#include "logger.h"
+#include "shell.h"
+#include "threads.h"
+#include "watchdog.h"
+
+// Asks the main thread for its stack
+#define	WATCHDOG_SIGNAL		(SIGRTMIN + 1)
+
+static pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct watchdog_cb watchdog_cbs[WATCHDOG_MAX_CB];
+static int watchdog_ncbs = 0;
+static hist watchdog_loop;		// ns from waking up to blocking again
+static pthread_t watchdog_main;
+static int watchdog_enabled = 0;
+static unsigned long watchdog_threshold = WATCHDOG_THRESHOLD * 1000000UL;
+
+// What the main loop is doing right now (0: nothing we know of)
+static unsigned long watchdog_since = 0;	// current callback started
+static int watchdog_slot = 0;
+static unsigned long watchdog_woke = 0;		// current loop pass started
+static unsigned long watchdog_left = 0;		// last callback returned
+
+// Filled in by the signal handler
+static unsigned long watchdog_frames[WATCHDOG_FRAMES];
+static int watchdog_nframes = 0;
+
+static unsigned long watchdog_now_ns(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+int watchdog_register(const char *name) {
+   int i;
+
+   if (name == NULL)
+      return 0;
+
+   pthread_mutex_lock(&watchdog_lock);
+
+   for (i = 0; i < watchdog_ncbs; i++)
+      if (strcmp(watchdog_cbs[i].name, name) == 0)
+         break;
+
+   if (i == watchdog_ncbs) {
+      if (watchdog_ncbs < WATCHDOG_MAX_CB) {
+         snprintf(watchdog_cbs[i].name, sizeof(watchdog_cbs[i].name), "%s", name);
+         __atomic_store_n(&watchdog_ncbs, watchdog_ncbs + 1, __ATOMIC_RELEASE);
+      } else
+         i = 0;
+   }
+
+   pthread_mutex_unlock(&watchdog_lock);
+   return i;
+}
+
+void watchdog_enter(int slot) {
+   if (!__atomic_load_n(&watchdog_enabled, __ATOMIC_RELAXED))
+      return;
+
+   __atomic_store_n(&watchdog_slot, slot, __ATOMIC_RELAXED);
+   __atomic_store_n(&watchdog_since, watchdog_now_ns(), __ATOMIC_RELEASE);
+}
+
+void watchdog_leave(int slot) {
+   struct watchdog_cb *cb = &watchdog_cbs[slot];
+   unsigned long since = watchdog_since, ran;
+
+   // Not enabled, or it was switched on halfway through
+   if (since == 0)
+      return;
+
+   ran = watchdog_now_ns() - since;
+   __atomic_store_n(&watchdog_left, since + ran, __ATOMIC_RELAXED);
+   __atomic_store_n(&watchdog_since, 0, __ATOMIC_RELEASE);
+   hist_record(&cb->run, ran);
+
+   if (ran >= __atomic_load_n(&watchdog_threshold, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&cb->stalls, cb->stalls + 1, __ATOMIC_RELAXED);
+      Log(LOG_WARNING, "watchdog: %s held up the main loop for %.1f ms", cb->name, ran / 1e6);
+   }
+}
+
+void watchdog_loop_wake(void) {
+   if (__atomic_load_n(&watchdog_enabled, __ATOMIC_RELAXED))
+      __atomic_store_n(&watchdog_woke, watchdog_now_ns(), __ATOMIC_RELEASE);
+}
+
+void watchdog_loop_idle(void) {
+   unsigned long woke = watchdog_woke;
+
+   if (woke == 0)
+      return;
+
+   hist_record(&watchdog_loop, watchdog_now_ns() - woke);
+   __atomic_store_n(&watchdog_woke, 0, __ATOMIC_RELEASE);
+}
+
+int watchdog_count(void) {
+   return __atomic_load_n(&watchdog_ncbs, __ATOMIC_ACQUIRE);
+}
+
+const struct watchdog_cb *watchdog_callback(int slot) {
+   return (slot >= 0 && slot < watchdog_count() ? &watchdog_cbs[slot] : NULL);
+}
+
+const hist *watchdog_loop_hist(void) {
+   return &watchdog_loop;
+}
+
+void watchdog_dump(void) {
+   const struct watchdog_cb *cb;
+   int i, n = watchdog_count();
+
+   Log(LOG_SHELL, "watchdog %s, threshold %lu ms, %d callbacks",
+       (watchdog_enabled ? "on" : "off (experimental.watchdog)"), watchdog_threshold / 1000000, n);
+   Log(LOG_SHELL, "  %-24s runs %8lu  p50 %8.3fms  p99 %8.3fms  max %8.3fms",
+       "(loop pass)", watchdog_loop.count, hist_percentile(&watchdog_loop, 50) / 1e6,
+       hist_percentile(&watchdog_loop, 99) / 1e6, watchdog_loop.max / 1e6);
+
+   for (i = 0; i < n; i++) {
+      cb = &watchdog_cbs[i];
+      Log(LOG_SHELL, "  %-24s runs %8lu  p50 %8.3fms  p99 %8.3fms  max %8.3fms  stalls %lu",
+          cb->name, cb->run.count, hist_percentile(&cb->run, 50) / 1e6,
+          hist_percentile(&cb->run, 99) / 1e6, cb->run.max / 1e6, cb->stalls);
+   }
+}
+
+/*
+ * Runs on the main thread, in the middle of whatever it is stuck in.
+ * Local unwinding is async-signal-safe; naming the frames is left to
+ * the watchdog thread.
+ */
+static void watchdog_sig(int sig, siginfo_t *si, void *uctx) {
+   unw_cursor_t cursor;
+   unw_context_t ctx;
+   unw_word_t ip;
+   int n = 0, saved = errno;
+
+   unw_getcontext(&ctx);
+
+   if (unw_init_local(&cursor, &ctx) == 0) {
+      while (n < WATCHDOG_FRAMES && unw_step(&cursor) > 0) {
+         // Start over from the interrupted frame
+         if (unw_is_signal_frame(&cursor) > 0)
+            n = 0;
+
+         if (unw_get_reg(&cursor, UNW_REG_IP, &ip) < 0)
+            break;
+
+         watchdog_frames[n++] = ip;
+      }
+   }
+
+   __atomic_store_n(&watchdog_nframes, n, __ATOMIC_RELEASE);
+   errno = saved;
+}
+
+// Main thread's stack into watchdog_frames, returns the depth
+static int watchdog_trace(void) {
+   int i, n;
+
+   __atomic_store_n(&watchdog_nframes, -1, __ATOMIC_RELEASE);
+
+   if (pthread_kill(watchdog_main, WATCHDOG_SIGNAL) != 0)
+      return 0;
+
+   for (i = 0; i < 100; i++) {
+      if ((n = __atomic_load_n(&watchdog_nframes, __ATOMIC_ACQUIRE)) >= 0)
+         return n;
+
+      usleep(1000);
+   }
+
+   return 0;
+}
+
+static void watchdog_check(void) {
+   static unsigned long reported = 0;
+   unsigned long now, since, woke, left, start, ip;
+   const char *name;
+   Dl_info di;
+   int slot, i, n;
+
+   woke = __atomic_load_n(&watchdog_woke, __ATOMIC_ACQUIRE);
+   since = __atomic_load_n(&watchdog_since, __ATOMIC_ACQUIRE);
+   slot = __atomic_load_n(&watchdog_slot, __ATOMIC_RELAXED);
+
+   // A callback we know of, or something else holding up this pass
+   if (since != 0) {
+      start = since;
+      name = watchdog_cbs[slot].name;
+   } else if (woke != 0) {
+      left = __atomic_load_n(&watchdog_left, __ATOMIC_RELAXED);
+      start = (left > woke ? left : woke);
+      name = "an unnamed callback";
+   } else
+      return;
+
+   // Once per stall
+   now = watchdog_now_ns();
+
+   if (now < start || now - start < watchdog_threshold || start == reported)
+      return;
+
+   reported = start;
+   n = watchdog_trace();
+
+   Log(LOG_WARNING, "watchdog: main loop stuck in %s for %lu ms", name, (now - start) / 1000000);
+
+   for (i = 0; i < n; i++) {
+      ip = watchdog_frames[i];
+      memset(&di, 0, sizeof(di));
+
+      if (dladdr((void *)ip, &di) && di.dli_sname != NULL)
+         Log(LOG_WARNING, "watchdog:   #%-2d %s+0x%lx (%s)", i, di.dli_sname,
+             ip - (unsigned long)di.dli_saddr, di.dli_fname);
+      else
+         Log(LOG_WARNING, "watchdog:   #%-2d 0x%lx (%s)", i, ip,
+             (di.dli_fname != NULL ? di.dli_fname : "?"));
+   }
+}
+
+void watchdog_init(void) {
+   struct sigaction sa;
+
+   watchdog_main = pthread_self();
+   watchdog_register("other");
+
+   memset(&sa, 0, sizeof(sa));
+   sigemptyset(&sa.sa_mask);
+   sa.sa_sigaction = watchdog_sig;
+   sa.sa_flags = SA_SIGINFO | SA_RESTART;
+
+   if (sigaction(WATCHDOG_SIGNAL, &sa, NULL) != 0)
+      Log(LOG_ERR, "watchdog: sigaction: %s", strerror(errno));
+}
+
+////////////
+// thread //
+////////////
+void *thread_watchdog_init(void *data) {
+   int interval;
+
+   thread_entry((dict *)data);
+
+   if (!dconf_get_bool("experimental.watchdog", 0)) {
+      ebr_unregister();
+      return NULL;
+   }
+
+   __atomic_store_n(&watchdog_enabled, 1, __ATOMIC_RELAXED);
+   Log(LOG_INFO, "watchdog: watching the main loop");
+
+   while (!conf.dying) {
+      ebr_quiescent();
+
+      // Both may be changed on the fly (config is EBR-reclaimed, so
+      // only read it while online)
+      if ((interval = dconf_get_int("watchdog.interval", 0)) <= 0)
+         interval = WATCHDOG_INTERVAL;
+
+      __atomic_store_n(&watchdog_threshold,
+                       (unsigned long)dconf_get_int("watchdog.threshold", WATCHDOG_THRESHOLD) * 1000000UL,
+                       __ATOMIC_RELAXED);
+
+      // watchdog_check() only looks at plain counters
+      ebr_offline();
+      usleep(interval * 1000);
+      watchdog_check();
+      ebr_online();
+   }
+
+   ebr_unregister();
+   return NULL;
+}
+
+void *thread_watchdog_fini(void *data) {
+   __atomic_store_n(&watchdog_enabled, 0, __ATOMIC_RELAXED);
+   thread_exit((dict *)data);
+   return NULL;
+}
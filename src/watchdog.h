@@ -0,0 +1,66 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * src/watchdog.h:
+ *	Main loop stall detector (experimental.watchdog)
+ *
+ *	Everything on evt_loop - FUSE requests, inotify, the master
+ * mailbox and every cron job - runs on one thread, so one slow callback
+ * holds up all the others. Callbacks are bracketed with
+ * watchdog_enter()/watchdog_leave(), which keep a run time histogram
+ * per callback, and the loop's own prepare/check watchers time each
+ * pass through the loop.
+ *	A watchdog thread looks at the loop every watchdog.interval ms.
+ * Once a callback has been running for watchdog.threshold ms it grabs
+ * the main thread's stack (libunwind, from a signal handler) and logs
+ * it along with the callback's name.
+ */
+#if	!defined(__WATCHDOG_H)
+#define	__WATCHDOG_H
+#include <lsd/hist.h>
+
+#define	WATCHDOG_MAX_CB		64	// distinct callback names, the rest count as "other"
+#define	WATCHDOG_NAMELEN	32
+#define	WATCHDOG_FRAMES		32	// deepest stack we log
+#define	WATCHDOG_INTERVAL	100	// ms, if watchdog.interval is 0
+#define	WATCHDOG_THRESHOLD	200	// ms, if watchdog.threshold is unset
+
+struct watchdog_cb {
+   char        name[WATCHDOG_NAMELEN];
+   hist        run;			// ns per call (main loop is the only writer)
+   unsigned long stalls;		// calls over watchdog.threshold
+};
+
+// Main thread, after evt_init()
+extern void watchdog_init(void);
+
+// Slot for a callback name (any thread); same name, same slot
+extern int watchdog_register(const char *name);
+// Around a callback on the main loop, no nesting
+extern void watchdog_enter(int slot);
+extern void watchdog_leave(int slot);
+// From the loop's ev_check / ev_prepare watchers
+extern void watchdog_loop_wake(void);
+extern void watchdog_loop_idle(void);
+
+// For exporters: callbacks registered so far, and ns spent per loop pass
+extern int watchdog_count(void);
+extern const struct watchdog_cb *watchdog_callback(int slot);
+extern const hist *watchdog_loop_hist(void);
+// Per callback run times on the shell
+extern void watchdog_dump(void);
+
+extern void *thread_watchdog_init(void *data);
+extern void *thread_watchdog_fini(void *data);
+
+#endif	// !defined(__WATCHDOG_H)
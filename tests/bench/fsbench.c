@@ -0,0 +1,530 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * tests/bench/fsbench.c:
+ *	Synthetic package pools and filesystem workloads (see run-bench)
+ *
+ *	fsbench gen <dir> [-p pkgs] [-f files] [-s maxsize] [-b bigdir] [-S seed]
+ *	   Writes <dir>/src/pkgNNN/ trees ready to be tarred up and a
+ *	   <dir>/manifest listing every file. The same seed always gives
+ *	   the same pool.
+ *	fsbench run <mountpoint> <manifest> [-t threads] [-n ops] [-S seed]
+ *	            [-o out.json] [-c key=value ...]
+ *	   Drives the workloads against a mounted jail and writes ops/sec
+ *	   and latency percentiles as JSON (-c pairs are copied into the
+ *	   "config" object, to tell runs apart later).
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <lsd/hist.h>
+
+#define	BENCH_BIGDIR	"usr/share/bench/big"
+#define	BENCH_LIBDIR	"usr/lib"
+#define	BENCH_MAX_CONF	32
+
+// Where ld.so would look for a library before finding it in usr/lib
+static const char *bench_ldpath[] = {
+   "lib/x86_64-linux-gnu/tls/x86_64", "lib/x86_64-linux-gnu/tls",
+   "lib/x86_64-linux-gnu/x86_64", "lib/x86_64-linux-gnu",
+   "usr/lib/x86_64-linux-gnu/tls", "usr/lib/x86_64-linux-gnu",
+   "lib", BENCH_LIBDIR, NULL
+};
+
+struct bench_file {
+   char       *path;			// relative to the mountpoint
+   char       *name;			// basename, for ld.so style probes
+   size_t      size;
+   int         lib;
+};
+
+struct bench_result {
+   const char *name;
+   unsigned long ops, errors, bytes;
+   double      secs;
+   hist        lat;			// ns per op
+};
+
+static struct bench_file *files = NULL, **libs = NULL, **big = NULL;
+static int nfiles = 0, nlibs = 0, nbig = 0;
+static const char *mnt = NULL;
+static unsigned long nops = 10000;
+static int nthreads = 4;
+static unsigned long long seed = 1;
+
+/* xorshift64*: small, fast and the same everywhere */
+static unsigned long long bench_rand(unsigned long long *s) {
+   *s ^= *s >> 12;
+   *s ^= *s << 25;
+   *s ^= *s >> 27;
+   return *s * 2685821657736338717ULL;
+}
+
+static unsigned long bench_ns(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int bench_mkdirs(char *path) {
+   char *p;
+
+   for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+      *p = '\0';
+
+      if (mkdir(path, 0755) != 0 && errno != EEXIST)
+         return -1;
+
+      *p = '/';
+   }
+
+   return 0;
+}
+
+/*
+ * File contents: base64-ish text from the PRNG, so compressed pools
+ * shrink about as much as real binaries do rather than to nothing.
+ */
+static int bench_write(const char *path, size_t size, unsigned long long *rs) {
+   static const char alpha[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+   char buf[65536];
+   size_t i, n;
+   FILE *fp;
+
+   if (!(fp = fopen(path, "w")))
+      return -1;
+
+   while (size > 0) {
+      n = (size < sizeof(buf) ? size : sizeof(buf));
+
+      for (i = 0; i < n; i++)
+         buf[i] = alpha[bench_rand(rs) & 63];
+
+      if (fwrite(buf, 1, n, fp) != n)
+         break;
+
+      size -= n;
+   }
+
+   return (fclose(fp) == 0 && size == 0 ? 0 : -1);
+}
+
+static int bench_gen(const char *dir, int npkgs, int nper, size_t maxsize, int nbigdir) {
+   unsigned long long rs = seed;
+   char path[PATH_MAX], rel[256];
+   double span = log2((double)maxsize / 64);
+   size_t size;
+   FILE *man;
+   int p, i;
+
+   snprintf(path, sizeof(path), "%s/manifest", dir);
+
+   if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+      fprintf(stderr, "fsbench: mkdir %s: %s\n", dir, strerror(errno));
+      return 1;
+   }
+
+   if (!(man = fopen(path, "w"))) {
+      fprintf(stderr, "fsbench: %s: %s\n", path, strerror(errno));
+      return 1;
+   }
+
+   for (p = 0; p < npkgs; p++) {
+      for (i = 0; i < nper; i++) {
+         // Log-uniform sizes between 64 bytes and maxsize: mostly small, some big
+         size = (size_t)(64 * exp2(span * (bench_rand(&rs) % 10000) / 10000.0));
+
+         if (i % 10 == 0)
+            snprintf(rel, sizeof(rel), "%s/libbench%03d_%d.so", BENCH_LIBDIR, p, i / 10);
+         else
+            snprintf(rel, sizeof(rel), "usr/share/bench/pkg%03d/d%d/f%d.dat", p, i % 16, i);
+
+         snprintf(path, sizeof(path), "%s/src/pkg%03d/%s", dir, p, rel);
+
+         if (bench_mkdirs(path) != 0 || bench_write(path, size, &rs) != 0) {
+            fprintf(stderr, "fsbench: can't write %s: %s\n", path, strerror(errno));
+            fclose(man);
+            return 1;
+         }
+
+         fprintf(man, "%c %lu %s\n", (i % 10 == 0 ? 'l' : 'f'), (unsigned long)size, rel);
+      }
+
+      // A directory every package adds to, for readdir
+      for (i = p; i < nbigdir; i += npkgs) {
+         snprintf(rel, sizeof(rel), "%s/e%06d", BENCH_BIGDIR, i);
+         snprintf(path, sizeof(path), "%s/src/pkg%03d/%s", dir, p, rel);
+
+         if (bench_mkdirs(path) != 0 || bench_write(path, 32, &rs) != 0) {
+            fprintf(stderr, "fsbench: can't write %s: %s\n", path, strerror(errno));
+            fclose(man);
+            return 1;
+         }
+
+         fprintf(man, "b 32 %s\n", rel);
+      }
+   }
+
+   fclose(man);
+   return 0;
+}
+
+static int bench_load(const char *manifest) {
+   char line[PATH_MAX + 64], path[PATH_MAX], type;
+   unsigned long size;
+   FILE *fp;
+   int cap = 0;
+
+   if (!(fp = fopen(manifest, "r"))) {
+      fprintf(stderr, "fsbench: %s: %s\n", manifest, strerror(errno));
+      return -1;
+   }
+
+   while (fgets(line, sizeof(line), fp)) {
+      if (sscanf(line, "%c %lu %4095s", &type, &size, path) != 3)
+         continue;
+
+      if (nfiles == cap) {
+         cap = (cap ? cap * 2 : 1024);
+         files = realloc(files, cap * sizeof(*files));
+      }
+
+      files[nfiles].path = strdup(path);
+      files[nfiles].name = strrchr(files[nfiles].path, '/') + 1;
+      files[nfiles].size = size;
+      files[nfiles].lib = (type == 'l');
+      nfiles++;
+   }
+
+   fclose(fp);
+
+   libs = calloc(nfiles + 1, sizeof(*libs));
+   big = calloc(nfiles + 1, sizeof(*big));
+
+   for (cap = 0; cap < nfiles; cap++) {
+      if (files[cap].lib)
+         libs[nlibs++] = &files[cap];
+      else if (strncmp(files[cap].path, BENCH_BIGDIR "/", sizeof(BENCH_BIGDIR)) == 0)
+         big[nbig++] = &files[cap];
+   }
+
+   return (nfiles > 0 && nlibs > 0 ? 0 : -1);
+}
+
+/////////////
+// Workloads
+/////////////
+// One op each: return bytes moved, or -1 on error
+typedef long (*bench_op)(unsigned long long *rs, char *buf, size_t len);
+
+static struct bench_file *bench_pick(unsigned long long *rs) {
+   return &files[bench_rand(rs) % nfiles];
+}
+
+static long op_stat(unsigned long long *rs, char *buf, size_t len) {
+   char path[PATH_MAX];
+   struct stat sb;
+
+   snprintf(path, sizeof(path), "%s/%s", mnt, bench_pick(rs)->path);
+   return (stat(path, &sb) == 0 ? 0 : -1);
+}
+
+// Like ld.so: try every directory on the search path, then read the ELF header
+static long op_ldso(unsigned long long *rs, char *buf, size_t len) {
+   struct bench_file *lib = libs[bench_rand(rs) % nlibs];
+   char path[PATH_MAX];
+   long n = -1;
+   int i, fd;
+
+   for (i = 0; bench_ldpath[i]; i++) {
+      snprintf(path, sizeof(path), "%s/%s/%s", mnt, bench_ldpath[i], lib->name);
+
+      if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+         n = read(fd, buf, (len < 832 ? len : 832));
+         close(fd);
+         break;
+      }
+   }
+
+   return n;
+}
+
+static long bench_read_file(struct bench_file *f, char *buf, size_t len) {
+   char path[PATH_MAX];
+   long total = 0;
+   ssize_t n;
+   int fd;
+
+   snprintf(path, sizeof(path), "%s/%s", mnt, f->path);
+
+   if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+      return -1;
+
+   while ((n = read(fd, buf, len)) > 0)
+      total += n;
+
+   close(fd);
+   return (n < 0 ? -1 : total);
+}
+
+static long op_seq_read(unsigned long long *rs, char *buf, size_t len) {
+   return bench_read_file(bench_pick(rs), buf, len);
+}
+
+// Every file once, in manifest order
+static unsigned long cold_next = 0;
+
+static long op_cold_read(unsigned long long *rs, char *buf, size_t len) {
+   return bench_read_file(&files[__atomic_fetch_add(&cold_next, 1, __ATOMIC_RELAXED) % nfiles], buf, len);
+}
+
+static long op_rand_read(unsigned long long *rs, char *buf, size_t len) {
+   struct bench_file *f = bench_pick(rs);
+   char path[PATH_MAX];
+   off_t off;
+   ssize_t n;
+   int fd;
+
+   snprintf(path, sizeof(path), "%s/%s", mnt, f->path);
+
+   if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+      return -1;
+
+   off = (f->size > 4096 ? (off_t)(bench_rand(rs) % (f->size / 4096)) * 4096 : 0);
+   n = pread(fd, buf, 4096, off);
+   close(fd);
+   return n;
+}
+
+static long op_readdir(unsigned long long *rs, char *buf, size_t len) {
+   char path[PATH_MAX];
+   struct dirent *de;
+   long n = 0;
+   DIR *d;
+
+   snprintf(path, sizeof(path), "%s/%s", mnt, BENCH_BIGDIR);
+
+   if (!(d = opendir(path)))
+      return -1;
+
+   while ((de = readdir(d)))
+      n++;
+
+   closedir(d);
+   return (n > 0 ? 0 : -1);
+}
+
+// What a busy jail looks like: mostly stats, some reads, the odd exec
+static long op_mixed(unsigned long long *rs, char *buf, size_t len) {
+   unsigned long r = bench_rand(rs) % 10;
+
+   if (r < 6)
+      return op_stat(rs, buf, len);
+   else if (r < 9)
+      return op_rand_read(rs, buf, len);
+
+   return op_ldso(rs, buf, len);
+}
+
+struct bench_worker {
+   pthread_t   tid;
+   bench_op    op;
+   unsigned long ops, errors, bytes;
+   unsigned long long rs;
+   hist        lat;
+};
+
+static void *bench_thread(void *arg) {
+   struct bench_worker *w = (struct bench_worker *)arg;
+   unsigned long i, t0;
+   char *buf = malloc(131072);
+   long n;
+
+   for (i = 0; i < w->ops; i++) {
+      t0 = bench_ns();
+      n = w->op(&w->rs, buf, 131072);
+      hist_record(&w->lat, bench_ns() - t0);
+
+      if (n < 0)
+         w->errors++;
+      else
+         w->bytes += n;
+   }
+
+   free(buf);
+   return NULL;
+}
+
+static void bench_run(struct bench_result *res, const char *name, bench_op op, unsigned long ops, int threads) {
+   struct bench_worker *w = calloc(threads, sizeof(*w));
+   unsigned long t0;
+   int i;
+
+   memset(res, 0, sizeof(*res));
+   res->name = name;
+   fprintf(stderr, "fsbench: %-14s %8lu ops x %d thread(s)...", name, ops, threads);
+
+   t0 = bench_ns();
+
+   for (i = 0; i < threads; i++) {
+      w[i].op = op;
+      w[i].ops = ops / threads + (i < (int)(ops % threads));
+      w[i].rs = seed * 0x9e3779b97f4a7c15ULL + i + 1;
+      pthread_create(&w[i].tid, NULL, bench_thread, &w[i]);
+   }
+
+   for (i = 0; i < threads; i++) {
+      pthread_join(w[i].tid, NULL);
+      res->ops += w[i].ops;
+      res->errors += w[i].errors;
+      res->bytes += w[i].bytes;
+      hist_merge(&res->lat, &w[i].lat);
+   }
+
+   res->secs = (bench_ns() - t0) / 1e9;
+   fprintf(stderr, " %10.0f ops/sec, p99 %.1f us\n", res->ops / res->secs, hist_percentile(&res->lat, 99) / 1000.0);
+   free(w);
+}
+
+static void bench_json(FILE *fp, struct bench_result *res, int nres, char **conf, int nconf) {
+   char *eq;
+   int i;
+
+   fprintf(fp, "{\n  \"config\": {\n");
+   fprintf(fp, "    \"threads\": %d,\n    \"ops\": %lu,\n    \"seed\": %llu,\n    \"files\": %d", nthreads, nops, seed, nfiles);
+
+   for (i = 0; i < nconf; i++)
+      if ((eq = strchr(conf[i], '=')))
+         fprintf(fp, ",\n    \"%.*s\": \"%s\"", (int)(eq - conf[i]), conf[i], eq + 1);
+
+   fprintf(fp, "\n  },\n  \"results\": {\n");
+
+   for (i = 0; i < nres; i++) {
+      fprintf(fp, "    \"%s\": { \"ops\": %lu, \"errors\": %lu, \"seconds\": %.3f, \"ops_per_sec\": %.1f, "
+              "\"mb_per_sec\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f }%s\n",
+              res[i].name, res[i].ops, res[i].errors, res[i].secs, res[i].ops / res[i].secs,
+              res[i].bytes / res[i].secs / 1048576.0, hist_percentile(&res[i].lat, 50) / 1000.0,
+              hist_percentile(&res[i].lat, 99) / 1000.0, res[i].lat.max / 1000.0,
+              (i < nres - 1 ? "," : ""));
+   }
+
+   fprintf(fp, "  }\n}\n");
+}
+
+static int bench_main(const char *manifest, const char *out, char **conf, int nconf) {
+   struct bench_result res[8];
+   unsigned long dirops;
+   int n = 0;
+   FILE *fp;
+
+   if (bench_load(manifest) != 0) {
+      fprintf(stderr, "fsbench: %s: no files or no libraries\n", manifest);
+      return 1;
+   }
+
+   // First touch pulls every file out of its package: cold, then warm
+   bench_run(&res[n++], "seq_read_cold", op_cold_read, nfiles, 1);
+   bench_run(&res[n++], "seq_read", op_seq_read, nops / 10 ? nops / 10 : 1, 1);
+   bench_run(&res[n++], "stat", op_stat, nops, 1);
+   bench_run(&res[n++], "ldso_probe", op_ldso, nops, 1);
+   bench_run(&res[n++], "rand_read", op_rand_read, nops, 1);
+   // Listings are ~nbig times the work of a stat; keep the run about as long
+   dirops = nops / (nbig / 100 + 1);
+   bench_run(&res[n++], "readdir", op_readdir, dirops ? dirops : 1, 1);
+   bench_run(&res[n++], "stat_parallel", op_stat, nops * nthreads, nthreads);
+   bench_run(&res[n++], "mixed_parallel", op_mixed, nops * nthreads, nthreads);
+
+   if (out == NULL || strcmp(out, "-") == 0)
+      bench_json(stdout, res, n, conf, nconf);
+   else if ((fp = fopen(out, "w"))) {
+      bench_json(fp, res, n, conf, nconf);
+      fclose(fp);
+      fprintf(stderr, "fsbench: results in %s\n", out);
+   } else {
+      fprintf(stderr, "fsbench: %s: %s\n", out, strerror(errno));
+      return 1;
+   }
+
+   return 0;
+}
+
+static void usage(void) {
+   fprintf(stderr, "usage: fsbench gen <dir> [-p pkgs] [-f files] [-s maxsize] [-b bigdir] [-S seed]\n"
+                   "       fsbench run <mountpoint> <manifest> [-t threads] [-n ops] [-S seed]\n"
+                   "                   [-o out.json] [-c key=value ...]\n");
+   exit(1);
+}
+
+int main(int argc, char **argv) {
+   int npkgs = 20, nper = 100, nbigdir = 2000, nconf = 0, c;
+   char *conf[BENCH_MAX_CONF];
+   size_t maxsize = 1048576;
+   const char *out = NULL;
+
+   if (argc < 3)
+      usage();
+
+   optind = (strcmp(argv[1], "run") == 0 ? 4 : 3);
+
+   if (optind > argc)
+      usage();
+
+   while ((c = getopt(argc, argv, "p:f:s:b:S:t:n:o:c:")) != -1) {
+      switch (c) {
+         case 'p': npkgs = atoi(optarg); break;
+         case 'f': nper = atoi(optarg); break;
+         case 's': maxsize = strtoul(optarg, NULL, 0); break;
+         case 'b': nbigdir = atoi(optarg); break;
+         case 'S': seed = strtoull(optarg, NULL, 0); break;
+         case 't': nthreads = atoi(optarg); break;
+         case 'n': nops = strtoul(optarg, NULL, 0); break;
+         case 'o': out = optarg; break;
+         case 'c':
+            if (nconf < BENCH_MAX_CONF)
+               conf[nconf++] = optarg;
+            break;
+         default:
+            usage();
+      }
+   }
+
+   if (seed == 0)
+      seed = 1;
+
+   if (nthreads < 1)
+      nthreads = 1;
+
+   if (strcmp(argv[1], "gen") == 0) {
+      if (npkgs < 1 || nper < 1 || maxsize < 64)
+         usage();
+
+      return bench_gen(argv[2], npkgs, nper, maxsize, nbigdir);
+   } else if (strcmp(argv[1], "run") == 0) {
+      mnt = argv[2];
+      return bench_main(argv[3], out, conf, nconf);
+   }
+
+   usage();
+   return 1;
+}
@@ -0,0 +1,670 @@
+/*
+ * tk/servers/jailfs:
+ *	Package filesystem. Allows mounting various package files as
+ *   a read-only (optionally with spillover file) overlay filesystem
+ *   via FUSE or (eventually) LD_PRELOAD library.
+ *
+ * Copyright (C) 2012-2019 BigFluffy.Cloud <joseph@bigfluffy.cloud>
+ *
+ * Distributed under a MIT license. Send bugs/patches by email or
+ * on github - https://github.com/bigfluffycloud/jailfs/
+ *
+ * No warranty of any kind. Good luck!
+ *
+ * tests/bench/lsd-bench.c:
+ *	Microbenchmarks for the lsd/ containers and allocator
+ *
+ *	lsd-bench [-t threads] [-m maxkeys] [-n ops] [filter...]
+ *
+ *	Every benchmark runs single threaded, and again on -t threads
+ * hitting one shared structure (behind the lock jailfs would need for
+ * it, where it needs one). Results are ns/op and, where the kernel lets
+ * us open a hardware counter (perf_event_open), cache misses per op.
+ * Sizes go from 1k up to -m (default 1M, use -m 10000000 for 10M keys).
+ * Only benchmarks whose name contains one of the filters are run.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <lsd/balloc.h>
+#include <lsd/cdict.h>
+#include <lsd/dict.h>
+#include <lsd/dlink.h>
+#include <lsd/tree.h>
+
+#define	BENCH_MIN_OPS	1000000
+
+static int nthreads = 4;
+static unsigned long maxkeys = 1000000;
+static unsigned long minops = BENCH_MIN_OPS;
+static char **filters = NULL;
+static int nfilters = 0;
+static int perf_ok = 1;
+
+// lsd/dlink.c reads its heap size from the config, which isn't here
+int dconf_get_int(const char *key, const int def) {
+   return def;
+}
+
+int conf_watch_heap(const char *key, BlockHeap *bh) {
+   return 0;
+}
+
+/* xorshift64*: cheap, and the same sequence every run */
+static unsigned long long bench_rand(unsigned long long *s) {
+   *s ^= *s >> 12;
+   *s ^= *s << 25;
+   *s ^= *s >> 27;
+   return *s * 2685821657736338717ULL;
+}
+
+static unsigned long bench_ns(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+///////////////////////////////
+// Timing and cache misses
+///////////////////////////////
+struct probe {
+   unsigned long t0, ns;
+   unsigned long long misses;
+   int         fd;
+};
+
+static void probe_start(struct probe *p) {
+   struct perf_event_attr pe;
+
+   p->fd = -1;
+   p->misses = 0;
+
+   if (perf_ok) {
+      memset(&pe, 0, sizeof(pe));
+      pe.type = PERF_TYPE_HARDWARE;
+      pe.size = sizeof(pe);
+      pe.config = PERF_COUNT_HW_CACHE_MISSES;
+      pe.disabled = 1;
+      pe.exclude_kernel = 1;
+      pe.exclude_hv = 1;
+
+      // Not allowed (perf_event_paranoid) or no PMU (VMs): just time it
+      if ((p->fd = syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0)) < 0)
+         __atomic_store_n(&perf_ok, 0, __ATOMIC_RELAXED);
+      else {
+         ioctl(p->fd, PERF_EVENT_IOC_RESET, 0);
+         ioctl(p->fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+   }
+
+   p->t0 = bench_ns();
+}
+
+static void probe_stop(struct probe *p) {
+   p->ns = bench_ns() - p->t0;
+
+   if (p->fd >= 0) {
+      ioctl(p->fd, PERF_EVENT_IOC_DISABLE, 0);
+
+      if (read(p->fd, &p->misses, sizeof(p->misses)) != sizeof(p->misses))
+         p->misses = 0;
+
+      close(p->fd);
+   }
+}
+
+static int bench_wanted(const char *name) {
+   int i;
+
+   if (nfilters == 0)
+      return 1;
+
+   for (i = 0; i < nfilters; i++)
+      if (strstr(name, filters[i]))
+         return 1;
+
+   return 0;
+}
+
+static void bench_report(const char *name, unsigned long n, int threads, unsigned long ops,
+                         unsigned long ns, unsigned long long misses, int counted) {
+   char mbuf[32];
+
+   if (counted)
+      snprintf(mbuf, sizeof(mbuf), "%10.2f", (double)misses / ops);
+   else
+      snprintf(mbuf, sizeof(mbuf), "%10s", "-");
+
+   printf("%-26s %9lu %7d %10.1f %s\n", name, n, threads, (double)ns / ops, mbuf);
+   fflush(stdout);
+}
+
+/*
+ * Run fn on threads threads at once and report the average time per op
+ * as each thread saw it, so contention shows up as slower ops.
+ */
+struct bench_thread {
+   pthread_t   tid;
+   int         id;
+   void       *arg;
+   unsigned long ops;
+   void      (*fn)(void *arg, int id, unsigned long ops);
+   pthread_barrier_t *go;
+   struct probe p;
+};
+
+static void *bench_thread_main(void *data) {
+   struct bench_thread *t = (struct bench_thread *)data;
+
+   pthread_barrier_wait(t->go);
+   probe_start(&t->p);
+   t->fn(t->arg, t->id, t->ops);
+   probe_stop(&t->p);
+   return NULL;
+}
+
+static void bench_parallel(const char *name, unsigned long n, int threads, unsigned long ops,
+                           void (*fn)(void *, int, unsigned long), void *arg) {
+   struct bench_thread *t;
+   pthread_barrier_t go;
+   unsigned long ns = 0;
+   unsigned long long misses = 0;
+   int i, counted = 1;
+
+   if (!bench_wanted(name))
+      return;
+
+   t = calloc(threads, sizeof(*t));
+   pthread_barrier_init(&go, NULL, threads);
+
+   for (i = 0; i < threads; i++) {
+      t[i].id = i;
+      t[i].arg = arg;
+      t[i].ops = ops;
+      t[i].fn = fn;
+      t[i].go = &go;
+      pthread_create(&t[i].tid, NULL, bench_thread_main, &t[i]);
+   }
+
+   for (i = 0; i < threads; i++) {
+      pthread_join(t[i].tid, NULL);
+      ns += t[i].p.ns;
+      misses += t[i].p.misses;
+      counted &= (t[i].p.fd >= 0);
+   }
+
+   bench_report(name, n, threads, ops * threads, ns, misses, counted);
+   pthread_barrier_destroy(&go);
+   free(t);
+}
+
+static void bench_single(const char *name, unsigned long n, unsigned long ops,
+                         void (*fn)(void *, int, unsigned long), void *arg) {
+   struct probe p;
+
+   if (!bench_wanted(name))
+      return;
+
+   probe_start(&p);
+   fn(arg, 0, ops);
+   probe_stop(&p);
+   bench_report(name, n, 1, ops, p.ns, p.misses, p.fd >= 0);
+}
+
+static unsigned long bench_ops(unsigned long n) {
+   return (n > minops ? n : minops);
+}
+
+///////////////
+// BlockHeap
+///////////////
+struct heap_arg {
+   BlockHeap  *bh;
+   pthread_mutex_t lock;
+   size_t      size;
+   unsigned long n;			// live objects (per thread)
+   void      **slot;
+   int         locked;
+};
+
+static void *heap_get(struct heap_arg *a) {
+   void *p;
+
+   if (a->bh == NULL)
+      return malloc(a->size);
+
+   if (a->locked)
+      pthread_mutex_lock(&a->lock);
+
+   p = blockheap_alloc(a->bh);
+
+   if (a->locked)
+      pthread_mutex_unlock(&a->lock);
+
+   return p;
+}
+
+static void heap_put(struct heap_arg *a, void *p) {
+   if (a->bh == NULL) {
+      free(p);
+      return;
+   }
+
+   if (a->locked)
+      pthread_mutex_lock(&a->lock);
+
+   blockheap_free(a->bh, p);
+
+   if (a->locked)
+      pthread_mutex_unlock(&a->lock);
+}
+
+static void heap_fill(void *arg, int id, unsigned long ops) {
+   struct heap_arg *a = (struct heap_arg *)arg;
+   void **slot = a->slot + id * a->n;
+   unsigned long i;
+
+   for (i = 0; i < ops; i++)
+      slot[i] = heap_get(a);
+}
+
+// Steady state: free a random live object, allocate a new one (one op)
+static void heap_churn(void *arg, int id, unsigned long ops) {
+   struct heap_arg *a = (struct heap_arg *)arg;
+   void **slot = a->slot + id * a->n;
+   unsigned long long rs = id + 1;
+   unsigned long i, j;
+
+   for (i = 0; i < ops; i++) {
+      j = bench_rand(&rs) % a->n;
+      heap_put(a, slot[j]);
+      slot[j] = heap_get(a);
+   }
+}
+
+static void heap_drain(struct heap_arg *a, int threads) {
+   unsigned long i;
+
+   for (i = 0; i < a->n * threads; i++)
+      heap_put(a, a->slot[i]);
+}
+
+static void bench_heap_one(const char *kind, size_t size, int epb, unsigned long n) {
+   struct heap_arg a;
+   char name[64];
+   int t, i;
+
+   memset(&a, 0, sizeof(a));
+   pthread_mutex_init(&a.lock, NULL);
+   a.size = size;
+
+   for (t = 1; t <= nthreads; t = (t == 1 && nthreads > 1 ? nthreads : nthreads + 1)) {
+      a.n = n / t;
+      a.slot = calloc(n, sizeof(void *));
+      a.locked = (t > 1);
+
+      if (epb > 0)
+         a.bh = blockheap_create(size, epb, "bench");
+
+      if (epb > 0)
+         snprintf(name, sizeof(name), "%s_%lu/%d_fill", kind, (unsigned long)size, epb);
+      else
+         snprintf(name, sizeof(name), "%s_%lu_fill", kind, (unsigned long)size);
+
+      if (!bench_wanted(name)) {
+         // Filtered out, but churn still needs a full heap
+         for (i = 0; i < t; i++)
+            heap_fill(&a, i, a.n);
+      } else if (t == 1)
+         bench_single(name, n, a.n, heap_fill, &a);
+      else
+         bench_parallel(name, n, t, a.n, heap_fill, &a);
+
+      strcpy(strrchr(name, '_'), "_churn");
+
+      if (t == 1)
+         bench_single(name, n, bench_ops(n), heap_churn, &a);
+      else
+         bench_parallel(name, n, t, bench_ops(n) / t, heap_churn, &a);
+
+      heap_drain(&a, t);
+
+      if (a.bh)
+         blockheap_destroy(a.bh);
+
+      a.bh = NULL;
+      free(a.slot);
+   }
+
+   pthread_mutex_destroy(&a.lock);
+}
+
+static void bench_heap(void) {
+   static const size_t sizes[] = { 32, 256 };
+   static const int epbs[] = { 64, 1024, 16384 };
+   unsigned long n = (maxkeys < 1000000 ? maxkeys : 1000000);
+   unsigned int s, e;
+
+   for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      bench_heap_one("malloc", sizes[s], 0, n);
+
+      for (e = 0; e < sizeof(epbs) / sizeof(epbs[0]); e++)
+         bench_heap_one("balloc", sizes[s], epbs[e], n);
+   }
+}
+
+//////////
+// dict
+//////////
+struct dict_arg {
+   dict       *d;
+   cdict      *cd;
+   pthread_rwlock_t lock;
+   char      **keys, **miss;
+   unsigned long n;
+};
+
+// Shaped like what jailfs keeps in dicts: paths from package pools
+static char **bench_keys(unsigned long n, const char *fmt) {
+   char **keys = malloc(n * sizeof(char *)), buf[128];
+   unsigned long i;
+
+   for (i = 0; i < n; i++) {
+      snprintf(buf, sizeof(buf), fmt, i % 97, i);
+      keys[i] = strdup(buf);
+   }
+
+   return keys;
+}
+
+static void dict_insert(void *arg, int id, unsigned long ops) {
+   struct dict_arg *a = (struct dict_arg *)arg;
+   unsigned long i;
+
+   for (i = 0; i < ops; i++)
+      dict_add(a->d, a->keys[i], "1");
+}
+
+static void dict_lookup_keys(struct dict_arg *a, int id, unsigned long ops, char **keys, int locked) {
+   unsigned long long rs = id + 1;
+   unsigned long i, found = 0;
+
+   for (i = 0; i < ops; i++) {
+      if (locked)
+         pthread_rwlock_rdlock(&a->lock);
+
+      found += (dict_get(a->d, keys[bench_rand(&rs) % a->n], NULL) != NULL);
+
+      if (locked)
+         pthread_rwlock_unlock(&a->lock);
+   }
+
+   __asm__ __volatile__("" :: "r"(found));
+}
+
+static void dict_hit(void *arg, int id, unsigned long ops) {
+   dict_lookup_keys((struct dict_arg *)arg, id, ops, ((struct dict_arg *)arg)->keys, 0);
+}
+
+static void dict_miss(void *arg, int id, unsigned long ops) {
+   dict_lookup_keys((struct dict_arg *)arg, id, ops, ((struct dict_arg *)arg)->miss, 0);
+}
+
+static void dict_hit_locked(void *arg, int id, unsigned long ops) {
+   dict_lookup_keys((struct dict_arg *)arg, id, ops, ((struct dict_arg *)arg)->keys, 1);
+}
+
+static void dict_delete(void *arg, int id, unsigned long ops) {
+   struct dict_arg *a = (struct dict_arg *)arg;
+   unsigned long i;
+
+   for (i = 0; i < ops; i++)
+      dict_del(a->d, a->keys[i]);
+}
+
+static void cdict_insert(void *arg, int id, unsigned long ops) {
+   struct dict_arg *a = (struct dict_arg *)arg;
+   unsigned long i;
+
+   for (i = 0; i < ops; i++)
+      cdict_add(a->cd, a->keys[i], "1");
+}
+
+static void cdict_hit(void *arg, int id, unsigned long ops) {
+   struct dict_arg *a = (struct dict_arg *)arg;
+   unsigned long long rs = id + 1;
+   unsigned long i, found = 0;
+
+   for (i = 0; i < ops; i++)
+      found += (cdict_get(a->cd, a->keys[bench_rand(&rs) % a->n], NULL) != NULL);
+
+   __asm__ __volatile__("" :: "r"(found));
+}
+
+static void bench_dict(void) {
+   struct dict_arg a;
+   unsigned long n, i;
+
+   memset(&a, 0, sizeof(a));
+   pthread_rwlock_init(&a.lock, NULL);
+
+   for (n = 1000; n <= maxkeys; n *= 10) {
+      a.n = n;
+      a.keys = bench_keys(n, "/usr/lib/x86_64-linux-gnu/pkg%02lu/lib%07lu.so");
+      a.miss = bench_keys(n, "/usr/share/doc/pkg%02lu/missing%07lu");
+
+      a.d = dict_new();
+      bench_single("dict_insert", n, n, dict_insert, &a);
+      // The rest need the keys in there, filtered out or not
+      if (!bench_wanted("dict_insert"))
+         dict_insert(&a, 0, n);
+
+      bench_single("dict_lookup_hit", n, bench_ops(n), dict_hit, &a);
+      bench_single("dict_lookup_miss", n, bench_ops(n), dict_miss, &a);
+      bench_parallel("dict_lookup_hit_rwlock", n, nthreads, bench_ops(n), dict_hit_locked, &a);
+      bench_single("dict_delete", n, n, dict_delete, &a);
+      dict_free(a.d);
+
+      // The lock-free one, for comparison under contention
+      if (bench_wanted("cdict")) {
+         a.cd = cdict_new(0);
+         bench_single("cdict_insert", n, n, cdict_insert, &a);
+         bench_parallel("cdict_lookup_hit", n, nthreads, bench_ops(n), cdict_hit, &a);
+         cdict_free(a.cd);
+      }
+
+      for (i = 0; i < n; i++) {
+         free(a.keys[i]);
+         free(a.miss[i]);
+      }
+
+      free(a.keys);
+      free(a.miss);
+   }
+
+   pthread_rwlock_destroy(&a.lock);
+}
+
+///////////
+// dlink
+///////////
+struct list_arg {
+   dlink_list  list;
+   unsigned long n;
+};
+
+// One op is one node visited
+static void dlink_iter(void *arg, int id, unsigned long ops) {
+   struct list_arg *a = (struct list_arg *)arg;
+   unsigned long seen = 0, sum = 0;
+   dlink_node *ptr;
+
+   while (seen < ops) {
+      DLINK_FOREACH(ptr, a->list.head) {
+         sum += (uintptr_t)ptr->data;
+
+         if (++seen == ops)
+            break;
+      }
+   }
+
+   __asm__ __volatile__("" :: "r"(sum));
+}
+
+static void bench_dlink(void) {
+   struct list_arg a;
+   dlink_node **nodes, *ptr, *tptr;
+   unsigned long long rs = 1;
+   unsigned long n, i, j;
+   int shuffled;
+
+   dlink_init();
+
+   for (n = 1000; n <= maxkeys; n *= 10) {
+      for (shuffled = 0; shuffled <= 1; shuffled++) {
+         memset(&a, 0, sizeof(a));
+         a.n = n;
+         nodes = malloc(n * sizeof(*nodes));
+
+         for (i = 0; i < n; i++)
+            nodes[i] = dlink_create();
+
+         // Linked in allocation order, or all over the heap like a long lived list
+         if (shuffled) {
+            for (i = n - 1; i > 0; i--) {
+               j = bench_rand(&rs) % (i + 1);
+               ptr = nodes[i], nodes[i] = nodes[j], nodes[j] = ptr;
+            }
+         }
+
+         for (i = 0; i < n; i++)
+            dlink_add_tail((void *)(uintptr_t)i, nodes[i], &a.list);
+
+         bench_single(shuffled ? "dlink_iter_shuffled" : "dlink_iter", n, bench_ops(n), dlink_iter, &a);
+         bench_parallel(shuffled ? "dlink_iter_shuffled" : "dlink_iter", n, nthreads, bench_ops(n), dlink_iter, &a);
+
+         DLINK_FOREACH_SAFE(ptr, tptr, a.list.head) {
+            dlink_destroy(ptr, &a.list);
+         }
+
+         free(nodes);
+      }
+   }
+
+   dlink_fini();
+}
+
+//////////
+// tree
+//////////
+struct tree_arg {
+   struct tree tr;
+   unsigned long *vals;
+   unsigned long n;
+};
+
+static int tree_cmp(void *a, void *b) {
+   unsigned long x = *(unsigned long *)a, y = *(unsigned long *)b;
+
+   return (x < y ? -1 : x > y);
+}
+
+static void tree_ins(void *arg, int id, unsigned long ops) {
+   struct tree_arg *a = (struct tree_arg *)arg;
+   unsigned long i;
+
+   for (i = 0; i < ops; i++)
+      rb_insert(&a->tr, &a->vals[i], sizeof(unsigned long));
+}
+
+static void tree_find(void *arg, int id, unsigned long ops) {
+   struct tree_arg *a = (struct tree_arg *)arg;
+   unsigned long long rs = id + 1;
+   unsigned long i, found = 0;
+
+   for (i = 0; i < ops; i++)
+      found += (tree_search(&a->tr, &a->vals[bench_rand(&rs) % a->n]) != NULL);
+
+   __asm__ __volatile__("" :: "r"(found));
+}
+
+static void tree_free_nodes(tnode_p node) {
+   if (node == NULL)
+      return;
+
+   tree_free_nodes(node->left);
+   tree_free_nodes(node->right);
+   free(node->data);
+   free(node);
+}
+
+static void bench_tree(void) {
+   struct tree_arg a;
+   unsigned long long rs = 1;
+   unsigned long n, i;
+
+   for (n = 1000; n <= maxkeys; n *= 10) {
+      memset(&a, 0, sizeof(a));
+      a.tr.cmpfunc = tree_cmp;
+      a.n = n;
+      a.vals = malloc(n * sizeof(unsigned long));
+
+      for (i = 0; i < n; i++)
+         a.vals[i] = bench_rand(&rs);
+
+      bench_single("tree_insert", n, n, tree_ins, &a);
+
+      if (!bench_wanted("tree_insert"))
+         tree_ins(&a, 0, n);
+
+      bench_single("tree_search", n, bench_ops(n), tree_find, &a);
+      bench_parallel("tree_search", n, nthreads, bench_ops(n), tree_find, &a);
+
+      tree_free_nodes(a.tr.root);
+      free(a.vals);
+   }
+}
+
+static void usage(const char *prog) {
+   fprintf(stderr, "usage: %s [-t threads] [-m maxkeys] [-n minops] [filter...]\n", prog);
+   exit(1);
+}
+
+int main(int argc, char **argv) {
+   int c;
+
+   while ((c = getopt(argc, argv, "t:m:n:h")) != -1) {
+      switch (c) {
+         case 't': nthreads = atoi(optarg); break;
+         case 'm': maxkeys = strtoul(optarg, NULL, 0); break;
+         case 'n': minops = strtoul(optarg, NULL, 0); break;
+         default: usage(argv[0]);
+      }
+   }
+
+   if (nthreads < 1 || maxkeys < 1000)
+      usage(argv[0]);
+
+   filters = argv + optind;
+   nfilters = argc - optind;
+
+   printf("%-26s %9s %7s %10s %10s\n", "benchmark", "n", "threads", "ns/op", "misses/op");
+   bench_heap();
+   bench_dict();
+   bench_dlink();
+   bench_tree();
+
+   if (!perf_ok)
+      fprintf(stderr, "lsd-bench: no hardware cache counters (perf_event_open), misses not counted\n");
+
+   return 0;
+}
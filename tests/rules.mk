@@ -12,3 +12,28 @@
 
 #test_targets += 
 #extra_test_targets +=
+
+# Synthetic pool generator and workload driver for 'make bench'
+bin/fsbench: tests/bench/fsbench.c lsd/hist.c lsd/hist.h
+	@echo "[LD] $@"
+	@${CC} ${warn_flags} ${CFLAGS} -o $@ tests/bench/fsbench.c lsd/hist.c -lpthread -lm
+clean_objs += bin/fsbench
+
+# Knobs are the BENCH_* variables at the top of tests/bench/run-bench,
+# ex: make bench BENCH_PKGS=100 BENCH_COMPRESS=gzip BENCH_OUT=/tmp/new.json
+# Only BENCH_MODE=jailfs runs (and so needs) bin/jailfs
+BENCH_MODE ?= direct
+bench: bin/fsbench $(if $(filter jailfs,${BENCH_MODE}),bin/jailfs)
+	./tests/bench/run-bench
+
+extra_clean += bench.json
+
+# lsd/ microbenchmarks: ns/op (and cache misses/op where perf allows),
+# ex: make bench-lsd LSD_BENCH_FLAGS="-m 10000000 -t 8 dict"
+bin/lsd-bench: tests/bench/lsd-bench.c lib/libsd.a
+	@echo "[LD] $@"
+	@${CC} ${warn_flags} ${CFLAGS} -o $@ $< lib/libsd.a -lbsd -lpthread -lm
+clean_objs += bin/lsd-bench
+
+bench-lsd: bin/lsd-bench
+	./bin/lsd-bench ${LSD_BENCH_FLAGS}